@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+
+#include "blob.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crate.h"
+#include "crate_internal.h"
+
+#define blobBuckets 64
+
+static void
+traceBlobStore(void *object, uint64_t length, dsVisitCallback visit,
+			   void *arg)
+{
+	dsBlobStore *store = object;
+
+	visit(arg, &store->bucketsOffset);
+}
+
+static void
+traceBlobBuckets(void *object, uint64_t length, dsVisitCallback visit,
+				 void *arg)
+{
+	dsBlobBuckets *buckets = object;
+	uint64_t i;
+
+	for (i = 0; i < buckets->count; i++) {
+		visit(arg, &buckets->headOffset[i]);
+	}
+}
+
+static void
+traceBlob(void *object, uint64_t length, dsVisitCallback visit, void *arg)
+{
+	dsBlob *blob = object;
+
+	visit(arg, &blob->nextOffset);
+}
+
+/*
+ * Hashing.
+ *
+ * Input is read in 32 byte stripes, one 64-bit word into each of four
+ * independent lanes, so the bulk of it can be hashed four words at a time.
+ * Every 512 bytes the lanes are scrambled to keep early input from being
+ * cancelled out. Lanes only need 32x32 bit multiplies, which SSE2 and AVX2
+ * have for 64-bit lanes, and the tail is mixed in by the portable code.
+ */
+#define prime1 0x9E3779B185EBCA87ULL
+#define prime2 0xC2B2AE3D27D4EB4FULL
+#define prime3 0x165667B19E3779F9ULL
+#define prime4 0x85EBCA77C2B2AE63ULL
+#define prime5 0x27D4EB2F165667C5ULL
+#define primeScramble 0x9E3779B1ULL
+#define hashLanes 4
+#define hashStripe (hashLanes * sizeof(uint64_t))
+#define hashBlock (16 * hashStripe)
+
+static const uint64_t laneKeys[hashLanes] = {
+	prime1, prime2, prime3, prime4,
+};
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+	uint64_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return(value);
+}
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return(value);
+}
+
+static inline uint64_t
+rotl64(uint64_t value, int bits)
+{
+	return((value << bits) | (value >> (64 - bits)));
+}
+
+/*
+ * Accumulate whole stripes of 'data' into 'acc', returning how many bytes
+ * were consumed.
+ */
+static uint64_t
+accumulateScalar(uint64_t *acc, const uint8_t *data, uint64_t length)
+{
+	uint64_t done;
+	int i;
+
+	for (done = 0; done + hashStripe <= length; done += hashStripe) {
+		for (i = 0; i < hashLanes; i++) {
+			uint64_t word = read64(data + done + i * sizeof(uint64_t));
+			uint64_t key = word ^ laneKeys[i];
+
+			acc[i] += word + (key & 0xFFFFFFFF) * (key >> 32);
+		}
+
+		if ((done + hashStripe) % hashBlock == 0) {
+			for (i = 0; i < hashLanes; i++) {
+				acc[i] ^= acc[i] >> 47;
+				acc[i] ^= laneKeys[i];
+				acc[i] *= primeScramble;
+			}
+		}
+	}
+
+	return(done);
+}
+
+#if defined(__x86_64__)
+static uint64_t
+accumulateSSE2(uint64_t *acc, const uint8_t *data, uint64_t length)
+{
+	const __m128i key0 = _mm_loadu_si128((const __m128i *)&laneKeys[0]);
+	const __m128i key1 = _mm_loadu_si128((const __m128i *)&laneKeys[2]);
+	const __m128i prime = _mm_set1_epi64x(primeScramble);
+	__m128i acc0 = _mm_loadu_si128((const __m128i *)&acc[0]);
+	__m128i acc1 = _mm_loadu_si128((const __m128i *)&acc[2]);
+	uint64_t done;
+
+	for (done = 0; done + hashStripe <= length; done += hashStripe) {
+		__m128i word0 = _mm_loadu_si128((const __m128i *)(data + done));
+		__m128i word1 = _mm_loadu_si128((const __m128i *)(data + done + 16));
+		__m128i k0 = _mm_xor_si128(word0, key0);
+		__m128i k1 = _mm_xor_si128(word1, key1);
+
+		acc0 = _mm_add_epi64(acc0, _mm_add_epi64(word0,
+					_mm_mul_epu32(k0, _mm_srli_epi64(k0, 32))));
+		acc1 = _mm_add_epi64(acc1, _mm_add_epi64(word1,
+					_mm_mul_epu32(k1, _mm_srli_epi64(k1, 32))));
+
+		if ((done + hashStripe) % hashBlock == 0) {
+			acc0 = _mm_xor_si128(acc0, _mm_srli_epi64(acc0, 47));
+			acc0 = _mm_xor_si128(acc0, key0);
+			acc0 = _mm_add_epi64(_mm_mul_epu32(acc0, prime),
+					_mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(acc0, 32),
+												 prime), 32));
+			acc1 = _mm_xor_si128(acc1, _mm_srli_epi64(acc1, 47));
+			acc1 = _mm_xor_si128(acc1, key1);
+			acc1 = _mm_add_epi64(_mm_mul_epu32(acc1, prime),
+					_mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(acc1, 32),
+												 prime), 32));
+		}
+	}
+
+	_mm_storeu_si128((__m128i *)&acc[0], acc0);
+	_mm_storeu_si128((__m128i *)&acc[2], acc1);
+
+	return(done);
+}
+
+static uint64_t __attribute__((target("avx2")))
+accumulateAVX2(uint64_t *acc, const uint8_t *data, uint64_t length)
+{
+	const __m256i key = _mm256_loadu_si256((const __m256i *)laneKeys);
+	const __m256i prime = _mm256_set1_epi64x(primeScramble);
+	__m256i lanes = _mm256_loadu_si256((const __m256i *)acc);
+	uint64_t done;
+
+	for (done = 0; done + hashStripe <= length; done += hashStripe) {
+		__m256i word = _mm256_loadu_si256((const __m256i *)(data + done));
+		__m256i k = _mm256_xor_si256(word, key);
+
+		lanes = _mm256_add_epi64(lanes, _mm256_add_epi64(word,
+					_mm256_mul_epu32(k, _mm256_srli_epi64(k, 32))));
+
+		if ((done + hashStripe) % hashBlock == 0) {
+			lanes = _mm256_xor_si256(lanes, _mm256_srli_epi64(lanes, 47));
+			lanes = _mm256_xor_si256(lanes, key);
+			lanes = _mm256_add_epi64(_mm256_mul_epu32(lanes, prime),
+					_mm256_slli_epi64(_mm256_mul_epu32(
+						_mm256_srli_epi64(lanes, 32), prime), 32));
+		}
+	}
+
+	_mm256_storeu_si256((__m256i *)acc, lanes);
+
+	return(done);
+}
+#endif
+
+static uint64_t (*accumulate)(uint64_t *acc, const uint8_t *data,
+							  uint64_t length) = accumulateScalar;
+
+/*
+ * Let the crate follow blob offsets, e.g. when compacting, and pick the
+ * fastest hash this CPU can run.
+ */
+static void __attribute__((constructor))
+registerBlob()
+{
+	dsRegisterType(MAGIC_BLOBSTORE, traceBlobStore);
+	dsRegisterType(MAGIC_BLOBBUCKETS, traceBlobBuckets);
+	dsRegisterType(MAGIC_BLOB, traceBlob);
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		accumulate = accumulateAVX2;
+	} else {
+		accumulate = accumulateSSE2;
+	}
+#endif
+}
+
+static uint64_t
+mergeLane(uint64_t hash, uint64_t lane)
+{
+	hash ^= rotl64(lane * prime2, 31) * prime1;
+	return(rotl64(hash, 27) * prime1 + prime4);
+}
+
+uint64_t
+dsBlobHash(const void *data, uint64_t length)
+{
+	uint64_t acc[hashLanes] = {
+		prime5, prime3, prime2, prime1,
+	};
+	const uint8_t *p = data;
+	uint64_t left = length;
+	uint64_t hash;
+	uint64_t done;
+	int i;
+
+	done = accumulate(acc, p, left);
+	p += done;
+	left -= done;
+
+	hash = length * prime5;
+	for (i = 0; i < hashLanes; i++) {
+		hash = mergeLane(hash, acc[i]);
+	}
+
+	for (; left >= sizeof(uint64_t); p += sizeof(uint64_t),
+		 left -= sizeof(uint64_t)) {
+		hash = mergeLane(hash, read64(p));
+	}
+	if (left >= sizeof(uint32_t)) {
+		hash ^= read32(p) * prime1;
+		hash = rotl64(hash, 23) * prime2 + prime3;
+		p += sizeof(uint32_t);
+		left -= sizeof(uint32_t);
+	}
+	for (; left > 0; p++, left--) {
+		hash ^= *p * prime5;
+		hash = rotl64(hash, 11) * prime1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= prime2;
+	hash ^= hash >> 29;
+	hash *= prime3;
+	hash ^= hash >> 32;
+
+	return(hash);
+}
+
+/*
+ * Blob store.
+ */
+static dsBlobBuckets *
+allocBuckets(uint64_t count)
+{
+	dsBlobBuckets *buckets;
+	uint64_t i;
+
+	if ((buckets = dsAlloc(sizeof(*buckets) +
+						   count * sizeof(buckets->headOffset[0]))) == NULL) {
+		dsLog("Can't allocate blob buckets.\n");
+		return(NULL);
+	}
+
+	buckets->magic = MAGIC_BLOBBUCKETS;
+	buckets->count = count;
+	for (i = 0; i < count; i++) {
+		buckets->headOffset[i] = UINT64_MAX;
+	}
+
+	return(buckets);
+}
+
+static dsBlobBuckets *
+getBuckets(dsBlobStore *store)
+{
+	dsBlobBuckets *buckets;
+
+	if ((buckets = dsPtr(store->bucketsOffset, sizeof(*buckets))) == NULL) {
+		dsLog("Can't map blob buckets.\n");
+		return(NULL);
+	}
+
+	if ((buckets = dsPtr(store->bucketsOffset, sizeof(*buckets) +
+				buckets->count * sizeof(buckets->headOffset[0]))) == NULL) {
+		dsLog("Can't map blob buckets.\n");
+		return(NULL);
+	}
+
+	return(buckets);
+}
+
+static dsBlob *
+getBlob(uint64_t handle)
+{
+	dsCrate *crate = dsGet();
+	dsBlob *blob;
+
+	if ((handle == UINT64_MAX) ||
+		((blob = dsCratePtr(crate, handle, sizeof(*blob))) == NULL) ||
+		(blob->magic != MAGIC_BLOB)) {
+		dsLog("Bad blob handle %" PRIu64 "\n", handle);
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	if ((blob = dsCratePtr(crate, handle,
+						   sizeof(*blob) + blob->length)) == NULL) {
+		dsLog("Can't map blob %" PRIu64 "\n", handle);
+		return(NULL);
+	}
+
+	return(blob);
+}
+
+/*
+ * Double the buckets once there are more blobs than buckets. Blobs stay
+ * where they are, only their chains are relinked.
+ */
+static int
+growBuckets(dsBlobStore *store, dsBlobBuckets *buckets)
+{
+	dsBlobBuckets *newBuckets;
+	uint64_t i;
+
+	if ((newBuckets = allocBuckets(buckets->count * 2)) == NULL) {
+		return(-1);
+	}
+
+	for (i = 0; i < buckets->count; i++) {
+		uint64_t blobOffset = buckets->headOffset[i];
+
+		while (blobOffset != UINT64_MAX) {
+			dsBlob *blob;
+			uint64_t *head;
+
+			if ((blob = dsPtr(blobOffset, sizeof(*blob))) == NULL) {
+				dsLog("Can't map blob %" PRIu64 "\n", blobOffset);
+				dsFree(newBuckets);
+				return(-1);
+			}
+			if (dsTxAdd(&blob->nextOffset, sizeof(blob->nextOffset)) < 0) {
+				dsLog("Can't log blob changes.\n");
+				dsFree(newBuckets);
+				return(-1);
+			}
+
+			head = &newBuckets->headOffset[blob->hash &
+										   (newBuckets->count - 1)];
+			blobOffset = blob->nextOffset;
+			blob->nextOffset = *head;
+			*head = dsOffset(blob);
+		}
+	}
+
+	if (dsTxAdd(store, sizeof(*store)) < 0) {
+		dsLog("Can't log blob store changes.\n");
+		return(-1);
+	}
+	store->bucketsOffset = dsOffset(newBuckets);
+
+	if (dsFree(buckets) < 0) {
+		dsLog("Can't free old blob buckets.\n");
+	}
+
+	return(0);
+}
+
+int
+dsBlobStoreInit(dsBlobStore *store)
+{
+	dsBlobBuckets *buckets;
+
+	if (store == NULL) {
+		dsLog("Bad argument: %p\n", store);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if ((buckets = allocBuckets(blobBuckets)) == NULL) {
+		return(-1);
+	}
+
+	dsNoteReferences(store, sizeof(*store));
+	store->magic = MAGIC_BLOBSTORE;
+	store->count = 0;
+	store->bucketsOffset = dsOffset(buckets);
+
+	return(0);
+}
+
+dsBlobStore *
+dsBlobStoreAlloc()
+{
+	dsBlobStore *store;
+
+	if ((store = dsAlloc(sizeof(*store))) == NULL) {
+		dsLog("Can't allocate blob store object.\n");
+		return(NULL);
+	}
+
+	if (dsBlobStoreInit(store) < 0) {
+		dsFree(store);
+		return(NULL);
+	}
+
+	return(store);
+}
+
+uint64_t
+dsBlobPut(dsBlobStore *store, const void *data, uint64_t length)
+{
+	dsCrate *crate = dsGet();
+	dsBlobBuckets *buckets;
+	dsBlob *blob;
+	uint64_t *head;
+	uint64_t blobOffset;
+	uint64_t hash;
+
+	if ((store == NULL) || (store->magic != MAGIC_BLOBSTORE) ||
+		((data == NULL) && (length != 0))) {
+		dsLog("Bad argument: %p, %p\n", store, data);
+		errno = EINVAL;
+		return(UINT64_MAX);
+	}
+
+	if ((buckets = getBuckets(store)) == NULL) {
+		return(UINT64_MAX);
+	}
+
+	hash = dsBlobHash(data, length);
+	head = &buckets->headOffset[hash & (buckets->count - 1)];
+
+	for (blobOffset = *head; blobOffset != UINT64_MAX;
+		 blobOffset = blob->nextOffset) {
+		if ((blob = dsCratePtr(crate, blobOffset, sizeof(*blob))) == NULL) {
+			dsLog("Can't map blob %" PRIu64 "\n", blobOffset);
+			return(UINT64_MAX);
+		}
+		if ((blob->hash != hash) || (blob->length != length)) {
+			continue;
+		}
+		if ((blob = dsCratePtr(crate, blobOffset,
+							   sizeof(*blob) + length)) == NULL) {
+			dsLog("Can't map blob %" PRIu64 "\n", blobOffset);
+			return(UINT64_MAX);
+		}
+		if ((length > 0) && (memcmp(blob->data, data, length) != 0)) {
+			continue;
+		}
+
+		/*
+		 * Already stored.
+		 */
+		if (dsTxAdd(&blob->refs, sizeof(blob->refs)) < 0) {
+			dsLog("Can't log blob changes.\n");
+			return(UINT64_MAX);
+		}
+		blob->refs++;
+
+		return(blobOffset);
+	}
+
+	if ((blob = dsAlloc(sizeof(*blob) + length)) == NULL) {
+		dsLog("Can't allocate blob object.\n");
+		return(UINT64_MAX);
+	}
+	blobOffset = dsOffset(blob);
+
+	if ((dsTxAdd(store, sizeof(*store)) < 0) ||
+		(dsTxAdd(head, sizeof(*head)) < 0)) {
+		dsLog("Can't log blob store changes.\n");
+		dsFree(blob);
+		return(UINT64_MAX);
+	}
+
+	blob->magic = MAGIC_BLOB;
+	blob->hash = hash;
+	blob->refs = 1;
+	blob->length = length;
+	if (length > 0) {
+		memcpy(blob->data, data, length);
+	}
+	blob->nextOffset = *head;
+	*head = blobOffset;
+	store->count++;
+
+	if ((store->count > buckets->count) &&
+		(growBuckets(store, buckets) < 0)) {
+		dsLog("Can't grow blob buckets.\n");
+	}
+
+	return(blobOffset);
+}
+
+void *
+dsBlobGet(uint64_t handle, uint64_t *length)
+{
+	dsBlob *blob;
+
+	if ((blob = getBlob(handle)) == NULL) {
+		return(NULL);
+	}
+
+	if (length != NULL) {
+		*length = blob->length;
+	}
+
+	return(blob->data);
+}
+
+int
+dsBlobRetain(uint64_t handle)
+{
+	dsBlob *blob;
+
+	if ((blob = getBlob(handle)) == NULL) {
+		return(-1);
+	}
+
+	if (dsTxAdd(&blob->refs, sizeof(blob->refs)) < 0) {
+		dsLog("Can't log blob changes.\n");
+		return(-1);
+	}
+	blob->refs++;
+
+	return(0);
+}
+
+int
+dsBlobRelease(dsBlobStore *store, uint64_t handle)
+{
+	dsBlobBuckets *buckets;
+	dsBlob *blob;
+	uint64_t *link;
+
+	if ((store == NULL) || (store->magic != MAGIC_BLOBSTORE)) {
+		dsLog("Bad argument: %p\n", store);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if ((blob = getBlob(handle)) == NULL) {
+		return(-1);
+	}
+
+	if (dsTxAdd(&blob->refs, sizeof(blob->refs)) < 0) {
+		dsLog("Can't log blob changes.\n");
+		return(-1);
+	}
+	if (--blob->refs > 0) {
+		return(0);
+	}
+
+	/*
+	 * Last reference, find whatever points at the blob and unlink it.
+	 */
+	if ((buckets = getBuckets(store)) == NULL) {
+		return(-1);
+	}
+
+	link = &buckets->headOffset[blob->hash & (buckets->count - 1)];
+	while (*link != handle) {
+		dsBlob *prev;
+
+		if ((*link == UINT64_MAX) ||
+			((prev = dsPtr(*link, sizeof(*prev))) == NULL)) {
+			dsLog("Blob %" PRIu64 " isn't in the store.\n", handle);
+			errno = EINVAL;
+			return(-1);
+		}
+		link = &prev->nextOffset;
+	}
+
+	if ((dsTxAdd(store, sizeof(*store)) < 0) ||
+		(dsTxAdd(link, sizeof(*link)) < 0)) {
+		dsLog("Can't log blob store changes.\n");
+		return(-1);
+	}
+	*link = blob->nextOffset;
+	store->count--;
+
+	if (dsFree(blob) < 0) {
+		dsLog("Can't free blob object.\n");
+		return(-1);
+	}
+
+	return(0);
+}
+
+uint64_t
+dsBlobCount(dsBlobStore *store)
+{
+	if (store == NULL) {
+		return -1;
+	}
+
+	return store->count;
+}
@@ -0,0 +1,92 @@
+#ifndef CRATE_BLOB_H_
+#define CRATE_BLOB_H_
+
+#include <inttypes.h>
+
+/*
+ * A content addressed store of blobs. Each distinct blob is kept once, with a
+ * count of how many times it was put, and is found again by hashing its
+ * contents. Blobs are referred to by handle, the offset of the blob within
+ * the crate, which can be stored in other objects like any other offset.
+ */
+typedef struct dsBlobStore {
+	uint64_t magic;
+	uint64_t count;
+	uint64_t bucketsOffset;
+} dsBlobStore;
+
+typedef struct dsBlobBuckets {
+	uint64_t magic;
+	uint64_t count;
+	uint64_t headOffset[];
+} dsBlobBuckets;
+
+typedef struct dsBlob {
+	uint64_t magic;
+	uint64_t hash;
+	uint64_t refs;
+	uint64_t length;
+	uint64_t nextOffset;
+	uint8_t data[];
+} dsBlob;
+
+/*
+ * Allocate and initialize a new blob store object.
+ *
+ * On success, a pointer to the new blob store object is returned.
+ * On error, NULL is returned and errno is set appropriately.
+ */
+dsBlobStore *dsBlobStoreAlloc();
+
+/*
+ * Initialize an already allocated blob store object.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsBlobStoreInit(dsBlobStore *store);
+
+/*
+ * Put 'length' bytes of 'data' in the store. If an identical blob is already
+ * there, its count goes up and its handle is returned, otherwise a copy is
+ * added.
+ *
+ * On success, the blob's handle is returned.
+ * On error, UINT64_MAX is returned and errno is set appropriately.
+ */
+uint64_t dsBlobPut(dsBlobStore *store, const void *data, uint64_t length);
+
+/*
+ * Get a pointer to the contents of the blob 'handle', and optionally its
+ * length. Blobs must not be changed through it, other holders share them.
+ *
+ * On success, a pointer to the blob's contents is returned.
+ * On error, NULL is returned and errno is set appropriately.
+ */
+void *dsBlobGet(uint64_t handle, uint64_t *length);
+
+/*
+ * Take another reference to the blob 'handle', or drop one. The blob is
+ * removed from the store and freed once its last reference is dropped.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsBlobRetain(uint64_t handle);
+int dsBlobRelease(dsBlobStore *store, uint64_t handle);
+
+/*
+ * Get a count of how many distinct blobs are in the store.
+ *
+ * On success, the number of blobs is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+uint64_t dsBlobCount(dsBlobStore *store);
+
+/*
+ * The 64-bit hash blobs are stored by. Large inputs are hashed with SSE2 or
+ * AVX2 when the CPU has them, which give the same hash as the portable code.
+ */
+uint64_t dsBlobHash(const void *data, uint64_t length);
+
+#endif
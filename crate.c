@@ -11,13 +11,18 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
+#include <time.h>
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
+#include <linux/userfaultfd.h>
 #include <linux/fiemap.h>
 
 #include "crate_internal.h"
@@ -29,13 +34,27 @@
 #define freeObjectBit 0x8000000000000000
 #define lastObjectBit 0x4000000000000000
 #define objectOverhead 24
+
+/*
+ * Object lengths are rounded up so every header, and the memory after it,
+ * is 8 byte aligned, which atomic operations on crate memory rely on.
+ */
+#define objectAlignment 8
+#define alignObjectLength(length) \
+	(((length) + objectAlignment - 1) & ~(uint64_t)(objectAlignment - 1))
+
+#define punchThreshold (1 << 20)
+#define mapReservation (1ULL << 40)
+#define mapAlignment (2ULL << 20)
+#define growthLimit (1ULL << 30)
 typedef struct dsObject {
 	uint64_t length;
 	uint64_t nextGroupOffset;
 } dsObject;
 
-#define crateVersion 0x1
+#define crateVersion 0x3
 #define objectGroups 8 // B K M G T P E Z
+_Static_assert(objectGroups == DS_STATS_GROUPS, "dsStats() reports every group");
 typedef struct dsSuperObject {
 	uint64_t magic;
 	uint64_t version;
@@ -48,27 +67,237 @@ typedef struct dsSuperObject {
 	 */
 	uint64_t headGroupOffset[objectGroups];
 	uint64_t firstObjectOffset;
+
+	/*
+	 * Version 2 and later.
+	 */
+	uint64_t logHeadOffset;
+
+	/*
+	 * Version 3 and later.
+	 */
+	uint64_t rootsOffset;
 } dsSuperObject;
 
 /*
- * In-memory structures.
+ * Undo logs record what transactions are about to overwrite. All of them are
+ * chained from the super object so they can be rolled back after a crash.
+ * Records follow the header, each padded to 8 bytes and followed by the old
+ * contents of what it covers.
  */
+#define undoLogSize (64 << 10)
+typedef struct dsUndoLog {
+	uint64_t magic;
+	uint64_t nextOffset;
+	uint64_t size;
+	uint64_t used;
 
-typedef struct dsMapping {
-	void *ptr;
+	/*
+	 * Only meaningful while the crate is open.
+	 */
+	uint64_t busy;
+} dsUndoLog;
+
+#define undoData  1
+#define undoAlloc 2
+typedef struct dsUndoRecord {
+	uint64_t offset;
+	uint64_t length;
+	uint64_t type;
+	uint64_t check;
+} dsUndoRecord;
+
+/*
+ * Named roots live in an open addressed hash table, linearly probed. Each
+ * entry fills a cache line, empty ones have an offset of UINT64_MAX.
+ */
+#define rootsMinCapacity 16
+#define rootsLookupTries 4
+typedef struct dsRootEntry {
+	uint64_t hash;
 	uint64_t offset;
 	uint64_t length;
-	struct dsMapping *next;
-} dsMapping;
+	char name[DS_ROOT_NAME_MAX];
+} dsRootEntry;
+_Static_assert(sizeof(dsRootEntry) == 64, "root entries fill a cache line");
+
+typedef struct dsRootTable {
+	uint64_t magic;
+	uint64_t count;
+	uint64_t capacity;
+	dsRootEntry entries[];
+} dsRootTable;
+
+/*
+ * In-memory structures.
+ */
+
+/*
+ * Event counters kept by each thread using a crate, summed by dsStats().
+ * Only the owning thread writes them.
+ */
+typedef struct dsThreadStats {
+	uint64_t allocations;
+	uint64_t allocationFailures;
+	uint64_t frees;
+	uint64_t splits;
+	uint64_t merges;
+	uint64_t allocationLatency[DS_STATS_BUCKETS];
+
+	uint64_t syncs;
+	uint64_t syncNanoseconds;
+	uint64_t syncMaxNanoseconds;
+	uint64_t snapshots;
+	uint64_t snapshotNanoseconds;
+	uint64_t snapshotMaxNanoseconds;
+
+	pthread_t thread;
+	struct dsThreadStats *next;
+} dsThreadStats;
+
+/*
+ * The global epoch a thread saw when it entered a read section of a crate,
+ * zero while it is outside of one. Only the owning thread writes it.
+ */
+typedef struct dsThreadEpoch {
+	uint64_t epoch;
+	uint64_t depth;
+
+	pthread_t thread;
+	struct dsThreadEpoch *next;
+} dsThreadEpoch;
+
+/*
+ * An object freed while readers may still be looking at it, tagged with the
+ * global epoch it was retired in.
+ */
+typedef struct dsRetired {
+	uint64_t offset;
+	uint64_t epoch;
+} dsRetired;
 
 typedef struct dsCrate {
+	/*
+	 * Must come first, see dsCratePtr().
+	 */
+	dsMapping map;
+
 	char *filename;
 	int fd;
 
-	dsMapping map;
 	dsSuperObject *super;
+
+	/*
+	 * Set when the crate is cached by a buffer pool instead of mapped.
+	 */
+	struct dsPool *pool;
+
+	/*
+	 * Set when other processes may map the same file, see dsOpenFd().
+	 * Allocator changes then also take the file lock.
+	 */
+	int shared;
+
+	/*
+	 * Serializes allocator changes between threads sharing this handle.
+	 */
+	pthread_mutex_t lock;
+
+	/*
+	 * Objects to checksum on the next sync, an open addressed set of
+	 * offsets, see dsMarkDirty(). Nothing is recorded unless 'checksums'
+	 * is set.
+	 */
+	int checksums;
+	pthread_mutex_t dirtyLock;
+	uint64_t *dirty;
+	uint64_t dirtyCount;
+	uint64_t dirtySize;
+
+	/*
+	 * Where the next compaction slice picks up, UINT64_MAX when idle. Slices
+	 * with a budget keep the offsets objects hold in 'references', see
+	 * dsReferenceIndex. It is changed under 'lock'.
+	 */
+	uint64_t compactOffset;
+	struct dsReferenceIndex *references;
+
+	/*
+	 * Space accounting per group, kept up to date under 'lock' once the
+	 * first dsStats() call has counted everything.
+	 */
+	int statsReady;
+	uint64_t liveObjects[objectGroups];
+	uint64_t liveBytes[objectGroups];
+	uint64_t freeObjects[objectGroups];
+	uint64_t freeBytes[objectGroups];
+
+	/*
+	 * Unique for the life of the process, used to tell crates apart in
+	 * thread-local caches.
+	 */
+	uint64_t id;
+	pthread_mutex_t statsLock;
+	dsThreadStats *threadStats;
+
+	/*
+	 * Deferred reclamation, see dsEpochEnter(). 'threadEpochs' is protected
+	 * by 'statsLock' and 'retired' by 'lock'. 'moving' is set under 'lock'
+	 * while objects are moved or collected, and keeps new readers out.
+	 */
+	uint64_t epoch;
+	dsThreadEpoch *threadEpochs;
+	dsRetired *retired;
+	uint64_t retiredCount;
+	uint64_t retiredSize;
+	int moving;
+
+	/*
+	 * Odd while the root table is changed or objects are moved, so
+	 * dsGetRoot() can look roots up without the allocator lock. Changed
+	 * under 'lock'.
+	 */
+	uint64_t rootsSequence;
+
+	/*
+	 * Transactions in progress, protected by 'lock'.
+	 */
+	uint64_t openTxs;
+
+	/*
+	 * Group commit. Every thread that needs its writes on disk waits for a
+	 * sync that started after it asked, and one of them runs it for all.
+	 */
+	pthread_mutex_t syncLock;
+	pthread_cond_t syncCond;
+	uint64_t syncRequested;
+	uint64_t syncStarted;
+	uint64_t syncFinished;
+	int syncResult;
+
+	struct dsSyncRequest *syncRequests;
+	struct dsSyncRequest *syncRequestsTail;
+	pthread_t flusher;
+	int flusherRunning;
+	int flusherStop;
 } dsCrate;
 
+/*
+ * A transaction, owned by the thread that began it.
+ */
+typedef struct dsTx {
+	dsCrate *crate;
+	uint64_t logOffset;
+
+	uint64_t *frees;
+	uint64_t freeCount;
+	uint64_t freeSize;
+} dsTx;
+
+static __thread dsTx *threadTx;
+
+_Static_assert(offsetof(dsCrate, map) == 0, "dsCratePtr() finds the mapping");
+
 /*
  * Logging.
  */
@@ -78,10 +307,44 @@ dsLogToStderr(void *userPtr, const char *format, va_list args)
 	vfprintf(stderr, format, args);
 }
 
-static pthread_rwlock_t logLock = PTHREAD_RWLOCK_INITIALIZER;
+/*
+ * The callback and its pointer are read together under a sequence count, so
+ * logging never takes a lock. dsLogger() is the only writer and bumps the
+ * count around each change, readers retry if it moved or was odd.
+ */
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t logSequence = 0;
 static dsLogCallback logCallback = dsLogToStderr;
 static void *logUserPtr = NULL;
 
+static void
+readLogger(dsLogCallback *callback, void **userPtr)
+{
+	uint64_t sequence;
+
+	do {
+		/*
+		 * dsLogger() is almost never running, don't bother backing off.
+		 */
+		while ((sequence = __atomic_load_n(&logSequence,
+										   __ATOMIC_ACQUIRE)) & 1) {
+		}
+		*callback = __atomic_load_n(&logCallback, __ATOMIC_RELAXED);
+		*userPtr = __atomic_load_n(&logUserPtr, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&logSequence, __ATOMIC_RELAXED) != sequence);
+}
+
+static void
+writeLogger(dsLogCallback callback, void *userPtr)
+{
+	__atomic_store_n(&logSequence, logSequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&logCallback, callback, __ATOMIC_RELAXED);
+	__atomic_store_n(&logUserPtr, userPtr, __ATOMIC_RELAXED);
+	__atomic_store_n(&logSequence, logSequence + 1, __ATOMIC_RELEASE);
+}
+
 void
 dsRunLogCallback(const char *fmt, ...)
 {
@@ -89,788 +352,8160 @@ dsRunLogCallback(const char *fmt, ...)
 	dsLogCallback callback;
 	void *userPtr;
 
-	if (logCallback == NULL) {
+	if (__atomic_load_n(&logCallback, __ATOMIC_RELAXED) == NULL) {
 		return;
 	}
 
-	pthread_rwlock_rdlock(&logLock);
-	callback = logCallback;
-	userPtr = logUserPtr;
-	pthread_rwlock_unlock(&logLock);
+	readLogger(&callback, &userPtr);
+	if (callback == NULL) {
+		return;
+	}
 
 	va_start(ap, fmt);
 	callback(userPtr, fmt, ap);
 	va_end(ap);
 }
 
-int
-dsLogger(dsLogCallback callback, void *userPtr)
-{
-	pthread_rwlock_wrlock(&logLock);
-	logCallback = callback;
-	logUserPtr = userPtr;
-	pthread_rwlock_unlock(&logLock);
-
-	return 0;
-}
+/*
+ * Asynchronous logging.
+ *
+ * Each thread formats its messages into a ring of its own, which only it
+ * writes and only the drain thread reads. Records are a length followed by
+ * the message, padded to 8 bytes. One that doesn't fit before the end of the
+ * ring is put at the start, behind a skip marker. Rings outlive their
+ * threads and are handed to new ones.
+ */
+#define logRingSize (64 << 10)
+#define logMessageMax 512
+#define logRecordSkip UINT32_MAX
+#define logDrainInterval 10000000
+
+typedef struct dsLogRing {
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+	uint64_t reported;
+	int owned;
+	struct dsLogRing *next;
+	uint8_t data[logRingSize];
+} dsLogRing;
+
+static dsLogRing *logRings = NULL;
+static __thread dsLogRing *threadRing;
+static pthread_key_t logKey;
+static pthread_once_t logKeyOnce = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drainCond = PTHREAD_COND_INITIALIZER;
+static pthread_t drainThread;
+static int drainRunning = 0;
+static int drainStop = 0;
+static uint64_t drainRequested = 0;
+static uint64_t drainFinished = 0;
+static dsLogCallback asyncCallback = NULL;
+static void *asyncUserPtr = NULL;
 
 /*
- * Thread specifics.
+ * Threads inside logToRing(), so the last messages of a ring can be passed
+ * on after dsLogger() replaces it.
  */
-static pthread_key_t key;
-static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static uint64_t logWriters = 0;
 
 static void
-makeKey()
+releaseLogRing(void *arg)
 {
-	if (pthread_key_create(&key, NULL) != 0) {
-		dsLog("Can't create pthread key.\n");
-		abort();
-	}
+	dsLogRing *ring = arg;
+
+	__atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
 }
 
-static dsCrate *
-getActiveCrate()
+static void
+makeLogKey()
 {
-	pthread_once(&keyOnce, makeKey);
-
-	/*
-	 * pthread_getspecific() doesn't fail.
-	 */
-	return pthread_getspecific(key);
+	if (pthread_key_create(&logKey, releaseLogRing) != 0) {
+		abort();
+	}
 }
 
-static void *
-mapObject(dsCrate *crate, uint64_t offset, uint64_t length)
+static dsLogRing *
+getLogRing()
 {
-	if (crate == NULL) {
-		dsLog("Bad argument %p\n", crate);
-		return NULL;
-	}
+	dsLogRing *ring;
 
-	if ((offset < crate->map.offset) ||
-		(offset + length > crate->map.offset + crate->map.length)) {
-		dsLog("Can't map region outside of crate.\n");
-		return NULL;
+	if (threadRing != NULL) {
+		return threadRing;
 	}
 
-	return crate->map.ptr + offset;
-}
+	pthread_once(&logKeyOnce, makeLogKey);
 
-static void
-unmapObject(dsCrate *crate, void *address)
-{
-	crate = address = NULL;
-	return;
-}
+	for (ring = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE); ring != NULL;
+		 ring = ring->next) {
+		int owned = 0;
 
-#if 0
-static dsMapping *
-makeMapping(dsCrate *crate)
-{
-	if (crate == NULL) {
-		dsLog("Bad argument %p\n", crate);
-		return NULL;
+		if (__atomic_compare_exchange_n(&ring->owned, &owned, 1, 0,
+										__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
 	}
 
-	if ((offset < crate->map.offset) ||
-		(offset + length > crate->map.offset + crate->map.length)) {
-		dsLog("Can't map region outside of crate.\n");
-		return NULL;
+	if (ring == NULL) {
+		if ((ring = calloc(1, sizeof(*ring))) == NULL) {
+			return NULL;
+		}
+		ring->owned = 1;
+		ring->next = __atomic_load_n(&logRings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&logRings, &ring->next, ring, 0,
+											__ATOMIC_RELEASE,
+											__ATOMIC_RELAXED)) {
+		}
 	}
 
-	return crate->map.ptr + offset;
+	pthread_setspecific(logKey, ring);
+	threadRing = ring;
+
+	return ring;
 }
-#endif
 
 static void
-freeMapping(dsMapping *mapping)
+logToRing(void *userPtr, const char *format, va_list args)
 {
-	if (mapping == NULL) {
+	char message[logMessageMax];
+	dsLogRing *ring;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t position;
+	uint64_t need;
+	uint64_t skip = 0;
+	uint32_t length;
+	int n;
+
+	/*
+	 * The callback may have been replaced since it was read, stopDrain()
+	 * either sees this thread writing or this thread sees the new one.
+	 */
+	__atomic_add_fetch(&logWriters, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&logCallback, __ATOMIC_SEQ_CST) != logToRing) {
+		dsLogCallback callback;
+		void *logPtr;
+
+		__atomic_sub_fetch(&logWriters, 1, __ATOMIC_RELEASE);
+		readLogger(&callback, &logPtr);
+		if (callback != NULL) {
+			callback(logPtr, format, args);
+		}
 		return;
 	}
-	if ((mapping->ptr != NULL) &&
-		(munmap(mapping->ptr, mapping->length) < 0)) {
-		dsLog("Can't munmap(%p,%" PRIu64 "): %s", mapping->ptr,
-			mapping->length, strerror(errno));
+
+	if (((ring = getLogRing()) == NULL) ||
+		((n = vsnprintf(message, sizeof(message), format, args)) < 0)) {
+		__atomic_sub_fetch(&logWriters, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	length = (n < logMessageMax ? n : logMessageMax - 1) + 1;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	position = head % logRingSize;
+	need = (sizeof(length) + length + 7) & ~7ULL;
+	if (position + need > logRingSize) {
+		skip = logRingSize - position;
 	}
-	mapping->ptr = NULL;
-	mapping->offset = 0;
-	mapping->length = 0;
-}
 
-static uint64_t
-objectOffset(dsCrate *crate, void *address)
-{
 	/*
-	 * We only support a single giant mapping, for now.
+	 * Never wait on the drain thread.
 	 */
-	if ((intptr_t)address < (intptr_t)crate->map.ptr) {
-		dsLog("Pointer falls outside of the crate.\n");
-		return UINT64_MAX;
+	if (skip + need > logRingSize - (head - tail)) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&logWriters, 1, __ATOMIC_RELEASE);
+		return;
 	}
 
-	return (intptr_t)address - (intptr_t)crate->map.ptr;
-}
+	if (skip) {
+		*(uint32_t *)(ring->data + position) = logRecordSkip;
+		position = 0;
+	}
+	*(uint32_t *)(ring->data + position) = length;
+	memcpy(ring->data + position + sizeof(length), message, length - 1);
+	ring->data[position + sizeof(length) + length - 1] = '\0';
 
-static inline uint64_t
-getRealLength(uint64_t length)
-{
-	return length & ~(freeObjectBit | lastObjectBit);
+	__atomic_store_n(&ring->head, head + skip + need, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&logWriters, 1, __ATOMIC_RELEASE);
 }
 
-#if 0
-static dsObject *
-prevObject(dsCrate *crate, dsObject *object)
+static void
+passMessage(const char *format, ...)
 {
-	dsObject *prev;
-	uint64_t offset;
-	uint64_t *trailer;
+	va_list ap;
 
-	if ((offset = objectOffset(crate, object)) == UINT64_MAX) {
-		dsLog("Can't get object offset.\n");
-		return (void *)-1;
-	}
+	va_start(ap, format);
+	asyncCallback(asyncUserPtr, format, ap);
+	va_end(ap);
+}
 
-	if (offset == crate->super->firstObjectOffset) {
-		return NULL;
-	}
+/*
+ * Pass on everything in every ring.
+ *
+ * Returns how many messages were passed on.
+ */
+static uint64_t
+drainLogRings()
+{
+	dsLogRing *ring;
+	uint64_t count = 0;
+
+	for (ring = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE); ring != NULL;
+		 ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+		uint64_t dropped;
+
+		while (tail != head) {
+			uint64_t position = tail % logRingSize;
+			uint32_t length = *(uint32_t *)(ring->data + position);
+
+			if (length == logRecordSkip) {
+				tail += logRingSize - position;
+				continue;
+			}
 
-	if ((trailer = mapObject(crate, offset-sizeof(*trailer),
-							 sizeof(*trailer))) == NULL) {
-		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
-			offset-sizeof(*trailer), sizeof(*trailer));
-		return (void *)-1;
-	}
+			passMessage("%s", ring->data + position + sizeof(length));
+			tail += (sizeof(length) + length + 7) & ~7ULL;
+			count++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
 
-	if ((prev = mapObject(crate, *trailer, sizeof(*prev))) == NULL) {
-		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
-			*trailer, sizeof(*prev));
-		return (void *)-1;
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			passMessage("Dropped %" PRIu64 " log messages.\n",
+				dropped - ring->reported);
+			ring->reported = dropped;
+		}
 	}
 
-	return prev;
+	return count;
 }
-#endif
 
-static dsObject *
-nextObject(dsCrate *crate, dsObject *object)
+static void *
+drainLog(void *arg)
 {
-	dsObject *next;
-	uint64_t offset;
+	pthread_mutex_lock(&drainLock);
 
-	if (object->length & lastObjectBit) {
-		return NULL;
-	}
+	for (;;) {
+		uint64_t requested = drainRequested;
+		int stop = drainStop;
 
-	if ((offset = objectOffset(crate, object)) == UINT64_MAX) {
-		dsLog("Can't get object offset.\n");
-		return (void *)-1;
-	}
+		pthread_mutex_unlock(&drainLock);
+		while (drainLogRings() > 0) {
+		}
+		pthread_mutex_lock(&drainLock);
 
-	if ((next = mapObject(crate, offset + getRealLength(object->length),
-						  sizeof(*next))) == NULL) {
-		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
-			offset + object->length, sizeof(*next));
-		return (void *)-1;
-	}
+		drainFinished = requested;
+		pthread_cond_broadcast(&drainCond);
 
-	return next;
-}
+		if (stop) {
+			break;
+		}
 
-/*
- * The whole object should already be mapped.
+		/*
+		 * Writers don't wake this thread, it looks every so often.
+		 */
+		if (drainRequested == requested) {
+			struct timespec deadline;
+
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += logDrainInterval;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&drainCond, &drainLock, &deadline);
+		}
+	}
+
+	pthread_mutex_unlock(&drainLock);
+
+	return NULL;
+}
+
+/*
+ * Pass on what is left in the rings once threads that read the callback
+ * before it was replaced are out of them.
  */
 static void
-setObjectTrailer(dsObject *object, uint64_t offset)
+flushLogRings()
 {
-	uint64_t *trailer;
-	uint64_t trailerOffset;
-
-	trailerOffset = getRealLength(object->length) - sizeof(*trailer);
-	trailer = (uint64_t *)((uintptr_t)object + trailerOffset);
-	*trailer = offset;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&logWriters, __ATOMIC_ACQUIRE) != 0) {
+		sched_yield();
+	}
+	drainLogRings();
 }
 
-static uint64_t
-getObjectTrailer(dsCrate *crate, dsObject *object)
+/*
+ * Called with 'logLock' held.
+ */
+static void
+stopDrain()
 {
-	dsObject *fullObject;
-	uint64_t offset;
-	uint64_t length;
-
-	if ((offset = objectOffset(crate, object)) == UINT64_MAX) {
-		dsLog("Can't get object offset.\n");
-		return UINT64_MAX;
+	if (!drainRunning) {
+		return;
 	}
 
-	length = getRealLength(object->length);
-	if ((fullObject = mapObject(crate, offset, length)) == NULL) {
-		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
-			offset, length);
-		return UINT64_MAX;
-	}
+	pthread_mutex_lock(&drainLock);
+	drainStop = 1;
+	pthread_cond_broadcast(&drainCond);
+	pthread_mutex_unlock(&drainLock);
 
-	uint64_t trailer;
-	uint64_t trailerOffset;
+	pthread_join(drainThread, NULL);
+	drainRunning = 0;
+	drainStop = 0;
 
-	trailerOffset = length - sizeof(trailer);
-	trailer = *(uint64_t *)((uintptr_t)object + trailerOffset);
-	unmapObject(crate, fullObject);
+	/*
+	 * Threads that read the callback before dsLogger() replaced it can
+	 * still be adding to their rings, pass on what the drain thread didn't
+	 * see.
+	 */
+	if (__atomic_load_n(&logCallback, __ATOMIC_SEQ_CST) != logToRing) {
+		flushLogRings();
+	}
+}
 
-	return trailer;
+int
+dsLogger(dsLogCallback callback, void *userPtr)
+{
+	pthread_mutex_lock(&logLock);
+	writeLogger(callback, userPtr);
+	stopDrain();
+	pthread_mutex_unlock(&logLock);
+
+	return 0;
 }
 
-static int
-debugDump(dsCrate *crate)
+int
+dsLoggerAsync(dsLogCallback callback, void *userPtr)
 {
-	dsObject *object;
-	int i;
+	dsLogCallback oldCallback;
+	void *oldUserPtr;
+	int wasRunning;
 
-	if ((object = mapObject(crate, crate->super->firstObjectOffset,
-						 	sizeof(*object))) == NULL) {
-		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
-			crate->super->firstObjectOffset, sizeof(*object));
+	if (callback == NULL) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	dsLog("i, head\n");
-	for (i = 0; i < objectGroups; i++) {
-		dsLog("%d %-20" PRIu64 "\n", i, crate->super->headGroupOffset[i]);
-	}
-
-	dsLog("%-20s %-4s %-4s %-20s %-20s %-20s\n",
-		"@offset", "free", "last", "length", "next", "offset");
-	while (object != NULL) {
-		uint64_t offset;
-
-		if ((offset = objectOffset(crate, object)) == UINT64_MAX) {
-			dsLog("Can't get object offset.\n");
-			return -1;
-		}
+	pthread_mutex_lock(&logLock);
 
+	/*
+	 * Messages still queued go to the old callback.
+	 */
+	wasRunning = drainRunning;
+	oldCallback = asyncCallback;
+	oldUserPtr = asyncUserPtr;
+	stopDrain();
+	asyncCallback = callback;
+	asyncUserPtr = userPtr;
+
+	if (pthread_create(&drainThread, NULL, drainLog, NULL) != 0) {
 		/*
-		 * Dump debug info.
+		 * Keep the old logger. If it was asynchronous, nothing drains the
+		 * rings anymore, so it is called directly from now on.
 		 */
-		dsLog("%-20" PRIu64 ": %-4s %-4s %-20" PRIu64 " %-20" PRIu64 " %-20" PRIu64 "\n",
-			offset,
-			object->length & freeObjectBit ? "y" : "n",
-			object->length & lastObjectBit ? "y" : "n",
-			getRealLength(object->length), object->nextGroupOffset,
-			getObjectTrailer(crate, object));
-
-		if ((object = nextObject(crate, object)) == (void *)-1) {
-			dsLog("Can't get next object.\n");
-			return -1;
+		asyncCallback = oldCallback;
+		asyncUserPtr = oldUserPtr;
+		if (wasRunning) {
+			writeLogger(oldCallback, oldUserPtr);
+			flushLogRings();
 		}
+		pthread_mutex_unlock(&logLock);
+		errno = EAGAIN;
+		return -1;
 	}
+	drainRunning = 1;
+	writeLogger(logToRing, NULL);
+
+	pthread_mutex_unlock(&logLock);
 
 	return 0;
 }
 
 int
-dsDebugDump()
+dsLogFlush()
 {
-	dsCrate *crate;
-
-	if ((crate = getActiveCrate()) == NULL) {
-		dsLog("Can't get active crate.\n");
-		return -1;
-	}
+	uint64_t ticket;
 
-	return debugDump(crate);
-}
+	pthread_mutex_lock(&logLock);
 
-static int
-unlinkFromGroup(dsCrate *crate, dsObject *freeObject,
-				uint64_t freeObjectOffset, int group)
-{
-	if (group >= objectGroups) {
-		dsLog("Group does not exist.\n");
-		return -1;
-	}
-	if (crate->super->headGroupOffset[group] != freeObjectOffset) {
-		dsLog("Free object isn't head of group.\n");
-		return -1;
+	if (drainRunning) {
+		pthread_mutex_lock(&drainLock);
+		ticket = ++drainRequested;
+		pthread_cond_broadcast(&drainCond);
+		while (drainFinished < ticket) {
+			pthread_cond_wait(&drainCond, &drainLock);
+		}
+		pthread_mutex_unlock(&drainLock);
 	}
 
-	/*
-	 * Remove from the group.
-	 */
-	crate->super->headGroupOffset[group] = freeObject->nextGroupOffset;
-	freeObject->nextGroupOffset = UINT64_MAX;
+	pthread_mutex_unlock(&logLock);
 
 	return 0;
 }
 
-static int
-linkToGroup(dsCrate *crate, dsObject *freeObject,
-			uint64_t freeObjectOffset, int group)
+/*
+ * Thread specifics.
+ */
+static pthread_key_t key;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+
+static void
+makeKey()
 {
-	if (group >= objectGroups) {
-		dsLog("Group does not exist.\n");
-		return -1;
+	if (pthread_key_create(&key, NULL) != 0) {
+		dsLog("Can't create pthread key.\n");
+		abort();
 	}
+}
+
+static dsCrate *
+getActiveCrate()
+{
+	pthread_once(&keyOnce, makeKey);
 
 	/*
-	 * Add to the new group.
+	 * pthread_getspecific() doesn't fail.
 	 */
-	freeObject->nextGroupOffset = crate->super->headGroupOffset[group];
-	crate->super->headGroupOffset[group] = freeObjectOffset;
-
-	return 0;
+	return pthread_getspecific(key);
 }
 
-static int
-getGroup(uint64_t length)
-{
-	#if 0
-	return (int)(log((double)length) / log(1024));
-	#else
-	int i;
-	for (i = 0; length >= 1024; i++, length /= 1024);
-	dsLog("Group: %d\n", i);
-	return i;
-	#endif
-}
+/*
+ * Statistics.
+ */
+static uint64_t nextCrateId = 1;
 
-static void *
-allocateObject(dsCrate *crate, uint64_t length)
-{
-	dsObject *newObject;
-	dsObject *freeObject;
-	uint64_t nextGroupOffset;
-	uint64_t lengthToAlloc;
-	uint64_t realObjectLength;
-	int group;
+static __thread uint64_t threadStatsId;
+static __thread dsThreadStats *threadStatsCache;
 
-	debugDump(crate);
+static dsThreadStats *
+getThreadStats(dsCrate *crate)
+{
+	dsThreadStats *stats;
 
-	lengthToAlloc = length + objectOverhead;
+	if (threadStatsId == crate->id) {
+		return threadStatsCache;
+	}
 
 	/*
-	 * Find the best-fit group.
+	 * The cache only remembers the last crate, a thread switching between
+	 * crates finds the record it already has.
 	 */
-	group = getGroup(lengthToAlloc);
-
-	for (; group < objectGroups; group++) {
-
-		nextGroupOffset = crate->super->headGroupOffset[group];
-
-		if (nextGroupOffset == UINT64_MAX) {
-			/*
-			 * This list is empty.
-			 */
-			continue;
+	pthread_mutex_lock(&crate->statsLock);
+	for (stats = crate->threadStats; stats != NULL; stats = stats->next) {
+		if (pthread_equal(stats->thread, pthread_self())) {
+			break;
 		}
+	}
+
+	if ((stats == NULL) && ((stats = calloc(1, sizeof(*stats))) != NULL)) {
+		stats->thread = pthread_self();
+		stats->next = crate->threadStats;
+		crate->threadStats = stats;
+	}
+	pthread_mutex_unlock(&crate->statsLock);
 
+	if (stats == NULL) {
 		/*
-		 * The first group entry will do.
+		 * Statistics aren't worth failing over, count somewhere harmless.
 		 */
-		if ((freeObject = mapObject(crate, nextGroupOffset,
-									sizeof(*freeObject))) == NULL) {
-			dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
-				nextGroupOffset, sizeof(*freeObject));
-			return NULL;
-		}
-		if ((freeObject->length & freeObjectBit) == 0) {
-			dsLog("Object should be free but isn't.\n");
-			unmapObject(crate, freeObject);
-			return NULL;
-		}
-		realObjectLength = getRealLength(freeObject->length);
-
-		if (freeObject->length & lastObjectBit) {
-			/*
-			 * The last free object is the best fit.
-			 */
-			if (lengthToAlloc > realObjectLength + objectOverhead + 1) {
-				/*
-				 * But, it isn't large enough. Grow the crate.
-				 */
-				//TODO: Grow the crate.
-			}
-		}
-
-		if (lengthToAlloc > realObjectLength) {
-			dsLog("Object groups are corrupt!\n");
-			unmapObject(crate, freeObject);
-			return NULL;
-		}
+		static __thread dsThreadStats scratch;
+		return &scratch;
+	}
 
-		if (unlinkFromGroup(crate, freeObject, nextGroupOffset, group) < 0) {
-			dsLog("Can't unlink free object.\n");
-			unmapObject(crate, freeObject);
-			return NULL;
-		}
+	threadStatsId = crate->id;
+	threadStatsCache = stats;
 
-		unmapObject(crate, freeObject);
-		if ((freeObject = mapObject(crate, nextGroupOffset,
-									realObjectLength)) == NULL) {
-			dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
-				nextGroupOffset, realObjectLength);
-			return NULL;
-		}
-		newObject = freeObject;
+	return stats;
+}
 
-		if (realObjectLength < lengthToAlloc + objectOverhead + 1) {
-			/*
-			 * The free object is too small to split. Use it all.
-			 */
-			lengthToAlloc = realObjectLength;
-		} else {
-			int newGroup;
-			uint64_t offset;
-			uint64_t length;
+/*
+ * Epochs.
+ */
+#define reclaimBatch 64
 
-			/*
-			 * Adjust the free object.
-			 */
-			offset = nextGroupOffset + lengthToAlloc;
-			length = realObjectLength - lengthToAlloc;
+static __thread uint64_t threadEpochId;
+static __thread dsThreadEpoch *threadEpochCache;
 
-			freeObject = (dsObject *)((uintptr_t)freeObject +
-														lengthToAlloc);
-			freeObject->length = length | freeObjectBit;
-			freeObject->nextGroupOffset = UINT64_MAX;
-			setObjectTrailer(freeObject, offset);
+static dsThreadEpoch *
+getThreadEpoch(dsCrate *crate)
+{
+	dsThreadEpoch *record;
 
-			if (newObject->length & lastObjectBit) {
-				freeObject->length |= lastObjectBit;
-			}
+	if (threadEpochId == crate->id) {
+		return threadEpochCache;
+	}
 
-			newGroup = getGroup(length);
-			if (linkToGroup(crate, freeObject, offset, newGroup) < 0) {
-				dsLog("Can't link free object.\n");
-				unmapObject(crate, freeObject);
-				return NULL;
-			}
+	/*
+	 * Like getThreadStats(), a thread inside read sections of several
+	 * crates must find the record it entered with.
+	 */
+	pthread_mutex_lock(&crate->statsLock);
+	for (record = crate->threadEpochs; record != NULL; record = record->next) {
+		if (pthread_equal(record->thread, pthread_self())) {
+			break;
 		}
+	}
 
-		/*
-		 * Adjust the new new object.
-		 */
-		newObject->length = lengthToAlloc;
-		newObject->nextGroupOffset = UINT64_MAX;
-		setObjectTrailer(newObject, nextGroupOffset);
-
-		debugDump(crate);
+	if ((record == NULL) && ((record = calloc(1, sizeof(*record))) != NULL)) {
+		record->thread = pthread_self();
+		record->next = crate->threadEpochs;
+		__atomic_store_n(&crate->threadEpochs, record, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&crate->statsLock);
 
-		return newObject;
+	if (record == NULL) {
+		dsLog("Can't allocate thread epoch.\n");
+		return NULL;
 	}
 
-	return NULL;
+	threadEpochId = crate->id;
+	threadEpochCache = record;
+
+	return record;
 }
 
-static void
-freeCrate(dsCrate **crate)
+/*
+ * The oldest epoch any reader is still in, UINT64_MAX if there are none.
+ */
+static uint64_t
+oldestEpoch(dsCrate *crate)
 {
-	if (crate == NULL || *crate == NULL) {
-		return;
-	}
-
-	if ((*crate)->fd >= 0) {
-		close((*crate)->fd);
-		(*crate)->fd = -1;
+	dsThreadEpoch *record;
+	uint64_t oldest = UINT64_MAX;
+	uint64_t epoch;
+
+	pthread_mutex_lock(&crate->statsLock);
+	for (record = crate->threadEpochs; record != NULL; record = record->next) {
+		epoch = __atomic_load_n(&record->epoch, __ATOMIC_SEQ_CST);
+		if ((epoch != 0) && (epoch < oldest)) {
+			oldest = epoch;
+		}
 	}
+	pthread_mutex_unlock(&crate->statsLock);
 
-	freeMapping(&(*crate)->map);
-
-	free(*crate);
-	*crate = NULL;
+	return oldest;
 }
 
+/*
+ * Writers' side of 'rootsSequence', see lookupRoot(). Must hold the
+ * allocator lock.
+ */
+static void
+beginRootsChange(dsCrate *crate)
+{
+	__atomic_store_n(&crate->rootsSequence, crate->rootsSequence + 1,
+					 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+endRootsChange(dsCrate *crate)
+{
+	__atomic_store_n(&crate->rootsSequence, crate->rootsSequence + 1,
+					 __ATOMIC_RELEASE);
+}
+
+/*
+ * Keep readers out while objects are moved or freed behind their backs. A
+ * reader announces its epoch before it looks at 'moving', and this sets
+ * 'moving' before looking at the epochs, so one of the two always sees the
+ * other. Must hold the allocator lock.
+ *
+ * Returns zero, or -1 if a reader is already inside.
+ */
 static int
-lockCrate(dsCrate *crate)
+blockReaders(dsCrate *crate)
 {
-	if (flock(crate->fd, LOCK_EX) < 0) {
-		dsLog("Can't lock crate '%s': %s\n", crate->filename, strerror(errno));
+	__atomic_store_n(&crate->moving, 1, __ATOMIC_SEQ_CST);
+
+	if (oldestEpoch(crate) != UINT64_MAX) {
+		__atomic_store_n(&crate->moving, 0, __ATOMIC_SEQ_CST);
 		return -1;
 	}
+	beginRootsChange(crate);
 
 	return 0;
 }
 
+static void
+unblockReaders(dsCrate *crate)
+{
+	endRootsChange(crate);
+	__atomic_store_n(&crate->moving, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Counters are written by one thread and read by another, relaxed atomics
+ * keep that well defined without a locked instruction.
+ */
+#define statsAdd(counter, n) \
+	__atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define statsRead(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+static void
+statsMax(uint64_t *counter, uint64_t value)
+{
+	if (value > *counter) {
+		__atomic_store_n(counter, value, __ATOMIC_RELAXED);
+	}
+}
+
+static uint64_t
+elapsedNanoseconds(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000 +
+		   (now.tv_nsec - start->tv_nsec);
+}
+
 static int
-unlockCrate(dsCrate *crate)
+latencyBucket(uint64_t nanoseconds)
 {
-	if (flock(crate->fd, LOCK_UN) < 0) {
-		dsLog("Can't unlock crate '%s': %s\n", crate->filename, strerror(errno));
+	int bucket;
+
+	if (nanoseconds == 0) {
+		return 0;
+	}
+
+	bucket = 63 - __builtin_clzll(nanoseconds);
+
+	return bucket < DS_STATS_BUCKETS ? bucket : DS_STATS_BUCKETS - 1;
+}
+
+/*
+ * Reserve 'length' bytes of anonymous address space aligned to
+ * 'mapAlignment', so offsets aligned to anything up to a huge page are
+ * aligned in memory too, every time the crate is opened.
+ */
+static void *
+reserveMapping(uint64_t length, int prot)
+{
+	uint8_t *ptr;
+	uint64_t head;
+
+	if ((ptr = mmap(0, length + mapAlignment, prot,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+					-1, 0)) == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+
+	head = -(uintptr_t)ptr & (mapAlignment - 1);
+	if (head != 0) {
+		munmap(ptr, head);
+	}
+	munmap(ptr + head + length, mapAlignment - head);
+
+	return ptr + head;
+}
+
+/*
+ * Buffer pool.
+ *
+ * Instead of mapping the file, pool crates live in anonymous memory backed
+ * by a userfaultfd. The first touch of a page faults to one of a few handler
+ * threads, which reads it in from the file without holding the pool lock, so
+ * faults on different pages are served in parallel. Pages are loaded write
+ * protected, so the first write faults again and marks the page dirty. Once
+ * more than the pool's capacity is resident, CLOCK picks pages to write back
+ * if dirty and drop, skipping pinned ones.
+ *
+ * Loaded pages start out unreferenced and only mapObject() calls on them
+ * while resident mark them, so a scan that touches pages once can't push
+ * the hot set out.
+ *
+ * Pages holding undo records that aren't on disk yet are marked, and are
+ * written and synced before any other page, so a transaction's changes never
+ * reach the file ahead of what rolls them back.
+ */
+#define poolPageSize (64 << 10)
+#define poolHandlers 4
+#define poolResident   0x1
+#define poolDirty      0x2
+#define poolReferenced 0x4
+#define poolLog        0x8
+#define poolLoading    0x10
+
+typedef struct dsPool {
+	int uffd;
+	int wakeFds[2];
+	int epollFds[poolHandlers];
+	pthread_t handlers[poolHandlers];
+	int handlersRunning;
+	int handlersStarted;
+	uint8_t *buffers;
+
+	/*
+	 * Page states and pin counts are protected by 'lock', except setting
+	 * poolReferenced. Pages being loaded count as resident.
+	 */
+	pthread_mutex_t lock;
+	uint8_t *pages;
+	uint32_t *pins;
+	uint64_t pageCount;
+	uint64_t capacity;
+	uint64_t resident;
+	uint64_t dirty;
+	uint64_t pinned;
+	uint64_t hand;
+	int logPending;
+
+	uint64_t loads;
+	uint64_t evictions;
+	uint64_t writebacks;
+} dsPool;
+
+static inline uint8_t
+pageState(dsPool *pool, uint64_t page)
+{
+	return __atomic_load_n(&pool->pages[page], __ATOMIC_RELAXED);
+}
+
+static void
+poolTouch(dsCrate *crate, uint64_t offset, uint64_t length)
+{
+	uint64_t page = offset / poolPageSize;
+	uint64_t last = (offset + (length ? length - 1 : 0)) / poolPageSize;
+
+	for (; page <= last; page++) {
+		uint8_t *state = &crate->pool->pages[page];
+
+		if ((__atomic_load_n(state, __ATOMIC_RELAXED) &
+			 (poolResident | poolReferenced)) == poolResident) {
+			__atomic_or_fetch(state, poolReferenced, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static int
+protectPage(dsPool *pool, void *address, int protect)
+{
+	struct uffdio_writeprotect wp = {
+		.range = {(uintptr_t)address, poolPageSize},
+		.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+	};
+
+	if (ioctl(pool->uffd, UFFDIO_WRITEPROTECT, &wp) < 0) {
+		dsLog("Can't write protect %p: %s\n", address, strerror(errno));
 		return -1;
 	}
 
 	return 0;
 }
 
-static void *
-openCrate(const char *filename, int create)
+static int writeLogPages(dsCrate *crate);
+
+/*
+ * Must hold the pool lock.
+ */
+static int
+writePage(dsCrate *crate, uint64_t page)
 {
-	dsCrate *crate = NULL;
-	struct stat statBuffer;
-	int flags = 0;
+	dsPool *pool = crate->pool;
+	uint64_t offset = page * poolPageSize;
+	uint64_t end = __atomic_load_n(&crate->map.length, __ATOMIC_ACQUIRE);
+	uint64_t length = poolPageSize;
 
-	if ((crate = malloc(sizeof(*crate))) == NULL) {
-		dsLog("Can't allocate crate.\n");
-		goto error;
+	if (pool->logPending && (writeLogPages(crate) < 0)) {
+		return -1;
 	}
-	memset(crate, 0, sizeof(*crate));
-	crate->filename = strdup(filename);
 
-	flags = O_RDWR | O_NOATIME;
-	if (create) {
-		flags |= O_CREAT;
+	/*
+	 * Protect first, so writes that race with the copy dirty it again.
+	 */
+	if (protectPage(pool, crate->map.ptr + offset, 1) < 0) {
+		return -1;
 	}
+	__atomic_and_fetch(&pool->pages[page], ~poolDirty, __ATOMIC_RELAXED);
+	pool->dirty--;
 
-	if ((crate->fd = open(filename, flags, S_IRUSR | S_IWUSR)) < 0) {
-		dsLog("Can't open %s: %s\n", filename, strerror(errno));
-		goto error;
+	if (offset >= end) {
+		return 0;
+	}
+	if (offset + length > end) {
+		length = end - offset;
 	}
 
-	if (lockCrate(crate) < 0) {
-		goto error;
+	if (pwrite(crate->fd, crate->map.ptr + offset, length, offset) !=
+		(ssize_t)length) {
+		dsLog("Can't write back page %" PRIu64 ": %s\n", page,
+			strerror(errno));
+		__atomic_or_fetch(&pool->pages[page], poolDirty, __ATOMIC_RELAXED);
+		pool->dirty++;
+		return -1;
 	}
+	pool->writebacks++;
 
-	if (fstat(crate->fd, &statBuffer) < 0) {
-		dsLog("Can't fstat(%s,): %s\n", filename, strerror(errno));
-		goto error;
+	return 0;
+}
+
+/*
+ * Get every page with undo records waiting for it on disk. Must hold the
+ * pool lock.
+ */
+static int
+writeLogPages(dsCrate *crate)
+{
+	dsPool *pool = crate->pool;
+	uint64_t count = __atomic_load_n(&crate->map.length, __ATOMIC_ACQUIRE) /
+					 poolPageSize + 1;
+	uint64_t page;
+
+	if (count > pool->pageCount) {
+		count = pool->pageCount;
 	}
 
-	if (statBuffer.st_size == 0) {
-		/*
-		 * Create a giant fixed size sparse file.
-		 */
-		crate->map.length = 5*(1<<20);
+	pool->logPending = 0;
+	for (page = 0; page < count; page++) {
+		uint8_t state = pageState(pool, page);
 
-		if (ftruncate(crate->fd, crate->map.length) < 0) {
-			dsLog("Can't ftruncate(%s, %" PRIu64 "): %s\n", filename,
-				crate->map.length, strerror(errno));
+		if (!(state & poolLog)) {
+			continue;
+		}
+		__atomic_and_fetch(&pool->pages[page], ~poolLog, __ATOMIC_RELAXED);
+
+		if ((state & poolDirty) && (writePage(crate, page) < 0)) {
+			__atomic_or_fetch(&pool->pages[page], poolLog, __ATOMIC_RELAXED);
 			goto error;
 		}
-	} else {
-		crate->map.length = statBuffer.st_size;
 	}
 
-	if ((crate->map.ptr = mmap(0, crate->map.length,
-					PROT_READ | PROT_WRITE,
-					MAP_SHARED, crate->fd, 0)) == MAP_FAILED) {
-		dsLog("Can't map shared memory: %s\n", strerror(errno));
+	/*
+	 * Pages evicted since they were marked were written, but maybe not
+	 * synced.
+	 */
+	if (fdatasync(crate->fd) < 0) {
+		dsLog("Can't synchronize undo logs: %s\n", strerror(errno));
 		goto error;
 	}
 
-	crate->super = crate->map.ptr;
-	if (crate->super->magic != MAGIC_LIB_SUPER) {
-		dsObject *freeObject;
-		int i;
+	return 0;
 
-		/*
-		 * This crate needs a super object.
-		 */
-		crate->super->magic = MAGIC_LIB_SUPER;
-		crate->super->version = crateVersion;
-		crate->super->indexObjectOffset = UINT64_MAX;
-		crate->super->indexObjectLength = 0;
-		for (i = 0; i < objectGroups; i++) {
-			crate->super->headGroupOffset[i] = UINT64_MAX;
+error:
+	pool->logPending = 1;
+
+	return -1;
+}
+
+/*
+ * Must hold the pool lock.
+ */
+static void
+dropPage(dsCrate *crate, uint64_t page)
+{
+	dsPool *pool = crate->pool;
+
+	if (madvise(crate->map.ptr + page * poolPageSize, poolPageSize,
+				MADV_DONTNEED) < 0) {
+		dsLog("Can't drop page %" PRIu64 ": %s\n", page, strerror(errno));
+		return;
+	}
+
+	if (pageState(pool, page) & poolDirty) {
+		pool->dirty--;
+	}
+	__atomic_store_n(&pool->pages[page], 0, __ATOMIC_RELAXED);
+	pool->resident--;
+}
+
+/*
+ * Make room for one more page. Must hold the pool lock.
+ */
+static void
+evictPage(dsCrate *crate)
+{
+	dsPool *pool = crate->pool;
+	uint64_t count = __atomic_load_n(&crate->map.length, __ATOMIC_ACQUIRE) /
+					 poolPageSize + 1;
+	uint64_t i;
+
+	if (count > pool->pageCount) {
+		count = pool->pageCount;
+	}
+
+	/*
+	 * Two sweeps clear every reference bit, so something always goes.
+	 */
+	for (i = 0; i < 2 * count + 1; i++) {
+		uint64_t page = pool->hand;
+		uint8_t state;
+
+		pool->hand = (pool->hand + 1) % count;
+
+		state = pageState(pool, page);
+		if (!(state & poolResident) || (pool->pins[page] > 0)) {
+			continue;
+		}
+		if (state & poolReferenced) {
+			__atomic_and_fetch(&pool->pages[page], ~poolReferenced,
+							   __ATOMIC_RELAXED);
+			continue;
 		}
-		/*
-		 * First object comes directly after the super object.
-		 */
-		crate->super->firstObjectOffset = sizeof(*crate->super);
 
-		/*
-		 * Create the first free object.
-		 */
-		freeObject = crate->map.ptr + crate->super->firstObjectOffset;
-		freeObject->length = crate->map.length -
-										crate->super->firstObjectOffset;
-		freeObject->length |= freeObjectBit | lastObjectBit;
-		freeObject->nextGroupOffset = UINT64_MAX;
-		setObjectTrailer(freeObject, crate->super->firstObjectOffset);
+		if ((state & poolDirty) && (writePage(crate, page) < 0)) {
+			continue;
+		}
+		dropPage(crate, page);
+		pool->evictions++;
+		return;
+	}
+}
+
+/*
+ * Read a page in through 'buffer'. Must hold the pool lock, which is dropped
+ * while reading. Faults on the page meanwhile are woken by the copy.
+ */
+static int
+loadPage(dsCrate *crate, uint64_t page, int write, void *buffer)
+{
+	dsPool *pool = crate->pool;
+	uint64_t offset = page * poolPageSize;
+	struct uffdio_copy copy;
+	uint8_t state;
+	ssize_t n;
+	int ret = 0;
+
+	while (pool->resident >= pool->capacity) {
+		uint64_t resident = pool->resident;
+
+		evictPage(crate);
+		if (pool->resident == resident) {
+			break;
+		}
+	}
+
+	__atomic_store_n(&pool->pages[page], poolLoading, __ATOMIC_RELAXED);
+	pool->resident++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if ((n = pread(crate->fd, buffer, poolPageSize, offset)) < 0) {
+		dsLog("Can't read page %" PRIu64 ": %s\n", page, strerror(errno));
+		n = 0;
+	}
+	memset(buffer + n, 0, poolPageSize - n);
+
+	copy.dst = (uintptr_t)crate->map.ptr + offset;
+	copy.src = (uintptr_t)buffer;
+	copy.len = poolPageSize;
+	copy.mode = write ? 0 : UFFDIO_COPY_MODE_WP;
+	copy.copy = 0;
+	if ((ioctl(pool->uffd, UFFDIO_COPY, &copy) < 0) && (errno != EEXIST)) {
+		dsLog("Can't load page %" PRIu64 ": %s\n", page, strerror(errno));
+		ret = -1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (ret < 0) {
+		__atomic_store_n(&pool->pages[page], 0, __ATOMIC_RELAXED);
+		pool->resident--;
+		return -1;
+	}
+
+	/*
+	 * A write may have found the page already, and marked it dirty.
+	 */
+	state = pageState(pool, page);
+	if (write && !(state & poolDirty)) {
+		state |= poolDirty;
+		pool->dirty++;
+	}
+	__atomic_store_n(&pool->pages[page],
+					 (state & ~poolLoading) | poolResident, __ATOMIC_RELAXED);
+	pool->loads++;
+
+	return 0;
+}
+
+static void
+handleFault(dsCrate *crate, struct uffd_msg *msg, void *buffer)
+{
+	dsPool *pool = crate->pool;
+	uint64_t offset = msg->arg.pagefault.address - (uintptr_t)crate->map.ptr;
+	uint64_t page = offset / poolPageSize;
+	uint8_t state = pageState(pool, page);
+	int write = !!(msg->arg.pagefault.flags &
+				   (UFFD_PAGEFAULT_FLAG_WRITE | UFFD_PAGEFAULT_FLAG_WP));
+
+	if (!(state & (poolResident | poolLoading))) {
+		loadPage(crate, page, write, buffer);
+		return;
+	}
+
+	/*
+	 * A write to a clean page, which may still be finishing its load. Faults
+	 * already queued for a page that was loaded since then find it resident
+	 * and, if clean, writable.
+	 */
+	if (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) {
+		if (!(__atomic_fetch_or(&pool->pages[page], poolDirty,
+								__ATOMIC_RELAXED) & poolDirty)) {
+			pool->dirty++;
+		}
+		protectPage(pool, crate->map.ptr + page * poolPageSize, 0);
+		return;
+	}
+
+	/*
+	 * Being loaded for another thread, the copy wakes this one too.
+	 */
+	if (state & poolLoading) {
+		return;
+	}
+
+	/*
+	 * Already loaded for another thread, just wake this one up.
+	 */
+	struct uffdio_range range = {
+		(uintptr_t)crate->map.ptr + page * poolPageSize, poolPageSize
+	};
+	ioctl(pool->uffd, UFFDIO_WAKE, &range);
+}
+
+/*
+ * Every handler waits on the userfaultfd and takes one fault at a time, so
+ * the others pick up the next ones while it reads. Each waits with its own
+ * exclusive epoll, so a fault only wakes one of them. Nothing ever reads the
+ * wake pipe, so one byte in it stops them all.
+ */
+static void *
+handlePool(void *arg)
+{
+	dsCrate *crate = arg;
+	dsPool *pool = crate->pool;
+	int handler = __atomic_fetch_add(&pool->handlersStarted, 1,
+									 __ATOMIC_RELAXED);
+	void *buffer = pool->buffers + handler * poolPageSize;
+	struct epoll_event event;
+	struct uffd_msg msg;
+
+	for (;;) {
+		ssize_t n;
+
+		if (epoll_wait(pool->epollFds[handler], &event, 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			dsLog("Can't wait for page faults: %s\n", strerror(errno));
+			break;
+		}
+		if (event.data.fd == pool->wakeFds[0]) {
+			break;
+		}
 
 		/*
-		 * Link the first free object.
+		 * Another handler may have taken it already.
 		 */
-		int group = getGroup(freeObject->length & ~freeObjectBit);
-		crate->super->headGroupOffset[group] = crate->super->firstObjectOffset;
+		if ((n = read(pool->uffd, &msg, sizeof(msg))) < 0) {
+			if (errno != EAGAIN) {
+				dsLog("Can't read page faults: %s\n", strerror(errno));
+			}
+			continue;
+		}
+
+		if ((n == sizeof(msg)) && (msg.event == UFFD_EVENT_PAGEFAULT)) {
+			pthread_mutex_lock(&pool->lock);
+			handleFault(crate, &msg, buffer);
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Write every dirty page to the file, without syncing it.
+ */
+static int
+flushPool(dsCrate *crate)
+{
+	dsPool *pool = crate->pool;
+	uint64_t page;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (page = 0; (page < pool->pageCount) && (pool->dirty > 0); page++) {
+		if ((pageState(pool, page) & poolDirty) &&
+			(writePage(crate, page) < 0)) {
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+/*
+ * Forget pages entirely inside [offset, offset + length), their contents no
+ * longer matter.
+ */
+static void
+discardPool(dsCrate *crate, uint64_t offset, uint64_t length)
+{
+	dsPool *pool = crate->pool;
+	uint64_t page = (offset + poolPageSize - 1) / poolPageSize;
+	uint64_t end = (offset + length) / poolPageSize;
+
+	pthread_mutex_lock(&pool->lock);
+	for (; page < end; page++) {
+		if (pageState(pool, page) & poolResident) {
+			dropPage(crate, page);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Pin the pages under [offset, offset + length) and load them. Loading takes
+ * the pool lock, so it happens after dropping it.
+ */
+static void
+pinPool(dsCrate *crate, uint64_t offset, uint64_t length)
+{
+	dsPool *pool = crate->pool;
+	uint64_t first = offset / poolPageSize;
+	uint64_t last = (offset + (length ? length - 1 : 0)) / poolPageSize;
+	uint64_t page;
+
+	pthread_mutex_lock(&pool->lock);
+	for (page = first; page <= last; page++) {
+		if (pool->pins[page]++ == 0) {
+			pool->pinned++;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	for (page = first; page <= last; page++) {
+		uint64_t touch = page == first ? offset : page * poolPageSize;
+
+		(void)*(volatile uint8_t *)(crate->map.ptr + touch);
+	}
+}
+
+static int
+unpinPool(dsCrate *crate, uint64_t offset, uint64_t length)
+{
+	dsPool *pool = crate->pool;
+	uint64_t first = offset / poolPageSize;
+	uint64_t last = (offset + (length ? length - 1 : 0)) / poolPageSize;
+	uint64_t page;
+
+	pthread_mutex_lock(&pool->lock);
+	for (page = first; page <= last; page++) {
+		if (pool->pins[page] == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			dsLog("Page %" PRIu64 " isn't pinned.\n", page);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	for (page = first; page <= last; page++) {
+		if (--pool->pins[page] == 0) {
+			pool->pinned--;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/*
+ * Back the crate's reservation with anonymous memory that pages itself in
+ * from the file.
+ */
+static int
+openPool(dsCrate *crate, uint64_t poolBytes)
+{
+	struct uffdio_api api = {
+		.api = UFFD_API,
+		.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP,
+	};
+	struct uffdio_register reg;
+	dsPool *pool;
+	int ret, i;
+
+	if ((pool = calloc(1, sizeof(*pool))) == NULL) {
+		dsLog("Can't allocate buffer pool.\n");
+		return -1;
+	}
+	crate->pool = pool;
+	pool->uffd = -1;
+	pool->wakeFds[0] = pool->wakeFds[1] = -1;
+	for (i = 0; i < poolHandlers; i++) {
+		pool->epollFds[i] = -1;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pool->capacity = poolBytes / poolPageSize;
+	if (pool->capacity < 2) {
+		pool->capacity = 2;
+	}
+
+	if ((crate->map.ptr = reserveMapping(crate->map.reserved,
+					PROT_READ | PROT_WRITE)) == MAP_FAILED) {
+		dsLog("Can't reserve %" PRIu64 " bytes, crate can't grow: %s\n",
+			crate->map.reserved, strerror(errno));
+		crate->map.reserved = crate->map.length;
+		if ((crate->map.ptr = reserveMapping(crate->map.reserved,
+						PROT_READ | PROT_WRITE)) == MAP_FAILED) {
+			dsLog("Can't reserve %" PRIu64 " bytes: %s\n",
+				crate->map.reserved, strerror(errno));
+			crate->map.ptr = NULL;
+			return -1;
+		}
+	}
+
+	/*
+	 * One state byte per page, only the part in use is ever touched.
+	 */
+	pool->pageCount = crate->map.reserved / poolPageSize + 1;
+	if ((pool->pages = mmap(0, pool->pageCount, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+					-1, 0)) == MAP_FAILED) {
+		dsLog("Can't allocate page states: %s\n", strerror(errno));
+		pool->pages = NULL;
+		return -1;
+	}
+	if ((pool->pins = mmap(0, pool->pageCount * sizeof(*pool->pins),
+					PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+					-1, 0)) == MAP_FAILED) {
+		dsLog("Can't allocate pin counts: %s\n", strerror(errno));
+		pool->pins = NULL;
+		return -1;
+	}
+
+	if ((pool->buffers = malloc(poolHandlers * poolPageSize)) == NULL) {
+		dsLog("Can't allocate page buffers.\n");
+		return -1;
+	}
+
+	/*
+	 * Without privileges only faults from user space can be handled, so
+	 * system calls are never handed crate memory that may not be resident:
+	 * syncRange() and exports copy it to buffers of their own first, and
+	 * snapshots copy the file. Callers doing that themselves get EFAULT, as
+	 * documented with dsOpenOptions.
+	 */
+	if (((pool->uffd = syscall(SYS_userfaultfd,
+							   O_CLOEXEC | O_NONBLOCK)) < 0) &&
+		((errno != EPERM) ||
+		 ((pool->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK |
+								UFFD_USER_MODE_ONLY)) < 0))) {
+		dsLog("Can't open userfaultfd: %s\n", strerror(errno));
+		return -1;
+	}
+	if (ioctl(pool->uffd, UFFDIO_API, &api) < 0) {
+		dsLog("Can't set up userfaultfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	reg.range.start = (uintptr_t)crate->map.ptr;
+	reg.range.len = crate->map.reserved;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+	if (ioctl(pool->uffd, UFFDIO_REGISTER, &reg) < 0) {
+		dsLog("Can't register crate with userfaultfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (pipe2(pool->wakeFds, O_CLOEXEC) < 0) {
+		dsLog("Can't create pipe: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < poolHandlers; i++) {
+		struct epoll_event fault = {
+			.events = EPOLLIN | EPOLLEXCLUSIVE, .data.fd = pool->uffd
+		};
+		struct epoll_event wake = {
+			.events = EPOLLIN, .data.fd = pool->wakeFds[0]
+		};
+
+		if (((pool->epollFds[i] = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+			(epoll_ctl(pool->epollFds[i], EPOLL_CTL_ADD, pool->uffd,
+					   &fault) < 0) ||
+			(epoll_ctl(pool->epollFds[i], EPOLL_CTL_ADD, pool->wakeFds[0],
+					   &wake) < 0)) {
+			dsLog("Can't set up waiting for page faults: %s\n",
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	for (i = 0; i < poolHandlers; i++) {
+		if ((ret = pthread_create(&pool->handlers[i], NULL, handlePool,
+								  crate)) != 0) {
+			dsLog("Can't start page fault handler: %s\n", strerror(ret));
+			errno = ret;
+			return -1;
+		}
+		pool->handlersRunning++;
+	}
+
+	return 0;
+}
+
+/*
+ * Dirty pages must have been flushed already.
+ */
+static void
+closePool(dsCrate *crate)
+{
+	dsPool *pool = crate->pool;
+	int i;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	if (pool->handlersRunning > 0) {
+		if (write(pool->wakeFds[1], "", 1) < 0) {
+			dsLog("Can't stop page fault handlers: %s\n", strerror(errno));
+		}
+		for (i = 0; i < pool->handlersRunning; i++) {
+			pthread_join(pool->handlers[i], NULL);
+		}
+	}
+
+	for (i = 0; i < poolHandlers; i++) {
+		if (pool->epollFds[i] >= 0) {
+			close(pool->epollFds[i]);
+		}
+	}
+	if (pool->uffd >= 0) {
+		close(pool->uffd);
+	}
+	if (pool->wakeFds[0] >= 0) {
+		close(pool->wakeFds[0]);
+		close(pool->wakeFds[1]);
+	}
+	if (pool->pages != NULL) {
+		munmap(pool->pages, pool->pageCount);
+	}
+	if (pool->pins != NULL) {
+		munmap(pool->pins, pool->pageCount * sizeof(*pool->pins));
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->buffers);
+	free(pool);
+	crate->pool = NULL;
+}
+
+/*
+ * Map the file from the page holding the current end up to 'newLength', the
+ * file offset must be page aligned. Pools already cover the whole
+ * reservation.
+ */
+static int
+extendMapping(dsCrate *crate, uint64_t newLength)
+{
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	uint64_t oldLength;
+	uint64_t mapOffset;
+
+	if (newLength > crate->map.reserved) {
+		dsLog("Can't grow crate '%s' past %" PRIu64 " bytes.\n",
+			crate->filename, crate->map.reserved);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	mapOffset = crate->map.length & ~(pageSize - 1);
+	if ((crate->pool == NULL) &&
+		(mmap(crate->map.ptr + mapOffset, newLength - mapOffset,
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			  crate->fd, mapOffset) == MAP_FAILED)) {
+		dsLog("Can't map grown crate: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * Readers of a shared crate may catch up at the same time, never let
+	 * the length go backwards.
+	 */
+	oldLength = __atomic_load_n(&crate->map.length, __ATOMIC_RELAXED);
+	while ((oldLength < newLength) &&
+		   !__atomic_compare_exchange_n(&crate->map.length, &oldLength,
+				newLength, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+
+	return 0;
+}
+
+/*
+ * Another process sharing the crate may have grown the file, catch the
+ * mapping up with it. Mapping the same file range twice is harmless, so
+ * this doesn't need 'lock'.
+ */
+static int
+refreshMapping(dsCrate *crate)
+{
+	struct stat statBuffer;
+
+	if (fstat(crate->fd, &statBuffer) < 0) {
+		dsLog("Can't fstat(%s,): %s\n", crate->filename, strerror(errno));
+		return -1;
+	}
+
+	if ((uint64_t)statBuffer.st_size <= crate->map.length) {
+		return 0;
+	}
+
+	return extendMapping(crate, statBuffer.st_size);
+}
+
+static void *
+mapObject(dsCrate *crate, uint64_t offset, uint64_t length)
+{
+	if (crate == NULL) {
+		dsLog("Bad argument %p\n", crate);
+		return NULL;
+	}
+
+	if (crate->shared &&
+		(offset + length > crate->map.offset +
+			__atomic_load_n(&crate->map.length, __ATOMIC_ACQUIRE))) {
+		refreshMapping(crate);
+	}
+
+	if ((offset < crate->map.offset) ||
+		(offset + length > crate->map.offset + crate->map.length)) {
+		dsLog("Can't map region outside of crate.\n");
+		return NULL;
+	}
+
+	if (crate->pool != NULL) {
+		poolTouch(crate, offset, length);
+	}
+
+	return crate->map.ptr + offset;
+}
+
+static inline void
+unmapObject(dsCrate *crate, void *address)
+{
+	crate = address = NULL;
+	return;
+}
+
+#if 0
+static dsMapping *
+makeMapping(dsCrate *crate)
+{
+	if (crate == NULL) {
+		dsLog("Bad argument %p\n", crate);
+		return NULL;
+	}
+
+	if ((offset < crate->map.offset) ||
+		(offset + length > crate->map.offset + crate->map.length)) {
+		dsLog("Can't map region outside of crate.\n");
+		return NULL;
+	}
+
+	return crate->map.ptr + offset;
+}
+#endif
+
+static void
+freeMapping(dsMapping *mapping)
+{
+	if (mapping == NULL) {
+		return;
+	}
+	if ((mapping->ptr != NULL) &&
+		(munmap(mapping->ptr, mapping->reserved) < 0)) {
+		dsLog("Can't munmap(%p,%" PRIu64 "): %s", mapping->ptr,
+			mapping->reserved, strerror(errno));
+	}
+	mapping->ptr = NULL;
+	mapping->offset = 0;
+	mapping->length = 0;
+	mapping->reserved = 0;
+}
+
+static uint64_t
+objectOffset(dsCrate *crate, void *address)
+{
+	/*
+	 * We only support a single giant mapping, for now.
+	 */
+	if ((intptr_t)address < (intptr_t)crate->map.ptr) {
+		dsLog("Pointer falls outside of the crate.\n");
+		return UINT64_MAX;
+	}
+
+	return (intptr_t)address - (intptr_t)crate->map.ptr;
+}
+
+static inline uint64_t
+getRealLength(uint64_t length)
+{
+	return length & ~(freeObjectBit | lastObjectBit);
+}
+
+static dsObject *
+prevObject(dsCrate *crate, dsObject *object)
+{
+	dsObject *prev;
+	uint64_t offset;
+	uint64_t *trailer;
+
+	if ((offset = objectOffset(crate, object)) == UINT64_MAX) {
+		dsLog("Can't get object offset.\n");
+		return (void *)-1;
+	}
+
+	if (offset == crate->super->firstObjectOffset) {
+		return NULL;
+	}
+
+	if ((trailer = mapObject(crate, offset-sizeof(*trailer),
+							 sizeof(*trailer))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			offset-sizeof(*trailer), sizeof(*trailer));
+		return (void *)-1;
+	}
+
+	if ((prev = mapObject(crate, *trailer, sizeof(*prev))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			*trailer, sizeof(*prev));
+		return (void *)-1;
+	}
+
+	return prev;
+}
+
+static dsObject *
+nextObject(dsCrate *crate, dsObject *object)
+{
+	dsObject *next;
+	uint64_t offset;
+
+	if (object->length & lastObjectBit) {
+		return NULL;
+	}
+
+	if ((offset = objectOffset(crate, object)) == UINT64_MAX) {
+		dsLog("Can't get object offset.\n");
+		return (void *)-1;
+	}
+
+	if ((next = mapObject(crate, offset + getRealLength(object->length),
+						  sizeof(*next))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			offset + object->length, sizeof(*next));
+		return (void *)-1;
+	}
+
+	return next;
+}
+
+/*
+ * The whole object should already be mapped.
+ */
+static void
+setObjectTrailer(dsObject *object, uint64_t offset)
+{
+	uint64_t *trailer;
+	uint64_t trailerOffset;
+
+	trailerOffset = getRealLength(object->length) - sizeof(*trailer);
+	trailer = (uint64_t *)((uintptr_t)object + trailerOffset);
+	*trailer = offset;
+}
+
+static uint64_t
+getObjectTrailer(dsCrate *crate, dsObject *object)
+{
+	dsObject *fullObject;
+	uint64_t offset;
+	uint64_t length;
+
+	if ((offset = objectOffset(crate, object)) == UINT64_MAX) {
+		dsLog("Can't get object offset.\n");
+		return UINT64_MAX;
+	}
+
+	length = getRealLength(object->length);
+	if ((fullObject = mapObject(crate, offset, length)) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			offset, length);
+		return UINT64_MAX;
+	}
+
+	uint64_t trailer;
+	uint64_t trailerOffset;
+
+	trailerOffset = length - sizeof(trailer);
+	trailer = *(uint64_t *)((uintptr_t)object + trailerOffset);
+	unmapObject(crate, fullObject);
+
+	return trailer;
+}
+
+static int
+debugDump(dsCrate *crate)
+{
+	dsObject *object;
+	int i;
+
+	if (logCallback == NULL) {
+		/*
+		 * Nobody is listening, don't bother walking the crate.
+		 */
+		return 0;
+	}
+
+	if ((object = mapObject(crate, crate->super->firstObjectOffset,
+						 	sizeof(*object))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			crate->super->firstObjectOffset, sizeof(*object));
+		return -1;
+	}
+
+	dsLog("i, head\n");
+	for (i = 0; i < objectGroups; i++) {
+		dsLog("%d %-20" PRIu64 "\n", i, crate->super->headGroupOffset[i]);
+	}
+
+	dsLog("%-20s %-4s %-4s %-20s %-20s %-20s\n",
+		"@offset", "free", "last", "length", "next", "offset");
+	while (object != NULL) {
+		uint64_t offset;
+
+		if ((offset = objectOffset(crate, object)) == UINT64_MAX) {
+			dsLog("Can't get object offset.\n");
+			return -1;
+		}
+
+		/*
+		 * Dump debug info.
+		 */
+		dsLog("%-20" PRIu64 ": %-4s %-4s %-20" PRIu64 " %-20" PRIu64 " %-20" PRIu64 "\n",
+			offset,
+			object->length & freeObjectBit ? "y" : "n",
+			object->length & lastObjectBit ? "y" : "n",
+			getRealLength(object->length), object->nextGroupOffset,
+			getObjectTrailer(crate, object));
+
+		if ((object = nextObject(crate, object)) == (void *)-1) {
+			dsLog("Can't get next object.\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int
+dsDebugDump()
+{
+	dsCrate *crate;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	return debugDump(crate);
+}
+
+/*
+ * Free objects with room for it keep the offset of the one in front of them
+ * in their group in their first word, UINT64_MAX at the head, so unlinking
+ * doesn't walk the group. Crates written by older versions may hold anything
+ * there, so it is only trusted when the object it names links back.
+ */
+static uint64_t *
+groupPrev(dsObject *freeObject)
+{
+	if (getRealLength(freeObject->length) < objectOverhead + sizeof(uint64_t)) {
+		return NULL;
+	}
+
+	return (uint64_t *)(freeObject + 1);
+}
+
+static uint64_t *
+findGroupLink(dsCrate *crate, dsObject *freeObject,
+			  uint64_t freeObjectOffset, int group, uint64_t *prevOffset)
+{
+	uint64_t *link = &crate->super->headGroupOffset[group];
+	uint64_t *prev = groupPrev(freeObject);
+	uint64_t *trailer;
+	dsObject *object;
+
+	*prevOffset = UINT64_MAX;
+	if (prev != NULL) {
+		if ((*prev == UINT64_MAX) && (*link == freeObjectOffset)) {
+			return link;
+		}
+		if ((*prev != UINT64_MAX) && (*prev != freeObjectOffset) &&
+			((object = mapObject(crate, *prev, sizeof(*object))) != NULL) &&
+			(object->length & freeObjectBit) &&
+			(object->nextGroupOffset == freeObjectOffset) &&
+			((trailer = mapObject(crate, *prev +
+								  getRealLength(object->length) -
+								  sizeof(*trailer),
+								  sizeof(*trailer))) != NULL) &&
+			(*trailer == *prev)) {
+			*prevOffset = *prev;
+			return &object->nextGroupOffset;
+		}
+	}
+
+	/*
+	 * Find whatever points at the free object the long way.
+	 */
+	while (*link != freeObjectOffset) {
+		if (*link == UINT64_MAX) {
+			dsLog("Free object isn't in group.\n");
+			return NULL;
+		}
+		*prevOffset = *link;
+		if ((object = mapObject(crate, *link, sizeof(*object))) == NULL) {
+			dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+				*link, sizeof(*object));
+			return NULL;
+		}
+		link = &object->nextGroupOffset;
+	}
+
+	return link;
+}
+
+static void
+setGroupPrev(dsCrate *crate, uint64_t offset, uint64_t prevOffset)
+{
+	dsObject *object;
+	uint64_t *prev;
+
+	if ((offset != UINT64_MAX) &&
+		((object = mapObject(crate, offset, sizeof(*object))) != NULL) &&
+		((prev = groupPrev(object)) != NULL) &&
+		(mapObject(crate, offset, sizeof(*object) + sizeof(*prev)) != NULL)) {
+		*prev = prevOffset;
+	}
+}
+
+static int
+unlinkFromGroup(dsCrate *crate, dsObject *freeObject,
+				uint64_t freeObjectOffset, int group)
+{
+	uint64_t *link;
+	uint64_t prevOffset;
+
+	if (group >= objectGroups) {
+		dsLog("Group does not exist.\n");
+		return -1;
+	}
+
+	if ((link = findGroupLink(crate, freeObject, freeObjectOffset, group,
+							  &prevOffset)) == NULL) {
+		return -1;
+	}
+
+	/*
+	 * Remove from the group.
+	 */
+	*link = freeObject->nextGroupOffset;
+	setGroupPrev(crate, freeObject->nextGroupOffset, prevOffset);
+	freeObject->nextGroupOffset = UINT64_MAX;
+
+	crate->freeObjects[group]--;
+	crate->freeBytes[group] -= getRealLength(freeObject->length);
+
+	return 0;
+}
+
+static int
+linkToGroup(dsCrate *crate, dsObject *freeObject,
+			uint64_t freeObjectOffset, int group)
+{
+	if (group >= objectGroups) {
+		dsLog("Group does not exist.\n");
+		return -1;
+	}
+
+	/*
+	 * Add to the new group.
+	 */
+	freeObject->nextGroupOffset = crate->super->headGroupOffset[group];
+	setGroupPrev(crate, freeObjectOffset, UINT64_MAX);
+	setGroupPrev(crate, freeObject->nextGroupOffset, freeObjectOffset);
+	crate->super->headGroupOffset[group] = freeObjectOffset;
+
+	crate->freeObjects[group]++;
+	crate->freeBytes[group] += getRealLength(freeObject->length);
+
+	return 0;
+}
+
+static int
+getGroup(uint64_t length)
+{
+	#if 0
+	return (int)(log((double)length) / log(1024));
+	#else
+	int i;
+	for (i = 0; length >= 1024; i++, length /= 1024);
+	dsLog("Group: %d\n", i);
+	return i;
+	#endif
+}
+
+static int releaseObject(dsCrate *crate, dsObject *object, uint64_t offset,
+						 int punch);
+
+/*
+ * Extend the crate file and its mapping by enough to fit an object of
+ * 'lengthToAlloc' bytes, doubling it up to 'growthLimit' at a time. The new
+ * space is merged into the last object if it is free.
+ */
+static int
+growCrate(dsCrate *crate, uint64_t lengthToAlloc)
+{
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	uint64_t oldLength = crate->map.length;
+	uint64_t newLength;
+	uint64_t growth;
+	uint64_t *trailer;
+	dsObject *object;
+
+	growth = lengthToAlloc + objectOverhead + 1;
+	if (growth < oldLength) {
+		growth = oldLength < growthLimit ? oldLength : growthLimit;
+		if (growth < lengthToAlloc + objectOverhead + 1) {
+			growth = lengthToAlloc + objectOverhead + 1;
+		}
+	}
+	newLength = (oldLength + growth + pageSize - 1) & ~(pageSize - 1);
+	growth = newLength - oldLength;
+
+	if (newLength > crate->map.reserved) {
+		dsLog("Can't grow crate '%s' past %" PRIu64 " bytes.\n",
+			crate->filename, crate->map.reserved);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (ftruncate(crate->fd, newLength) < 0) {
+		dsLog("Can't ftruncate(%s, %" PRIu64 "): %s\n", crate->filename,
+			newLength, strerror(errno));
+		return -1;
+	}
+
+	if (extendMapping(crate, newLength) < 0) {
+		return -1;
+	}
+
+	/*
+	 * The old last object gives up its bit to a new object covering the
+	 * growth, which then gets freed like any other.
+	 */
+	if ((trailer = mapObject(crate, oldLength - sizeof(*trailer),
+							 sizeof(*trailer))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			oldLength - sizeof(*trailer), sizeof(*trailer));
+		return -1;
+	}
+	if ((object = mapObject(crate, *trailer, sizeof(*object))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			*trailer, sizeof(*object));
+		return -1;
+	}
+	unmapObject(crate, trailer);
+	object->length &= ~lastObjectBit;
+	unmapObject(crate, object);
+
+	if ((object = mapObject(crate, oldLength, growth)) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			oldLength, growth);
+		return -1;
+	}
+	object->length = growth | lastObjectBit;
+	object->nextGroupOffset = UINT64_MAX;
+	setObjectTrailer(object, oldLength);
+
+	if (releaseObject(crate, object, oldLength, 0) < 0) {
+		dsLog("Can't release grown space.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Turn the unlinked free object at 'offset' into an allocated object of
+ * 'lengthToAlloc' bytes, giving back whatever is left over at its end.
+ */
+static void *
+carveObject(dsCrate *crate, uint64_t offset, uint64_t realLength,
+			uint64_t lengthToAlloc)
+{
+	dsObject *newObject;
+	dsObject *freeObject;
+	int group;
+
+	if ((newObject = mapObject(crate, offset, realLength)) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			offset, realLength);
+		return NULL;
+	}
+
+	if (realLength < lengthToAlloc + objectOverhead + 1) {
+		/*
+		 * The free object is too small to split. Use it all.
+		 */
+		lengthToAlloc = realLength;
+		lengthToAlloc |= newObject->length & lastObjectBit;
+	} else {
+		int newGroup;
+		uint64_t freeOffset;
+		uint64_t length;
+
+		/*
+		 * Adjust the free object.
+		 */
+		statsAdd(getThreadStats(crate)->splits, 1);
+		freeOffset = offset + lengthToAlloc;
+		length = realLength - lengthToAlloc;
+
+		freeObject = (dsObject *)((uintptr_t)newObject + lengthToAlloc);
+		freeObject->length = length | freeObjectBit;
+		freeObject->nextGroupOffset = UINT64_MAX;
+		setObjectTrailer(freeObject, freeOffset);
+
+		if (newObject->length & lastObjectBit) {
+			freeObject->length |= lastObjectBit;
+		}
+
+		newGroup = getGroup(length);
+		if (linkToGroup(crate, freeObject, freeOffset, newGroup) < 0) {
+			dsLog("Can't link free object.\n");
+			unmapObject(crate, freeObject);
+			return NULL;
+		}
+	}
+
+	/*
+	 * Adjust the new new object.
+	 */
+	newObject->length = lengthToAlloc;
+	newObject->nextGroupOffset = UINT64_MAX;
+	setObjectTrailer(newObject, offset);
+
+	group = getGroup(getRealLength(lengthToAlloc));
+	crate->liveObjects[group]++;
+	crate->liveBytes[group] += getRealLength(lengthToAlloc);
+
+	debugDump(crate);
+
+	return newObject;
+}
+
+/*
+ * How far into the free object at 'offset' an object has to start for the
+ * memory after its header to be aligned to 'alignment'. Space skipped in
+ * front has to be large enough to stay behind as a free object.
+ */
+static uint64_t
+alignmentGap(dsCrate *crate, uint64_t offset, uint64_t alignment)
+{
+	uint64_t gap;
+
+	gap = -((uintptr_t)crate->map.ptr + offset + sizeof(dsObject)) &
+		  (alignment - 1);
+	while ((gap != 0) && (gap < objectOverhead + 1)) {
+		gap += alignment;
+	}
+
+	return gap;
+}
+
+static void indexAllocated(dsCrate *crate, uint64_t offset);
+
+/*
+ * Allocate an object whose memory after the header is aligned to
+ * 'alignment', a power of two no larger than 'mapAlignment'. Free objects
+ * that only fit once aligned are split in three.
+ */
+static void *
+allocateAligned(dsCrate *crate, uint64_t length, uint64_t alignment)
+{
+	dsObject *freeObject;
+	uint64_t nextGroupOffset;
+	uint64_t lengthToAlloc;
+	uint64_t realObjectLength;
+	uint64_t gap = 0;
+	int group;
+
+	debugDump(crate);
+
+	lengthToAlloc = alignObjectLength(length + objectOverhead);
+
+	/*
+	 * Find the best-fit group.
+	 */
+	group = getGroup(lengthToAlloc);
+
+	for (; group < objectGroups; group++) {
+
+		/*
+		 * Objects in the best-fit group may still be too small, so take
+		 * the first one that fits. Any object in a larger group will do.
+		 */
+		freeObject = NULL;
+		nextGroupOffset = crate->super->headGroupOffset[group];
+		while (nextGroupOffset != UINT64_MAX) {
+			if ((freeObject = mapObject(crate, nextGroupOffset,
+										sizeof(*freeObject))) == NULL) {
+				dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+					nextGroupOffset, sizeof(*freeObject));
+				return NULL;
+			}
+			if ((freeObject->length & freeObjectBit) == 0) {
+				dsLog("Object should be free but isn't.\n");
+				unmapObject(crate, freeObject);
+				return NULL;
+			}
+			if (alignment > 1) {
+				gap = alignmentGap(crate, nextGroupOffset, alignment);
+			}
+			if (getRealLength(freeObject->length) >= gap + lengthToAlloc) {
+				break;
+			}
+
+			nextGroupOffset = freeObject->nextGroupOffset;
+			unmapObject(crate, freeObject);
+			freeObject = NULL;
+		}
+
+		if (freeObject == NULL) {
+			/*
+			 * Nothing in this group fits.
+			 */
+			continue;
+		}
+		realObjectLength = getRealLength(freeObject->length);
+
+		if (gap + lengthToAlloc > realObjectLength) {
+			dsLog("Object groups are corrupt!\n");
+			unmapObject(crate, freeObject);
+			return NULL;
+		}
+
+		if (unlinkFromGroup(crate, freeObject, nextGroupOffset, group) < 0) {
+			dsLog("Can't unlink free object.\n");
+			unmapObject(crate, freeObject);
+			return NULL;
+		}
+
+		if (gap != 0) {
+			dsObject *rest;
+
+			/*
+			 * The space in front stays free, the rest is split as usual.
+			 */
+			statsAdd(getThreadStats(crate)->splits, 1);
+			rest = (dsObject *)((uintptr_t)freeObject + gap);
+			rest->length = (realObjectLength - gap) | freeObjectBit |
+						   (freeObject->length & lastObjectBit);
+			rest->nextGroupOffset = UINT64_MAX;
+
+			freeObject->length = gap | freeObjectBit;
+			setObjectTrailer(freeObject, nextGroupOffset);
+			if (linkToGroup(crate, freeObject, nextGroupOffset,
+							getGroup(gap)) < 0) {
+				dsLog("Can't link free object.\n");
+				unmapObject(crate, freeObject);
+				return NULL;
+			}
+
+			nextGroupOffset += gap;
+			realObjectLength -= gap;
+		}
+
+		unmapObject(crate, freeObject);
+
+		if ((freeObject = carveObject(crate, nextGroupOffset,
+									  realObjectLength,
+									  lengthToAlloc)) != NULL) {
+			indexAllocated(crate, nextGroupOffset);
+		}
+
+		return freeObject;
+	}
+
+	/*
+	 * Nothing is large enough. Grow the crate and try again, growing
+	 * guarantees a free object that fits, wherever the alignment puts it.
+	 */
+	if (growCrate(crate, lengthToAlloc +
+				  (alignment > 1 ? alignment + objectOverhead : 0)) < 0) {
+		dsLog("Can't grow crate.\n");
+		return NULL;
+	}
+
+	return allocateAligned(crate, length, alignment);
+}
+
+static void *
+allocateObject(dsCrate *crate, uint64_t length)
+{
+	return allocateAligned(crate, length, 1);
+}
+
+/*
+ * Hand the interior pages of a free object back to the file system, leaving
+ * its header and trailer in place. Punching also drops the pages from the
+ * page cache and from every mapping of the crate.
+ */
+static void
+punchObject(dsCrate *crate, uint64_t offset, uint64_t length)
+{
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	uint64_t start;
+	uint64_t end;
+
+	/*
+	 * The first word links it into its group.
+	 */
+	start = (offset + sizeof(dsObject) + sizeof(uint64_t) + pageSize - 1) &
+			~(pageSize - 1);
+	end = (offset + length - sizeof(uint64_t)) & ~(pageSize - 1);
+	if (end <= start) {
+		return;
+	}
+
+	if (crate->pool != NULL) {
+		discardPool(crate, start, end - start);
+	}
+
+	if (fallocate(crate->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  start, end - start) == 0) {
+		return;
+	}
+
+	if (crate->pool != NULL) {
+		dsLog("Can't punch hole(%" PRIu64 ",%" PRIu64 "): %s\n",
+			start, end - start, strerror(errno));
+		return;
+	}
+
+	/*
+	 * Some file systems only support it through the mapping.
+	 */
+	if (madvise(crate->map.ptr + start, end - start, MADV_REMOVE) < 0) {
+		dsLog("Can't punch hole(%" PRIu64 ",%" PRIu64 "): %s\n",
+			start, end - start, strerror(errno));
+	}
+}
+
+/*
+ * Turn an object into a free object, merging it with any free neighbors.
+ * Optionally, punch the result out of the file if it's large enough.
+ */
+static int
+releaseObject(dsCrate *crate, dsObject *object, uint64_t offset, int punch)
+{
+	dsObject *neighbor;
+	uint64_t neighborOffset;
+	uint64_t neighborLength;
+	uint64_t length;
+	uint64_t last;
+
+	length = getRealLength(object->length);
+	last = object->length & lastObjectBit;
+
+	if ((neighbor = nextObject(crate, object)) == (void *)-1) {
+		dsLog("Can't get next object.\n");
+		return -1;
+	}
+	if ((neighbor != NULL) && (neighbor->length & freeObjectBit)) {
+		neighborOffset = offset + length;
+		neighborLength = getRealLength(neighbor->length);
+
+		if (unlinkFromGroup(crate, neighbor, neighborOffset,
+							getGroup(neighborLength)) < 0) {
+			dsLog("Can't unlink free object.\n");
+			return -1;
+		}
+		if (crate->compactOffset == neighborOffset) {
+			crate->compactOffset = offset;
+		}
+
+		statsAdd(getThreadStats(crate)->merges, 1);
+		last = neighbor->length & lastObjectBit;
+		length += neighborLength;
+		unmapObject(crate, neighbor);
+	}
+
+	if ((neighbor = prevObject(crate, object)) == (void *)-1) {
+		dsLog("Can't get previous object.\n");
+		return -1;
+	}
+	if ((neighbor != NULL) && (neighbor->length & freeObjectBit)) {
+		neighborOffset = offset - getRealLength(neighbor->length);
+		neighborLength = getRealLength(neighbor->length);
+
+		if (unlinkFromGroup(crate, neighbor, neighborOffset,
+							getGroup(neighborLength)) < 0) {
+			dsLog("Can't unlink free object.\n");
+			return -1;
+		}
+		if (crate->compactOffset == offset) {
+			crate->compactOffset = neighborOffset;
+		}
+
+		statsAdd(getThreadStats(crate)->merges, 1);
+		object = neighbor;
+		offset = neighborOffset;
+		length += neighborLength;
+	}
+
+	if ((object = mapObject(crate, offset, length)) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n", offset, length);
+		return -1;
+	}
+
+	object->length = length | freeObjectBit | last;
+	object->nextGroupOffset = UINT64_MAX;
+	setObjectTrailer(object, offset);
+
+	if (linkToGroup(crate, object, offset, getGroup(length)) < 0) {
+		dsLog("Can't link free object.\n");
+		unmapObject(crate, object);
+		return -1;
+	}
+
+	if (punch && (length >= punchThreshold)) {
+		punchObject(crate, offset, length);
+	}
+
+	unmapObject(crate, object);
+
+	return 0;
+}
+
+/*
+ * Count the space in every group from scratch.
+ */
+static int
+countSpace(dsCrate *crate)
+{
+	dsObject *object;
+
+	memset(crate->liveObjects, 0, sizeof(crate->liveObjects));
+	memset(crate->liveBytes, 0, sizeof(crate->liveBytes));
+	memset(crate->freeObjects, 0, sizeof(crate->freeObjects));
+	memset(crate->freeBytes, 0, sizeof(crate->freeBytes));
+
+	if ((object = mapObject(crate, crate->super->firstObjectOffset,
+							sizeof(*object))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			crate->super->firstObjectOffset, sizeof(*object));
+		return -1;
+	}
+
+	while (object != NULL) {
+		dsObject *next;
+		uint64_t length = getRealLength(object->length);
+		int group = getGroup(length);
+
+		if (object->length & freeObjectBit) {
+			crate->freeObjects[group]++;
+			crate->freeBytes[group] += length;
+		} else {
+			crate->liveObjects[group]++;
+			crate->liveBytes[group] += length;
+		}
+
+		if ((next = nextObject(crate, object)) == (void *)-1) {
+			dsLog("Can't get next object.\n");
+			return -1;
+		}
+		unmapObject(crate, object);
+		object = next;
+	}
+
+	crate->statsReady = 1;
+
+	return 0;
+}
+
+static uint64_t
+largestFreeObject(dsCrate *crate)
+{
+	uint64_t largest = 0;
+	int group;
+
+	/*
+	 * Only the highest group with anything in it needs walking.
+	 */
+	for (group = objectGroups - 1; group >= 0; group--) {
+		uint64_t offset = crate->super->headGroupOffset[group];
+
+		while (offset != UINT64_MAX) {
+			dsObject *object;
+
+			if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+				break;
+			}
+			if (getRealLength(object->length) > largest) {
+				largest = getRealLength(object->length);
+			}
+			offset = object->nextGroupOffset;
+			unmapObject(crate, object);
+		}
+
+		if (largest) {
+			break;
+		}
+	}
+
+	/*
+	 * Report what could actually be handed to dsAlloc().
+	 */
+	return largest > objectOverhead ? largest - objectOverhead : 0;
+}
+
+/*
+ * Checksums.
+ *
+ * Allocated objects don't use 'nextGroupOffset', so it holds a CRC32C of the
+ * object's contents, tagged in its upper half. Objects only get one once
+ * dsMarkDirty() is called on them. Marked objects are kept in a hash set and
+ * checksummed on the next sync, which writes them out with their contents.
+ */
+#define checksumTag  0x4353554d00000000ULL
+#define checksumMask 0xffffffff00000000ULL
+#define dirtyMinSize 256
+
+static uint32_t crcTable[8][256];
+
+static uint32_t
+crc32cSoftware(uint32_t crc, const uint8_t *data, uint64_t length)
+{
+	while ((length > 0) && ((uintptr_t)data & 7)) {
+		crc = crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+		length--;
+	}
+
+	/*
+	 * Slicing by 8, one table lookup per byte but no dependency between
+	 * them.
+	 */
+	while (length >= 8) {
+		uint64_t word = *(const uint64_t *)data ^ crc;
+
+		crc = crcTable[7][word & 0xff] ^
+			  crcTable[6][(word >> 8) & 0xff] ^
+			  crcTable[5][(word >> 16) & 0xff] ^
+			  crcTable[4][(word >> 24) & 0xff] ^
+			  crcTable[3][(word >> 32) & 0xff] ^
+			  crcTable[2][(word >> 40) & 0xff] ^
+			  crcTable[1][(word >> 48) & 0xff] ^
+			  crcTable[0][word >> 56];
+		data += 8;
+		length -= 8;
+	}
+
+	while (length > 0) {
+		crc = crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+		length--;
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+static uint32_t __attribute__((target("sse4.2")))
+crc32cSSE42(uint32_t crc, const uint8_t *data, uint64_t length)
+{
+	uint64_t crc64;
+
+	while ((length > 0) && ((uintptr_t)data & 7)) {
+		crc = __builtin_ia32_crc32qi(crc, *data++);
+		length--;
+	}
+
+	crc64 = crc;
+	while (length >= 8) {
+		crc64 = __builtin_ia32_crc32di(crc64, *(const uint64_t *)data);
+		data += 8;
+		length -= 8;
+	}
+	crc = crc64;
+
+	while (length > 0) {
+		crc = __builtin_ia32_crc32qi(crc, *data++);
+		length--;
+	}
+
+	return crc;
+}
+#endif
+
+static uint32_t (*crc32c)(uint32_t crc, const uint8_t *data,
+						  uint64_t length) = crc32cSoftware;
+
+static void __attribute__((constructor))
+makeCrcTable()
+{
+	uint32_t crc;
+	int i;
+	int j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		}
+		crcTable[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crcTable[j][i] = crcTable[0][crcTable[j - 1][i] & 0xff] ^
+							 (crcTable[j - 1][i] >> 8);
+		}
+	}
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c = crc32cSSE42;
+	}
+#endif
+}
+
+static int
+hasChecksum(dsObject *object)
+{
+	return (object->nextGroupOffset & checksumMask) == checksumTag;
+}
+
+static uint32_t
+objectChecksum(dsObject *object)
+{
+	return ~crc32c(~0U, (const uint8_t *)(object + 1),
+				   getRealLength(object->length) - objectOverhead);
+}
+
+static void
+setChecksum(dsObject *object)
+{
+	object->nextGroupOffset = checksumTag | objectChecksum(object);
+}
+
+static uint64_t
+dirtySlot(uint64_t offset, uint64_t size)
+{
+	return (offset * 0x9e3779b97f4a7c15ULL >> 32) & (size - 1);
+}
+
+/*
+ * Must hold 'dirtyLock'.
+ */
+static int
+addDirty(dsCrate *crate, uint64_t offset)
+{
+	uint64_t i;
+
+	if ((crate->dirtyCount + 1) * 2 > crate->dirtySize) {
+		uint64_t size = crate->dirtySize ? crate->dirtySize * 2 : dirtyMinSize;
+		uint64_t *dirty;
+
+		if ((dirty = malloc(size * sizeof(*dirty))) == NULL) {
+			dsLog("Can't grow dirty objects to %" PRIu64 "\n", size);
+			return -1;
+		}
+		memset(dirty, 0xff, size * sizeof(*dirty));
+
+		for (i = 0; i < crate->dirtySize; i++) {
+			uint64_t j;
+
+			if (crate->dirty[i] == UINT64_MAX) {
+				continue;
+			}
+			for (j = dirtySlot(crate->dirty[i], size); dirty[j] != UINT64_MAX;
+				 j = (j + 1) & (size - 1)) {
+			}
+			dirty[j] = crate->dirty[i];
+		}
+
+		free(crate->dirty);
+		crate->dirty = dirty;
+		crate->dirtySize = size;
+	}
+
+	for (i = dirtySlot(offset, crate->dirtySize);
+		 crate->dirty[i] != UINT64_MAX; i = (i + 1) & (crate->dirtySize - 1)) {
+		if (crate->dirty[i] == offset) {
+			return 0;
+		}
+	}
+	crate->dirty[i] = offset;
+	crate->dirtyCount++;
+
+	return 0;
+}
+
+/*
+ * Forget a freed object, so whoever gets its space next doesn't end up with
+ * a checksum it never asked for.
+ */
+static void
+removeDirty(dsCrate *crate, uint64_t offset)
+{
+	uint64_t mask;
+	uint64_t i;
+	uint64_t j;
+
+	if (__atomic_load_n(&crate->dirtyCount, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&crate->dirtyLock);
+
+	mask = crate->dirtySize - 1;
+	for (i = dirtySlot(offset, crate->dirtySize);
+		 crate->dirty[i] != offset; i = (i + 1) & mask) {
+		if (crate->dirty[i] == UINT64_MAX) {
+			pthread_mutex_unlock(&crate->dirtyLock);
+			return;
+		}
+	}
+
+	/*
+	 * Shift back whatever would no longer be found past the gap.
+	 */
+	for (j = i; ; ) {
+		uint64_t home;
+
+		j = (j + 1) & mask;
+		if (crate->dirty[j] == UINT64_MAX) {
+			break;
+		}
+
+		home = dirtySlot(crate->dirty[j], crate->dirtySize);
+		if ((i <= j) ? ((home <= i) || (home > j)) :
+					   ((home <= i) && (home > j))) {
+			crate->dirty[i] = crate->dirty[j];
+			i = j;
+		}
+	}
+	crate->dirty[i] = UINT64_MAX;
+	crate->dirtyCount--;
+
+	pthread_mutex_unlock(&crate->dirtyLock);
+}
+
+/*
+ * Checksum every object marked since the last time. Must hold 'lock', so
+ * nothing marked can be freed or moved meanwhile.
+ */
+static void
+updateChecksums(dsCrate *crate)
+{
+	uint64_t *dirty;
+	uint64_t size;
+	uint64_t i;
+
+	if (__atomic_load_n(&crate->dirtyCount, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&crate->dirtyLock);
+	dirty = crate->dirty;
+	size = crate->dirtySize;
+	crate->dirty = NULL;
+	crate->dirtySize = 0;
+	crate->dirtyCount = 0;
+	pthread_mutex_unlock(&crate->dirtyLock);
+
+	for (i = 0; i < size; i++) {
+		dsObject *object;
+
+		if (dirty[i] == UINT64_MAX) {
+			continue;
+		}
+		if ((object = mapObject(crate, dirty[i], sizeof(*object))) == NULL) {
+			continue;
+		}
+		if (((object->length & freeObjectBit) == 0) &&
+			(mapObject(crate, dirty[i], getRealLength(object->length)) != NULL)) {
+			setChecksum(object);
+		}
+		unmapObject(crate, object);
+	}
+
+	free(dirty);
+}
+
+/*
+ * Registered types.
+ */
+#define maxTypes 64
+
+typedef struct dsType {
+	uint64_t magic;
+	dsTraceCallback trace;
+} dsType;
+
+static pthread_mutex_t typeLock = PTHREAD_MUTEX_INITIALIZER;
+static dsType types[maxTypes];
+static int typeCount = 0;
+
+int
+dsRegisterType(uint64_t magic, dsTraceCallback trace)
+{
+	int i;
+
+	if (trace == NULL) {
+		dsLog("Bad argument %p\n", trace);
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&typeLock);
+
+	for (i = 0; i < typeCount; i++) {
+		if (types[i].magic == magic) {
+			types[i].trace = trace;
+			pthread_mutex_unlock(&typeLock);
+			return 0;
+		}
+	}
+
+	if (typeCount == maxTypes) {
+		dsLog("Too many registered types.\n");
+		pthread_mutex_unlock(&typeLock);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	types[typeCount].magic = magic;
+	types[typeCount].trace = trace;
+	__atomic_store_n(&typeCount, typeCount + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&typeLock);
+
+	return 0;
+}
+
+static dsTraceCallback
+findType(uint64_t magic)
+{
+	int count = __atomic_load_n(&typeCount, __ATOMIC_ACQUIRE);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (types[i].magic == magic) {
+			return types[i].trace;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Call the registered trace callback, if any, of every allocated object.
+ */
+static int
+traceObjects(dsCrate *crate, dsVisitCallback visit, void *arg)
+{
+	dsObject *object;
+
+	if ((object = mapObject(crate, crate->super->firstObjectOffset,
+							sizeof(*object))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			crate->super->firstObjectOffset, sizeof(*object));
+		return -1;
+	}
+
+	while (object != NULL) {
+		dsObject *next;
+		uint64_t length = getRealLength(object->length) - objectOverhead;
+
+		if (((object->length & freeObjectBit) == 0) &&
+			(length >= sizeof(uint64_t))) {
+			dsTraceCallback trace;
+			uint64_t *magic = (uint64_t *)(object + 1);
+
+			if ((trace = findType(*magic)) != NULL) {
+				trace(magic, length, visit, arg);
+
+				/*
+				 * Visits may have rewritten offsets.
+				 */
+				if (hasChecksum(object)) {
+					setChecksum(object);
+				}
+			}
+		}
+
+		if ((next = nextObject(crate, object)) == (void *)-1) {
+			dsLog("Can't get next object.\n");
+			return -1;
+		}
+		unmapObject(crate, object);
+		object = next;
+	}
+
+	return 0;
+}
+
+/*
+ * Compaction.
+ *
+ * Free space is gathered into one free object which slides toward the end of
+ * the crate by moving the live object after it down, one object at a time.
+ * Every free object it passes merges into it. Offsets held by registered
+ * types and the index are rewritten once per slice, by tracing the whole
+ * crate when running to completion.
+ */
+typedef struct dsRelocation {
+	uint64_t offset;
+	uint64_t length;
+	uint64_t newOffset;
+} dsRelocation;
+
+typedef struct dsRelocations {
+	dsRelocation *moves;
+	uint64_t count;
+	uint64_t capacity;
+} dsRelocations;
+
+static int
+addRelocation(dsRelocations *relocations, uint64_t offset, uint64_t length,
+			  uint64_t newOffset)
+{
+	if (relocations->count == relocations->capacity) {
+		dsRelocation *moves;
+		uint64_t capacity;
+
+		capacity = relocations->capacity ? relocations->capacity * 2 : 256;
+		if ((moves = realloc(relocations->moves,
+							 capacity * sizeof(*moves))) == NULL) {
+			dsLog("Can't grow relocations.\n");
+			return -1;
+		}
+		relocations->moves = moves;
+		relocations->capacity = capacity;
+	}
+
+	relocations->moves[relocations->count].offset = offset;
+	relocations->moves[relocations->count].length = length;
+	relocations->moves[relocations->count].newOffset = newOffset;
+	relocations->count++;
+
+	return 0;
+}
+
+/*
+ * Moves are recorded in offset order, so they can be binary searched.
+ */
+static void
+relocateOffset(void *arg, uint64_t *offset)
+{
+	dsRelocations *relocations = arg;
+	uint64_t low = 0;
+	uint64_t high = relocations->count;
+
+	if (*offset == UINT64_MAX) {
+		return;
+	}
+
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+
+		if (relocations->moves[middle].offset <= *offset) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	if (low > 0) {
+		dsRelocation *move = &relocations->moves[low - 1];
+
+		if (*offset < move->offset + move->length) {
+			*offset = *offset - move->offset + move->newOffset;
+		}
+	}
+}
+
+static void lockAllocator(dsCrate *crate);
+static void unlockAllocator(dsCrate *crate);
+
+/*
+ * Slices with a budget don't trace the whole crate. The first ones add every
+ * allocated object to an index ordered by offset, a treap, and then trace
+ * each object once, linking every offset it holds both to it and to the
+ * object the offset points to. Moving an object then only rewrites the
+ * offsets pointing into it, and since sliding keeps objects in order, it
+ * only changes the object's key.
+ *
+ * Objects allocated in between are added as they come, objects changed
+ * through dsTxAdd() or dsNoteReferences() are traced again before the next
+ * slice moves anything. Offsets to anything but the start of an object's
+ * data are rewritten by every slice like the super object's. The index goes
+ * away once compaction is done, or when it can't be kept up, which leaves
+ * the next slice tracing the whole crate.
+ */
+#define noIndex UINT32_MAX
+#define indexCheckInterval 64
+
+#define indexPending 0x1
+#define indexTouched 0x2
+
+typedef struct dsIndexNode {
+	uint64_t offset;
+	uint32_t left;
+	uint32_t right;
+	uint32_t priority;
+	uint32_t flags;
+	uint32_t inHead;
+	uint32_t outHead;
+} dsIndexNode;
+
+/*
+ * An offset at 'slot' held by 'holder', pointing to 'target' or on the
+ * unresolved list.
+ */
+typedef struct dsReference {
+	uint64_t slot;
+	uint32_t holder;
+	uint32_t target;
+	uint32_t prevIn;
+	uint32_t nextIn;
+	uint32_t nextOut;
+} dsReference;
+
+typedef struct dsIdList {
+	uint32_t *ids;
+	uint32_t count;
+	uint32_t capacity;
+} dsIdList;
+
+typedef struct dsReferenceIndex {
+	/*
+	 * Objects from 'collectOffset' on aren't added yet, objects from
+	 * 'traceOffset' on aren't traced yet. Both are UINT64_MAX once done.
+	 */
+	uint64_t collectOffset;
+	uint64_t traceOffset;
+
+	dsIndexNode *nodes;
+	uint32_t nodeCount;
+	uint32_t nodeCapacity;
+	uint32_t freeNode;
+	uint32_t root;
+	uint32_t seed;
+
+	dsReference *references;
+	uint32_t referenceCount;
+	uint32_t referenceCapacity;
+	uint32_t freeReference;
+	uint32_t unresolved;
+
+	/*
+	 * Objects to trace again, and objects with offsets rewritten by this
+	 * slice that need a new checksum.
+	 */
+	dsIdList pending;
+	dsIdList touched;
+
+	int failed;
+} dsReferenceIndex;
+
+static int
+makeIndex(dsCrate *crate)
+{
+	dsReferenceIndex *index;
+
+	if ((index = calloc(1, sizeof(*index))) == NULL) {
+		dsLog("Can't allocate reference index.\n");
+		return -1;
+	}
+
+	index->collectOffset = crate->super->firstObjectOffset;
+	index->traceOffset = 0;
+	index->freeNode = noIndex;
+	index->root = noIndex;
+	index->seed = 0x9e3779b9;
+	index->freeReference = noIndex;
+	index->unresolved = noIndex;
+
+	__atomic_store_n(&crate->references, index, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void
+dropIndex(dsCrate *crate)
+{
+	dsReferenceIndex *index = crate->references;
+
+	if (index == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&crate->references, NULL, __ATOMIC_RELEASE);
+	free(index->nodes);
+	free(index->references);
+	free(index->pending.ids);
+	free(index->touched.ids);
+	free(index);
+}
+
+/*
+ * Grow 'array' of 'capacity' elements of 'size' bytes to fit one more.
+ */
+static int
+growArray(void **array, uint32_t *capacity, uint32_t count, size_t size)
+{
+	uint32_t newCapacity;
+	void *newArray;
+
+	if (count < *capacity) {
+		return 0;
+	}
+
+	if (*capacity >= noIndex / 2) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	newCapacity = *capacity ? *capacity * 2 : 1024;
+	if ((newArray = realloc(*array, (size_t)newCapacity * size)) == NULL) {
+		return -1;
+	}
+	*array = newArray;
+	*capacity = newCapacity;
+
+	return 0;
+}
+
+static void
+addId(dsReferenceIndex *index, dsIdList *list, uint32_t id)
+{
+	if (growArray((void **)&list->ids, &list->capacity, list->count,
+				  sizeof(*list->ids)) < 0) {
+		index->failed = 1;
+		return;
+	}
+
+	list->ids[list->count++] = id;
+}
+
+static uint32_t
+rotateRight(dsIndexNode *nodes, uint32_t id)
+{
+	uint32_t left = nodes[id].left;
+
+	nodes[id].left = nodes[left].right;
+	nodes[left].right = id;
+
+	return left;
+}
+
+static uint32_t
+rotateLeft(dsIndexNode *nodes, uint32_t id)
+{
+	uint32_t right = nodes[id].right;
+
+	nodes[id].right = nodes[right].left;
+	nodes[right].left = id;
+
+	return right;
+}
+
+static uint32_t
+insertNode(dsIndexNode *nodes, uint32_t root, uint32_t id)
+{
+	if (root == noIndex) {
+		return id;
+	}
+
+	if (nodes[id].offset < nodes[root].offset) {
+		nodes[root].left = insertNode(nodes, nodes[root].left, id);
+		if (nodes[nodes[root].left].priority > nodes[root].priority) {
+			root = rotateRight(nodes, root);
+		}
+	} else {
+		nodes[root].right = insertNode(nodes, nodes[root].right, id);
+		if (nodes[nodes[root].right].priority > nodes[root].priority) {
+			root = rotateLeft(nodes, root);
+		}
+	}
+
+	return root;
+}
+
+static uint32_t
+removeNode(dsIndexNode *nodes, uint32_t root, uint32_t id)
+{
+	if (root == noIndex) {
+		return noIndex;
+	}
+
+	if (root == id) {
+		if (nodes[root].left == noIndex) {
+			return nodes[root].right;
+		}
+		if (nodes[root].right == noIndex) {
+			return nodes[root].left;
+		}
+
+		/*
+		 * Rotate it down below the child that stays on top.
+		 */
+		if (nodes[nodes[root].left].priority >
+			nodes[nodes[root].right].priority) {
+			root = rotateRight(nodes, root);
+			nodes[root].right = removeNode(nodes, nodes[root].right, id);
+		} else {
+			root = rotateLeft(nodes, root);
+			nodes[root].left = removeNode(nodes, nodes[root].left, id);
+		}
+	} else if (nodes[id].offset < nodes[root].offset) {
+		nodes[root].left = removeNode(nodes, nodes[root].left, id);
+	} else {
+		nodes[root].right = removeNode(nodes, nodes[root].right, id);
+	}
+
+	return root;
+}
+
+/*
+ * Find the object at 'offset', or else the closest one before it, or after
+ * it when 'after' is set.
+ */
+static uint32_t
+findNode(dsReferenceIndex *index, uint64_t offset, int after)
+{
+	uint32_t id = index->root;
+	uint32_t found = noIndex;
+
+	while (id != noIndex) {
+		dsIndexNode *node = &index->nodes[id];
+
+		if (node->offset == offset) {
+			return id;
+		}
+		if (node->offset < offset) {
+			if (!after) {
+				found = id;
+			}
+			id = node->right;
+		} else {
+			if (after) {
+				found = id;
+			}
+			id = node->left;
+		}
+	}
+
+	return found;
+}
+
+static uint32_t
+findObject(dsReferenceIndex *index, uint64_t offset)
+{
+	uint32_t id = findNode(index, offset, 0);
+
+	if ((id == noIndex) || (index->nodes[id].offset != offset)) {
+		return noIndex;
+	}
+
+	return id;
+}
+
+static uint32_t
+addNode(dsReferenceIndex *index, uint64_t offset)
+{
+	dsIndexNode *node;
+	uint32_t id;
+
+	if (index->freeNode != noIndex) {
+		id = index->freeNode;
+		index->freeNode = index->nodes[id].left;
+	} else {
+		if (growArray((void **)&index->nodes, &index->nodeCapacity,
+					  index->nodeCount, sizeof(*index->nodes)) < 0) {
+			dsLog("Can't grow reference index.\n");
+			index->failed = 1;
+			return noIndex;
+		}
+		id = index->nodeCount++;
+	}
+
+	/*
+	 * xorshift32, priorities only need to look random.
+	 */
+	index->seed ^= index->seed << 13;
+	index->seed ^= index->seed >> 17;
+	index->seed ^= index->seed << 5;
+
+	node = &index->nodes[id];
+	node->offset = offset;
+	node->left = noIndex;
+	node->right = noIndex;
+	node->priority = index->seed;
+	node->flags = 0;
+	node->inHead = noIndex;
+	node->outHead = noIndex;
+	index->root = insertNode(index->nodes, index->root, id);
+
+	return id;
+}
+
+static uint32_t *
+inHead(dsReferenceIndex *index, uint32_t target)
+{
+	return target == noIndex ? &index->unresolved :
+							   &index->nodes[target].inHead;
+}
+
+static void
+linkIn(dsReferenceIndex *index, uint32_t id, uint32_t target)
+{
+	dsReference *reference = &index->references[id];
+	uint32_t *head = inHead(index, target);
+
+	reference->target = target;
+	reference->prevIn = noIndex;
+	reference->nextIn = *head;
+	if (*head != noIndex) {
+		index->references[*head].prevIn = id;
+	}
+	*head = id;
+}
+
+static void
+unlinkIn(dsReferenceIndex *index, uint32_t id)
+{
+	dsReference *reference = &index->references[id];
+
+	if (reference->prevIn != noIndex) {
+		index->references[reference->prevIn].nextIn = reference->nextIn;
+	} else {
+		*inHead(index, reference->target) = reference->nextIn;
+	}
+	if (reference->nextIn != noIndex) {
+		index->references[reference->nextIn].prevIn = reference->prevIn;
+	}
+}
+
+static void
+addReference(dsReferenceIndex *index, uint64_t slot, uint32_t holder,
+			 uint32_t target)
+{
+	dsReference *reference;
+	uint32_t id;
+
+	if (index->freeReference != noIndex) {
+		id = index->freeReference;
+		index->freeReference = index->references[id].nextOut;
+	} else {
+		if (growArray((void **)&index->references,
+					  &index->referenceCapacity, index->referenceCount,
+					  sizeof(*index->references)) < 0) {
+			dsLog("Can't grow reference index.\n");
+			index->failed = 1;
+			return;
+		}
+		id = index->referenceCount++;
+	}
+
+	reference = &index->references[id];
+	reference->slot = slot;
+	reference->holder = holder;
+	reference->nextOut = index->nodes[holder].outHead;
+	index->nodes[holder].outHead = id;
+	linkIn(index, id, target);
+}
+
+/*
+ * Forget the offsets 'holder' holds.
+ */
+static void
+dropReferences(dsReferenceIndex *index, uint32_t holder)
+{
+	uint32_t id = index->nodes[holder].outHead;
+
+	while (id != noIndex) {
+		uint32_t next = index->references[id].nextOut;
+
+		unlinkIn(index, id);
+		index->references[id].nextOut = index->freeReference;
+		index->freeReference = id;
+		id = next;
+	}
+	index->nodes[holder].outHead = noIndex;
+}
+
+static void
+deleteNode(dsReferenceIndex *index, uint32_t id)
+{
+	uint32_t reference = index->nodes[id].inHead;
+
+	dropReferences(index, id);
+
+	/*
+	 * Whatever still points here is left to be rewritten by value.
+	 */
+	while (reference != noIndex) {
+		uint32_t next = index->references[reference].nextIn;
+
+		linkIn(index, reference, noIndex);
+		reference = next;
+	}
+	index->nodes[id].inHead = noIndex;
+
+	index->root = removeNode(index->nodes, index->root, id);
+	index->nodes[id].offset = UINT64_MAX;
+	index->nodes[id].left = index->freeNode;
+	index->freeNode = id;
+}
+
+static void
+markPending(dsReferenceIndex *index, uint32_t id)
+{
+	if (index->nodes[id].flags & indexPending) {
+		return;
+	}
+
+	index->nodes[id].flags |= indexPending;
+	addId(index, &index->pending, id);
+}
+
+typedef struct dsIndexTrace {
+	dsCrate *crate;
+	dsReferenceIndex *index;
+	uint32_t holder;
+} dsIndexTrace;
+
+static void
+indexOffset(void *arg, uint64_t *offset)
+{
+	dsIndexTrace *trace = arg;
+	dsReferenceIndex *index = trace->index;
+	uint32_t target = noIndex;
+
+	/*
+	 * Changing it to anything else goes through dsTxAdd() first.
+	 */
+	if (*offset == UINT64_MAX) {
+		return;
+	}
+
+	if (*offset >= sizeof(dsObject)) {
+		target = findObject(index, *offset - sizeof(dsObject));
+	}
+
+	addReference(index, objectOffset(trace->crate, offset), trace->holder,
+				 target);
+}
+
+static int
+traceNode(dsCrate *crate, dsReferenceIndex *index, uint32_t id)
+{
+	dsIndexTrace trace = {crate, index, id};
+	dsTraceCallback callback;
+	dsObject *object;
+	uint64_t offset = index->nodes[id].offset;
+	uint64_t length;
+
+	dropReferences(index, id);
+
+	if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			offset, sizeof(*object));
+		return -1;
+	}
+	length = getRealLength(object->length) - objectOverhead;
+
+	if (((object->length & freeObjectBit) == 0) &&
+		(length >= sizeof(uint64_t)) &&
+		((callback = findType(*(uint64_t *)(object + 1))) != NULL)) {
+		callback(object + 1, length, indexOffset, &trace);
+	}
+	unmapObject(crate, object);
+
+	return index->failed ? -1 : 0;
+}
+
+/*
+ * Add and trace objects until everything is indexed or the slice is out of
+ * time. Returns 1 if there is more to do.
+ */
+static int
+buildIndex(dsCrate *crate, dsReferenceIndex *index, struct timespec *start,
+		   uint64_t budget)
+{
+	dsObject *object;
+	uint64_t offset;
+	uint64_t steps = 0;
+	uint32_t id;
+
+	if (index->collectOffset != UINT64_MAX) {
+		/*
+		 * The object the last slice stopped at may have merged into a free
+		 * neighbor since, so start from the last object added before it.
+		 */
+		id = findNode(index, index->collectOffset, 0);
+		offset = (id == noIndex) ? crate->super->firstObjectOffset :
+								   index->nodes[id].offset;
+
+		if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+			dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+				offset, sizeof(*object));
+			return -1;
+		}
+
+		while (object != NULL) {
+			dsObject *next;
+
+			if ((offset >= index->collectOffset) &&
+				((object->length & freeObjectBit) == 0) &&
+				(addNode(index, offset) == noIndex)) {
+				return -1;
+			}
+
+			if ((next = nextObject(crate, object)) == (void *)-1) {
+				dsLog("Can't get next object.\n");
+				return -1;
+			}
+			offset += getRealLength(object->length);
+			unmapObject(crate, object);
+			object = next;
+
+			if ((object != NULL) && (++steps % indexCheckInterval == 0) &&
+				(elapsedNanoseconds(start) / 1000 >= budget)) {
+				if (offset > index->collectOffset) {
+					index->collectOffset = offset;
+				}
+				unmapObject(crate, object);
+				return 1;
+			}
+		}
+		index->collectOffset = UINT64_MAX;
+	}
+
+	while (index->traceOffset != UINT64_MAX) {
+		if ((id = findNode(index, index->traceOffset, 1)) == noIndex) {
+			index->traceOffset = UINT64_MAX;
+			break;
+		}
+
+		if (traceNode(crate, index, id) < 0) {
+			return -1;
+		}
+		index->traceOffset = index->nodes[id].offset + 1;
+
+		if ((++steps % indexCheckInterval == 0) &&
+			(elapsedNanoseconds(start) / 1000 >= budget)) {
+			return 1;
+		}
+	}
+
+	/*
+	 * Bring objects that changed since they were traced up to date.
+	 */
+	for (steps = 0; steps < index->pending.count; steps++) {
+		id = index->pending.ids[steps];
+		index->nodes[id].flags &= ~indexPending;
+		if ((index->nodes[id].offset != UINT64_MAX) &&
+			(traceNode(crate, index, id) < 0)) {
+			return -1;
+		}
+	}
+	index->pending.count = 0;
+
+	return index->failed ? -1 : 0;
+}
+
+/*
+ * Hooks keeping the index up to date, called under 'lock'.
+ */
+static void
+indexAllocated(dsCrate *crate, uint64_t offset)
+{
+	dsReferenceIndex *index = crate->references;
+	uint32_t id;
+
+	/*
+	 * Objects past the collection are added when it gets there.
+	 */
+	if ((index == NULL) || (offset >= index->collectOffset)) {
+		return;
+	}
+
+	if ((id = addNode(index, offset)) != noIndex) {
+		if (offset < index->traceOffset) {
+			markPending(index, id);
+		}
+	}
+}
+
+static void
+indexFreed(dsCrate *crate, uint64_t offset)
+{
+	dsReferenceIndex *index = crate->references;
+	uint32_t id;
+
+	if ((index != NULL) && ((id = findObject(index, offset)) != noIndex)) {
+		deleteNode(index, id);
+	}
+}
+
+/*
+ * Trace every object overlapping 'length' bytes at 'offset' again before
+ * anything moves.
+ */
+static void
+indexChanged(dsCrate *crate, uint64_t offset, uint64_t length)
+{
+	dsReferenceIndex *index = crate->references;
+	uint32_t id;
+
+	if (index == NULL) {
+		return;
+	}
+
+	if ((id = findNode(index, offset, 0)) == noIndex) {
+		id = findNode(index, offset, 1);
+	}
+
+	while ((id != noIndex) && (index->nodes[id].offset < offset + length)) {
+		uint64_t nodeOffset = index->nodes[id].offset;
+		dsObject *object;
+
+		if ((object = mapObject(crate, nodeOffset, sizeof(*object))) == NULL) {
+			index->failed = 1;
+			return;
+		}
+		if ((nodeOffset + getRealLength(object->length) > offset) &&
+			(nodeOffset < index->traceOffset)) {
+			markPending(index, id);
+		}
+		unmapObject(crate, object);
+
+		id = findNode(index, nodeOffset + 1, 1);
+	}
+}
+
+static void
+noteReferences(dsCrate *crate, void *address, uint64_t length)
+{
+	uint64_t offset;
+
+	if ((__atomic_load_n(&crate->references, __ATOMIC_ACQUIRE) == NULL) ||
+		((offset = objectOffset(crate, address)) == UINT64_MAX)) {
+		return;
+	}
+
+	lockAllocator(crate);
+	indexChanged(crate, offset, length);
+	unlockAllocator(crate);
+}
+
+void
+dsNoteReferences(void *address, uint64_t length)
+{
+	dsCrate *crate;
+
+	if ((crate = getActiveCrate()) != NULL) {
+		noteReferences(crate, address, length);
+	}
+}
+
+static void
+touchHolder(dsReferenceIndex *index, uint32_t holder)
+{
+	if ((index->nodes[holder].flags & indexTouched) == 0) {
+		index->nodes[holder].flags |= indexTouched;
+		addId(index, &index->touched, holder);
+	}
+}
+
+/*
+ * Object 'id' slid from 'offset' down to 'newOffset'. Its own offsets moved
+ * with it, offsets pointing into it are rewritten.
+ */
+static void
+indexMoved(dsCrate *crate, uint32_t id, uint64_t offset, uint64_t newOffset,
+		   uint64_t length)
+{
+	dsReferenceIndex *index = crate->references;
+	uint32_t reference;
+
+	index->nodes[id].offset = newOffset;
+
+	for (reference = index->nodes[id].outHead; reference != noIndex;
+		 reference = index->references[reference].nextOut) {
+		index->references[reference].slot -= offset - newOffset;
+	}
+
+	for (reference = index->nodes[id].inHead; reference != noIndex;
+		 reference = index->references[reference].nextIn) {
+		dsReference *in = &index->references[reference];
+		uint64_t *slot;
+
+		if ((slot = mapObject(crate, in->slot, sizeof(*slot))) == NULL) {
+			continue;
+		}
+		if ((*slot >= offset) && (*slot < offset + length)) {
+			*slot -= offset - newOffset;
+			touchHolder(index, in->holder);
+		}
+		unmapObject(crate, slot);
+	}
+}
+
+/*
+ * Rewrite offsets no object in the index starts at, and checksum the objects
+ * whose offsets changed.
+ */
+static void
+relocateIndexed(dsCrate *crate, dsReferenceIndex *index,
+				dsRelocations *relocations)
+{
+	uint32_t reference;
+	uint32_t i;
+
+	for (reference = index->unresolved; reference != noIndex;
+		 reference = index->references[reference].nextIn) {
+		dsReference *unresolved = &index->references[reference];
+		uint64_t *slot;
+		uint64_t old;
+
+		if ((slot = mapObject(crate, unresolved->slot,
+							  sizeof(*slot))) == NULL) {
+			continue;
+		}
+		old = *slot;
+		relocateOffset(relocations, slot);
+		if (*slot != old) {
+			touchHolder(index, unresolved->holder);
+		}
+		unmapObject(crate, slot);
+	}
+
+	for (i = 0; i < index->touched.count; i++) {
+		dsIndexNode *node = &index->nodes[index->touched.ids[i]];
+		dsObject *object;
+
+		node->flags &= ~indexTouched;
+		if ((object = mapObject(crate, node->offset,
+								sizeof(*object))) == NULL) {
+			continue;
+		}
+		if (hasChecksum(object) &&
+			(mapObject(crate, node->offset,
+					   getRealLength(object->length)) != NULL)) {
+			setChecksum(object);
+		}
+		unmapObject(crate, object);
+	}
+	index->touched.count = 0;
+}
+
+static int
+relocateReferences(dsCrate *crate, dsRelocations *relocations)
+{
+	if (relocations->count == 0) {
+		return 0;
+	}
+
+	if (crate->references != NULL) {
+		relocateIndexed(crate, crate->references, relocations);
+	} else if (traceObjects(crate, relocateOffset, relocations) < 0) {
+		dsLog("Can't trace objects.\n");
+		return -1;
+	}
+
+	relocateOffset(relocations, &crate->super->indexObjectOffset);
+	if (crate->super->version >= 2) {
+		relocateOffset(relocations, &crate->super->logHeadOffset);
+	}
+	if (crate->super->version >= 3) {
+		relocateOffset(relocations, &crate->super->rootsOffset);
+	}
+
+	return 0;
+}
+
+/*
+ * Move the object after the free object at 'holeOffset' in front of it.
+ *
+ * Returns 1 and where the free object ended up if something moved, zero once
+ * the free object is the last object and -1 on error.
+ */
+static int
+slideObject(dsCrate *crate, uint64_t holeOffset, uint64_t *newHoleOffset,
+			dsRelocations *relocations)
+{
+	dsObject *hole;
+	dsObject *object;
+	uint64_t holeLength;
+	uint64_t length;
+	uint64_t last;
+
+	if ((hole = mapObject(crate, holeOffset, sizeof(*hole))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			holeOffset, sizeof(*hole));
+		return -1;
+	}
+	if (hole->length & lastObjectBit) {
+		unmapObject(crate, hole);
+		return 0;
+	}
+	holeLength = getRealLength(hole->length);
+
+	if ((object = nextObject(crate, hole)) == (void *)-1) {
+		dsLog("Can't get next object.\n");
+		unmapObject(crate, hole);
+		return -1;
+	}
+	length = getRealLength(object->length);
+	last = object->length & lastObjectBit;
+
+	if (unlinkFromGroup(crate, hole, holeOffset, getGroup(holeLength)) < 0) {
+		dsLog("Can't unlink free object.\n");
+		unmapObject(crate, object);
+		unmapObject(crate, hole);
+		return -1;
+	}
+
+	if (object->length & freeObjectBit) {
+		/*
+		 * Crates written before objects could be freed may have free
+		 * neighbors. Merge them instead.
+		 */
+		if (unlinkFromGroup(crate, object, holeOffset + holeLength,
+							getGroup(length)) < 0) {
+			dsLog("Can't unlink free object.\n");
+			unmapObject(crate, object);
+			unmapObject(crate, hole);
+			return -1;
+		}
+		unmapObject(crate, object);
+		hole->length = (holeLength + length) | last;
+		*newHoleOffset = holeOffset;
+	} else {
+		uint32_t id = noIndex;
+
+		if ((crate->references != NULL) &&
+			((id = findObject(crate->references,
+							  holeOffset + holeLength)) == noIndex)) {
+			dsLog("Object at %" PRIu64 " isn't indexed.\n",
+				holeOffset + holeLength);
+			unmapObject(crate, object);
+			unmapObject(crate, hole);
+			return -1;
+		}
+
+		if (addRelocation(relocations, holeOffset + holeLength, length,
+						  holeOffset) < 0) {
+			unmapObject(crate, object);
+			unmapObject(crate, hole);
+			return -1;
+		}
+
+		unmapObject(crate, object);
+		unmapObject(crate, hole);
+		if ((object = mapObject(crate, holeOffset,
+								holeLength + length)) == NULL) {
+			dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+				holeOffset, holeLength + length);
+			return -1;
+		}
+
+		memmove(object, (void *)((uintptr_t)object + holeLength), length);
+		object->length &= ~lastObjectBit;
+		setObjectTrailer(object, holeOffset);
+		if (id != noIndex) {
+			indexMoved(crate, id, holeOffset + holeLength, holeOffset, length);
+		}
+
+		*newHoleOffset = holeOffset + length;
+		hole = (dsObject *)((uintptr_t)object + length);
+		hole->length = holeLength | last;
+	}
+
+	/*
+	 * Free it again, picking up whatever free object follows. It only gets
+	 * punched once it stops moving.
+	 */
+	hole->nextGroupOffset = UINT64_MAX;
+	setObjectTrailer(hole, *newHoleOffset);
+	crate->compactOffset = *newHoleOffset;
+
+	if (releaseObject(crate, hole, *newHoleOffset, 0) < 0) {
+		dsLog("Can't release free object.\n");
+		return -1;
+	}
+	*newHoleOffset = crate->compactOffset;
+
+	return 1;
+}
+
+static int
+compactCrate(dsCrate *crate, uint64_t budget)
+{
+	dsRelocations relocations;
+	struct timespec start;
+	dsObject *object;
+	uint64_t offset;
+	uint64_t steps = 0;
+	int more = 1;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(&relocations, 0, sizeof(relocations));
+
+	/*
+	 * Running to completion traces the crate just once, slices keep an
+	 * index instead.
+	 */
+	if (budget == 0) {
+		dropIndex(crate);
+	} else if ((crate->references == NULL) && (makeIndex(crate) < 0)) {
+		dsLog("Can't index references, tracing the whole crate.\n");
+	}
+	if (crate->references != NULL) {
+		if ((ret = buildIndex(crate, crate->references, &start,
+							  budget)) > 0) {
+			return 1;
+		}
+		if (ret < 0) {
+			dsLog("Can't index references, tracing the whole crate.\n");
+			dropIndex(crate);
+		}
+	}
+
+	offset = crate->compactOffset;
+	if (offset == UINT64_MAX) {
+		offset = crate->super->firstObjectOffset;
+	}
+
+	/*
+	 * Find the free object to slide, allocations may have taken the one
+	 * the last slice stopped at.
+	 */
+	if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			offset, sizeof(*object));
+		return -1;
+	}
+	while ((object->length & freeObjectBit) == 0) {
+		dsObject *next;
+
+		if ((next = nextObject(crate, object)) == (void *)-1) {
+			dsLog("Can't get next object.\n");
+			return -1;
+		}
+		if (next == NULL) {
+			/*
+			 * Nothing is free, nothing to compact.
+			 */
+			crate->compactOffset = UINT64_MAX;
+			dropIndex(crate);
+			return 0;
+		}
+		offset += getRealLength(object->length);
+		unmapObject(crate, object);
+		object = next;
+
+		/*
+		 * Live objects stay put, so the next slice can go on from here.
+		 */
+		if (budget && (++steps % indexCheckInterval == 0) &&
+			(elapsedNanoseconds(&start) / 1000 >= budget)) {
+			unmapObject(crate, object);
+			crate->compactOffset = offset;
+			return 1;
+		}
+	}
+	unmapObject(crate, object);
+
+	while ((ret = slideObject(crate, offset, &offset, &relocations)) > 0) {
+		if (budget && (elapsedNanoseconds(&start) / 1000 >= budget)) {
+			break;
+		}
+	}
+	if (ret < 0) {
+		dsLog("Can't slide object.\n");
+	}
+
+	if (relocateReferences(crate, &relocations) < 0) {
+		dsLog("Can't relocate references.\n");
+		ret = -1;
+	}
+	free(relocations.moves);
+
+	if (ret == 0) {
+		/*
+		 * All the free space is at the end of the crate now.
+		 */
+		if ((object = mapObject(crate, offset, sizeof(*object))) != NULL) {
+			punchObject(crate, offset, getRealLength(object->length));
+			unmapObject(crate, object);
+		}
+		crate->compactOffset = UINT64_MAX;
+		more = 0;
+	} else {
+		crate->compactOffset = offset;
+	}
+	if (ret <= 0) {
+		dropIndex(crate);
+	}
+
+	return ret < 0 ? -1 : more;
+}
+
+/*
+ * Deferred reclamation.
+ *
+ * Freed objects go on the retired list instead of straight back to the free
+ * groups whenever a thread has ever read the crate inside dsEpochEnter().
+ * Every retirement advances the global epoch, so once no reader is left in
+ * an epoch at or before an object's tag, nobody can still hold it.
+ */
+static int
+freeObject(dsCrate *crate, uint64_t offset)
+{
+	dsObject *object;
+	int group;
+
+	if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			offset, sizeof(*object));
+		return -1;
+	}
+
+	group = getGroup(getRealLength(object->length));
+	crate->liveObjects[group]--;
+	crate->liveBytes[group] -= getRealLength(object->length);
+	removeDirty(crate, offset);
+	indexFreed(crate, offset);
+
+	if (releaseObject(crate, object, offset, 1) < 0) {
+		dsLog("Can't release object.\n");
+		return -1;
+	}
+
+	statsAdd(getThreadStats(crate)->frees, 1);
+
+	return 0;
+}
+
+static int
+retireObject(dsCrate *crate, uint64_t offset)
+{
+	dsRetired *retired;
+
+	if (crate->retiredCount == crate->retiredSize) {
+		uint64_t size = crate->retiredSize ? crate->retiredSize * 2 :
+											 reclaimBatch;
+
+		if ((retired = realloc(crate->retired,
+							   size * sizeof(*retired))) == NULL) {
+			dsLog("Can't grow retired objects to %" PRIu64 "\n", size);
+			return -1;
+		}
+		crate->retired = retired;
+		crate->retiredSize = size;
+	}
+
+	retired = &crate->retired[crate->retiredCount++];
+	retired->offset = offset;
+	retired->epoch = __atomic_fetch_add(&crate->epoch, 1, __ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+/*
+ * Free every retired object no reader can still see, or all of them when
+ * 'all' is set because no reader is left at all.
+ */
+static int
+reclaimObjects(dsCrate *crate, int all)
+{
+	uint64_t oldest;
+	uint64_t i;
+	uint64_t kept = 0;
+	int ret = 0;
+
+	if (crate->retiredCount == 0) {
+		return 0;
+	}
+
+	oldest = all ? UINT64_MAX : oldestEpoch(crate);
+
+	/*
+	 * Tags only grow, so the list stays sorted.
+	 */
+	for (i = 0; i < crate->retiredCount; i++) {
+		if (crate->retired[i].epoch >= oldest) {
+			break;
+		}
+		if (freeObject(crate, crate->retired[i].offset) < 0) {
+			ret = -1;
+		}
+	}
+	kept = crate->retiredCount - i;
+
+	memmove(crate->retired, crate->retired + i, kept * sizeof(*crate->retired));
+	crate->retiredCount = kept;
+
+	return ret;
+}
+
+/*
+ * Give an object back, right away if nobody could be reading it.
+ */
+static int
+disposeObject(dsCrate *crate, uint64_t offset)
+{
+	if (__atomic_load_n(&crate->threadEpochs, __ATOMIC_SEQ_CST) == NULL) {
+		return freeObject(crate, offset);
+	}
+
+	if (retireObject(crate, offset) < 0) {
+		dsLog("Can't retire object.\n");
+		return -1;
+	}
+
+	if (crate->retiredCount >= reclaimBatch) {
+		return reclaimObjects(crate, 0);
+	}
+
+	return 0;
+}
+
+static void
+countLive(dsCrate *crate, uint64_t length, int add)
+{
+	int group = getGroup(length);
+
+	if (add) {
+		crate->liveObjects[group]++;
+		crate->liveBytes[group] += length;
+	} else {
+		crate->liveObjects[group]--;
+		crate->liveBytes[group] -= length;
+	}
+}
+
+/*
+ * Resize an allocated object to 'lengthToAlloc' bytes without moving it,
+ * growing into a free next object or splitting off its tail. The tail is
+ * disposed of like any freed object, readers may still be looking at it.
+ *
+ * Returns 1 if the object was resized, zero if it has to move instead.
+ */
+static int
+resizeObject(dsCrate *crate, dsObject *object, uint64_t offset,
+			 uint64_t lengthToAlloc)
+{
+	dsObject *neighbor;
+	uint64_t neighborOffset;
+	uint64_t neighborLength;
+	uint64_t length;
+
+	length = getRealLength(object->length);
+
+	if (lengthToAlloc <= length) {
+		if (length < lengthToAlloc + objectOverhead + 1) {
+			/*
+			 * The tail is too small to be an object, keep it.
+			 */
+			return 1;
+		}
+
+		statsAdd(getThreadStats(crate)->splits, 1);
+		neighborOffset = offset + lengthToAlloc;
+		neighbor = (dsObject *)((uintptr_t)object + lengthToAlloc);
+		neighbor->length = (length - lengthToAlloc) |
+						   (object->length & lastObjectBit);
+		neighbor->nextGroupOffset = UINT64_MAX;
+		setObjectTrailer(neighbor, neighborOffset);
+
+		object->length = lengthToAlloc;
+		setObjectTrailer(object, offset);
+
+		countLive(crate, length, 0);
+		countLive(crate, lengthToAlloc, 1);
+		countLive(crate, length - lengthToAlloc, 1);
+
+		return disposeObject(crate, neighborOffset) < 0 ? -1 : 1;
+	}
+
+	if ((neighbor = nextObject(crate, object)) == (void *)-1) {
+		dsLog("Can't get next object.\n");
+		return -1;
+	}
+	if ((neighbor == NULL) || !(neighbor->length & freeObjectBit) ||
+		(length + getRealLength(neighbor->length) < lengthToAlloc)) {
+		return 0;
+	}
+
+	neighborOffset = offset + length;
+	neighborLength = getRealLength(neighbor->length);
+	if (unlinkFromGroup(crate, neighbor, neighborOffset,
+						getGroup(neighborLength)) < 0) {
+		dsLog("Can't unlink free object.\n");
+		return -1;
+	}
+	if (crate->compactOffset == neighborOffset) {
+		crate->compactOffset = offset;
+	}
+	statsAdd(getThreadStats(crate)->merges, 1);
+
+	/*
+	 * Both together make one free object to carve the new size from.
+	 */
+	object->length = (length + neighborLength) |
+					 (neighbor->length & lastObjectBit);
+	countLive(crate, length, 0);
+
+	if (carveObject(crate, offset, length + neighborLength,
+					lengthToAlloc) == NULL) {
+		dsLog("Can't carve grown object.\n");
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Group commit.
+ *
+ * Every sync request gets a ticket, the number of the first sync that starts
+ * after it. Whoever needs a ticket finished and finds no sync running starts
+ * the next one, covering every ticket handed out so far. Asynchronous
+ * requests are synced and completed, in ticket order, by a flusher thread.
+ */
+typedef struct dsSyncRequest {
+	uint64_t ticket;
+	dsSyncCallback callback;
+	void *userPtr;
+
+	struct dsSyncRequest *next;
+} dsSyncRequest;
+
+/*
+ * Must hold 'syncLock'.
+ */
+static uint64_t
+takeTicket(dsCrate *crate)
+{
+	uint64_t ticket = crate->syncStarted + 1;
+
+	if (crate->syncRequested < ticket) {
+		crate->syncRequested = ticket;
+	}
+
+	return ticket;
+}
+
+/*
+ * Must hold 'syncLock' and no sync may be running.
+ */
+static void
+runSync(dsCrate *crate)
+{
+	int ret;
+
+	crate->syncStarted++;
+	pthread_mutex_unlock(&crate->syncLock);
+
+	/*
+	 * Checksums of marked objects go to disk along with their contents.
+	 */
+	if (__atomic_load_n(&crate->dirtyCount, __ATOMIC_RELAXED) != 0) {
+		lockAllocator(crate);
+		updateChecksums(crate);
+		unlockAllocator(crate);
+	}
+
+	/*
+	 * Dirty pages of a shared mapping are written back like any other, so
+	 * this covers the whole crate. A pool's have to be written first.
+	 */
+	ret = crate->pool != NULL ? flushPool(crate) : 0;
+	if ((ret < 0) || ((ret = fdatasync(crate->fd)) < 0)) {
+		dsLog("Can't synchronize crate: %s\n", strerror(errno));
+	}
+
+	pthread_mutex_lock(&crate->syncLock);
+	crate->syncResult = ret;
+	crate->syncFinished = crate->syncStarted;
+	pthread_cond_broadcast(&crate->syncCond);
+}
+
+static int
+waitTicket(dsCrate *crate, uint64_t ticket)
+{
+	int ret;
+
+	pthread_mutex_lock(&crate->syncLock);
+
+	while (crate->syncFinished < ticket) {
+		if (crate->syncStarted == crate->syncFinished) {
+			runSync(crate);
+		} else {
+			pthread_cond_wait(&crate->syncCond, &crate->syncLock);
+		}
+	}
+
+	ret = crate->syncResult;
+	pthread_mutex_unlock(&crate->syncLock);
+
+	return ret;
+}
+
+static int
+syncCrate(dsCrate *crate)
+{
+	uint64_t ticket;
+
+	pthread_mutex_lock(&crate->syncLock);
+	ticket = takeTicket(crate);
+	pthread_mutex_unlock(&crate->syncLock);
+
+	return waitTicket(crate, ticket);
+}
+
+static void *
+flushCrate(void *arg)
+{
+	dsCrate *crate = arg;
+
+	pthread_mutex_lock(&crate->syncLock);
+
+	for (;;) {
+		dsSyncRequest *request = crate->syncRequests;
+
+		if ((request != NULL) && (request->ticket <= crate->syncFinished)) {
+			int result = crate->syncResult;
+
+			crate->syncRequests = request->next;
+			if (crate->syncRequests == NULL) {
+				crate->syncRequestsTail = NULL;
+			}
+			pthread_mutex_unlock(&crate->syncLock);
+
+			if (request->callback != NULL) {
+				request->callback(request->userPtr, result);
+			}
+			free(request);
+
+			pthread_mutex_lock(&crate->syncLock);
+			continue;
+		}
+
+		if ((crate->syncRequested > crate->syncFinished) &&
+			(crate->syncStarted == crate->syncFinished)) {
+			runSync(crate);
+			continue;
+		}
+
+		if (crate->flusherStop && (crate->syncRequests == NULL)) {
+			break;
+		}
+
+		pthread_cond_wait(&crate->syncCond, &crate->syncLock);
+	}
+
+	pthread_mutex_unlock(&crate->syncLock);
+
+	return NULL;
+}
+
+/*
+ * Must hold 'syncLock'.
+ */
+static int
+startFlusher(dsCrate *crate)
+{
+	int ret;
+
+	if (crate->flusherRunning) {
+		return 0;
+	}
+
+	if ((ret = pthread_create(&crate->flusher, NULL, flushCrate, crate)) != 0) {
+		dsLog("Can't start flusher thread: %s\n", strerror(ret));
+		errno = ret;
+		return -1;
+	}
+	crate->flusherRunning = 1;
+
+	return 0;
+}
+
+/*
+ * Completes every outstanding request before returning.
+ */
+static void
+stopFlusher(dsCrate *crate)
+{
+	pthread_mutex_lock(&crate->syncLock);
+	if (!crate->flusherRunning) {
+		pthread_mutex_unlock(&crate->syncLock);
+		return;
+	}
+	crate->flusherStop = 1;
+	pthread_cond_broadcast(&crate->syncCond);
+	pthread_mutex_unlock(&crate->syncLock);
+
+	pthread_join(crate->flusher, NULL);
+	crate->flusherRunning = 0;
+	crate->flusherStop = 0;
+}
+
+static void
+freeCrate(dsCrate **crate)
+{
+	if (crate == NULL || *crate == NULL) {
+		return;
+	}
+
+	stopFlusher(*crate);
+
+	if ((*crate)->pool != NULL) {
+		if (((*crate)->fd >= 0) && (flushPool(*crate) < 0)) {
+			dsLog("Can't write back crate '%s'\n", (*crate)->filename);
+		}
+		closePool(*crate);
+	}
+
+	if ((*crate)->fd >= 0) {
+		close((*crate)->fd);
+		(*crate)->fd = -1;
+	}
+
+	freeMapping(&(*crate)->map);
+	pthread_mutex_destroy(&(*crate)->lock);
+	pthread_mutex_destroy(&(*crate)->statsLock);
+	pthread_mutex_destroy(&(*crate)->dirtyLock);
+	pthread_mutex_destroy(&(*crate)->syncLock);
+	pthread_cond_destroy(&(*crate)->syncCond);
+
+	while ((*crate)->threadStats != NULL) {
+		dsThreadStats *stats = (*crate)->threadStats;
+
+		(*crate)->threadStats = stats->next;
+		free(stats);
+	}
+
+	while ((*crate)->threadEpochs != NULL) {
+		dsThreadEpoch *record = (*crate)->threadEpochs;
+
+		(*crate)->threadEpochs = record->next;
+		free(record);
+	}
+	free((*crate)->retired);
+	free((*crate)->dirty);
+	dropIndex(*crate);
+
+	free((*crate)->filename);
+	free(*crate);
+	*crate = NULL;
+}
+
+static int
+lockCrate(dsCrate *crate)
+{
+	if (flock(crate->fd, LOCK_EX) < 0) {
+		dsLog("Can't lock crate '%s': %s\n", crate->filename, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+unlockCrate(dsCrate *crate)
+{
+	if (flock(crate->fd, LOCK_UN) < 0) {
+		dsLog("Can't unlock crate '%s': %s\n", crate->filename, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Serialize allocator changes. Threads of this process share 'lock', other
+ * processes mapping a shared crate are kept out by the file lock, and may
+ * have grown the file since this process last looked.
+ */
+static void
+lockAllocator(dsCrate *crate)
+{
+	pthread_mutex_lock(&crate->lock);
+	if (!crate->shared) {
+		return;
+	}
+
+	while (flock(crate->fd, LOCK_EX) < 0) {
+		if (errno != EINTR) {
+			dsLog("Can't lock crate '%s': %s\n", crate->filename,
+				strerror(errno));
+			break;
+		}
+	}
+
+	if (refreshMapping(crate) < 0) {
+		dsLog("Can't catch up with crate '%s'\n", crate->filename);
+	}
+}
+
+static void
+unlockAllocator(dsCrate *crate)
+{
+	if (crate->shared) {
+		unlockCrate(crate);
+	}
+	pthread_mutex_unlock(&crate->lock);
+}
+
+/*
+ * Integrity checking.
+ *
+ * Object headers form a chain that can only be walked serially, so the chain
+ * is walked once touching nothing but the headers. Everything else, trailers
+ * and free group links, is validated in parallel chunks afterwards.
+ */
+
+#define checkInGroup 0x1
+
+typedef struct dsCheckState {
+	dsCrate *crate;
+	int repair;
+
+	uint64_t *offsets;
+	uint8_t *flags;
+	uint64_t count;
+} dsCheckState;
+
+typedef struct dsCheckWork {
+	dsCheckState *state;
+	uint64_t begin;
+	uint64_t end;
+	int group;
+
+	dsCheckReport report;
+} dsCheckWork;
+
+static int
+findCheckObject(dsCheckState *state, uint64_t offset, uint64_t *index)
+{
+	uint64_t low = 0;
+	uint64_t high = state->count;
+
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+
+		if (state->offsets[middle] < offset) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	if ((low == state->count) || (state->offsets[low] != offset)) {
+		return -1;
+	}
+
+	*index = low;
+	return 0;
+}
+
+static void *
+checkChunk(void *arg)
+{
+	dsCheckWork *work = arg;
+	dsCheckState *state = work->state;
+	dsCrate *crate = state->crate;
+	uint64_t i;
+
+	for (i = work->begin; i < work->end; i++) {
+		dsObject *object;
+		uint64_t offset = state->offsets[i];
+		uint64_t length;
+		uint64_t *trailer;
+
+		if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+			work->report.badHeaders++;
+			continue;
+		}
+		length = getRealLength(object->length);
+
+		if (object->length & freeObjectBit) {
+			work->report.freeObjects++;
+			work->report.freeBytes += length;
+		} else if (hasChecksum(object)) {
+			work->report.checksums++;
+			if ((mapObject(crate, offset, length) == NULL) ||
+				(objectChecksum(object) != (uint32_t)object->nextGroupOffset)) {
+				dsLog("Bad checksum at %" PRIu64 "\n", offset);
+				work->report.badChecksums++;
+			}
+		} else if (object->nextGroupOffset != UINT64_MAX) {
+			/*
+			 * Allocated objects never belong to a group.
+			 */
+			work->report.badGroups++;
+			if (state->repair) {
+				object->nextGroupOffset = UINT64_MAX;
+				work->report.repairs++;
+			}
+		}
+
+		if ((trailer = mapObject(crate, offset + length - sizeof(*trailer),
+								 sizeof(*trailer))) == NULL) {
+			work->report.badTrailers++;
+			unmapObject(crate, object);
+			continue;
+		}
+		if (*trailer != offset) {
+			work->report.badTrailers++;
+			if (state->repair) {
+				*trailer = offset;
+				work->report.repairs++;
+			}
+		}
+
+		unmapObject(crate, trailer);
+		unmapObject(crate, object);
+	}
+
+	return NULL;
+}
+
+static void *
+checkGroup(void *arg)
+{
+	dsCheckWork *work = arg;
+	dsCheckState *state = work->state;
+	dsCrate *crate = state->crate;
+	uint64_t offset;
+
+	offset = crate->super->headGroupOffset[work->group];
+
+	while (offset != UINT64_MAX) {
+		dsObject *object;
+		uint64_t index;
+
+		if ((findCheckObject(state, offset, &index) < 0) ||
+			((object = mapObject(crate, offset, sizeof(*object))) == NULL)) {
+			/*
+			 * The link points in between objects.
+			 */
+			work->report.badGroups++;
+			break;
+		}
+
+		if (((object->length & freeObjectBit) == 0) ||
+			(getGroup(getRealLength(object->length)) != work->group)) {
+			work->report.badGroups++;
+			unmapObject(crate, object);
+			break;
+		}
+
+		if (__atomic_fetch_or(&state->flags[index], checkInGroup,
+							  __ATOMIC_RELAXED) & checkInGroup) {
+			/*
+			 * Already linked, either a cycle or shared by two groups.
+			 */
+			work->report.badGroups++;
+			unmapObject(crate, object);
+			break;
+		}
+
+		offset = object->nextGroupOffset;
+		unmapObject(crate, object);
+	}
+
+	return NULL;
+}
+
+static int
+runCheckWork(dsCheckWork *work, int n, void *(*function)(void *))
+{
+	pthread_t threads[n];
+	int started;
+	int i;
+
+	for (started = 0; started < n; started++) {
+		if (pthread_create(threads + started, NULL, function,
+						   work + started) != 0) {
+			dsLog("Can't create check thread.\n");
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/*
+	 * Whatever couldn't get a thread runs here.
+	 */
+	for (i = started; i < n; i++) {
+		function(work + i);
+	}
+
+	return 0;
+}
+
+static void
+addCheckReport(dsCheckReport *report, dsCheckReport *add)
+{
+	report->freeObjects += add->freeObjects;
+	report->freeBytes += add->freeBytes;
+	report->badHeaders += add->badHeaders;
+	report->badTrailers += add->badTrailers;
+	report->badLastObjects += add->badLastObjects;
+	report->badGroups += add->badGroups;
+	report->lostBytes += add->lostBytes;
+	report->checksums += add->checksums;
+	report->badChecksums += add->badChecksums;
+	report->repairs += add->repairs;
+}
+
+/*
+ * Walk the header chain and record where every object starts.
+ */
+static int
+scanObjects(dsCheckState *state, dsCheckReport *report)
+{
+	dsCrate *crate = state->crate;
+	uint64_t capacity = 1024;
+	uint64_t end = crate->map.offset + crate->map.length;
+	uint64_t offset;
+
+	if ((state->offsets = malloc(capacity * sizeof(*state->offsets))) == NULL) {
+		dsLog("Can't allocate object offsets.\n");
+		return -1;
+	}
+
+	offset = crate->super->firstObjectOffset;
+	while (offset < end) {
+		dsObject *object;
+		uint64_t length;
+
+		if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+			dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+				offset, sizeof(*object));
+			report->badHeaders++;
+			break;
+		}
+
+		length = getRealLength(object->length);
+		if ((length < objectOverhead) || (length > end - offset)) {
+			dsLog("Bad object header at %" PRIu64 ".\n", offset);
+			report->badHeaders++;
+			report->lostBytes += end - offset;
+
+			if (state->repair) {
+				/*
+				 * Nothing past this point can be found again. Turn the
+				 * rest of the crate into a single free object.
+				 */
+				object->length = (end - offset) | freeObjectBit | lastObjectBit;
+				object->nextGroupOffset = UINT64_MAX;
+				setObjectTrailer(object, offset);
+				length = end - offset;
+				report->repairs++;
+			} else {
+				unmapObject(crate, object);
+				break;
+			}
+		}
+
+		if (((object->length & lastObjectBit) != 0) !=
+			(offset + length == end)) {
+			report->badLastObjects++;
+			if (state->repair) {
+				object->length ^= lastObjectBit;
+				report->repairs++;
+			}
+		}
+
+		/*
+		 * Crates written before lengths were rounded up may have objects at
+		 * unaligned offsets. They still work, but atomics inside them don't.
+		 */
+		if (offset % objectAlignment != 0) {
+			report->misalignedObjects++;
+		}
+		unmapObject(crate, object);
+
+		if (state->count == capacity) {
+			uint64_t *offsets;
+
+			capacity *= 2;
+			if ((offsets = realloc(state->offsets,
+								   capacity * sizeof(*offsets))) == NULL) {
+				dsLog("Can't grow object offsets.\n");
+				return -1;
+			}
+			state->offsets = offsets;
+		}
+		state->offsets[state->count++] = offset;
+
+		offset += length;
+	}
+
+	return 0;
+}
+
+/*
+ * Throw away the free groups and relink every free object found by the scan.
+ */
+static void
+rebuildGroups(dsCheckState *state)
+{
+	dsCrate *crate = state->crate;
+	uint64_t i;
+	int group;
+
+	for (group = 0; group < objectGroups; group++) {
+		crate->super->headGroupOffset[group] = UINT64_MAX;
+	}
+
+	/*
+	 * Link in reverse so each group ends up in offset order.
+	 */
+	for (i = state->count; i > 0; i--) {
+		dsObject *object;
+		uint64_t offset = state->offsets[i - 1];
+
+		if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+			continue;
+		}
+		if (object->length & freeObjectBit) {
+			group = getGroup(getRealLength(object->length));
+			linkToGroup(crate, object, offset, group);
+		}
+		unmapObject(crate, object);
+	}
+}
+
+static int
+checkCrate(dsCrate *crate, dsCheckReport *report, int threads, int repair)
+{
+	dsCheckState state;
+	dsCheckWork *work = NULL;
+	uint64_t chunk;
+	uint64_t i;
+	int n;
+	int ret = -1;
+
+	memset(report, 0, sizeof(*report));
+	memset(&state, 0, sizeof(state));
+	state.crate = crate;
+	state.repair = repair;
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads <= 0) {
+		threads = 1;
+	}
+
+	if (scanObjects(&state, report) < 0) {
+		goto out;
+	}
+	report->objects = state.count;
+
+	if ((state.flags = calloc(state.count + 1, sizeof(*state.flags))) == NULL) {
+		dsLog("Can't allocate object flags.\n");
+		goto out;
+	}
+
+	n = (threads > objectGroups) ? threads : objectGroups;
+	if ((work = calloc(n, sizeof(*work))) == NULL) {
+		dsLog("Can't allocate check work.\n");
+		goto out;
+	}
+
+	/*
+	 * Headers and trailers, in parallel chunks.
+	 */
+	chunk = (state.count + threads - 1) / threads;
+	for (n = 0; n < threads; n++) {
+		work[n].state = &state;
+		work[n].begin = n * chunk < state.count ? n * chunk : state.count;
+		work[n].end = work[n].begin + chunk < state.count ?
+					  work[n].begin + chunk : state.count;
+	}
+	runCheckWork(work, threads, checkChunk);
+	for (n = 0; n < threads; n++) {
+		addCheckReport(report, &work[n].report);
+	}
+
+	/*
+	 * Free groups, one walker per group.
+	 */
+	memset(work, 0, objectGroups * sizeof(*work));
+	for (n = 0; n < objectGroups; n++) {
+		work[n].state = &state;
+		work[n].group = n;
+	}
+	runCheckWork(work, objectGroups, checkGroup);
+	for (n = 0; n < objectGroups; n++) {
+		addCheckReport(report, &work[n].report);
+	}
+
+	/*
+	 * Free objects that no group reaches are lost to the allocator.
+	 */
+	for (i = 0; i < state.count; i++) {
+		dsObject *object;
+
+		if (state.flags[i] & checkInGroup) {
+			continue;
+		}
+		if ((object = mapObject(crate, state.offsets[i],
+								sizeof(*object))) == NULL) {
+			continue;
+		}
+		if (object->length & freeObjectBit) {
+			report->badGroups++;
+		}
+		unmapObject(crate, object);
+	}
+
+	if (repair && (report->badGroups || report->badHeaders)) {
+		rebuildGroups(&state);
+		report->repairs++;
+	}
+	if (report->repairs) {
+		/*
+		 * Space accounting can't be trusted anymore, count again.
+		 */
+		crate->statsReady = 0;
+	}
+
+	ret = 0;
+
+out:
+	free(work);
+	free(state.flags);
+	free(state.offsets);
+
+	return ret;
+}
+
+int
+dsCheck(dsCheckReport *report, int threads, int repair)
+{
+	dsCrate *crate;
+	int ret;
+
+	if (report == NULL) {
+		dsLog("Bad argument %p\n", report);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	lockAllocator(crate);
+	if (lockCrate(crate) < 0) {
+		unlockAllocator(crate);
+		return -1;
+	}
+
+	ret = checkCrate(crate, report, threads, repair);
+
+	unlockCrate(crate);
+	unlockAllocator(crate);
+
+	return ret;
+}
+
+int
+dsScrub(dsScrubReport *report, int threads)
+{
+	dsCheckReport check;
+
+	if (report == NULL) {
+		dsLog("Bad argument %p\n", report);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (dsCheck(&check, threads, 0) < 0) {
+		return -1;
+	}
+
+	report->objects = check.objects;
+	report->checksums = check.checksums;
+	report->badChecksums = check.badChecksums;
+
+	return 0;
+}
+
+/*
+ * Garbage collection.
+ *
+ * Everything reachable from the index, the named roots and the undo logs is
+ * marked, following offsets through the trace callbacks of registered types.
+ * Objects of other types are scanned conservatively, any word that falls
+ * inside an allocated object keeps it alive. Marking runs on several threads
+ * that each work off their own stack, handing half of it to a shared one
+ * when others run dry. Whatever is still allocated and unmarked afterwards
+ * is freed.
+ */
+
+#define collectMarked 0x2
+#define collectBatch  256
+
+typedef struct dsCollectState {
+	dsCheckState check;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t *shared;
+	uint64_t sharedCount;
+	uint64_t sharedSize;
+	int threads;
+	int idle;
+	int failed;
+} dsCollectState;
+
+typedef struct dsCollectWork {
+	dsCollectState *state;
+	pthread_t thread;
+	uint64_t *stack;
+	uint64_t count;
+	uint64_t size;
+	uint64_t marked;
+	uint64_t markedBytes;
+} dsCollectWork;
+
+/*
+ * Find the object an offset points into, anywhere between its header and its
+ * trailer.
+ */
+static int
+findContainingObject(dsCheckState *state, uint64_t offset, uint64_t *index)
+{
+	uint64_t low = 0;
+	uint64_t high = state->count;
+
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+
+		if (state->offsets[middle] <= offset) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	if (low == 0) {
+		return -1;
+	}
+
+	*index = low - 1;
+	return 0;
+}
+
+static int
+pushMark(dsCollectWork *work, uint64_t index)
+{
+	if (work->count == work->size) {
+		uint64_t *stack;
+		uint64_t size = work->size ? work->size * 2 : collectBatch;
+
+		if ((stack = realloc(work->stack, size * sizeof(*stack))) == NULL) {
+			dsLog("Can't grow mark stack to %" PRIu64 "\n", size);
+			return -1;
+		}
+		work->stack = stack;
+		work->size = size;
+	}
+
+	work->stack[work->count++] = index;
+
+	return 0;
+}
+
+static void
+markOffset(void *arg, uint64_t *offset)
+{
+	dsCollectWork *work = arg;
+	dsCheckState *state = &work->state->check;
+	uint64_t index;
+
+	if ((*offset == UINT64_MAX) ||
+		(findContainingObject(state, *offset, &index) < 0)) {
+		return;
+	}
+
+	if (__atomic_fetch_or(&state->flags[index], collectMarked,
+						  __ATOMIC_RELAXED) & collectMarked) {
+		return;
+	}
+
+	if (pushMark(work, index) < 0) {
+		__atomic_store_n(&work->state->failed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Follow every offset held by a marked object.
+ */
+static void
+scanMarked(dsCollectWork *work, uint64_t index)
+{
+	dsCrate *crate = work->state->check.crate;
+	uint64_t offset = work->state->check.offsets[index];
+	dsObject *object;
+	uint64_t *words;
+	uint64_t length;
+	uint64_t i;
+	int isFree;
+	dsTraceCallback trace;
+
+	if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+		__atomic_store_n(&work->state->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	length = getRealLength(object->length);
+	isFree = (object->length & freeObjectBit) != 0;
+	unmapObject(crate, object);
+
+	/*
+	 * Conservative words can land in free space, which holds nothing.
+	 */
+	if (isFree) {
+		return;
+	}
+
+	work->marked++;
+	work->markedBytes += length;
+	length -= objectOverhead;
+
+	if ((length < sizeof(uint64_t)) ||
+		((words = mapObject(crate, offset + sizeof(*object), length)) == NULL)) {
+		return;
+	}
+
+	if ((trace = findType(words[0])) != NULL) {
+		trace(words, length, markOffset, work);
+	} else {
+		for (i = 0; i < length / sizeof(*words); i++) {
+			uint64_t word = words[i];
+
+			markOffset(work, &word);
+		}
+	}
+
+	unmapObject(crate, words);
+}
+
+/*
+ * Take a batch from the shared stack, waiting for one while other markers
+ * are still busy.
+ *
+ * Returns zero with a batch on the local stack, -1 once marking is done.
+ */
+static int
+takeMarks(dsCollectWork *work)
+{
+	dsCollectState *state = work->state;
+	int ret = -1;
+
+	pthread_mutex_lock(&state->lock);
+
+	state->idle++;
+	while ((state->sharedCount == 0) && (state->idle < state->threads) &&
+		   !__atomic_load_n(&state->failed, __ATOMIC_RELAXED)) {
+		pthread_cond_wait(&state->cond, &state->lock);
+	}
+
+	if ((state->sharedCount > 0) &&
+		!__atomic_load_n(&state->failed, __ATOMIC_RELAXED)) {
+		uint64_t n = state->sharedCount < collectBatch ?
+					 state->sharedCount : collectBatch;
+
+		state->idle--;
+		state->sharedCount -= n;
+		ret = 0;
+		while (n-- > 0) {
+			if (pushMark(work, state->shared[state->sharedCount + n]) < 0) {
+				__atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+				ret = -1;
+				break;
+			}
+		}
+	} else {
+		/*
+		 * Everyone is idle or gave up, wake the rest so they can leave.
+		 */
+		pthread_cond_broadcast(&state->cond);
+	}
+
+	pthread_mutex_unlock(&state->lock);
+
+	return ret;
+}
+
+/*
+ * Hand half of a deep local stack to markers that are waiting for work.
+ */
+static void
+shareMarks(dsCollectWork *work)
+{
+	dsCollectState *state = work->state;
+	uint64_t n;
+
+	if ((work->count < 2 * collectBatch) ||
+		(__atomic_load_n(&state->idle, __ATOMIC_RELAXED) == 0)) {
+		return;
+	}
+
+	pthread_mutex_lock(&state->lock);
+
+	n = work->count / 2;
+	if (state->sharedCount + n > state->sharedSize) {
+		uint64_t *shared;
+		uint64_t size = (state->sharedCount + n) * 2;
+
+		if ((shared = realloc(state->shared, size * sizeof(*shared))) == NULL) {
+			pthread_mutex_unlock(&state->lock);
+			return;
+		}
+		state->shared = shared;
+		state->sharedSize = size;
+	}
+
+	work->count -= n;
+	memcpy(state->shared + state->sharedCount, work->stack + work->count,
+		   n * sizeof(*work->stack));
+	state->sharedCount += n;
+
+	pthread_cond_broadcast(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void *
+markObjects(void *arg)
+{
+	dsCollectWork *work = arg;
+
+	do {
+		while ((work->count > 0) &&
+			   !__atomic_load_n(&work->state->failed, __ATOMIC_RELAXED)) {
+			scanMarked(work, work->stack[--work->count]);
+			shareMarks(work);
+		}
+	} while (takeMarks(work) == 0);
+
+	return NULL;
+}
+
+/*
+ * Free, back to front, every allocated object that wasn't marked. Merges
+ * only ever reach objects that were already swept, or free ones that get
+ * skipped.
+ */
+static int
+sweepObjects(dsCollectState *state, dsCollectReport *report)
+{
+	dsCrate *crate = state->check.crate;
+	uint64_t i;
+
+	for (i = state->check.count; i > 0; i--) {
+		dsObject *object;
+		uint64_t offset = state->check.offsets[i - 1];
+		uint64_t length;
+		int isFree;
+
+		if (state->check.flags[i - 1] & collectMarked) {
+			continue;
+		}
+
+		if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+			dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+				offset, sizeof(*object));
+			return -1;
+		}
+		length = getRealLength(object->length);
+		isFree = (object->length & freeObjectBit) != 0;
+		unmapObject(crate, object);
+
+		if (isFree) {
+			continue;
+		}
+
+		if (freeObject(crate, offset) < 0) {
+			dsLog("Can't free object at %" PRIu64 "\n", offset);
+			return -1;
+		}
+		report->freedObjects++;
+		report->freedBytes += length;
+	}
+
+	return 0;
+}
+
+static int
+collectCrate(dsCrate *crate, dsCollectReport *report, int threads)
+{
+	dsCollectState state;
+	dsCollectWork *work = NULL;
+	dsCheckReport scan;
+	uint64_t roots[3];
+	int started;
+	int n;
+	int ret = -1;
+
+	memset(report, 0, sizeof(*report));
+	memset(&scan, 0, sizeof(scan));
+	memset(&state, 0, sizeof(state));
+	state.check.crate = crate;
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads <= 0) {
+		threads = 1;
+	}
+	state.threads = threads;
+
+	if ((scanObjects(&state.check, &scan) < 0) || scan.badHeaders) {
+		dsLog("Can't scan objects.\n");
+		errno = EIO;
+		goto out;
+	}
+	report->objects = state.check.count;
+
+	if ((state.check.flags = calloc(state.check.count + 1,
+									sizeof(*state.check.flags))) == NULL) {
+		dsLog("Can't allocate object flags.\n");
+		goto out;
+	}
+
+	if ((work = calloc(threads, sizeof(*work))) == NULL) {
+		dsLog("Can't allocate collect work.\n");
+		goto out;
+	}
+	for (n = 0; n < threads; n++) {
+		work[n].state = &state;
+	}
+
+	/*
+	 * The roots start on the first marker's stack, the others pick up work
+	 * as it is shared.
+	 */
+	roots[0] = crate->super->indexObjectOffset;
+	roots[1] = crate->super->version >= 2 ?
+			   crate->super->logHeadOffset : UINT64_MAX;
+	roots[2] = crate->super->version >= 3 ?
+			   crate->super->rootsOffset : UINT64_MAX;
+	for (n = 0; n < 3; n++) {
+		markOffset(work, &roots[n]);
+	}
+
+	/*
+	 * This thread marks too. If not every thread could be started, the
+	 * others must not wait for the missing ones to go idle.
+	 */
+	for (started = 1; started < threads; started++) {
+		if (pthread_create(&work[started].thread, NULL, markObjects,
+						   work + started) != 0) {
+			dsLog("Can't create mark thread.\n");
+			break;
+		}
+	}
+	if (started < threads) {
+		pthread_mutex_lock(&state.lock);
+		state.threads = started;
+		pthread_cond_broadcast(&state.cond);
+		pthread_mutex_unlock(&state.lock);
+	}
+
+	markObjects(work);
+	for (n = 1; n < started; n++) {
+		pthread_join(work[n].thread, NULL);
+	}
+
+	if (state.failed) {
+		dsLog("Can't mark objects.\n");
+		errno = ENOMEM;
+		goto out;
+	}
+
+	for (n = 0; n < threads; n++) {
+		report->liveObjects += work[n].marked;
+		report->liveBytes += work[n].markedBytes;
+	}
+
+	ret = sweepObjects(&state, report);
+
+out:
+	if (work != NULL) {
+		for (n = 0; n < threads; n++) {
+			free(work[n].stack);
+		}
+	}
+	free(work);
+	free(state.shared);
+	free(state.check.flags);
+	free(state.check.offsets);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+
+	return ret;
+}
+
+int
+dsCollect(dsCollectReport *report, int threads)
+{
+	dsCrate *crate;
+	int ret;
+
+	if (report == NULL) {
+		dsLog("Bad argument %p\n", report);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	/*
+	 * Other processes hold references that can't be seen from here.
+	 */
+	if (crate->shared) {
+		dsLog("Can't collect crate '%s' shared with other processes.\n",
+			crate->filename);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	lockAllocator(crate);
+
+	/*
+	 * Neither can pointers held by readers, nor objects a transaction
+	 * allocated but hasn't linked anywhere yet.
+	 */
+	if ((crate->openTxs != 0) || (blockReaders(crate) < 0)) {
+		unlockAllocator(crate);
+		errno = EBUSY;
+		return -1;
+	}
+
+	/*
+	 * Retired objects are unreachable already, get them out of the way.
+	 */
+	reclaimObjects(crate, 1);
+	ret = collectCrate(crate, report, threads);
+
+	unblockReaders(crate);
+	unlockAllocator(crate);
+
+	return ret;
+}
+
+/*
+ * Transactions.
+ *
+ * Before a transaction overwrites anything, the old contents are appended to
+ * its undo log, which has to reach the disk before the new contents do.
+ * Committing syncs the crate once, the logs going first, and then empties
+ * the log. Whatever a crash leaves in a log was never committed and is
+ * rolled back the next time the crate is opened.
+ */
+static void
+traceUndoLog(void *object, uint64_t length, dsVisitCallback visit, void *arg)
+{
+	dsUndoLog *log = object;
+
+	if (length < sizeof(*log)) {
+		return;
+	}
+
+	visit(arg, &log->nextOffset);
+}
+
+static void __attribute__((constructor))
+registerUndoLog()
+{
+	dsRegisterType(MAGIC_LIB_UNDO, traceUndoLog);
+}
+
+static uint64_t
+recordCheck(dsUndoRecord *record)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	uint8_t *data = (uint8_t *)(record + 1);
+	uint64_t i;
+
+	hash = (hash ^ record->offset) * 0x100000001b3;
+	hash = (hash ^ record->length) * 0x100000001b3;
+	hash = (hash ^ record->type) * 0x100000001b3;
+	if (record->type == undoData) {
+		for (i = 0; i < record->length; i++) {
+			hash = (hash ^ data[i]) * 0x100000001b3;
+		}
+	}
+
+	return hash;
+}
+
+static uint64_t
+recordLength(dsUndoRecord *record)
+{
+	uint64_t length = sizeof(*record);
+
+	if (record->type == undoData) {
+		length += (record->length + 7) & ~7ULL;
+	}
+
+	return length;
+}
+
+/*
+ * Find the records of a log that made it to disk intact. A torn record can
+ * only be the last one, which its transaction was still waiting on.
+ */
+static int
+scanUndoLog(dsUndoLog *log, dsUndoRecord ***records, uint64_t *count)
+{
+	dsUndoRecord **found = NULL;
+	uint64_t used = 0;
+	uint64_t n = 0;
+
+	while (used + sizeof(dsUndoRecord) <= log->used) {
+		dsUndoRecord *record = (void *)(log + 1) + used;
+		dsUndoRecord **grow;
+
+		if ((record->type != undoData) && (record->type != undoAlloc)) {
+			break;
+		}
+		if ((record->length > log->used) ||
+			(used + recordLength(record) > log->used) ||
+			(record->check != recordCheck(record))) {
+			break;
+		}
+
+		if ((grow = realloc(found, (n + 1) * sizeof(*found))) == NULL) {
+			dsLog("Can't allocate undo records.\n");
+			free(found);
+			return -1;
+		}
+		found = grow;
+		found[n++] = record;
+		used += recordLength(record);
+	}
+
+	*records = found;
+	*count = n;
+
+	return 0;
+}
+
+static void
+putUndoLog(dsCrate *crate, dsUndoLog *log)
+{
+	lockAllocator(crate);
+	log->busy = 0;
+	unlockAllocator(crate);
+}
+
+/*
+ * Take an idle undo log, making a new one if they are all in use.
+ */
+static dsUndoLog *
+getUndoLog(dsCrate *crate, uint64_t size, uint64_t *logOffset)
+{
+	dsUndoLog *log;
+	dsObject *object;
+	uint64_t offset;
+	int created = 0;
+
+	lockAllocator(crate);
+
+	for (offset = crate->super->logHeadOffset; offset != UINT64_MAX;
+		 offset = log->nextOffset) {
+		if ((log = mapObject(crate, offset, sizeof(*log))) == NULL) {
+			dsLog("Can't map undo log.\n");
+			goto error;
+		}
+		if (!log->busy && (log->size >= size)) {
+			goto found;
+		}
+	}
+
+	if ((object = allocateObject(crate, sizeof(*log) + size)) == NULL) {
+		dsLog("Can't allocate undo log.\n");
+		goto error;
+	}
+	log = (void *)(object + 1);
+	offset = objectOffset(crate, log);
+
+	log->magic = MAGIC_LIB_UNDO;
+	log->size = size;
+	log->used = 0;
+	log->nextOffset = crate->super->logHeadOffset;
+	crate->super->logHeadOffset = offset;
+	created = 1;
+
+found:
+	log->busy = 1;
+	unlockAllocator(crate);
+
+	/*
+	 * Records are written out on their own, which only helps once the log
+	 * itself is on disk and linked in.
+	 */
+	if (created && (syncCrate(crate) < 0)) {
+		putUndoLog(crate, log);
+		return NULL;
+	}
+
+	*logOffset = offset;
+
+	return log;
+
+error:
+	unlockAllocator(crate);
+
+	return NULL;
+}
+
+/*
+ * Get 'length' bytes at 'address' to disk right away, without the rest of
+ * the crate.
+ */
+static int
+syncRange(dsCrate *crate, void *address, uint64_t length)
+{
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	uint64_t offset = address - crate->map.ptr;
+	uint64_t start = offset & ~(pageSize - 1);
+	void *copy;
+	int ret = 0;
+
+	if (crate->pool == NULL) {
+		if (msync(crate->map.ptr + start, offset + length - start,
+				  MS_SYNC) < 0) {
+			dsLog("Can't synchronize crate: %s\n", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	/*
+	 * Pool pages can be dropped at any time, so the system call gets a
+	 * copy of its own.
+	 */
+	if ((copy = malloc(length)) == NULL) {
+		dsLog("Can't allocate write buffer.\n");
+		return -1;
+	}
+	memcpy(copy, address, length);
+
+	if ((pwrite(crate->fd, copy, length, offset) != (ssize_t)length) ||
+		(fdatasync(crate->fd) < 0)) {
+		dsLog("Can't synchronize crate: %s\n", strerror(errno));
+		ret = -1;
+	}
+	free(copy);
+
+	return ret;
+}
+
+/*
+ * Make sure the undo records at 'address' reach the disk before anything
+ * they cover. A pool only writes pages back itself, and writes the marked
+ * ones first. A shared mapping can be written back by the kernel at any
+ * time, so the records are synced now.
+ */
+static int
+holdUndoRecords(dsCrate *crate, void *address, uint64_t length)
+{
+	dsPool *pool = crate->pool;
+	uint64_t offset = address - crate->map.ptr;
+	uint64_t page = offset / poolPageSize;
+	uint64_t last = (offset + length - 1) / poolPageSize;
+
+	if (pool == NULL) {
+		return syncRange(crate, address, length);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	for (; page <= last; page++) {
+		__atomic_or_fetch(&pool->pages[page], poolLog, __ATOMIC_RELAXED);
+	}
+	pool->logPending = 1;
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/*
+ * Move a transaction to a log with room for 'length' more bytes.
+ */
+static dsUndoLog *
+growUndoLog(dsTx *tx, dsUndoLog *log, uint64_t length)
+{
+	dsUndoLog *bigger;
+	uint64_t size = log->size * 2;
+	uint64_t offset;
+
+	while (size < log->used + length) {
+		size *= 2;
+	}
+
+	if ((bigger = getUndoLog(tx->crate, size, &offset)) == NULL) {
+		return NULL;
+	}
+
+	memcpy(bigger + 1, log + 1, log->used);
+	bigger->used = log->used;
+
+	/*
+	 * Both copies are safe to roll back, but the old one can't be emptied
+	 * before the new one is on disk.
+	 */
+	if (syncCrate(tx->crate) < 0) {
+		bigger->used = 0;
+		putUndoLog(tx->crate, bigger);
+		return NULL;
+	}
+
+	log->used = 0;
+	putUndoLog(tx->crate, log);
+	tx->logOffset = offset;
+
+	return bigger;
+}
+
+static int
+addUndoRecord(dsTx *tx, uint64_t type, uint64_t offset, void *address,
+			  uint64_t length)
+{
+	dsUndoLog *log;
+	dsUndoRecord *record;
+	dsUndoRecord probe = {offset, length, type, 0};
+
+	if ((log = mapObject(tx->crate, tx->logOffset, sizeof(*log))) == NULL) {
+		dsLog("Can't map undo log.\n");
+		return -1;
+	}
+
+	if (log->used + recordLength(&probe) > log->size) {
+		if ((log = growUndoLog(tx, log, recordLength(&probe))) == NULL) {
+			dsLog("Can't grow undo log.\n");
+			return -1;
+		}
+	}
+
+	record = (void *)(log + 1) + log->used;
+	*record = probe;
+	if (type == undoData) {
+		memcpy(record + 1, address, length);
+	}
+	record->check = recordCheck(record);
+
+	log->used += recordLength(record);
+
+	return 0;
+}
+
+/*
+ * Whether the old contents of a range are already in the log. Only the first
+ * copy matters when rolling back.
+ */
+static int
+isLogged(dsTx *tx, uint64_t offset, uint64_t length)
+{
+	dsUndoLog *log;
+	uint64_t used = 0;
+
+	if ((log = mapObject(tx->crate, tx->logOffset, sizeof(*log))) == NULL) {
+		return 0;
+	}
+
+	while (used < log->used) {
+		dsUndoRecord *record = (void *)(log + 1) + used;
+
+		if ((record->type == undoData) && (record->offset <= offset) &&
+			(offset + length <= record->offset + record->length)) {
+			return 1;
+		}
+		used += recordLength(record);
+	}
+
+	return 0;
+}
+
+static int
+deferFree(dsTx *tx, uint64_t offset)
+{
+	if (tx->freeCount == tx->freeSize) {
+		uint64_t size = tx->freeSize ? tx->freeSize * 2 : 16;
+		uint64_t *frees;
+
+		if ((frees = realloc(tx->frees, size * sizeof(*frees))) == NULL) {
+			dsLog("Can't defer free.\n");
+			return -1;
+		}
+		tx->frees = frees;
+		tx->freeSize = size;
+	}
+
+	tx->frees[tx->freeCount++] = offset;
+
+	return 0;
+}
+
+/*
+ * Put back everything the records cover, newest first, and collect the
+ * objects they allocated.
+ */
+static void
+undoRecords(dsUndoRecord **records, uint64_t count, void *base,
+			uint64_t **allocs, uint64_t *allocCount)
+{
+	uint64_t i;
+
+	for (i = count; i-- > 0; ) {
+		dsUndoRecord *record = records[i];
+
+		if (record->type == undoData) {
+			memcpy(base + record->offset, record + 1, record->length);
+		} else if (allocs != NULL) {
+			uint64_t *grow;
+
+			if ((grow = realloc(*allocs,
+								(*allocCount + 1) * sizeof(**allocs))) == NULL) {
+				dsLog("Can't remember allocation, leaking it.\n");
+				continue;
+			}
+			*allocs = grow;
+			(*allocs)[(*allocCount)++] = record->offset;
+		}
+	}
+}
+
+static int
+compareOffsets(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Free objects allocated by transactions that didn't commit. A grown log can
+ * leave two copies of the same record behind, so each is freed once.
+ */
+static void
+freeAllocs(dsCrate *crate, uint64_t *allocs, uint64_t count)
+{
+	uint64_t i;
+
+	if (count == 0) {
+		return;
+	}
+	qsort(allocs, count, sizeof(*allocs), compareOffsets);
+
+	for (i = 0; i < count; i++) {
+		dsObject *object;
+
+		if ((i > 0) && (allocs[i] == allocs[i - 1])) {
+			continue;
+		}
+		if (((object = mapObject(crate, allocs[i], sizeof(*object))) == NULL) ||
+			(object->length & freeObjectBit) ||
+			(getObjectTrailer(crate, object) != allocs[i])) {
+			dsLog("Lost allocation at %" PRIu64 "\n", allocs[i]);
+			continue;
+		}
+		if (freeObject(crate, allocs[i]) < 0) {
+			dsLog("Can't free allocation at %" PRIu64 "\n", allocs[i]);
+		}
+	}
+}
+
+/*
+ * Roll back every transaction a crash interrupted.
+ */
+static int
+recoverCrate(dsCrate *crate)
+{
+	dsUndoLog *log;
+	uint64_t *allocs = NULL;
+	uint64_t allocCount = 0;
+	uint64_t offset;
+	uint64_t logs = 0;
+
+	for (offset = crate->super->logHeadOffset; offset != UINT64_MAX;
+		 offset = log->nextOffset) {
+		dsUndoRecord **records;
+		uint64_t count;
+
+		if (((log = mapObject(crate, offset, sizeof(*log))) == NULL) ||
+			(log->magic != MAGIC_LIB_UNDO) ||
+			(mapObject(crate, offset, sizeof(*log) + log->size) == NULL)) {
+			dsLog("Can't map undo log at %" PRIu64 "\n", offset);
+			free(allocs);
+			return -1;
+		}
+		log->busy = 0;
+
+		if (log->used == 0) {
+			continue;
+		}
+
+		if (scanUndoLog(log, &records, &count) < 0) {
+			free(allocs);
+			return -1;
+		}
+		dsLog("Rolling back %" PRIu64 " records at %" PRIu64 "\n",
+			count, offset);
+		undoRecords(records, count, crate->map.ptr, &allocs, &allocCount);
+		free(records);
+		logs++;
+	}
+
+	if (logs == 0) {
+		return 0;
+	}
+
+	/*
+	 * The old contents have to be on disk before the logs are emptied, and
+	 * the logs emptied before anything allocated is handed out again.
+	 */
+	if (syncCrate(crate) < 0) {
+		free(allocs);
+		return -1;
+	}
+	for (offset = crate->super->logHeadOffset; offset != UINT64_MAX;
+		 offset = log->nextOffset) {
+		log = mapObject(crate, offset, sizeof(*log));
+		log->used = 0;
+	}
+	if (syncCrate(crate) < 0) {
+		free(allocs);
+		return -1;
+	}
+
+	freeAllocs(crate, allocs, allocCount);
+	free(allocs);
+
+	return 0;
+}
+
+static void
+endTx(dsTx *tx, dsUndoLog *log)
+{
+	putUndoLog(tx->crate, log);
+
+	pthread_mutex_lock(&tx->crate->lock);
+	tx->crate->openTxs--;
+	pthread_mutex_unlock(&tx->crate->lock);
+
+	threadTx = NULL;
+	free(tx->frees);
+	free(tx);
+}
+
+/*
+ * Open our own file description for 'fd', so the file lock keeps this handle
+ * apart from whoever passed the descriptor. Fall back to sharing it when
+ * /proc isn't around, which only loses locking against that one process.
+ */
+static int
+reopenFd(int fd)
+{
+	char path[64];
+	int newFd;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if ((newFd = open(path, O_RDWR | O_CLOEXEC)) >= 0) {
+		return newFd;
+	}
+
+	dsLog("Can't reopen %s: %s\n", path, strerror(errno));
+	return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/*
+ * Open 'filename', or the file behind 'fd' when it isn't negative.
+ */
+static void *
+openCrate(const char *filename, int fd, const dsOpenOptions *options)
+{
+	dsCrate *crate = NULL;
+	struct stat statBuffer;
+	int flags = 0;
+	char name[32];
+
+	if (fd >= 0) {
+		snprintf(name, sizeof(name), "(fd %d)", fd);
+		filename = name;
+	}
+
+	if ((crate = malloc(sizeof(*crate))) == NULL) {
+		dsLog("Can't allocate crate.\n");
+		goto error;
+	}
+	memset(crate, 0, sizeof(*crate));
+	crate->filename = strdup(filename != NULL ? filename : "(memory)");
+	crate->compactOffset = UINT64_MAX;
+	crate->epoch = 1;
+	crate->checksums = options->checksums;
+	crate->id = __atomic_fetch_add(&nextCrateId, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&crate->lock, NULL);
+	pthread_mutex_init(&crate->statsLock, NULL);
+	pthread_mutex_init(&crate->dirtyLock, NULL);
+	pthread_mutex_init(&crate->syncLock, NULL);
+	pthread_cond_init(&crate->syncCond, NULL);
+
+	flags = O_RDWR | O_NOATIME;
+	if (options->create) {
+		flags |= O_CREAT;
+	}
+
+	if (fd >= 0) {
+		if ((crate->fd = reopenFd(fd)) < 0) {
+			dsLog("Can't duplicate fd %d: %s\n", fd, strerror(errno));
+			goto error;
+		}
+		crate->shared = 1;
+	} else if (filename == NULL) {
+		if ((crate->fd = memfd_create("crate", MFD_CLOEXEC)) < 0) {
+			dsLog("Can't create memory file: %s\n", strerror(errno));
+			goto error;
+		}
+	} else if ((crate->fd = open(filename, flags, S_IRUSR | S_IWUSR)) < 0) {
+		dsLog("Can't open %s: %s\n", filename, strerror(errno));
+		goto error;
+	}
+
+	if (lockCrate(crate) < 0) {
+		goto error;
+	}
+
+	if (fstat(crate->fd, &statBuffer) < 0) {
+		dsLog("Can't fstat(%s,): %s\n", crate->filename, strerror(errno));
+		goto error;
+	}
+
+	if (statBuffer.st_size == 0) {
+		/*
+		 * Create a giant fixed size sparse file.
+		 */
+		crate->map.length = 5*(1<<20);
+
+		if (ftruncate(crate->fd, crate->map.length) < 0) {
+			dsLog("Can't ftruncate(%s, %" PRIu64 "): %s\n", crate->filename,
+				crate->map.length, strerror(errno));
+			goto error;
+		}
+	} else {
+		crate->map.length = statBuffer.st_size;
+	}
+
+	/*
+	 * Reserve address space for the crate to grow into, so growing never
+	 * moves the mapping out from under pointers into it.
+	 */
+	crate->map.reserved = mapReservation;
+	if (crate->map.reserved < crate->map.length) {
+		crate->map.reserved = crate->map.length;
+	}
+
+	if (options->poolBytes != 0) {
+		if (openPool(crate, options->poolBytes) < 0) {
+			dsLog("Can't set up buffer pool.\n");
+			goto error;
+		}
+	} else if ((crate->map.ptr = reserveMapping(crate->map.reserved,
+					PROT_NONE)) == MAP_FAILED) {
+		dsLog("Can't reserve %" PRIu64 " bytes, crate can't grow: %s\n",
+			crate->map.reserved, strerror(errno));
+		crate->map.ptr = NULL;
+		crate->map.reserved = crate->map.length;
+	}
+
+	if ((crate->pool == NULL) &&
+		((crate->map.ptr = mmap(crate->map.ptr, crate->map.length,
+					PROT_READ | PROT_WRITE,
+					MAP_SHARED | (crate->map.ptr ? MAP_FIXED : 0),
+					crate->fd, 0)) == MAP_FAILED)) {
+		dsLog("Can't map shared memory: %s\n", strerror(errno));
+		crate->map.ptr = NULL;
+		goto error;
+	}
+
+	crate->map.direct = (crate->pool == NULL) && !crate->shared;
+
+	crate->super = crate->map.ptr;
+	if (crate->super->magic != MAGIC_LIB_SUPER) {
+		dsObject *freeObject;
+		int i;
+
+		/*
+		 * This crate needs a super object.
+		 */
+		crate->super->magic = MAGIC_LIB_SUPER;
+		crate->super->version = crateVersion;
+		crate->super->indexObjectOffset = UINT64_MAX;
+		crate->super->indexObjectLength = 0;
+		for (i = 0; i < objectGroups; i++) {
+			crate->super->headGroupOffset[i] = UINT64_MAX;
+		}
+		/*
+		 * First object comes directly after the super object.
+		 */
+		crate->super->firstObjectOffset = sizeof(*crate->super);
+
+		/*
+		 * Create the first free object.
+		 */
+		freeObject = crate->map.ptr + crate->super->firstObjectOffset;
+		freeObject->length = crate->map.length -
+										crate->super->firstObjectOffset;
+		freeObject->length |= freeObjectBit | lastObjectBit;
+		freeObject->nextGroupOffset = UINT64_MAX;
+		setObjectTrailer(freeObject, crate->super->firstObjectOffset);
+
+		/*
+		 * Link the first free object.
+		 */
+		int group = getGroup(getRealLength(freeObject->length));
+		crate->super->headGroupOffset[group] = crate->super->firstObjectOffset;
+		crate->super->logHeadOffset = UINT64_MAX;
+		crate->super->rootsOffset = UINT64_MAX;
+	} else if ((crate->super->version >= 2) && !crate->shared) {
+		/*
+		 * Whoever shared the crate is still running its transactions.
+		 */
+		if (recoverCrate(crate) < 0) {
+			dsLog("Can't roll back unfinished transactions.\n");
+			goto error;
+		}
+	}
+
+	unlockCrate(crate);
+	debugDump(crate);
+
+	return crate;
+
+error:
+
+	freeCrate(&crate);
+
+	return NULL;
+}
+
+void *
+dsPtr(uint64_t offset, uint64_t length)
+{
+	dsCrate *crate;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return NULL;
+	}
+
+	return mapObject(crate, offset, length);
+}
+
+void *
+dsCratePtrSlow(dsCrate *crate, uint64_t offset, uint64_t length)
+{
+	if (crate == NULL) {
+		dsLog("Bad argument %p\n", crate);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return mapObject(crate, offset, length);
+}
+
+uint64_t
+dsCrateOffsetSlow(dsCrate *crate, void *address)
+{
+	if ((crate == NULL) || (address == NULL)) {
+		dsLog("Bad argument %p, %p\n", crate, address);
+		return UINT64_MAX;
+	}
+
+	return objectOffset(crate, address);
+}
+
+dsCrate *
+dsGet()
+{
+	return getActiveCrate();
+}
+
+void *
+dsBase()
+{
+	dsCrate *crate;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return NULL;
+	}
+
+	return crate->map.ptr;
+}
+
+uint64_t
+dsOffset(void *address)
+{
+	dsCrate *crate;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return UINT64_MAX;
+	}
+
+	return objectOffset(crate, address);
+}
+
+static void *
+allocateMemory(uint64_t length, uint64_t alignment)
+{
+	dsCrate *crate;
+	dsThreadStats *stats;
+	struct timespec start;
+	void *memory;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return NULL;
+	}
+
+	stats = getThreadStats(crate);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	lockAllocator(crate);
+	memory = allocateAligned(crate, length, alignment);
+	unlockAllocator(crate);
+
+	statsAdd(stats->allocationLatency[latencyBucket(
+		elapsedNanoseconds(&start))], 1);
+
+	if (memory == NULL) {
+		statsAdd(stats->allocationFailures, 1);
+		dsLog("Can't allocate object.\n");
+		return NULL;
+	}
+	statsAdd(stats->allocations, 1);
+
+	/*
+	 * Allocations are logged by the offset of their header, which is what
+	 * freeing them again takes.
+	 */
+	if ((threadTx != NULL) && (threadTx->crate == crate) &&
+		(addUndoRecord(threadTx, undoAlloc, objectOffset(crate, memory), NULL,
+					   0) < 0)) {
+		dsLog("Can't log allocation.\n");
+		lockAllocator(crate);
+		disposeObject(crate, objectOffset(crate, memory));
+		unlockAllocator(crate);
+		return NULL;
+	}
+
+	return memory + sizeof(dsObject);
+}
+
+void *
+dsAlloc(uint64_t length)
+{
+	return allocateMemory(length, 1);
+}
+
+void *
+dsAllocAligned(uint64_t length, uint64_t alignment)
+{
+	if ((alignment == 0) || (alignment & (alignment - 1)) ||
+		(alignment > mapAlignment)) {
+		dsLog("Bad argument %" PRIu64 "\n", alignment);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return allocateMemory(length, alignment);
+}
+
+void *
+dsRealloc(void *address, uint64_t length)
+{
+	dsCrate *crate;
+	dsObject *object;
+	uint64_t offset;
+	uint64_t oldLength;
+	void *memory;
+	int checksummed;
+	int ret = 0;
+
+	if (address == NULL) {
+		return dsAlloc(length);
+	}
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return NULL;
+	}
+
+	if (((offset = objectOffset(crate, address)) == UINT64_MAX) ||
+		(offset < crate->super->firstObjectOffset + sizeof(*object))) {
+		dsLog("Bad argument %p\n", address);
+		errno = EINVAL;
+		return NULL;
+	}
+	offset -= sizeof(*object);
+
+	lockAllocator(crate);
+
+	if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			offset, sizeof(*object));
+		unlockAllocator(crate);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((object->length & freeObjectBit) ||
+		(getObjectTrailer(crate, object) != offset)) {
+		dsLog("Not an allocated object %p\n", address);
+		unmapObject(crate, object);
+		unlockAllocator(crate);
+		errno = EINVAL;
+		return NULL;
+	}
+	oldLength = getRealLength(object->length) - objectOverhead;
+	checksummed = hasChecksum(object);
+
+	/*
+	 * Object headers aren't logged, so transactions always move it.
+	 */
+	if ((threadTx == NULL) || (threadTx->crate != crate)) {
+		ret = resizeObject(crate, object, offset,
+						   alignObjectLength(length + objectOverhead));
+	}
+	if (ret > 0) {
+		indexChanged(crate, offset, sizeof(*object));
+	}
+	if ((ret > 0) && checksummed) {
+		object->nextGroupOffset = UINT64_MAX;
+		pthread_mutex_lock(&crate->dirtyLock);
+		addDirty(crate, offset);
+		pthread_mutex_unlock(&crate->dirtyLock);
+	}
+	unlockAllocator(crate);
+
+	if (ret < 0) {
+		dsLog("Can't resize object %p\n", address);
+		return NULL;
+	}
+	if (ret > 0) {
+		return address;
+	}
+
+	if ((memory = dsAlloc(length)) == NULL) {
+		dsLog("Can't allocate object.\n");
+		return NULL;
+	}
+	memcpy(memory, address, oldLength < length ? oldLength : length);
+
+	if (checksummed && (dsMarkDirty(memory) < 0)) {
+		dsLog("Can't mark object %p\n", memory);
+	}
+
+	if (dsFree(address) < 0) {
+		dsLog("Can't free object %p\n", address);
+	}
+
+	return memory;
+}
+
+int
+dsSet(dsCrate *crate)
+{
+	/*
+	 * Set thread specific crate handle.
+	 */
+	pthread_once(&keyOnce, makeKey);
+	if (pthread_setspecific(key, crate) < 0) {
+		dsLog("Can't set pthread specific.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the allocated object 'address' points to the start of. Must hold
+ * 'lock'.
+ */
+static dsObject *
+getAllocatedObject(dsCrate *crate, void *address, uint64_t *offset)
+{
+	dsObject *object;
+
+	if ((address == NULL) ||
+		((*offset = objectOffset(crate, address)) == UINT64_MAX) ||
+		(*offset < crate->super->firstObjectOffset + sizeof(*object)) ||
+		((object = mapObject(crate, *offset - sizeof(*object),
+							 sizeof(*object))) == NULL)) {
+		dsLog("Bad argument %p\n", address);
+		errno = EINVAL;
+		return NULL;
+	}
+	*offset -= sizeof(*object);
+
+	if ((object->length & freeObjectBit) ||
+		(getObjectTrailer(crate, object) != *offset) ||
+		(mapObject(crate, *offset, getRealLength(object->length)) == NULL)) {
+		dsLog("Not an allocated object %p\n", address);
+		unmapObject(crate, object);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return object;
+}
+
+int
+dsMarkDirty(void *address)
+{
+	dsCrate *crate;
+	dsObject *object;
+	uint64_t offset;
+	int ret;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	if (!crate->checksums) {
+		return 0;
+	}
+
+	lockAllocator(crate);
+	object = getAllocatedObject(crate, address, &offset);
+	unlockAllocator(crate);
+	if (object == NULL) {
+		return -1;
+	}
+
+	/*
+	 * A rollback has to put back the checksum along with the contents.
+	 */
+	if ((threadTx != NULL) && (threadTx->crate == crate) &&
+		(dsTxAdd(object, sizeof(*object)) < 0)) {
+		dsLog("Can't log object header.\n");
+		return -1;
+	}
+	unmapObject(crate, object);
+
+	pthread_mutex_lock(&crate->dirtyLock);
+	ret = addDirty(crate, offset);
+	pthread_mutex_unlock(&crate->dirtyLock);
+
+	return ret;
+}
+
+int
+dsVerify(void *address)
+{
+	dsCrate *crate;
+	dsObject *object;
+	uint64_t offset;
+	int ret = 0;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	lockAllocator(crate);
+
+	if ((object = getAllocatedObject(crate, address, &offset)) == NULL) {
+		unlockAllocator(crate);
+		return -1;
+	}
+
+	if (hasChecksum(object) &&
+		(objectChecksum(object) != (uint32_t)object->nextGroupOffset)) {
+		dsLog("Bad checksum at %" PRIu64 "\n", offset);
+		errno = EBADMSG;
+		ret = -1;
+	}
+	unmapObject(crate, object);
+
+	unlockAllocator(crate);
+
+	return ret;
+}
+
+int
+dsFree(void *address)
+{
+	dsCrate *crate;
+	dsObject *object;
+	uint64_t offset;
+	int ret = -1;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	if ((address == NULL) ||
+		((offset = objectOffset(crate, address)) == UINT64_MAX) ||
+		(offset < crate->super->firstObjectOffset + sizeof(*object))) {
+		dsLog("Bad argument %p\n", address);
+		errno = EINVAL;
+		return -1;
+	}
+	offset -= sizeof(*object);
+
+	lockAllocator(crate);
+
+	if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			offset, sizeof(*object));
+		errno = EINVAL;
+		goto out;
+	}
+
+	/*
+	 * The trailer is the only way to tell an object from any other pointer.
+	 */
+	if ((object->length & freeObjectBit) ||
+		(getObjectTrailer(crate, object) != offset)) {
+		dsLog("Not an allocated object %p\n", address);
+		unmapObject(crate, object);
+		errno = EINVAL;
+		goto out;
+	}
+
+	/*
+	 * Freeing can't be undone, so transactions hold on to it until they
+	 * commit.
+	 */
+	if ((threadTx != NULL) && (threadTx->crate == crate)) {
+		ret = deferFree(threadTx, offset);
+		goto out;
+	}
+
+	ret = disposeObject(crate, offset);
+
+out:
+	unlockAllocator(crate);
+
+	return ret;
+}
+
+static int
+pinRange(void *address, uint64_t length, int pin)
+{
+	dsCrate *crate;
+	uint64_t offset;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	if ((address == NULL) ||
+		((offset = objectOffset(crate, address)) == UINT64_MAX) ||
+		(offset + length >
+		 __atomic_load_n(&crate->map.length, __ATOMIC_ACQUIRE))) {
+		dsLog("Bad argument %p\n", address);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (crate->pool == NULL) {
+		return 0;
+	}
+
+	if (!pin) {
+		return unpinPool(crate, offset, length);
+	}
+	pinPool(crate, offset, length);
+
+	return 0;
+}
+
+int
+dsPin(void *address, uint64_t length)
+{
+	return pinRange(address, length, 1);
+}
+
+int
+dsUnpin(void *address, uint64_t length)
+{
+	return pinRange(address, length, 0);
+}
+
+int
+dsEpochEnter()
+{
+	dsCrate *crate;
+	dsThreadEpoch *record;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	if ((record = getThreadEpoch(crate)) == NULL) {
+		return -1;
+	}
+
+	if (record->depth++ == 0) {
+		for (;;) {
+			__atomic_store_n(&record->epoch,
+							 __atomic_load_n(&crate->epoch, __ATOMIC_RELAXED),
+							 __ATOMIC_RELAXED);
+			/*
+			 * The announcement has to be visible before anything is read.
+			 */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+			if (!__atomic_load_n(&crate->moving, __ATOMIC_SEQ_CST)) {
+				break;
+			}
+
+			/*
+			 * Objects are being moved, wait for it to finish with the
+			 * allocator lock it holds.
+			 */
+			__atomic_store_n(&record->epoch, 0, __ATOMIC_SEQ_CST);
+			lockAllocator(crate);
+			unlockAllocator(crate);
+		}
+	}
+
+	return 0;
+}
+
+int
+dsEpochExit()
+{
+	dsCrate *crate;
+	dsThreadEpoch *record;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	if (((record = getThreadEpoch(crate)) == NULL) || (record->depth == 0)) {
+		dsLog("Not in an epoch.\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (--record->depth == 0) {
+		__atomic_store_n(&record->epoch, 0, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+int
+dsBegin()
+{
+	dsCrate *crate;
+	dsTx *tx;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	if (threadTx != NULL) {
+		dsLog("Already in a transaction.\n");
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (crate->super->version < 2) {
+		dsLog("Crate version %" PRIu64 " has no undo logs.\n",
+			crate->super->version);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if ((tx = calloc(1, sizeof(*tx))) == NULL) {
+		dsLog("Can't allocate transaction.\n");
+		return -1;
+	}
+	tx->crate = crate;
+
+	lockAllocator(crate);
+	crate->openTxs++;
+	unlockAllocator(crate);
+
+	if (getUndoLog(crate, undoLogSize, &tx->logOffset) == NULL) {
+		lockAllocator(crate);
+		crate->openTxs--;
+		unlockAllocator(crate);
+		free(tx);
+		return -1;
+	}
+
+	threadTx = tx;
+
+	return 0;
+}
+
+int
+dsTxAdd(void *address, uint64_t length)
+{
+	dsTx *tx = threadTx;
+	dsUndoLog *log;
+	uint64_t offset;
+
+	/*
+	 * Compaction has to hear about changes either way.
+	 */
+	if (tx == NULL) {
+		dsNoteReferences(address, length);
+		return 0;
+	}
+
+	if (((offset = objectOffset(tx->crate, address)) == UINT64_MAX) ||
+		(mapObject(tx->crate, offset, length) == NULL)) {
+		dsLog("Bad argument %p\n", address);
+		errno = EINVAL;
+		return -1;
+	}
+	noteReferences(tx->crate, address, length);
+
+	if (isLogged(tx, offset, length)) {
+		return 0;
+	}
+
+	if ((addUndoRecord(tx, undoData, offset, address, length) < 0) ||
+		((log = mapObject(tx->crate, tx->logOffset, sizeof(*log))) == NULL)) {
+		return -1;
+	}
+
+	/*
+	 * The old contents must be on disk before the caller's changes are.
+	 * Records of allocations before this one go along.
+	 */
+	return holdUndoRecords(tx->crate, &log->used,
+						   (void *)(log + 1) + log->used - (void *)&log->used);
+}
+
+int
+dsCommit()
+{
+	dsTx *tx = threadTx;
+	dsCrate *crate;
+	dsUndoLog *log;
+	uint64_t i;
+	int ret = 0;
+
+	if (tx == NULL) {
+		dsLog("Not in a transaction.\n");
+		errno = EINVAL;
+		return -1;
+	}
+	crate = tx->crate;
+
+	if ((log = mapObject(crate, tx->logOffset, sizeof(*log))) == NULL) {
+		dsLog("Can't map undo log.\n");
+		return -1;
+	}
+
+	/*
+	 * Everything the transaction wrote goes to disk before the log that
+	 * could undo it is emptied. Only the emptied log has to follow.
+	 */
+	if (syncCrate(crate) < 0) {
+		return -1;
+	}
+	log->used = 0;
+	if (syncRange(crate, &log->used, sizeof(log->used)) < 0) {
+		return -1;
+	}
+
+	lockAllocator(crate);
+	for (i = 0; i < tx->freeCount; i++) {
+		if (disposeObject(crate, tx->frees[i]) < 0) {
+			ret = -1;
+		}
+	}
+	unlockAllocator(crate);
+
+	endTx(tx, log);
+
+	return ret;
+}
+
+int
+dsAbort()
+{
+	dsTx *tx = threadTx;
+	dsCrate *crate;
+	dsUndoLog *log;
+	dsUndoRecord **records;
+	uint64_t *allocs = NULL;
+	uint64_t allocCount = 0;
+	uint64_t count;
+
+	if (tx == NULL) {
+		dsLog("Not in a transaction.\n");
+		errno = EINVAL;
+		return -1;
+	}
+	crate = tx->crate;
+
+	if (((log = mapObject(crate, tx->logOffset, sizeof(*log))) == NULL) ||
+		(scanUndoLog(log, &records, &count) < 0)) {
+		dsLog("Can't read undo log.\n");
+		return -1;
+	}
+
+	undoRecords(records, count, crate->map.ptr, &allocs, &allocCount);
+	free(records);
+
+	/*
+	 * Same order as recovery, the allocations can't be reused until no
+	 * crash could free them a second time.
+	 */
+	if (syncCrate(crate) < 0) {
+		free(allocs);
+		return -1;
+	}
+	log->used = 0;
+	if (syncRange(crate, &log->used, sizeof(log->used)) < 0) {
+		free(allocs);
+		return -1;
+	}
+
+	lockAllocator(crate);
+	freeAllocs(crate, allocs, allocCount);
+	unlockAllocator(crate);
+	free(allocs);
+
+	endTx(tx, log);
+
+	return 0;
+}
+
+void
+dsClose(dsCrate **crate)
+{
+	if (crate == NULL || *crate == NULL) {
+		return;
+	}
+
+	if (getActiveCrate() == *crate) {
+		/*
+		 * Deactivate the crate.
+		 */
+		dsSet(NULL);
+	}
+
+	/*
+	 * Closing the handle ends every read section on it.
+	 */
+	lockAllocator(*crate);
+	if (reclaimObjects(*crate, 1) < 0) {
+		dsLog("Can't free retired objects.\n");
+	}
+	unlockAllocator(*crate);
+
+	freeCrate(crate);
+}
+
+dsCrate *
+dsOpen(const char *filename, int create, int active)
+{
+	dsOpenOptions options = {
+		.create = create,
+		.active = active,
+	};
+
+	return dsOpenWith(filename, &options);
+}
+
+dsCrate *
+dsOpenWith(const char *filename, const dsOpenOptions *options)
+{
+	dsCrate *crate;
+
+	if (options == NULL) {
+		dsLog("Bad argument %p\n", options);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((crate = openCrate(filename, -1, options)) == NULL) {
+		dsLog("Can't allocate crate.\n");
+		return NULL;
+	}
+
+	if (options->active) {
+		if (dsSet(crate) < 0) {
+			dsClose(&crate);
+			return NULL;
+		}
+	}
+
+	return crate;
+}
+
+dsCrate *
+dsOpenFd(int fd, int active)
+{
+	dsOpenOptions options = {
+		.active = active,
+	};
+	dsCrate *crate;
+
+	if (fd < 0) {
+		dsLog("Bad argument %d\n", fd);
+		errno = EBADF;
+		return NULL;
+	}
+
+	if ((crate = openCrate(NULL, fd, &options)) == NULL) {
+		dsLog("Can't allocate crate.\n");
+		return NULL;
+	}
+
+	if (active) {
+		if (dsSet(crate) < 0) {
+			dsClose(&crate);
+			return NULL;
+		}
+	}
+
+	return crate;
+}
+
+int
+dsExportFd(dsCrate *crate)
+{
+	int fd;
+
+	if (crate == NULL) {
+		dsLog("Bad argument %p\n", crate);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (crate->pool != NULL) {
+		dsLog("Can't share pooled crate '%s'\n", crate->filename);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/*
+	 * From here on every allocator change takes the file lock, even in
+	 * this process.
+	 */
+	pthread_mutex_lock(&crate->lock);
+	if ((fd = fcntl(crate->fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		dsLog("Can't duplicate fd of crate '%s': %s\n", crate->filename,
+			strerror(errno));
+	} else {
+		crate->shared = 1;
+		crate->map.direct = 0;
+	}
+	pthread_mutex_unlock(&crate->lock);
+
+	return fd;
+}
+
+int
+dsSetIndex(void *address, uint64_t length)
+{
+	dsCrate *crate = NULL;
+	uint64_t offset = UINT64_MAX;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	if ((offset = objectOffset(crate, address)) == UINT64_MAX) {
+		dsLog("Can't get object offset.\n");
+		return -1;
+	}
+
+	crate->super->indexObjectOffset = offset;
+	crate->super->indexObjectLength = length;
+
+	return 0;
+}
+
+void *
+dsGetIndex()
+{
+	dsCrate *crate = NULL;
+	void *ptr;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return (void *)-1;
+	}
+
+	if ((ptr = mapObject(crate, crate->super->indexObjectOffset,
+					crate->super->indexObjectLength)) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			crate->super->indexObjectOffset,
+			crate->super->indexObjectLength);
+		return (void *)-1;
+	}
+
+	return ptr;
+}
+
+/*
+ * Named roots.
+ */
+static void
+traceRoots(void *object, uint64_t length, dsVisitCallback visit, void *arg)
+{
+	dsRootTable *table = object;
+	uint64_t i;
+
+	if (length < sizeof(*table)) {
+		return;
+	}
+
+	for (i = 0; i < table->capacity; i++) {
+		visit(arg, &table->entries[i].offset);
+	}
+}
+
+static void __attribute__((constructor))
+registerRoots()
+{
+	dsRegisterType(MAGIC_LIB_ROOTS, traceRoots);
+}
+
+static uint64_t
+hashRootName(const char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (*name != '\0') {
+		hash ^= (uint8_t)*name++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static dsRootTable *
+getRootTable(dsCrate *crate)
+{
+	dsRootTable *table;
+
+	if ((table = mapObject(crate, crate->super->rootsOffset,
+						   sizeof(*table))) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			crate->super->rootsOffset, sizeof(*table));
+		return NULL;
+	}
+
+	if (table->magic != MAGIC_LIB_ROOTS) {
+		dsLog("Bad root table at %" PRIu64 "\n", crate->super->rootsOffset);
+		unmapObject(crate, table);
+		errno = EIO;
+		return NULL;
+	}
+
+	return mapObject(crate, crate->super->rootsOffset,
+					 sizeof(*table) + table->capacity * sizeof(*table->entries));
+}
+
+/*
+ * Find the entry for 'name', or the empty one it would go in.
+ */
+static dsRootEntry *
+findRoot(dsRootTable *table, const char *name, uint64_t hash)
+{
+	uint64_t mask = table->capacity - 1;
+	uint64_t i;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		dsRootEntry *entry = &table->entries[i];
+
+		if ((entry->offset == UINT64_MAX) ||
+			((entry->hash == hash) && (strcmp(entry->name, name) == 0))) {
+			return entry;
+		}
+	}
+}
+
+static dsRootTable *
+allocateRoots(dsCrate *crate, uint64_t capacity, uint64_t *offset)
+{
+	dsRootTable *table;
+	dsObject *object;
+	uint64_t i;
+
+	if ((object = allocateObject(crate, sizeof(*table) +
+								 capacity * sizeof(*table->entries))) == NULL) {
+		dsLog("Can't allocate root table.\n");
+		return NULL;
+	}
+	table = (dsRootTable *)(object + 1);
+	*offset = objectOffset(crate, table);
+
+	table->magic = MAGIC_LIB_ROOTS;
+	table->count = 0;
+	table->capacity = capacity;
+	for (i = 0; i < capacity; i++) {
+		table->entries[i].offset = UINT64_MAX;
+	}
+
+	return table;
+}
+
+/*
+ * Move the roots into a table twice the size. The new table is complete
+ * before the super object points at it.
+ */
+static dsRootTable *
+growRoots(dsCrate *crate, dsRootTable *table)
+{
+	dsRootTable *newTable;
+	uint64_t oldOffset = crate->super->rootsOffset;
+	uint64_t offset;
+	uint64_t i;
+
+	if ((newTable = allocateRoots(crate, table->capacity * 2,
+								  &offset)) == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < table->capacity; i++) {
+		dsRootEntry *entry = &table->entries[i];
+
+		if (entry->offset != UINT64_MAX) {
+			*findRoot(newTable, entry->name, entry->hash) = *entry;
+		}
+	}
+	newTable->count = table->count;
+	unmapObject(crate, table);
+
+	crate->super->rootsOffset = offset;
+	disposeObject(crate, oldOffset - sizeof(dsObject));
+
+	return newTable;
+}
+
+/*
+ * Empty 'entry', shifting back any entry after it that would no longer be
+ * found past the gap.
+ */
+static void
+removeRoot(dsRootTable *table, dsRootEntry *entry)
+{
+	uint64_t mask = table->capacity - 1;
+	uint64_t i = entry - table->entries;
+	uint64_t j = i;
+
+	for (;;) {
+		uint64_t home;
+
+		j = (j + 1) & mask;
+		if (table->entries[j].offset == UINT64_MAX) {
+			break;
+		}
+
+		home = table->entries[j].hash & mask;
+		if ((i <= j) ? ((home <= i) || (home > j)) :
+					   ((home <= i) && (home > j))) {
+			table->entries[i] = table->entries[j];
+			i = j;
+		}
+	}
+
+	table->entries[i].offset = UINT64_MAX;
+	table->count--;
+}
+
+static int
+setRoot(dsCrate *crate, const char *name, uint64_t offset, uint64_t length)
+{
+	dsRootTable *table;
+	dsRootEntry *entry;
+	uint64_t hash = hashRootName(name);
+
+	if (crate->super->rootsOffset == UINT64_MAX) {
+		if (offset == UINT64_MAX) {
+			errno = ENOENT;
+			return -1;
+		}
+		if ((table = allocateRoots(crate, rootsMinCapacity,
+								   &crate->super->rootsOffset)) == NULL) {
+			return -1;
+		}
+	} else if ((table = getRootTable(crate)) == NULL) {
+		return -1;
+	}
+	indexChanged(crate, objectOffset(crate, table), sizeof(*table));
+
+	entry = findRoot(table, name, hash);
+
+	if (offset == UINT64_MAX) {
+		if (entry->offset == UINT64_MAX) {
+			unmapObject(crate, table);
+			errno = ENOENT;
+			return -1;
+		}
+		removeRoot(table, entry);
+		unmapObject(crate, table);
+		return 0;
+	}
+
+	if (entry->offset == UINT64_MAX) {
+		/*
+		 * Keep the table at most three quarters full.
+		 */
+		if ((table->count + 1) * 4 > table->capacity * 3) {
+			if ((table = growRoots(crate, table)) == NULL) {
+				return -1;
+			}
+			entry = findRoot(table, name, hash);
+		}
+		entry->hash = hash;
+		strcpy(entry->name, name);
+		table->count++;
+	}
+	entry->length = length;
+	entry->offset = offset;
+
+	unmapObject(crate, table);
+
+	return 0;
+}
+
+/*
+ * Look 'name' up without the allocator lock. The table can change or move
+ * while it is read, so nothing read is followed without checking it against
+ * the mapping, and the result only counts if 'rootsSequence' stayed the same
+ * and even throughout.
+ *
+ * Returns 1 with 'found' filled in, 0 if there is no such root, or -1 if the
+ * table changed and the lookup has to be done under the lock.
+ */
+static int
+lookupRoot(dsCrate *crate, const char *name, uint64_t hash,
+		   dsRootEntry *found)
+{
+	dsRootTable *table;
+	uint64_t sequence, offset, end, capacity, mask, i, n;
+	int ret = 0;
+
+	sequence = __atomic_load_n(&crate->rootsSequence, __ATOMIC_ACQUIRE);
+	if (sequence & 1) {
+		return -1;
+	}
+
+	end = crate->map.offset +
+		  __atomic_load_n(&crate->map.length, __ATOMIC_ACQUIRE);
+	offset = crate->super->rootsOffset;
+	if (offset != UINT64_MAX) {
+		if ((offset < crate->map.offset) || (offset > end - sizeof(*table)) ||
+			((table = mapObject(crate, offset, sizeof(*table))) == NULL) ||
+			(table->magic != MAGIC_LIB_ROOTS)) {
+			return -1;
+		}
+
+		capacity = table->capacity;
+		if ((capacity == 0) || ((capacity & (capacity - 1)) != 0) ||
+			(capacity > (end - offset - sizeof(*table)) /
+						sizeof(*table->entries)) ||
+			((table = mapObject(crate, offset, sizeof(*table) + capacity *
+								sizeof(*table->entries))) == NULL)) {
+			return -1;
+		}
+
+		mask = capacity - 1;
+		for (i = hash & mask, n = 0; n < capacity; i = (i + 1) & mask, n++) {
+			dsRootEntry *entry = &table->entries[i];
+
+			if (entry->offset == UINT64_MAX) {
+				break;
+			}
+			if ((entry->hash == hash) &&
+				(strncmp(entry->name, name, DS_ROOT_NAME_MAX) == 0)) {
+				*found = *entry;
+				ret = 1;
+				break;
+			}
+		}
+		unmapObject(crate, table);
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&crate->rootsSequence, __ATOMIC_RELAXED) != sequence) {
+		return -1;
+	}
+
+	return ret;
+}
+
+static int
+checkRootName(dsCrate *crate, const char *name)
+{
+	if (name == NULL) {
+		dsLog("Bad argument %p\n", name);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((name[0] == '\0') || (strlen(name) >= DS_ROOT_NAME_MAX)) {
+		dsLog("Bad root name '%s'\n", name);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (crate->super->version < 3) {
+		dsLog("Crate version %" PRIu64 " has no named roots.\n",
+			crate->super->version);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+dsSetRoot(const char *name, void *address, uint64_t length)
+{
+	dsCrate *crate;
+	uint64_t offset = UINT64_MAX;
+	int ret;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	if (checkRootName(crate, name) < 0) {
+		return -1;
+	}
+
+	if ((address != NULL) &&
+		((offset = objectOffset(crate, address)) == UINT64_MAX)) {
+		dsLog("Can't get object offset.\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	lockAllocator(crate);
+	beginRootsChange(crate);
+	ret = setRoot(crate, name, offset, length);
+	endRootsChange(crate);
+	unlockAllocator(crate);
+
+	return ret;
+}
+
+void *
+dsGetRoot(const char *name, uint64_t *length)
+{
+	dsCrate *crate;
+	dsRootTable *table;
+	dsRootEntry entry;
+	uint64_t hash;
+	void *ptr;
+	int found = -1;
+	int i;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return NULL;
+	}
+
+	if (checkRootName(crate, name) < 0) {
+		return NULL;
+	}
+	hash = hashRootName(name);
+
+	/*
+	 * Only lookups racing with changes to the table take the allocator
+	 * lock, and all of them do on crates other processes can change.
+	 */
+	for (i = 0; (i < rootsLookupTries) && (found < 0) && !crate->shared; i++) {
+		found = lookupRoot(crate, name, hash, &entry);
+	}
+
+	if (found < 0) {
+		lockAllocator(crate);
+		if (crate->super->rootsOffset == UINT64_MAX) {
+			found = 0;
+		} else if ((table = getRootTable(crate)) != NULL) {
+			entry = *findRoot(table, name, hash);
+			found = entry.offset != UINT64_MAX;
+			unmapObject(crate, table);
+		}
+		unlockAllocator(crate);
+
+		if (found < 0) {
+			return NULL;
+		}
+	}
+
+	if (!found) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if ((ptr = mapObject(crate, entry.offset, entry.length)) == NULL) {
+		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+			entry.offset, entry.length);
+		return NULL;
+	}
+	if (length != NULL) {
+		*length = entry.length;
+	}
+
+	return ptr;
+}
+
+/*
+ * Copy a file range through a buffer, for files copy_file_range() can't
+ * copy between.
+ */
+#define copyBufferSize (1 << 20)
+
+static int
+bounceExtent(int from, int to, uint64_t offset, uint64_t length)
+{
+	uint64_t size = length < copyBufferSize ? length : copyBufferSize;
+	uint8_t *buffer;
+	int ret = 0;
+
+	if ((buffer = malloc(size)) == NULL) {
+		dsLog("Can't allocate copy buffer.\n");
+		return -1;
+	}
+
+	while (length > 0) {
+		uint64_t chunk = length < size ? length : size;
+		ssize_t n;
+
+		if ((n = pread(from, buffer, chunk, offset)) <= 0) {
+			dsLog("Can't pread(%d,,%" PRIu64 ",%" PRIu64 "): %s\n", from,
+				chunk, offset, n < 0 ? strerror(errno) : "short file");
+			ret = -1;
+			break;
+		}
+		if (pwrite(to, buffer, n, offset) != n) {
+			dsLog("Can't pwrite(%d,,%" PRIu64 ",%" PRIu64 "): %s\n", to,
+				(uint64_t)n, offset, strerror(errno));
+			ret = -1;
+			break;
+		}
+		offset += n;
+		length -= n;
+	}
+	free(buffer);
+
+	return ret;
+}
+
+static int
+copyExtent(int from, int to, uint64_t offset, uint64_t length)
+{
+	loff_t in = offset;
+	loff_t out = offset;
+
+	while (length > 0) {
+		ssize_t n;
+
+		if (((n = copy_file_range(from, &in, to, &out, length, 0)) < 0) &&
+			((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS) ||
+			 (errno == EOPNOTSUPP))) {
+			return bounceExtent(from, to, in, length);
+		}
+		if (n <= 0) {
+			dsLog("Can't copy_file_range(%d,,%d,,%" PRIu64 "): %s\n",
+				from, to, length, n < 0 ? strerror(errno) : "short file");
+			return -1;
+		}
+		length -= n;
+	}
+
+	return 0;
+}
+
+static int
+copyData(dsCrate *crate, int fd, uint64_t offset, uint64_t length)
+{
+	/*
+	 * Copying through a pool would evict everything else.
+	 */
+	if (crate->pool != NULL) {
+		return copyExtent(crate->fd, fd, offset, length);
+	}
+
+	if (pwrite(fd, crate->map.ptr + offset, length, offset) < 0) {
+		dsLog("Can't pwrite(%d,,%" PRIu64 ",%" PRIu64 "): %s\n", fd, length,
+			offset, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+copyDataRegions(dsCrate *crate, int fd, uint64_t start, uint64_t end)
+{
+	off_t data;
+	off_t hole;
+
+	while (start < end) {
+		if ((data = lseek(crate->fd, start, SEEK_DATA)) < 0) {
+			if (errno == ENXIO) {
+				break;
+			}
+			dsLog("Can't lseek(%d,%" PRIu64 ",SEEK_DATA): %s\n",
+				crate->fd, start, strerror(errno));
+			return -1;
+		}
+		if ((hole = lseek(crate->fd, data, SEEK_HOLE)) < 0) {
+			dsLog("Can't lseek(%d,%" PRIu64 ",SEEK_HOLE): %s\n",
+				crate->fd, (uint64_t)data, strerror(errno));
+			return -1;
+		}
+		if ((uint64_t)hole > end) {
+			hole = end;
+		}
+
+		if (copyData(crate, fd, data, hole - data) < 0) {
+			return -1;
+		}
+		start = hole;
+	}
+
+	return 0;
+}
+
+static int
+snapshotCrate(dsCrate *crate, const char *filename)
+{
+	struct stat statBuffer;
+	struct fiemap *filemap = NULL;
+	uint64_t start = 0, end;
+	uint32_t i;
+	int fd, count = 0, ret = -1;
+
+	/*
+	 * FIEMAP
+	 * Inverse of objet index
+	 * pagemaps for CBT
+	 * File copy
+	 */
+	if ((fd = open(filename,
+				   O_RDWR | O_CREAT | O_EXCL | O_NOATIME,
+				   S_IRUSR | S_IWUSR)) < 0) {
+		dsLog("Can't open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * A pool's dirty pages aren't in the file yet.
+	 */
+	if ((crate->pool != NULL) && (flushPool(crate) < 0)) {
+		dsLog("Can't write back crate.\n");
+		goto out;
+	}
+
+	if (fstat(crate->fd, &statBuffer) < 0) {
+		dsLog("Can't fstat(%s,): %s\n", crate->filename, strerror(errno));
+		goto out;
+	}
+
+	#define MAX_EXTENT 64
+	if ((filemap = malloc(offsetof(struct fiemap, fm_extents[0]) +
+						  sizeof(struct fiemap_extent) * MAX_EXTENT)) == NULL) {
+		dsLog("Can't allocate extent map.\n");
+		goto out;
+	}
+
+	end = statBuffer.st_size;
+
+	dsLog("Bob is your uncle: %" PRIu64 ", %" PRIu64 "\n", start, end);
+
+	while (start < end) {
+		filemap->fm_start = start;
+		filemap->fm_length = end - start;
+		filemap->fm_flags = FIEMAP_FLAG_SYNC;
+		filemap->fm_extent_count = MAX_EXTENT;
+
+		if (ioctl(crate->fd, FS_IOC_FIEMAP, filemap) != 0) {
+			/*
+			 * Memory file systems can still tell data from holes.
+			 */
+			if ((errno == EOPNOTSUPP) || (errno == ENOTTY)) {
+				if (copyDataRegions(crate, fd, start, end) < 0) {
+					goto out;
+				}
+				break;
+			}
+			dsLog("Can't ioctl(%d, FS_IOC_FIEMAP,): %s\n",
+				crate->fd, strerror(errno));
+			goto out;
+		}
+
+		if (filemap->fm_mapped_extents == 0) {
+			break;
+		}
+
+		dsLog("FILE: # of extents=%" PRIu32 ", flags=%" PRIu32 "\n",
+			filemap->fm_mapped_extents, filemap->fm_flags);
+
+		for (i = 0; i < filemap->fm_mapped_extents; i++) {
+			struct fiemap_extent extent;
+			extent = filemap->fm_extents[i];
+
+			dsLog("Extent: %5d logical=%lld, phy=%lld, len=%lld, flags=%"
+				PRIX32 "\n", count, extent.fe_logical,
+				extent.fe_physical, extent.fe_length, extent.fe_flags);
+
+			if (copyData(crate, fd, extent.fe_logical,
+						 extent.fe_length) < 0) {
+				goto out;
+			}
+
+			count++;
+			start = extent.fe_logical + extent.fe_length;
+		}
+	}
+
+	/*
+	 * Holes at the end of the crate don't show up as extents.
+	 */
+	if (ftruncate(fd, statBuffer.st_size) < 0) {
+		dsLog("Can't ftruncate(%s, %" PRIu64 "): %s\n", filename,
+			(uint64_t)statBuffer.st_size, strerror(errno));
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	free(filemap);
+	close(fd);
+
+	/*
+	 * Don't leave half a snapshot behind to be taken for a whole one.
+	 */
+	if (ret < 0) {
+		unlink(filename);
+	}
+
+	return ret;
+}
+
+int
+dsSnapshot(const char *filename)
+{
+	dsCrate *crate;
+	dsThreadStats *stats;
+	struct timespec start;
+	uint64_t nanoseconds;
+	int ret;
+
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
+	}
+
+	stats = getThreadStats(crate);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = snapshotCrate(crate, filename);
+
+	nanoseconds = elapsedNanoseconds(&start);
+	statsAdd(stats->snapshots, 1);
+	statsAdd(stats->snapshotNanoseconds, nanoseconds);
+	statsMax(&stats->snapshotMaxNanoseconds, nanoseconds);
+
+	return ret;
+}
+
+/*
+ * Export and import.
+ *
+ * An export is a header followed by every allocated object in offset order,
+ * each as a record of where it was and how long it is, then its contents.
+ * Free space, retired objects and undo logs are left out. Importing allocates the objects one
+ * after another and rewrites the offsets registered types hold, like
+ * compaction does.
+ */
+#define exportVersion 2
+#define streamBufferSize (1 << 20)
+
+typedef struct dsExportHeader {
+	uint64_t magic;
+	uint64_t version;
+	uint64_t objects;
+	uint64_t bytes;
+	uint64_t indexObjectOffset;
+	uint64_t indexObjectLength;
+	uint64_t rootsOffset;
+} dsExportHeader;
+
+typedef struct dsExportRecord {
+	uint64_t offset;
+	uint64_t length;
+} dsExportRecord;
+
+typedef struct dsStream {
+	int fd;
+	uint8_t *buffer;
+	uint64_t used;
+	uint64_t filled;
+} dsStream;
+
+static int
+flushStream(dsStream *stream)
+{
+	uint64_t done = 0;
+
+	while (done < stream->used) {
+		ssize_t n;
+
+		if ((n = write(stream->fd, stream->buffer + done,
+					   stream->used - done)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			dsLog("Can't write(%d,,%" PRIu64 "): %s\n", stream->fd,
+				stream->used - done, strerror(errno));
+			return -1;
+		}
+		done += n;
+	}
+	stream->used = 0;
+
+	return 0;
+}
+
+static int
+writeStream(dsStream *stream, const void *data, uint64_t length)
+{
+	while (length > 0) {
+		uint64_t n = streamBufferSize - stream->used;
+
+		if (n > length) {
+			n = length;
+		}
+		memcpy(stream->buffer + stream->used, data, n);
+		stream->used += n;
+		data = (const uint8_t *)data + n;
+		length -= n;
+
+		if ((stream->used == streamBufferSize) && (flushStream(stream) < 0)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+readStream(dsStream *stream, void *data, uint64_t length)
+{
+	while (length > 0) {
+		uint64_t n;
+
+		if (stream->used == stream->filled) {
+			ssize_t got;
+
+			if ((got = read(stream->fd, stream->buffer,
+							streamBufferSize)) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				dsLog("Can't read(%d,,): %s\n", stream->fd, strerror(errno));
+				return -1;
+			}
+			if (got == 0) {
+				dsLog("Export ends early.\n");
+				errno = EINVAL;
+				return -1;
+			}
+			stream->used = 0;
+			stream->filled = got;
+		}
+
+		n = stream->filled - stream->used;
+		if (n > length) {
+			n = length;
+		}
+		memcpy(data, stream->buffer + stream->used, n);
+		stream->used += n;
+		data = (uint8_t *)data + n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the objects an export leaves out although they are allocated: retired
+ * objects, which were already freed, and undo logs. Returns their header
+ * offsets, sorted.
+ */
+static uint64_t *
+findUnexported(dsCrate *crate, uint64_t *count)
+{
+	uint64_t *offsets;
+	uint64_t logs = 0;
+	uint64_t offset;
+	uint64_t i;
+	dsUndoLog *log;
+
+	if (crate->super->version >= 2) {
+		for (offset = crate->super->logHeadOffset; offset != UINT64_MAX;
+			 offset = log->nextOffset) {
+			if ((log = mapObject(crate, offset, sizeof(*log))) == NULL) {
+				dsLog("Can't map undo log.\n");
+				return NULL;
+			}
+			logs++;
+		}
+	}
+
+	if ((offsets = malloc((crate->retiredCount + logs + 1) *
+						  sizeof(*offsets))) == NULL) {
+		dsLog("Can't allocate unexported objects.\n");
+		return NULL;
+	}
+
+	*count = 0;
+	for (i = 0; i < crate->retiredCount; i++) {
+		offsets[(*count)++] = crate->retired[i].offset;
+	}
+	if (crate->super->version >= 2) {
+		for (offset = crate->super->logHeadOffset; offset != UINT64_MAX;
+			 offset = log->nextOffset) {
+			if ((log = mapObject(crate, offset, sizeof(*log))) == NULL) {
+				break;
+			}
+			offsets[(*count)++] = offset - sizeof(dsObject);
+		}
+	}
+	qsort(offsets, *count, sizeof(*offsets), compareOffsets);
+
+	return offsets;
+}
+
+/*
+ * Call 'record' with every object an export includes, which is every
+ * allocated object but the 'count' sorted ones in 'unexported'.
+ */
+static int
+walkExported(dsCrate *crate, const uint64_t *unexported, uint64_t count,
+			 int (*record)(void *arg, uint64_t offset, uint64_t length,
+						   void *data),
+			 void *arg)
+{
+	uint64_t offset = crate->super->firstObjectOffset;
+	uint64_t end = crate->map.offset + crate->map.length;
+	uint64_t i = 0;
+
+	while (offset < end) {
+		dsObject *object;
+		uint64_t length;
+		uint64_t *data;
+		int skip;
+
+		if ((object = mapObject(crate, offset, sizeof(*object))) == NULL) {
+			dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+				offset, sizeof(*object));
+			return -1;
+		}
+		length = getRealLength(object->length);
+		skip = (object->length & freeObjectBit) != 0;
+		unmapObject(crate, object);
+
+		while ((i < count) && (unexported[i] < offset)) {
+			i++;
+		}
+		if ((i < count) && (unexported[i] == offset)) {
+			skip = 1;
+		}
+
+		if (length < objectOverhead) {
+			dsLog("Bad object header at %" PRIu64 ".\n", offset);
+			errno = EIO;
+			return -1;
+		}
+
+		if (!skip) {
+			if ((data = mapObject(crate, offset + sizeof(*object),
+								  length - objectOverhead)) == NULL) {
+				dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+					offset + sizeof(*object), length - objectOverhead);
+				return -1;
+			}
+
+			if (record(arg, offset + sizeof(*object),
+					   length - objectOverhead, data) < 0) {
+				unmapObject(crate, data);
+				return -1;
+			}
+			unmapObject(crate, data);
+		}
+
+		offset += length;
+	}
+
+	return 0;
+}
+
+static int
+countExported(void *arg, uint64_t offset, uint64_t length, void *data)
+{
+	dsExportHeader *header = arg;
+
+	header->objects++;
+	header->bytes += length;
+
+	return 0;
+}
+
+static int
+writeExported(void *arg, uint64_t offset, uint64_t length, void *data)
+{
+	dsExportRecord record = { .offset = offset, .length = length };
+
+	if ((writeStream(arg, &record, sizeof(record)) < 0) ||
+		(writeStream(arg, data, length) < 0)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+exportCrate(dsCrate *crate, int fd)
+{
+	dsExportHeader header;
+	dsStream stream;
+	uint64_t *unexported;
+	uint64_t count;
+	int ret = -1;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.fd = fd;
+	if ((stream.buffer = malloc(streamBufferSize)) == NULL) {
+		dsLog("Can't allocate export buffer.\n");
+		return -1;
+	}
+	if ((unexported = findUnexported(crate, &count)) == NULL) {
+		free(stream.buffer);
+		return -1;
 	}
 
-	unlockCrate(crate);
-	debugDump(crate);
+	/*
+	 * Headers are cheap to walk twice, and knowing the size up front lets
+	 * an import make room in one go.
+	 */
+	memset(&header, 0, sizeof(header));
+	header.magic = MAGIC_LIB_EXPORT;
+	header.version = exportVersion;
+	header.indexObjectOffset = crate->super->indexObjectOffset;
+	header.indexObjectLength = crate->super->indexObjectLength;
+	header.rootsOffset = crate->super->version >= 3 ?
+						 crate->super->rootsOffset : UINT64_MAX;
+	if (walkExported(crate, unexported, count, countExported, &header) < 0) {
+		goto out;
+	}
 
-	return crate;
+	if ((writeStream(&stream, &header, sizeof(header)) < 0) ||
+		(walkExported(crate, unexported, count, writeExported,
+					  &stream) < 0) ||
+		(flushStream(&stream) < 0)) {
+		goto out;
+	}
 
-error:
+	ret = 0;
 
-	freeCrate(&crate);
+out:
+	free(unexported);
+	free(stream.buffer);
 
-	return NULL;
+	return ret;
 }
 
-void *
-dsPtr(uint64_t offset, uint64_t length)
+int
+dsExport(int fd)
 {
 	dsCrate *crate;
+	int ret;
+
+	if (fd < 0) {
+		dsLog("Bad argument %d\n", fd);
+		errno = EBADF;
+		return -1;
+	}
 
 	if ((crate = getActiveCrate()) == NULL) {
 		dsLog("Can't get active crate.\n");
-		return NULL;
+		return -1;
 	}
 
-	return mapObject(crate, offset, length);
+	lockAllocator(crate);
+
+	/*
+	 * Half done transactions would be exported without their undo logs.
+	 */
+	if (crate->openTxs != 0) {
+		unlockAllocator(crate);
+		errno = EBUSY;
+		return -1;
+	}
+
+	reclaimObjects(crate, 0);
+	ret = exportCrate(crate, fd);
+
+	unlockAllocator(crate);
+
+	return ret;
 }
 
-uint64_t
-dsOffset(void *address)
+/*
+ * Rewrite the offsets held by imported objects of registered types.
+ */
+static int
+relocateImported(dsCrate *crate, dsRelocations *relocations)
 {
-	dsCrate *crate;
+	uint64_t i;
 
-	if ((crate = getActiveCrate()) == NULL) {
-		dsLog("Can't get active crate.\n");
-		return UINT64_MAX;
+	for (i = 0; i < relocations->count; i++) {
+		dsRelocation *move = &relocations->moves[i];
+		dsTraceCallback trace;
+		uint64_t *magic;
+
+		if (move->length < sizeof(*magic)) {
+			continue;
+		}
+
+		if ((magic = mapObject(crate, move->newOffset, move->length)) == NULL) {
+			dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
+				move->newOffset, move->length);
+			return -1;
+		}
+		if ((trace = findType(*magic)) != NULL) {
+			trace(magic, move->length, relocateOffset, relocations);
+		}
+		unmapObject(crate, magic);
 	}
 
-	return objectOffset(crate, address);
+	return 0;
 }
 
-void *
-dsAlloc(uint64_t length)
+static int
+importCrate(dsCrate *crate, int fd)
 {
-	dsCrate *crate;
-	void *memory;
+	dsExportHeader header;
+	dsRelocations relocations;
+	dsStream stream;
+	uint64_t i;
+	uint64_t need;
+	int ret = -1;
+
+	memset(&relocations, 0, sizeof(relocations));
+	memset(&stream, 0, sizeof(stream));
+	stream.fd = fd;
+	if ((stream.buffer = malloc(streamBufferSize)) == NULL) {
+		dsLog("Can't allocate import buffer.\n");
+		return -1;
+	}
 
-	if ((crate = getActiveCrate()) == NULL) {
-		dsLog("Can't get active crate.\n");
-		return NULL;
+	if (readStream(&stream, &header, sizeof(header)) < 0) {
+		goto out;
+	}
+	if ((header.magic != MAGIC_LIB_EXPORT) ||
+		(header.version != exportVersion)) {
+		dsLog("Not an export, or version %" PRIu64 " isn't supported.\n",
+			header.version);
+		errno = EINVAL;
+		goto out;
 	}
 
-	if ((memory = allocateObject(crate, length)) == NULL) {
-		dsLog("Can't allocate object.\n");
-		return NULL;
+	/*
+	 * Make room for everything at once, so the objects end up next to each
+	 * other.
+	 */
+	need = header.bytes + header.objects * objectOverhead;
+	if ((header.objects > 0) && (largestFreeObject(crate) < need) &&
+		(growCrate(crate, need) < 0)) {
+		dsLog("Can't grow crate by %" PRIu64 " bytes.\n", need);
+		goto out;
 	}
 
-	memory += sizeof(dsObject);
+	for (i = 0; i < header.objects; i++) {
+		dsExportRecord record;
+		dsObject *object;
+		uint64_t newOffset;
 
-	return memory;
-}
+		if (readStream(&stream, &record, sizeof(record)) < 0) {
+			goto undo;
+		}
+
+		/*
+		 * Relocations are looked up by binary search.
+		 */
+		if ((relocations.count > 0) &&
+			(record.offset < relocations.moves[relocations.count - 1].offset +
+							 relocations.moves[relocations.count - 1].length)) {
+			dsLog("Export records are out of order.\n");
+			errno = EINVAL;
+			goto undo;
+		}
+
+		if ((object = allocateObject(crate, record.length)) == NULL) {
+			dsLog("Can't allocate %" PRIu64 " bytes.\n", record.length);
+			goto undo;
+		}
+		newOffset = objectOffset(crate, object + 1);
+
+		if (addRelocation(&relocations, record.offset, record.length,
+						  newOffset) < 0) {
+			freeObject(crate, newOffset - sizeof(*object));
+			goto undo;
+		}
+
+		if (readStream(&stream, object + 1, record.length) < 0) {
+			goto undo;
+		}
+	}
+
+	if (relocateImported(crate, &relocations) < 0) {
+		goto undo;
+	}
+
+	if (header.indexObjectOffset != UINT64_MAX) {
+		relocateOffset(&relocations, &header.indexObjectOffset);
+		crate->super->indexObjectOffset = header.indexObjectOffset;
+		crate->super->indexObjectLength = header.indexObjectLength;
+	}
 
-int
-dsSet(dsCrate *crate)
-{
 	/*
-	 * Set thread specific crate handle.
+	 * The imported roots replace any the crate had.
 	 */
-	pthread_once(&keyOnce, makeKey);
-	if (pthread_setspecific(key, crate) < 0) {
-		dsLog("Can't set pthread specific.\n");
-		return -1;
+	if ((header.rootsOffset != UINT64_MAX) && (crate->super->version >= 3)) {
+		if (crate->super->rootsOffset != UINT64_MAX) {
+			disposeObject(crate, crate->super->rootsOffset - sizeof(dsObject));
+		}
+		relocateOffset(&relocations, &header.rootsOffset);
+		beginRootsChange(crate);
+		crate->super->rootsOffset = header.rootsOffset;
+		endRootsChange(crate);
 	}
 
-	return 0;
+	ret = 0;
+	goto out;
+
+undo:
+	/*
+	 * Leave the crate as it was.
+	 */
+	for (i = 0; i < relocations.count; i++) {
+		freeObject(crate, relocations.moves[i].newOffset - sizeof(dsObject));
+	}
+
+out:
+	free(relocations.moves);
+	free(stream.buffer);
+
+	return ret;
 }
 
 int
-dsFree(void *address)
+dsImport(int fd)
 {
 	dsCrate *crate;
+	int ret;
+
+	if (fd < 0) {
+		dsLog("Bad argument %d\n", fd);
+		errno = EBADF;
+		return -1;
+	}
 
 	if ((crate = getActiveCrate()) == NULL) {
 		dsLog("Can't get active crate.\n");
 		return -1;
 	}
 
-	//TODO: Actually free the object.
-	address = 0;
+	lockAllocator(crate);
 
-	return 0;
-}
-
-void
-dsClose(dsCrate **crate)
-{
-	if (crate == NULL || *crate == NULL) {
-		return;
+	if (crate->openTxs != 0) {
+		unlockAllocator(crate);
+		errno = EBUSY;
+		return -1;
 	}
 
-	if (getActiveCrate() == *crate) {
-		/*
-		 * Deactivate the crate.
-		 */
-		dsSet(NULL);
-	}
+	ret = importCrate(crate, fd);
 
-	freeCrate(crate);
+	unlockAllocator(crate);
+
+	return ret;
 }
 
-dsCrate *
-dsOpen(const char *filename, int create, int active)
+int
+dsSync(int block)
 {
 	dsCrate *crate;
 
-	if ((crate = openCrate(filename, create)) == NULL) {
-		dsLog("Can't allocate crate.\n");
-		return NULL;
+	if ((crate = getActiveCrate()) == NULL) {
+		dsLog("Can't get active crate.\n");
+		return -1;
 	}
 
-	if (active) {
-		if (dsSet(crate) < 0) {
-			dsClose(&crate);
-			return NULL;
+	dsThreadStats *stats = getThreadStats(crate);
+	struct timespec start;
+	uint64_t nanoseconds;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (block) {
+		if (syncCrate(crate) < 0) {
+			return -1;
 		}
+	} else if (sync_file_range(crate->fd, 0, 0, SYNC_FILE_RANGE_WRITE) < 0) {
+		/*
+		 * MS_ASYNC doesn't do anything on Linux, this at least starts
+		 * writing dirty pages back.
+		 */
+		dsLog("Can't start writeback: %s\n", strerror(errno));
+		return -1;
 	}
 
-	return crate;
+	nanoseconds = elapsedNanoseconds(&start);
+	statsAdd(stats->syncs, 1);
+	statsAdd(stats->syncNanoseconds, nanoseconds);
+	statsMax(&stats->syncMaxNanoseconds, nanoseconds);
+
+	return 0;
 }
 
-int
-dsSetIndex(void *address, uint64_t length)
+int64_t
+dsSyncAsync(dsSyncCallback callback, void *userPtr)
 {
-	dsCrate *crate = NULL;
-	uint64_t offset = UINT64_MAX;
+	dsCrate *crate;
+	dsSyncRequest *request;
+	uint64_t ticket;
 
 	if ((crate = getActiveCrate()) == NULL) {
 		dsLog("Can't get active crate.\n");
 		return -1;
 	}
 
-	if ((offset = objectOffset(crate, address)) == UINT64_MAX) {
-		dsLog("Can't get object offset.\n");
+	if ((request = calloc(1, sizeof(*request))) == NULL) {
+		dsLog("Can't allocate sync request.\n");
 		return -1;
 	}
+	request->callback = callback;
+	request->userPtr = userPtr;
 
-	crate->super->indexObjectOffset = offset;
-	crate->super->indexObjectLength = length;
+	pthread_mutex_lock(&crate->syncLock);
 
-	return -1;
+	if (startFlusher(crate) < 0) {
+		pthread_mutex_unlock(&crate->syncLock);
+		free(request);
+		return -1;
+	}
+
+	/*
+	 * Tickets only grow, so appending keeps the queue in order.
+	 */
+	ticket = request->ticket = takeTicket(crate);
+	if (crate->syncRequestsTail != NULL) {
+		crate->syncRequestsTail->next = request;
+	} else {
+		crate->syncRequests = request;
+	}
+	crate->syncRequestsTail = request;
+
+	pthread_cond_broadcast(&crate->syncCond);
+	pthread_mutex_unlock(&crate->syncLock);
+
+	return ticket;
 }
 
-void *
-dsGetIndex()
+int
+dsSyncWait(int64_t ticket)
 {
-	dsCrate *crate = NULL;
-	void *ptr;
+	dsCrate *crate;
 
 	if ((crate = getActiveCrate()) == NULL) {
 		dsLog("Can't get active crate.\n");
-		return (void *)-1;
+		return -1;
 	}
 
-	if ((ptr = mapObject(crate, crate->super->indexObjectOffset,
-					crate->super->indexObjectLength)) == NULL) {
-		dsLog("Can't mapObject(,%" PRIu64 ",%" PRIu64 ")\n",
-			crate->super->indexObjectOffset,
-			crate->super->indexObjectLength);
-		return (void *)-1;
+	if (ticket <= 0) {
+		dsLog("Bad argument %" PRId64 "\n", ticket);
+		errno = EINVAL;
+		return -1;
 	}
 
-	return ptr;
+	return waitTicket(crate, ticket);
 }
 
 int
-dsSnapshot(const char *filename)
+dsCompact(uint64_t budget)
 {
 	dsCrate *crate;
-	struct stat statBuffer;
-	int fd;
+	int ret;
 
 	if ((crate = getActiveCrate()) == NULL) {
 		dsLog("Can't get active crate.\n");
@@ -878,98 +8513,133 @@ dsSnapshot(const char *filename)
 	}
 
 	/*
-	 * FIEMAP
-	 * Inverse of objet index
-	 * pagemaps for CBT
-	 * File copy
+	 * Read sections of other processes can't be seen from here.
 	 */
-	if ((fd = open(filename,
-				   O_RDWR | O_CREAT | O_EXCL | O_NOATIME,
-				   S_IRUSR | S_IWUSR)) < 0) {
-		dsLog("Can't open %s: %s\n", filename, strerror(errno));
-		return -1;
-	}
-
-	if (fstat(crate->fd, &statBuffer) < 0) {
-		dsLog("Can't fstat(%s,): %s\n", filename, strerror(errno));
+	if (crate->shared) {
+		dsLog("Can't compact crate '%s' shared with other processes.\n",
+			crate->filename);
+		errno = ENOTSUP;
 		return -1;
 	}
 
-	struct fiemap *filemap;
-
-	#define MAX_EXTENT 64
-	filemap = malloc(offsetof(struct fiemap, fm_extents[0]) +
-								sizeof(struct fiemap_extent) * MAX_EXTENT);
-
-	int count = 0;
-	uint64_t start = 0;
-	uint64_t end = statBuffer.st_size;
-	uint32_t i;
-
-	dsLog("Bob is your uncle: %" PRIu64 ", %" PRIu64 "\n", start, end);
-
-	while (start < end) {
-		filemap->fm_start = start;
-		filemap->fm_length = end;
-		filemap->fm_flags = FIEMAP_FLAG_SYNC;
-		filemap->fm_extent_count = MAX_EXTENT;
-
-		if (ioctl(crate->fd, FS_IOC_FIEMAP, filemap) != 0) {
-			dsLog("Can't ioctl(%d, FS_IOC_FIEMAP,): %s\n",
-				crate->fd, strerror(errno));
-			return -1;
-		}
-
-		if (filemap->fm_mapped_extents == 0) {
-			break;
-		}
-
-		dsLog("FILE: # of extents=%" PRIu32 ", flags=%" PRIu32 "\n",
-			filemap->fm_mapped_extents, filemap->fm_flags);
-
-		for (i = 0; i < filemap->fm_mapped_extents; i++) {
-			struct fiemap_extent extent;
-			extent = filemap->fm_extents[i];
-
-			dsLog("Extent: %5d logical=%lld, phy=%lld, len=%lld, flags=%"
-				PRIX32 "\n", count, extent.fe_logical,
-				extent.fe_physical, extent.fe_length, extent.fe_flags);
-
-			void *buf = crate->map.ptr + extent.fe_logical;
+	lockAllocator(crate);
 
-			if (pwrite(fd, buf, extent.fe_length, extent.fe_logical) < 0) {
-				dsLog("Can't pwrite(%d,,%lld,%lld): %s\n", fd, extent.fe_length,
-					extent.fe_logical, strerror(errno));
-				return -1;
-			}
+	/*
+	 * Nothing can move while transactions have it logged, nor under
+	 * readers, which would have it pulled out from under their pointers.
+	 * Try again once they are gone.
+	 */
+	if ((crate->openTxs != 0) || (blockReaders(crate) < 0)) {
+		unlockAllocator(crate);
+		return 1;
+	}
 
-			count++;
-			start = extent.fe_logical + extent.fe_length;
-		}
+	/*
+	 * With no readers left, every retired object can go. Anything still
+	 * retired would be remembered by its old offset.
+	 */
+	reclaimObjects(crate, 1);
+	if (crate->retiredCount != 0) {
+		unblockReaders(crate);
+		unlockAllocator(crate);
+		return 1;
 	}
 
-	free(filemap);
-	close(fd);
-	return 0;
+	/*
+	 * Marked objects are remembered by offset, checksum them before they
+	 * move.
+	 */
+	updateChecksums(crate);
+	ret = compactCrate(crate, budget);
+	unblockReaders(crate);
+	unlockAllocator(crate);
+
+	return ret;
 }
 
 int
-dsSync(int block)
+dsStats(dsCrateStats *stats)
 {
 	dsCrate *crate;
+	dsThreadStats *threadStats;
+	int i;
+
+	if (stats == NULL) {
+		dsLog("Bad argument %p\n", stats);
+		errno = EINVAL;
+		return -1;
+	}
 
 	if ((crate = getActiveCrate()) == NULL) {
 		dsLog("Can't get active crate.\n");
 		return -1;
 	}
 
-	int flags = block ? MS_SYNC : MS_ASYNC;
+	memset(stats, 0, sizeof(*stats));
+
+	lockAllocator(crate);
 
-	if (msync(crate->map.ptr, crate->map.length, flags) < 0) {
-		dsLog("Can't synchronize crate.\n");
+	/*
+	 * Other processes sharing the crate don't update this one's counts.
+	 */
+	if ((!crate->statsReady || crate->shared) && (countSpace(crate) < 0)) {
+		dsLog("Can't count crate space.\n");
+		unlockAllocator(crate);
 		return -1;
 	}
 
+	for (i = 0; i < objectGroups; i++) {
+		stats->liveObjects[i] = crate->liveObjects[i];
+		stats->liveBytes[i] = crate->liveBytes[i];
+		stats->freeObjects[i] = crate->freeObjects[i];
+		stats->freeBytes[i] = crate->freeBytes[i];
+	}
+	stats->largestFree = largestFreeObject(crate);
+
+	unlockAllocator(crate);
+
+	pthread_mutex_lock(&crate->statsLock);
+	for (threadStats = crate->threadStats; threadStats != NULL;
+		 threadStats = threadStats->next) {
+		stats->allocations += statsRead(threadStats->allocations);
+		stats->allocationFailures +=
+			statsRead(threadStats->allocationFailures);
+		stats->frees += statsRead(threadStats->frees);
+		stats->splits += statsRead(threadStats->splits);
+		stats->merges += statsRead(threadStats->merges);
+		for (i = 0; i < DS_STATS_BUCKETS; i++) {
+			stats->allocationLatency[i] +=
+				statsRead(threadStats->allocationLatency[i]);
+		}
+
+		stats->syncs += statsRead(threadStats->syncs);
+		stats->syncNanoseconds += statsRead(threadStats->syncNanoseconds);
+		if (statsRead(threadStats->syncMaxNanoseconds) >
+			stats->syncMaxNanoseconds) {
+			stats->syncMaxNanoseconds =
+				statsRead(threadStats->syncMaxNanoseconds);
+		}
+		stats->snapshots += statsRead(threadStats->snapshots);
+		stats->snapshotNanoseconds +=
+			statsRead(threadStats->snapshotNanoseconds);
+		if (statsRead(threadStats->snapshotMaxNanoseconds) >
+			stats->snapshotMaxNanoseconds) {
+			stats->snapshotMaxNanoseconds =
+				statsRead(threadStats->snapshotMaxNanoseconds);
+		}
+	}
+	pthread_mutex_unlock(&crate->statsLock);
+
+	if (crate->pool != NULL) {
+		pthread_mutex_lock(&crate->pool->lock);
+		stats->poolResidentBytes = crate->pool->resident * poolPageSize;
+		stats->poolDirtyBytes = crate->pool->dirty * poolPageSize;
+		stats->poolLoads = crate->pool->loads;
+		stats->poolEvictions = crate->pool->evictions;
+		stats->poolWritebacks = crate->pool->writebacks;
+		stats->poolPinnedBytes = crate->pool->pinned * poolPageSize;
+		pthread_mutex_unlock(&crate->pool->lock);
+	}
+
 	return 0;
 }
-
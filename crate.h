@@ -14,11 +14,68 @@ typedef struct dsCrate dsCrate;
  * Optionally, creating it if it doesn't exist.
  * Optionally, setting it as the active crate.
  *
+ * A NULL 'filename' creates an anonymous crate that only lives in memory
+ * until the handle is closed. It works like any other crate and can be
+ * persisted with dsSnapshot().
+ *
  * On success, a pointer to the opened crate is returned.
  * On error, NULL is returned and errno is set appropriately.
  */
 dsCrate *dsOpen(const char *filename, int create, int active);
 
+/*
+ * Open a crate handle like dsOpen(), with more control over how.
+ *
+ * Setting 'poolBytes' caches the crate in a buffer pool of about that many
+ * bytes instead of mapping the whole file, for crates much larger than
+ * memory. Pages are read in when first touched and the least recently used
+ * ones written back and dropped once the pool is full. Pages touched only
+ * once, like by a scan, are the first to go, pages held with dsPin() never.
+ * Pointers into a pool crate work like any other, but only dsSync() and
+ * dsClose() write its changes to the file. Requires userfaultfd write
+ * protection (Linux 5.7 or later).
+ *
+ * Processes not allowed to handle kernel faults (vm.unprivileged_userfaultfd
+ * off and no CAP_SYS_PTRACE) fall back to handling faults from user space
+ * only. System calls handed a pointer into such a pool, like read() or
+ * write(), then fail with EFAULT when they touch a page that isn't resident,
+ * or write to one that isn't dirty yet. Copy through a buffer of your own
+ * instead; regions held with dsPin() can be passed to calls that only read
+ * them.
+ *
+ * Setting 'checksums' keeps checksums of objects passed to dsMarkDirty().
+ */
+typedef struct dsOpenOptions {
+	int create;
+	int active;
+	uint64_t poolBytes;
+	int checksums;
+} dsOpenOptions;
+
+dsCrate *dsOpenWith(const char *filename, const dsOpenOptions *options);
+
+/*
+ * Share a crate with other processes. dsExportFd() returns a new descriptor
+ * for the crate's file, anonymous crates included, to be handed to another
+ * process by fork() or over a Unix socket. There, dsOpenFd() opens a handle
+ * mapping the same pages, so changes made through one handle are seen by all
+ * of them. The caller still owns 'fd' and may close it once the crate is
+ * open.
+ *
+ * Allocations and frees are serialized between processes with the file lock.
+ * Anything else, like the contents of data structures, needs its own locking
+ * as it would between threads. Read sections from dsEpochEnter() only cover
+ * the threads of one process, shared crates can't be compacted and they
+ * can't use a buffer pool. Unfinished transactions are only rolled back by
+ * a later dsOpen() of the file.
+ *
+ * On success, dsOpenFd() returns a pointer to the opened crate and
+ * dsExportFd() a file descriptor.
+ * On error, NULL or -1 is returned and errno is set appropriately.
+ */
+dsCrate *dsOpenFd(int fd, int active);
+int dsExportFd(dsCrate *crate);
+
 /*
  * Close and free a previously opened crate handle.
  * If the crate being closed is also the active crate, the
@@ -35,6 +92,13 @@ void dsClose(dsCrate **crate);
  */
 int dsSet(dsCrate *crate);
 
+/*
+ * Get the active crate.
+ *
+ * On success, the active crate is returned, NULL if none is set.
+ */
+dsCrate *dsGet();
+
 /*
  * Allocate a new region of 'length' bytes in the active crate.
  *
@@ -43,6 +107,33 @@ int dsSet(dsCrate *crate);
  */
 void *dsAlloc(uint64_t length);
 
+/*
+ * Allocate like dsAlloc(), with the region aligned to 'alignment' bytes.
+ * 'alignment' must be a power of two up to 2 MiB, like a cache line, a page
+ * or a huge page. The crate is always mapped on a 2 MiB boundary, so regions
+ * stay aligned when it is opened again. Space skipped in front of a region
+ * is kept free for other allocations. dsCompact() doesn't preserve the
+ * alignment of regions it moves.
+ *
+ * On success, a pointer to the newly allocated region is returned.
+ * On error, NULL is returned and errno is set appropriately.
+ */
+void *dsAllocAligned(uint64_t length, uint64_t alignment);
+
+/*
+ * Change the size of the region pointed to by 'address' in the active crate
+ * to 'length' bytes, keeping its contents up to the smaller of the two sizes.
+ * Shrinking gives the end back and growing takes over free space right after
+ * the region, only when there isn't enough is it moved. Inside a transaction
+ * the region is always moved. A NULL 'address' works like dsAlloc().
+ *
+ * On success, a pointer to the resized region is returned, which is
+ * 'address' unless it moved.
+ * On error, NULL is returned, 'address' is left alone and errno is set
+ * appropriately.
+ */
+void *dsRealloc(void *address, uint64_t length);
+
 /*
  * Free a previously allocated region pointed to by 'address' in the
  * active crate.
@@ -52,10 +143,94 @@ void *dsAlloc(uint64_t length);
  */
 int dsFree(void *address);
 
+/*
+ * Keep the pages under the 'length' bytes at 'address' in the active crate's
+ * buffer pool, loading them now if they aren't. Pinned pages are never
+ * evicted, even when that takes the pool past its capacity, until dsUnpin()
+ * was called on them as often as dsPin(). Pins hold pages, not objects, so
+ * an object dsCompact() moves leaves them behind. Both do nothing for mapped
+ * crates.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set appropriately, to EINVAL when
+ * unpinning a page that isn't pinned.
+ */
+int dsPin(void *address, uint64_t length);
+int dsUnpin(void *address, uint64_t length);
+
+/*
+ * Checksum the object pointed to by 'address' in the active crate, to catch
+ * torn writes and bit rot in the file. Objects are checksummed by the next
+ * dsSync() or dsCommit() after they were marked, only the ones marked since
+ * the last sync are read, so it is cheap enough to leave on. Mark an object
+ * again after every change, it is reported as corrupt otherwise. Objects
+ * never marked don't have a checksum. Marking does nothing unless the crate
+ * was opened with the 'checksums' option.
+ *
+ * dsVerify() checks one object's checksum, for instance when it is first
+ * read after the crate is opened, and fails with EBADMSG if it doesn't
+ * match. dsScrub() checks every object in parallel on up to 'threads'
+ * threads, zero means one per online CPU. It holds off allocations until it
+ * is done and logs the offset of every mismatch.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+typedef struct dsScrubReport {
+	uint64_t objects;
+	uint64_t checksums;
+	uint64_t badChecksums;
+} dsScrubReport;
+
+int dsMarkDirty(void *address);
+int dsVerify(void *address);
+int dsScrub(dsScrubReport *report, int threads);
+
+/*
+ * Transactions group changes to the active crate so either all or none of
+ * them survive a crash. Call dsTxAdd() on every range before changing it,
+ * dsAlloc() and dsFree() inside a transaction are included automatically.
+ * Outside of a transaction dsTxAdd() does nothing, so data structures can
+ * call it unconditionally. Each thread can have one transaction at a time.
+ *
+ * dsCommit() returns once the changes are on disk, dsAbort() puts back what
+ * the transaction changed. Transactions that were in progress when the
+ * process died are rolled back by the next dsOpen(). Threads committing at
+ * the same time share syncs, as do threads calling dsSync(1).
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsBegin();
+int dsTxAdd(void *address, uint64_t length);
+int dsCommit();
+int dsAbort();
+
+/*
+ * Mark the calling thread as reading the active crate. Objects freed by any
+ * thread aren't reused until every thread that was reading at the time has
+ * called dsEpochExit(), so pointers found inside a read section, like list
+ * entries, stay valid until it ends. Read sections may nest and should be
+ * short, freed space builds up while they are open. Entering one waits for
+ * a dsCompact() slice or dsCollect() that is already running.
+ *
+ * Once any thread has entered a read section, dsFree() only retires objects
+ * and they are reclaimed by later calls. Retired objects that haven't been
+ * reclaimed when the process dies stay allocated in the file.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsEpochEnter();
+int dsEpochExit();
+
 /*
  * Set a region of the crate as the index. The index is used to
  * know what is inside a crate when it is loaded.
  *
+ * Earlier versions returned -1 even when the index was set, callers that
+ * worked around that by ignoring the result can now check it.
+ *
  * On success, 0 is returned.
  * On error, -1 is returned and errno is set appropriately.
  */
@@ -69,6 +244,30 @@ int dsSetIndex(void *address, uint64_t length);
  */
 void *dsGetIndex();
 
+/*
+ * Name a region of the active crate as a root, so it can be found again
+ * when the crate is opened. Unlike the index there can be any number of
+ * roots, for instance one per subsystem sharing a crate, and each is found by
+ * hashing its name. Names are up to DS_ROOT_NAME_MAX - 1 characters. Setting
+ * a name again replaces its root, a NULL 'address' removes it.
+ *
+ * Root offsets are rewritten when dsCompact() moves them, and the roots are
+ * kept by dsExport() and dsImport(). Crates created by older versions of the
+ * library don't have named roots.
+ *
+ * dsGetRoot() doesn't take the allocator lock unless the crate is shared with
+ * other processes or the table keeps changing under it, so threads looking
+ * roots up don't hold up each other or the allocator.
+ *
+ * On success, dsSetRoot() returns 0 and dsGetRoot() a pointer to the root,
+ * along with its length if 'length' isn't NULL.
+ * On error, -1 or NULL is returned and errno is set appropriately, to ENOENT
+ * when there is no root called 'name'.
+ */
+#define DS_ROOT_NAME_MAX 40
+int dsSetRoot(const char *name, void *address, uint64_t length);
+void *dsGetRoot(const char *name, uint64_t *length);
+
 /*
  * Save a snapshot of the active crate to a file called 'filename'.
  *
@@ -77,6 +276,23 @@ void *dsGetIndex();
  */
 int dsSnapshot(const char *filename);
 
+/*
+ * Write every live object of the active crate to 'fd' as one stream, leaving
+ * out the free space a snapshot would copy. dsImport() reads such a stream
+ * back into the active crate, usually a new one, allocating the objects next
+ * to each other and setting the index to the imported one.
+ *
+ * Imported objects get new addresses. Offsets stored in the index and in
+ * registered data structures, like dsList, are rewritten as by dsCompact(),
+ * any other offsets are not. Neither call works while a transaction is open,
+ * and other threads shouldn't change the crate during an export.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsExport(int fd);
+int dsImport(int fd);
+
 /*
  * Synchronize the active crate with its file on disk.
  * Optionally, schedule the sync but don't wait on it.
@@ -86,6 +302,101 @@ int dsSnapshot(const char *filename);
  */
 int dsSync(int block);
 
+/*
+ * Ask for everything written to the active crate so far to be synchronized
+ * in the background, without waiting on it. Syncs run on a flusher thread
+ * owned by the crate handle, which calls 'callback' with 'userPtr' and the
+ * result of the sync (zero or -1) once the data is durable. Callbacks run in
+ * the order they were requested and must not block. 'callback' may be NULL.
+ *
+ * dsSyncWait() blocks until the sync for 'ticket' has finished, and closing
+ * the crate finishes every outstanding request.
+ *
+ * On success, a positive ticket or zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+typedef void (*dsSyncCallback)(void *userPtr, int result);
+int64_t dsSyncAsync(dsSyncCallback callback, void *userPtr);
+int dsSyncWait(int64_t ticket);
+
+/*
+ * Compact the active crate by moving live objects toward the front and
+ * returning the free space gathered at the end to the file system. Each call
+ * does roughly 'budget' microseconds of work, zero means run to completion,
+ * so compaction can be spread across many calls. Between calls, an index of
+ * the offsets to rewrite is kept in memory, so a call takes about as long
+ * however large the crate is.
+ *
+ * Moved objects get new addresses. Offsets stored in the index and in
+ * registered data structures, like dsList, are rewritten. Pointers and any
+ * other offsets into the crate are not, and must be looked up again. Nothing
+ * is moved while any thread is inside dsEpochEnter() or a transaction, the
+ * call just returns 1.
+ *
+ * On success, 1 is returned if there is more to compact, otherwise zero.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsCompact(uint64_t budget);
+
+/*
+ * Statistics about the active crate.
+ *
+ * Space is reported per object group, where group 'i' holds objects of
+ * [1024^i, 1024^(i+1)) bytes including their overhead. Event counters cover
+ * every thread that used the crate handle since it was opened.
+ */
+#define DS_STATS_GROUPS 8
+#define DS_STATS_BUCKETS 32
+typedef struct dsCrateStats {
+	uint64_t liveObjects[DS_STATS_GROUPS];
+	uint64_t liveBytes[DS_STATS_GROUPS];
+	uint64_t freeObjects[DS_STATS_GROUPS];
+	uint64_t freeBytes[DS_STATS_GROUPS];
+
+	/*
+	 * The largest length dsAlloc() can currently satisfy.
+	 */
+	uint64_t largestFree;
+
+	uint64_t allocations;
+	uint64_t allocationFailures;
+	uint64_t frees;
+	uint64_t splits;
+	uint64_t merges;
+
+	/*
+	 * Bucket 'i' counts allocations that took [2^i, 2^(i+1)) nanoseconds,
+	 * the last bucket counts everything slower.
+	 */
+	uint64_t allocationLatency[DS_STATS_BUCKETS];
+
+	uint64_t syncs;
+	uint64_t syncNanoseconds;
+	uint64_t syncMaxNanoseconds;
+	uint64_t snapshots;
+	uint64_t snapshotNanoseconds;
+	uint64_t snapshotMaxNanoseconds;
+
+	/*
+	 * Buffer pool activity, all zero for mapped crates.
+	 */
+	uint64_t poolResidentBytes;
+	uint64_t poolDirtyBytes;
+	uint64_t poolLoads;
+	uint64_t poolEvictions;
+	uint64_t poolWritebacks;
+	uint64_t poolPinnedBytes;
+} dsCrateStats;
+
+/*
+ * Fill 'stats' with the active crate's statistics. The first call counts the
+ * space used by every object, later calls are cheap.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsStats(dsCrateStats *stats);
+
 /*
  * The library will call 'callback' each time it wants to print a log message.
  * The callback may be set to NULL to never print library log messages. If a
@@ -103,6 +414,25 @@ int dsSync(int block);
 typedef void (*dsLogCallback)(void *userPtr, const char *format, va_list args);
 int dsLogger(dsLogCallback callback, void *userPtr);
 
+/*
+ * Log asynchronously instead. Messages are formatted on the logging thread
+ * into a buffer of its own and passed to 'callback' by a background thread,
+ * in the order each thread logged them, so logging never waits on the
+ * callback or on other threads. Messages up to 511 bytes are kept whole.
+ * When a thread logs faster than the callback keeps up and its buffer fills,
+ * further messages are dropped and counted in a later message.
+ *
+ * dsLogFlush() waits until everything logged so far has been passed on.
+ * Calling dsLogger() or dsLoggerAsync() again passes on what is left and
+ * stops the background thread.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately. The previous
+ * callback keeps getting messages, called directly if it was asynchronous.
+ */
+int dsLoggerAsync(dsLogCallback callback, void *userPtr);
+int dsLogFlush();
+
 /*
  * Simple logger functions provided by the library.
  */
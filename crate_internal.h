@@ -1,21 +1,53 @@
 #ifndef CRATE_CRATE_INTERNAL_H_
 #define CRATE_CRATE_INTERNAL_H_
 
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "crate.h"
+
 /*
  * NOTICE: This header file should only be needed if you are implementing your
  * own data structures on top of the dsCrate API.
  */
 
+/*
+ * Magic numbers are spelled as 8 byte strings. The copy keeps the load
+ * aligned, string literals needn't be, and compiles to a constant.
+ */
+static inline uint64_t
+dsMagic(const char *name)
+{
+	uint64_t magic;
+
+	memcpy(&magic, name, sizeof(magic));
+
+	return magic;
+}
+
 /*
  * Structures used internally by the dsCrate interface.
  */
-#define MAGIC_LIB_SUPER     *(uint64_t *)"objSuper"
+#define MAGIC_LIB_SUPER     dsMagic("objSuper")
+#define MAGIC_LIB_UNDO      dsMagic("objUndo")
+#define MAGIC_LIB_EXPORT    dsMagic("objExprt")
+#define MAGIC_LIB_ROOTS     dsMagic("objRoots")
 
 /*
  * Structures built on top of the dsCrate interface.
  */
-#define MAGIC_LIST       *(uint64_t *)"listObj"
-#define MAGIC_LISTENTRY  *(uint64_t *)"listEnty"
+#define MAGIC_LIST             dsMagic("listObj")
+#define MAGIC_LIST_CONCURRENT  dsMagic("listConc")
+#define MAGIC_LISTENTRY        dsMagic("listEnty")
+#define MAGIC_LISTENTRY_DEAD   dsMagic("listDead")
+#define MAGIC_BLOBSTORE        dsMagic("blobStor")
+#define MAGIC_BLOBBUCKETS      dsMagic("blobBkts")
+#define MAGIC_BLOB             dsMagic("blobData")
+#define MAGIC_VECTOR           dsMagic("vectorOb")
+#define MAGIC_HEAP             dsMagic("heapObjt")
+#define MAGIC_HEAPHANDLES      dsMagic("heapHdls")
+#define MAGIC_RING             dsMagic("ringLog")
 
 /*
  * Given an offset and length within the 'active' crate file, return a pointer
@@ -29,6 +61,99 @@ void *dsPtr(uint64_t offset, uint64_t length);
  */
 uint64_t dsOffset(void *address);
 
+/*
+ * Where a crate is mapped. It is the first member of every dsCrate, so
+ * offsets can be turned into pointers inline.
+ */
+typedef struct dsMapping {
+	void *ptr;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t reserved;
+	struct dsMapping *next;
+
+	/*
+	 * Clear when every offset must go through the library, like for crates
+	 * cached by a buffer pool or shared with other processes.
+	 */
+	int direct;
+} dsMapping;
+
+/*
+ * Like dsPtr() and dsOffset(), for an explicit crate handle and without a
+ * call in the common case. The bounds checks are left out of builds with
+ * NDEBUG defined, handing out pointers to anything within the mapping. A
+ * NULL crate is refused either way.
+ */
+void *dsCratePtrSlow(dsCrate *crate, uint64_t offset, uint64_t length);
+uint64_t dsCrateOffsetSlow(dsCrate *crate, void *address);
+
+static inline void *
+dsCratePtr(dsCrate *crate, uint64_t offset, uint64_t length)
+{
+	dsMapping *map = (dsMapping *)crate;
+
+	if ((crate == NULL) || !map->direct) {
+		return dsCratePtrSlow(crate, offset, length);
+	}
+#ifndef NDEBUG
+	if ((offset < map->offset) ||
+		(offset + length > map->offset +
+			__atomic_load_n(&map->length, __ATOMIC_ACQUIRE))) {
+		return dsCratePtrSlow(crate, offset, length);
+	}
+#endif
+
+	return (uint8_t *)map->ptr + offset;
+}
+
+static inline uint64_t
+dsCrateOffset(dsCrate *crate, void *address)
+{
+	dsMapping *map = (dsMapping *)crate;
+
+	if (crate == NULL) {
+		return dsCrateOffsetSlow(crate, address);
+	}
+#ifndef NDEBUG
+	if ((uint8_t *)address < (uint8_t *)map->ptr) {
+		return dsCrateOffsetSlow(crate, address);
+	}
+#endif
+
+	return (uint8_t *)address - (uint8_t *)map->ptr;
+}
+
+/*
+ * Return the address the 'active' crate is mapped at. It doesn't change while
+ * the crate is open, so offsets can be turned into pointers without a call
+ * for each one.
+ */
+void *dsBase();
+
+/*
+ * Data structures register a trace callback for the magic their objects start
+ * with. The callback must call 'visit' with the address of every offset the
+ * object holds, so the library can follow them and rewrite them when objects
+ * move. Offsets are changed only after passing them to dsTxAdd(), which
+ * does so even outside of transactions, or dsNoteReferences().
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+typedef void (*dsVisitCallback)(void *arg, uint64_t *offset);
+typedef void (*dsTraceCallback)(void *object, uint64_t length,
+								dsVisitCallback visit, void *arg);
+int dsRegisterType(uint64_t magic, dsTraceCallback trace);
+
+/*
+ * Let dsCompact() know the offsets in 'length' bytes at 'address' are about
+ * to change, for updates that aren't worth an undo record, like initializing
+ * a new object or a compare-and-swap. Slices between which offsets change
+ * unannounced can rewrite stale ones.
+ */
+void dsNoteReferences(void *address, uint64_t length);
+
 /*
  * Call the global log callback set by dsLogger().
  */
@@ -41,4 +166,66 @@ void dsRunLogCallback(const char *fmt, ...);
  */
 int dsDebugDump();
 
+/*
+ * Validate every object header, trailer, checksum and free group link of the
+ * 'active' crate using up to 'threads' threads (zero means one per online CPU).
+ * Optionally, repair what was found, rebuilding the free groups from scratch
+ * when any of them are corrupt. Objects at unaligned offsets, which older
+ * versions left behind, are counted but aren't errors.
+ *
+ * The header chain is walked by the calling thread alone, since each header
+ * is only found through the length in the one before it. The threads share
+ * the checks that follow the walk, so the walk bounds how fast large crates
+ * are checked.
+ *
+ * On success, zero is returned and 'report' describes what was found.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+typedef struct dsCheckReport {
+	uint64_t objects;
+	uint64_t freeObjects;
+	uint64_t freeBytes;
+
+	uint64_t badHeaders;
+	uint64_t badTrailers;
+	uint64_t badLastObjects;
+	uint64_t badGroups;
+	uint64_t lostBytes;
+	uint64_t misalignedObjects;
+
+	uint64_t checksums;
+	uint64_t badChecksums;
+
+	uint64_t repairs;
+} dsCheckReport;
+
+int dsCheck(dsCheckReport *report, int threads, int repair);
+
+/*
+ * Free every object of the 'active' crate that can't be reached from the
+ * index or a named root, marking with up to 'threads' threads (zero means one per online
+ * CPU). Offsets are followed through the trace callbacks of registered types,
+ * objects of any other type are scanned for anything that looks like an
+ * offset into an allocated object and never freed by mistake.
+ *
+ * Objects only referenced by pointers, like ones just allocated and not yet
+ * stored anywhere, are freed too. Collect when nothing like that is held, for
+ * instance right after dsOpen(). It fails with EBUSY while any thread is
+ * inside dsEpochEnter() or a transaction, and shared crates can't be
+ * collected.
+ *
+ * On success, zero is returned and 'report' describes what was found.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+typedef struct dsCollectReport {
+	uint64_t objects;
+	uint64_t liveObjects;
+	uint64_t liveBytes;
+
+	uint64_t freedObjects;
+	uint64_t freedBytes;
+} dsCollectReport;
+
+int dsCollect(dsCollectReport *report, int threads);
+
 #endif
@@ -0,0 +1,654 @@
+#define _GNU_SOURCE
+
+#include "heap.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "crate.h"
+#include "crate_internal.h"
+
+#define heapMinCapacity 16
+#define heapLineSize 64
+
+/*
+ * Items are stored dsHeapArity - 1 slots in, which puts the children of every
+ * item, dsHeapArity * position + 1 and up, at the start of a cache line.
+ */
+#define heapSlot(position) ((position) + dsHeapArity - 1)
+#define heapParent(position) (((position) - 1) / dsHeapArity)
+#define heapChild(position) ((position) * dsHeapArity + 1)
+
+/*
+ * A free handle has no position and keeps the next free handle in place of
+ * its data offset.
+ */
+#define heapFreeHandle UINT64_MAX
+
+typedef struct heapView {
+	dsHeapItem *items;
+	dsHeapHandles *handles;
+} heapView;
+
+static void
+traceHeap(void *object, uint64_t length, dsVisitCallback visit, void *arg)
+{
+	dsHeap *heap = object;
+
+	visit(arg, &heap->itemsOffset);
+	visit(arg, &heap->handlesOffset);
+}
+
+static void
+traceHeapHandles(void *object, uint64_t length, dsVisitCallback visit,
+				 void *arg)
+{
+	dsHeapHandles *handles = object;
+	uint64_t i;
+
+	for (i = 0; i < handles->used; i++) {
+		if (handles->handles[i].position != heapFreeHandle) {
+			visit(arg, &handles->handles[i].dataOffset);
+		}
+	}
+}
+
+/*
+ * Let the crate follow heap offsets, e.g. when compacting.
+ */
+static void __attribute__((constructor))
+registerHeap()
+{
+	dsRegisterType(MAGIC_HEAP, traceHeap);
+	dsRegisterType(MAGIC_HEAPHANDLES, traceHeapHandles);
+}
+
+static int
+checkHeap(dsHeap *heap)
+{
+	if ((heap == NULL) || (heap->magic != MAGIC_HEAP)) {
+		dsLog("Bad argument: %p\n", heap);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	return(0);
+}
+
+static dsHeapItem *
+heapItems(dsHeap *heap)
+{
+	dsHeapItem *items;
+
+	if ((items = dsCratePtr(dsGet(), heap->itemsOffset,
+							heapSlot(heap->capacity) * sizeof(*items))) == NULL) {
+		dsLog("Can't map heap items.\n");
+		return(NULL);
+	}
+
+	return(items);
+}
+
+static dsHeapHandles *
+heapHandles(dsHeap *heap)
+{
+	dsHeapHandles *handles;
+
+	if (((handles = dsCratePtr(dsGet(), heap->handlesOffset,
+							   sizeof(*handles))) == NULL) ||
+		((handles = dsCratePtr(dsGet(), heap->handlesOffset,
+							   sizeof(*handles) + handles->capacity *
+							   sizeof(handles->handles[0]))) == NULL)) {
+		dsLog("Can't map heap handles.\n");
+		return(NULL);
+	}
+
+	return(handles);
+}
+
+static int
+viewHeap(dsHeap *heap, heapView *view)
+{
+	if (((view->items = heapItems(heap)) == NULL) ||
+		((view->handles = heapHandles(heap)) == NULL)) {
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+ * Make room for at least 'capacity' items. The items are kept cache line
+ * aligned, which dsRealloc() doesn't promise, so they are copied to a new
+ * array instead.
+ */
+static int
+reserveItems(dsHeap *heap, uint64_t capacity)
+{
+	dsHeapItem *items, *old = NULL;
+
+	if (capacity <= heap->capacity) {
+		return(0);
+	}
+
+	if ((heap->itemsOffset != UINT64_MAX) &&
+		((old = heapItems(heap)) == NULL)) {
+		return(-1);
+	}
+
+	if ((items = dsAllocAligned(heapSlot(capacity) * sizeof(*items),
+								heapLineSize)) == NULL) {
+		dsLog("Can't grow heap items.\n");
+		return(-1);
+	}
+	memset(items, 0, heapSlot(0) * sizeof(*items));
+	if (old != NULL) {
+		memcpy(items + heapSlot(0), old + heapSlot(0),
+			   heap->count * sizeof(*items));
+	}
+
+	if (dsTxAdd(heap, sizeof(*heap)) < 0) {
+		dsLog("Can't log heap changes.\n");
+		dsFree(items);
+		return(-1);
+	}
+
+	if ((old != NULL) && (dsFree(old) < 0)) {
+		dsLog("Can't free old heap items.\n");
+		dsFree(items);
+		return(-1);
+	}
+
+	heap->itemsOffset = dsOffset(items);
+	heap->capacity = capacity;
+
+	return(0);
+}
+
+/*
+ * Make room for 'count' more handles than are in use.
+ */
+static int
+reserveHandles(dsHeap *heap, uint64_t count)
+{
+	dsHeapHandles *handles = NULL;
+	uint64_t capacity;
+
+	if (heap->handlesOffset != UINT64_MAX) {
+		if ((handles = heapHandles(heap)) == NULL) {
+			return(-1);
+		}
+		if (handles->used + count <= handles->capacity) {
+			return(0);
+		}
+		capacity = handles->capacity * 2;
+		if (capacity < handles->used + count) {
+			capacity = handles->used + count;
+		}
+	} else {
+		capacity = count < heapMinCapacity ? heapMinCapacity : count;
+	}
+
+	/*
+	 * Usually the handles can grow in place, otherwise dsRealloc() moves
+	 * them. A transaction always gets a new copy, which needs no logging.
+	 */
+	if ((handles = dsRealloc(handles, sizeof(*handles) +
+							 capacity * sizeof(handles->handles[0]))) == NULL) {
+		dsLog("Can't grow heap handles.\n");
+		return(-1);
+	}
+	if (heap->handlesOffset == UINT64_MAX) {
+		handles->magic = MAGIC_HEAPHANDLES;
+		handles->used = 0;
+		handles->freeHandle = heapFreeHandle;
+	}
+	handles->capacity = capacity;
+
+	if (dsTxAdd(heap, sizeof(*heap)) < 0) {
+		dsLog("Can't log heap changes.\n");
+		return(-1);
+	}
+	heap->handlesOffset = dsOffset(handles);
+
+	return(0);
+}
+
+/*
+ * Take a free handle, there must be room for it.
+ */
+static uint64_t
+takeHandle(dsHeapHandles *handles)
+{
+	uint64_t handle;
+
+	if (dsTxAdd(handles, sizeof(*handles)) < 0) {
+		dsLog("Can't log heap handles.\n");
+		return(UINT64_MAX);
+	}
+
+	if (handles->freeHandle != heapFreeHandle) {
+		handle = handles->freeHandle;
+		if (dsTxAdd(&handles->handles[handle],
+					sizeof(handles->handles[0])) < 0) {
+			dsLog("Can't log heap handle.\n");
+			return(UINT64_MAX);
+		}
+		handles->freeHandle = handles->handles[handle].dataOffset;
+	} else {
+		handle = handles->used++;
+	}
+
+	return(handle);
+}
+
+static int
+releaseHandle(dsHeapHandles *handles, uint64_t handle)
+{
+	if ((dsTxAdd(handles, sizeof(*handles)) < 0) ||
+		(dsTxAdd(&handles->handles[handle],
+				 sizeof(handles->handles[0])) < 0)) {
+		dsLog("Can't log heap handles.\n");
+		return(-1);
+	}
+
+	handles->handles[handle].position = heapFreeHandle;
+	handles->handles[handle].dataOffset = handles->freeHandle;
+	handles->freeHandle = handle;
+
+	return(0);
+}
+
+/*
+ * Store 'item' at 'position' and point its handle there.
+ */
+static int
+placeItem(heapView *view, uint64_t position, dsHeapItem item)
+{
+	dsHeapItem *slot = &view->items[heapSlot(position)];
+	dsHeapHandle *handle = &view->handles->handles[item.handle];
+
+	if ((dsTxAdd(slot, sizeof(*slot)) < 0) ||
+		(dsTxAdd(&handle->position, sizeof(handle->position)) < 0)) {
+		dsLog("Can't log heap changes.\n");
+		return(-1);
+	}
+
+	*slot = item;
+	handle->position = position;
+
+	return(0);
+}
+
+/*
+ * Move 'item' from the hole at 'position' toward the root, shifting larger
+ * parents down instead of swapping.
+ */
+static int
+siftUp(heapView *view, uint64_t position, dsHeapItem item)
+{
+	dsHeapItem parent;
+
+	while (position > 0) {
+		parent = view->items[heapSlot(heapParent(position))];
+		if (parent.key <= item.key) {
+			break;
+		}
+		if (placeItem(view, position, parent) < 0) {
+			return(-1);
+		}
+		position = heapParent(position);
+	}
+
+	return(placeItem(view, position, item));
+}
+
+/*
+ * Move 'item' from the hole at 'position' toward the leaves of a heap of
+ * 'count' items, shifting the smallest child up each level.
+ */
+static int
+siftDown(heapView *view, uint64_t count, uint64_t position, dsHeapItem item)
+{
+	dsHeapItem *child;
+	uint64_t first, last, smallest, i;
+
+	while ((first = heapChild(position)) < count) {
+		last = first + dsHeapArity;
+		if (last > count) {
+			last = count;
+		}
+
+		/*
+		 * The children share one cache line.
+		 */
+		child = &view->items[heapSlot(first)];
+		smallest = 0;
+		for (i = 1; i < last - first; i++) {
+			if (child[i].key < child[smallest].key) {
+				smallest = i;
+			}
+		}
+
+		if (child[smallest].key >= item.key) {
+			break;
+		}
+		if (placeItem(view, position, child[smallest]) < 0) {
+			return(-1);
+		}
+		position = first + smallest;
+	}
+
+	return(placeItem(view, position, item));
+}
+
+int
+dsHeapInit(dsHeap *heap)
+{
+	if (heap == NULL) {
+		dsLog("Bad argument: %p\n", heap);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	dsNoteReferences(heap, sizeof(*heap));
+	heap->magic = MAGIC_HEAP;
+	heap->count = 0;
+	heap->capacity = 0;
+	heap->itemsOffset = UINT64_MAX;
+	heap->handlesOffset = UINT64_MAX;
+
+	return(0);
+}
+
+dsHeap *
+dsHeapAlloc()
+{
+	dsHeap *heap;
+
+	if ((heap = dsAlloc(sizeof(*heap))) == NULL) {
+		dsLog("Can't allocate heap object.\n");
+		return(NULL);
+	}
+
+	if (dsHeapInit(heap) < 0) {
+		dsFree(heap);
+		return(NULL);
+	}
+
+	return(heap);
+}
+
+static int
+reserveHeap(dsHeap *heap, uint64_t count)
+{
+	uint64_t capacity;
+
+	if (heap->count + count > heap->capacity) {
+		capacity = heap->capacity * 2;
+		if (capacity < heap->count + count) {
+			capacity = heap->count + count;
+		}
+		if (capacity < heapMinCapacity) {
+			capacity = heapMinCapacity;
+		}
+		if (reserveItems(heap, capacity) < 0) {
+			return(-1);
+		}
+	}
+
+	return(reserveHandles(heap, count));
+}
+
+uint64_t
+dsHeapPush(dsHeap *heap, uint64_t key, void *data)
+{
+	heapView view;
+	dsHeapItem item;
+	uint64_t dataOffset;
+
+	if (checkHeap(heap) < 0) {
+		return(UINT64_MAX);
+	}
+
+	if ((dataOffset = dsOffset(data)) == UINT64_MAX) {
+		dsLog("Bad argument: %p\n", data);
+		errno = EINVAL;
+		return(UINT64_MAX);
+	}
+
+	if ((reserveHeap(heap, 1) < 0) ||
+		(viewHeap(heap, &view) < 0)) {
+		return(UINT64_MAX);
+	}
+
+	item.key = key;
+	if ((item.handle = takeHandle(view.handles)) == UINT64_MAX) {
+		return(UINT64_MAX);
+	}
+	view.handles->handles[item.handle].dataOffset = dataOffset;
+
+	if (siftUp(&view, heap->count, item) < 0) {
+		return(UINT64_MAX);
+	}
+
+	if (dsTxAdd(heap, sizeof(*heap)) < 0) {
+		dsLog("Can't log heap changes.\n");
+		return(UINT64_MAX);
+	}
+	heap->count++;
+
+	return(item.handle);
+}
+
+int
+dsHeapPushBulk(dsHeap *heap, const uint64_t *keys, void **data,
+			   uint64_t count, uint64_t *handles)
+{
+	heapView view;
+	dsHeapItem item;
+	uint64_t total, i;
+
+	if (checkHeap(heap) < 0) {
+		return(-1);
+	}
+
+	if ((keys == NULL) || (data == NULL)) {
+		dsLog("Bad argument: %p, %p\n", keys, data);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (dsOffset(data[i]) == UINT64_MAX) {
+			dsLog("Bad argument: %p\n", data[i]);
+			errno = EINVAL;
+			return(-1);
+		}
+	}
+
+	if (count == 0) {
+		return(0);
+	}
+
+	if ((reserveHeap(heap, count) < 0) ||
+		(viewHeap(heap, &view) < 0)) {
+		return(-1);
+	}
+
+	if (dsTxAdd(&view.items[heapSlot(heap->count)],
+				count * sizeof(view.items[0])) < 0) {
+		dsLog("Can't log heap items.\n");
+		return(-1);
+	}
+
+	for (i = 0; i < count; i++) {
+		item.key = keys[i];
+		if ((item.handle = takeHandle(view.handles)) == UINT64_MAX) {
+			return(-1);
+		}
+		view.handles->handles[item.handle].dataOffset = dsOffset(data[i]);
+		if (placeItem(&view, heap->count + i, item) < 0) {
+			return(-1);
+		}
+
+		if (handles != NULL) {
+			handles[i] = item.handle;
+		}
+	}
+
+	total = heap->count + count;
+
+	/*
+	 * Rebuilding the whole heap bottom up is linear in its size, sifting
+	 * each new item up is logarithmic per item, so only rebuild when the
+	 * new items are a good share of the heap.
+	 */
+	if (count * 8 < heap->count) {
+		for (i = heap->count; i < total; i++) {
+			if (siftUp(&view, i, view.items[heapSlot(i)]) < 0) {
+				return(-1);
+			}
+		}
+	} else {
+		for (i = heapParent(total - 1) + 1; i-- > 0;) {
+			if (siftDown(&view, total, i, view.items[heapSlot(i)]) < 0) {
+				return(-1);
+			}
+		}
+	}
+
+	if (dsTxAdd(heap, sizeof(*heap)) < 0) {
+		dsLog("Can't log heap changes.\n");
+		return(-1);
+	}
+	heap->count = total;
+
+	return(0);
+}
+
+void *
+dsHeapPeek(dsHeap *heap, uint64_t *key)
+{
+	heapView view;
+	dsHeapItem *item;
+	void *data;
+
+	if (checkHeap(heap) < 0) {
+		return(NULL);
+	}
+
+	if (heap->count == 0) {
+		errno = ENOENT;
+		return(NULL);
+	}
+
+	if (viewHeap(heap, &view) < 0) {
+		return(NULL);
+	}
+
+	item = &view.items[heapSlot(0)];
+	if ((data = dsCratePtr(dsGet(),
+						   view.handles->handles[item->handle].dataOffset,
+						   1)) == NULL) {
+		dsLog("Can't map heap data.\n");
+		return(NULL);
+	}
+
+	if (key != NULL) {
+		*key = item->key;
+	}
+
+	return(data);
+}
+
+void *
+dsHeapPop(dsHeap *heap, uint64_t *key)
+{
+	heapView view;
+	dsHeapItem top;
+	void *data;
+
+	if ((data = dsHeapPeek(heap, NULL)) == NULL) {
+		return(NULL);
+	}
+
+	if (viewHeap(heap, &view) < 0) {
+		return(NULL);
+	}
+	top = view.items[heapSlot(0)];
+
+	if (dsTxAdd(heap, sizeof(*heap)) < 0) {
+		dsLog("Can't log heap changes.\n");
+		return(NULL);
+	}
+	heap->count--;
+
+	if ((heap->count > 0) &&
+		(siftDown(&view, heap->count, 0,
+				  view.items[heapSlot(heap->count)]) < 0)) {
+		return(NULL);
+	}
+
+	if (releaseHandle(view.handles, top.handle) < 0) {
+		return(NULL);
+	}
+
+	if (key != NULL) {
+		*key = top.key;
+	}
+
+	return(data);
+}
+
+int
+dsHeapDecreaseKey(dsHeap *heap, uint64_t handle, uint64_t key)
+{
+	heapView view;
+	dsHeapItem item;
+	uint64_t position;
+
+	if (checkHeap(heap) < 0) {
+		return(-1);
+	}
+
+	if (heap->count == 0) {
+		dsLog("Bad handle: %" PRIu64 "\n", handle);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if (viewHeap(heap, &view) < 0) {
+		return(-1);
+	}
+
+	if ((handle >= view.handles->used) ||
+		((position = view.handles->handles[handle].position) ==
+		 heapFreeHandle)) {
+		dsLog("Bad handle: %" PRIu64 "\n", handle);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	item = view.items[heapSlot(position)];
+	if (key > item.key) {
+		dsLog("Key %" PRIu64 " is larger than %" PRIu64 ".\n", key, item.key);
+		errno = EINVAL;
+		return(-1);
+	}
+	item.key = key;
+
+	return(siftUp(&view, position, item));
+}
+
+uint64_t
+dsHeapCount(dsHeap *heap)
+{
+	if (heap == NULL) {
+		return -1;
+	}
+
+	return heap->count;
+}
@@ -0,0 +1,118 @@
+#ifndef CRATE_HEAP_H_
+#define CRATE_HEAP_H_
+
+#include <inttypes.h>
+
+#include "crate.h"
+#include "crate_internal.h"
+
+/*
+ * A priority queue of data pointers ordered by a 64-bit key, smallest first.
+ * It is a 4-ary heap kept in an array of 16 byte items, aligned so the four
+ * children of any item share a cache line. Every item gets a handle when it
+ * is pushed, which stays the same as the item moves and can be used to
+ * lower its key.
+ */
+#define dsHeapArity 4
+
+typedef struct dsHeap {
+	uint64_t magic;
+	uint64_t count;
+	uint64_t capacity;
+	uint64_t itemsOffset;
+	uint64_t handlesOffset;
+} dsHeap;
+
+typedef struct dsHeapItem {
+	uint64_t key;
+	uint64_t handle;
+} dsHeapItem;
+
+typedef struct dsHeapHandle {
+	uint64_t position;
+	uint64_t dataOffset;
+} dsHeapHandle;
+
+typedef struct dsHeapHandles {
+	uint64_t magic;
+	uint64_t used;
+	uint64_t capacity;
+	uint64_t freeHandle;
+	dsHeapHandle handles[];
+} dsHeapHandles;
+
+/*
+ * Allocate and initialize a new, empty heap object.
+ *
+ * On success, a pointer to the new heap object is returned.
+ * On error, NULL is returned and errno is set appropriately.
+ */
+dsHeap *dsHeapAlloc();
+
+/*
+ * Initialize an already allocated heap object.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsHeapInit(dsHeap *heap);
+
+/*
+ * Add 'data' with priority 'key'.
+ *
+ * On success, the new item's handle is returned.
+ * On error, UINT64_MAX is returned and errno is set appropriately.
+ */
+uint64_t dsHeapPush(dsHeap *heap, uint64_t key, void *data);
+
+/*
+ * Add 'count' items at once, 'data[i]' with priority 'keys[i]', and restore
+ * the heap order in a single pass, which is linear instead of a sift for
+ * every item. Optionally, the handles of the new items are stored in
+ * 'handles'.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsHeapPushBulk(dsHeap *heap, const uint64_t *keys, void **data,
+				   uint64_t count, uint64_t *handles);
+
+/*
+ * Get the item with the smallest key, and optionally its key, without
+ * removing it.
+ *
+ * On success, a pointer to the item's data is returned.
+ * On error, NULL is returned and errno is set appropriately, to ENOENT if
+ * the heap is empty.
+ */
+void *dsHeapPeek(dsHeap *heap, uint64_t *key);
+
+/*
+ * Remove the item with the smallest key. Its handle may be reused by a later
+ * push.
+ *
+ * On success, a pointer to the item's data is returned and optionally its
+ * key.
+ * On error, NULL is returned and errno is set appropriately, to ENOENT if
+ * the heap is empty.
+ */
+void *dsHeapPop(dsHeap *heap, uint64_t *key);
+
+/*
+ * Lower the key of the item 'handle' to 'key'.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately, to EINVAL if
+ * 'key' is larger than the item's key.
+ */
+int dsHeapDecreaseKey(dsHeap *heap, uint64_t handle, uint64_t key);
+
+/*
+ * Get a count of how many items are in the heap.
+ *
+ * On success, the number of items is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+uint64_t dsHeapCount(dsHeap *heap);
+
+#endif
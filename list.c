@@ -8,6 +8,117 @@
 #include "crate.h"
 #include "crate_internal.h"
 
+static void
+traceList(void *object, uint64_t length, dsVisitCallback visit, void *arg)
+{
+	dsList *list = object;
+
+	visit(arg, &list->headOffset);
+}
+
+static void
+traceListEntry(void *object, uint64_t length, dsVisitCallback visit, void *arg)
+{
+	dsListEntry *entry = object;
+
+	visit(arg, &entry->prevOffset);
+	visit(arg, &entry->nextOffset);
+	visit(arg, &entry->dataOffset);
+}
+
+/*
+ * Let the crate follow list offsets, e.g. when compacting.
+ */
+static void __attribute__((constructor))
+registerList()
+{
+	dsRegisterType(MAGIC_LIST, traceList);
+	dsRegisterType(MAGIC_LIST_CONCURRENT, traceList);
+	dsRegisterType(MAGIC_LISTENTRY, traceListEntry);
+	dsRegisterType(MAGIC_LISTENTRY_DEAD, traceListEntry);
+}
+
+/*
+ * Concurrent lists.
+ *
+ * Entries are only ever pushed onto the head with a compare-and-swap, so an
+ * entry's 'nextOffset' never changes once it is visible and readers can walk
+ * the list without locks. 'prevOffset' isn't maintained. Deleting only marks
+ * an entry dead, dsListPurge() unlinks dead entries later.
+ */
+static dsListEntry *
+addConcurrent(dsList *list, dsListEntry *entry, uint64_t listEntryOffset)
+{
+	uint64_t headOffset;
+
+	dsNoteReferences(&list->headOffset, sizeof(list->headOffset));
+	headOffset = __atomic_load_n(&list->headOffset, __ATOMIC_ACQUIRE);
+	do {
+		entry->nextOffset = headOffset;
+	} while (!__atomic_compare_exchange_n(&list->headOffset, &headOffset,
+										  listEntryOffset, 1,
+										  __ATOMIC_RELEASE,
+										  __ATOMIC_ACQUIRE));
+
+	__atomic_fetch_add(&list->count, 1, __ATOMIC_RELAXED);
+
+	return(entry);
+}
+
+static int
+delConcurrent(dsList *list, uint64_t dataOffset)
+{
+	dsListEntry *entry;
+
+	for (entry = dsListBegin(list);
+		 entry != NULL;
+		 entry = dsListNext(entry)) {
+		uint64_t magic = MAGIC_LISTENTRY;
+
+		if (entry->dataOffset != dataOffset) {
+			continue;
+		}
+
+		/*
+		 * Whoever marks the entry dead deleted it.
+		 */
+		if (__atomic_compare_exchange_n(&entry->magic, &magic,
+										MAGIC_LISTENTRY_DEAD, 0,
+										__ATOMIC_RELEASE,
+										__ATOMIC_RELAXED)) {
+			__atomic_fetch_sub(&list->count, 1, __ATOMIC_RELAXED);
+			return(0);
+		}
+	}
+
+	return(1);
+}
+
+/*
+ * Skip past entries that were deleted from a concurrent list.
+ */
+static dsListEntry *
+skipDead(dsListEntry *entry)
+{
+	while ((entry != NULL) &&
+		   (__atomic_load_n(&entry->magic, __ATOMIC_ACQUIRE) ==
+			MAGIC_LISTENTRY_DEAD)) {
+		uint64_t nextOffset;
+
+		nextOffset = __atomic_load_n(&entry->nextOffset, __ATOMIC_ACQUIRE);
+		if (nextOffset == UINT64_MAX) {
+			return(NULL);
+		}
+		if ((entry = dsCratePtr(dsGet(), nextOffset,
+								sizeof(*entry))) == NULL) {
+			dsLog("Can't map next list entry.\n");
+			return(NULL);
+		}
+	}
+
+	return(entry);
+}
+
 dsListEntry *
 dsListAdd(dsList *list, void *data)
 {
@@ -32,6 +143,13 @@ dsListAdd(dsList *list, void *data)
 	dsLog("listEntryOffset: %" PRIu64 ", dataOffset: %" PRIu64 "\n",\
 		  listEntryOffset, dataOffset);
 
+	if (list->magic == MAGIC_LIST_CONCURRENT) {
+		entry->magic = MAGIC_LISTENTRY;
+		entry->dataOffset = dataOffset;
+		entry->prevOffset = UINT64_MAX;
+		return(addConcurrent(list, entry, listEntryOffset));
+	}
+
 	/*
 	 * Found the entry to remove.
 	 */
@@ -46,6 +164,15 @@ dsListAdd(dsList *list, void *data)
 		}
 	}
 
+	if ((dsTxAdd(list, sizeof(*list)) < 0) ||
+		((next != NULL) && (dsTxAdd(next, sizeof(*next)) < 0))) {
+		dsLog("Can't log list changes.\n");
+		if (dsFree(entry) < 0) {
+			dsLog("Can't free list entry object.\n");
+		}
+		return(NULL);
+	}
+
 	entry->magic = MAGIC_LISTENTRY;
 	entry->dataOffset = dataOffset;
 	entry->prevOffset = UINT64_MAX;
@@ -63,34 +190,125 @@ dsListEntry *
 dsListBegin(dsList *list)
 {
 	dsListEntry *entry;
+	uint64_t headOffset;
 
-	if (list->headOffset == UINT64_MAX) {
+	headOffset = __atomic_load_n(&list->headOffset, __ATOMIC_ACQUIRE);
+	if (headOffset == UINT64_MAX) {
 		return(NULL);
 	}
 
-	if ((entry = dsPtr(list->headOffset, sizeof(*entry))) == NULL) {
+	if ((entry = dsCratePtr(dsGet(), headOffset, sizeof(*entry))) == NULL) {
 		dsLog("Can't map list head.\n");
 		return(NULL);
 	}
 
-	return(entry);
+	return(skipDead(entry));
 }
 
 dsListEntry *
 dsListNext(dsListEntry *entry)
 {
-	if (entry->nextOffset == UINT64_MAX) {
+	uint64_t nextOffset;
+
+	nextOffset = __atomic_load_n(&entry->nextOffset, __ATOMIC_ACQUIRE);
+	if (nextOffset == UINT64_MAX) {
 		return(NULL);
 	}
 
-	dsLog("next: %" PRIu64 "\n", entry->nextOffset);
-
-	if ((entry = dsPtr(entry->nextOffset, sizeof(*entry))) == NULL) {
+	if ((entry = dsCratePtr(dsGet(), nextOffset, sizeof(*entry))) == NULL) {
 		dsLog("Can't map next list entry.\n");
 		return(NULL);
 	}
 
-	return(entry);
+	return(skipDead(entry));
+}
+
+/*
+ * Fast iteration.
+ *
+ * 'lead' runs dsListLookahead entries in front of 'entry'. Each step reads
+ * the lead entry, prefetched the step before, and prefetches the one after
+ * it along with the lead's data.
+ */
+static dsListEntry *
+iterEntry(dsListIter *iter, uint64_t offset)
+{
+	if (offset == UINT64_MAX) {
+		return(NULL);
+	}
+
+	return((dsListEntry *)(iter->base + offset));
+}
+
+static void
+iterAdvanceLead(dsListIter *iter)
+{
+	dsListEntry *lead;
+
+	if (iter->lead == NULL) {
+		return;
+	}
+
+	lead = iterEntry(iter, __atomic_load_n(&iter->lead->nextOffset,
+										   __ATOMIC_ACQUIRE));
+	__builtin_prefetch(iter->base + iter->lead->dataOffset);
+	if (lead != NULL) {
+		__builtin_prefetch(lead);
+	}
+	iter->lead = lead;
+}
+
+static dsListEntry *
+iterSkipDead(dsListIter *iter)
+{
+	while ((iter->entry != NULL) &&
+		   (__atomic_load_n(&iter->entry->magic, __ATOMIC_ACQUIRE) ==
+			MAGIC_LISTENTRY_DEAD)) {
+		iter->entry = iterEntry(iter, __atomic_load_n(
+			&iter->entry->nextOffset, __ATOMIC_ACQUIRE));
+		iterAdvanceLead(iter);
+	}
+
+	return(iter->entry);
+}
+
+dsListEntry *
+dsListIterBegin(dsListIter *iter, dsList *list)
+{
+	int i;
+
+	if ((iter == NULL) || (list == NULL)) {
+		dsLog("Bad argument: %p, %p\n", iter, list);
+		return(NULL);
+	}
+
+	if ((iter->base = dsBase()) == NULL) {
+		dsLog("Can't get crate base.\n");
+		return(NULL);
+	}
+
+	iter->entry = iterEntry(iter, __atomic_load_n(&list->headOffset,
+												  __ATOMIC_ACQUIRE));
+	iter->lead = iter->entry;
+	for (i = 0; (i < dsListLookahead) && (iter->lead != NULL); i++) {
+		iterAdvanceLead(iter);
+	}
+
+	return(iterSkipDead(iter));
+}
+
+dsListEntry *
+dsListIterNext(dsListIter *iter)
+{
+	if (iter->entry == NULL) {
+		return(NULL);
+	}
+
+	iter->entry = iterEntry(iter, __atomic_load_n(&iter->entry->nextOffset,
+												  __ATOMIC_ACQUIRE));
+	iterAdvanceLead(iter);
+
+	return(iterSkipDead(iter));
 }
 
 void *
@@ -98,7 +316,8 @@ dsListData(dsListEntry *entry)
 {
 	void *data;
 
-	if ((data = dsPtr(entry->dataOffset, sizeof(*entry))) == NULL) {
+	if ((data = dsCratePtr(dsGet(), entry->dataOffset,
+						   sizeof(*entry))) == NULL) {
 		dsLog("Can't map list data.\n");
 		return(NULL);
 	}
@@ -113,6 +332,7 @@ dsListInit(dsList *list)
 		return -1;
 	}
 
+	dsNoteReferences(list, sizeof(*list));
 	list->magic = MAGIC_LIST;
 	list->count = 0;
 	list->headOffset = UINT64_MAX;
@@ -120,6 +340,18 @@ dsListInit(dsList *list)
 	return 0;
 }
 
+int
+dsListInitConcurrent(dsList *list)
+{
+	if (dsListInit(list) < 0) {
+		return -1;
+	}
+
+	list->magic = MAGIC_LIST_CONCURRENT;
+
+	return 0;
+}
+
 dsList *
 dsListAlloc()
 {
@@ -134,6 +366,20 @@ dsListAlloc()
 	return list;
 }
 
+dsList *
+dsListAllocConcurrent()
+{
+	dsList *list = NULL;
+
+	if ((list = dsAlloc(sizeof(*list))) == NULL) {
+		return NULL;
+	}
+
+	dsListInitConcurrent(list);
+
+	return list;
+}
+
 uint64_t
 dsListCount(dsList *list)
 {
@@ -141,7 +387,7 @@ dsListCount(dsList *list)
 		return -1;
 	}
 
-	return list->count;
+	return __atomic_load_n(&list->count, __ATOMIC_RELAXED);
 }
 
 int
@@ -153,6 +399,10 @@ dsListDel(dsList *list, void *data)
 
 	dataOffset = dsOffset(data);
 
+	if (list->magic == MAGIC_LIST_CONCURRENT) {
+		return(delConcurrent(list, dataOffset));
+	}
+
 	for (entry = dsListBegin(list);
 		 entry != NULL;
 		 entry = dsListNext(entry)) {
@@ -179,6 +429,13 @@ dsListDel(dsList *list, void *data)
 				}
 			}
 
+			if ((dsTxAdd(list, sizeof(*list)) < 0) ||
+				((prev != NULL) && (dsTxAdd(prev, sizeof(*prev)) < 0)) ||
+				((next != NULL) && (dsTxAdd(next, sizeof(*next)) < 0))) {
+				dsLog("Can't log list changes.\n");
+				return(-1);
+			}
+
 			/*
 			 * Unlink after mapping all neighbors.
 			 */
@@ -211,6 +468,78 @@ dsListDel(dsList *list, void *data)
 	return(1);
 }
 
+int
+dsListPurge(dsList *list)
+{
+	dsListEntry *entry;
+	dsListEntry *prev = NULL;
+	uint64_t entryOffset;
+
+	if ((list == NULL) || (list->magic != MAGIC_LIST_CONCURRENT)) {
+		dsLog("Bad argument: %p\n", list);
+		return(-1);
+	}
+
+	entryOffset = __atomic_load_n(&list->headOffset, __ATOMIC_ACQUIRE);
+	while (entryOffset != UINT64_MAX) {
+		uint64_t nextOffset;
+
+		if ((entry = dsPtr(entryOffset, sizeof(*entry))) == NULL) {
+			dsLog("Can't map list entry.\n");
+			return(-1);
+		}
+		nextOffset = entry->nextOffset;
+
+		if (__atomic_load_n(&entry->magic, __ATOMIC_ACQUIRE) !=
+			MAGIC_LISTENTRY_DEAD) {
+			prev = entry;
+			entryOffset = nextOffset;
+			continue;
+		}
+
+		if (prev != NULL) {
+			/*
+			 * Only the head is contended by dsListAdd().
+			 */
+			dsNoteReferences(&prev->nextOffset, sizeof(prev->nextOffset));
+			__atomic_store_n(&prev->nextOffset, nextOffset, __ATOMIC_RELEASE);
+		} else {
+			uint64_t headOffset = entryOffset;
+
+			dsNoteReferences(&list->headOffset, sizeof(list->headOffset));
+			if (!__atomic_compare_exchange_n(&list->headOffset, &headOffset,
+											 nextOffset, 0,
+											 __ATOMIC_RELEASE,
+											 __ATOMIC_ACQUIRE)) {
+				/*
+				 * New entries were pushed in front, find the one that
+				 * points here now.
+				 */
+				prev = dsPtr(headOffset, sizeof(*prev));
+				while ((prev != NULL) && (prev->nextOffset != entryOffset)) {
+					prev = dsPtr(prev->nextOffset, sizeof(*prev));
+				}
+				if (prev == NULL) {
+					dsLog("Can't find dead list entry.\n");
+					return(-1);
+				}
+				dsNoteReferences(&prev->nextOffset, sizeof(prev->nextOffset));
+				__atomic_store_n(&prev->nextOffset, nextOffset,
+								 __ATOMIC_RELEASE);
+			}
+		}
+
+		if (dsFree(entry) < 0) {
+			dsLog("Can't free list entry object.\n");
+			return(-1);
+		}
+
+		entryOffset = nextOffset;
+	}
+
+	return(0);
+}
+
 #if 0
 static inline int
 unlinkFromLinkeddsList(dsCrate *crate, void *object,
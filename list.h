@@ -33,6 +33,33 @@ dsList *dsListAlloc();
  */
 int dsListInit(dsList *list);
 
+/*
+ * Allocate or initialize a concurrent list. Any number of threads may add,
+ * delete and iterate a concurrent list at the same time without locks.
+ *
+ * New entries are always added to the head and entries are never relinked,
+ * so iteration sees every entry that was added before it started. Deleting
+ * an entry only marks it dead, iteration skips dead entries and
+ * dsListPurge() reclaims them. Iterate inside dsEpochEnter() and
+ * dsEpochExit() if entries may be purged at the same time.
+ *
+ * On success, a pointer to the new list object or zero is returned.
+ * On error, NULL or -1 is returned and errno is set appropriately.
+ */
+dsList *dsListAllocConcurrent();
+int dsListInitConcurrent(dsList *list);
+
+/*
+ * Unlink and free the dead entries of a concurrent list. It may run while
+ * other threads add, delete and iterate, as long as those readers stay inside
+ * dsEpochEnter() and dsEpochExit() while they hold entries. Only one thread
+ * may purge a list at a time.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsListPurge(dsList *list);
+
 /*
  * Add a new entry to the list that points to 'data'.
  *
@@ -64,4 +91,84 @@ dsListEntry *dsListBegin(dsList *list);
 dsListEntry *dsListNext(dsListEntry *entry);
 void *dsListData(dsListEntry *entry);
 
+/*
+ * Fast iteration for long lists. The iterator keeps the crate's base address
+ * instead of looking up every offset, and prefetches entries and their data
+ * 'dsListLookahead' entries ahead, so scans don't wait on one cache miss
+ * after another. The list must not change during the scan, except for
+ * concurrent lists used as described above.
+ *
+ *   dsListIter iter;
+ *   dsListEntry *entry;
+ *
+ *   dsListForEach(&iter, list, entry) {
+ *       use(dsListIterData(&iter));
+ *   }
+ */
+#define dsListLookahead 4
+
+typedef struct dsListIter {
+	uint8_t *base;
+	dsListEntry *entry;
+	dsListEntry *lead;
+} dsListIter;
+
+dsListEntry *dsListIterBegin(dsListIter *iter, dsList *list);
+dsListEntry *dsListIterNext(dsListIter *iter);
+
+#define dsListIterData(iter) \
+	((void *)((iter)->base + (iter)->entry->dataOffset))
+
+#define dsListForEach(iter, list, entry) \
+	for ((entry) = dsListIterBegin((iter), (list)); \
+		 (entry) != NULL; \
+		 (entry) = dsListIterNext(iter))
+
+/*
+ * Define typed wrappers 'name'Add(), 'name'Del(), 'name'First() and
+ * 'name'Next() for a list whose entries point to 'T'. Iteration hands out the
+ * data directly, found from the iterator's base address:
+ *
+ *   DS_LIST_DEFINE(points, struct point)
+ *
+ *   dsListIter iter;
+ *   struct point *p;
+ *
+ *   for (p = pointsFirst(&iter, list); p != NULL; p = pointsNext(&iter)) {
+ *       ...
+ *   }
+ *
+ * The list itself is a plain dsList, nothing about 'T' is stored.
+ */
+#define DS_LIST_DEFINE(name, T)                                               \
+static inline dsListEntry *                                                   \
+name##Add(dsList *list, T *data)                                              \
+{                                                                             \
+	return dsListAdd(list, data);                                             \
+}                                                                             \
+                                                                              \
+static inline int                                                             \
+name##Del(dsList *list, T *data)                                              \
+{                                                                             \
+	return dsListDel(list, data);                                             \
+}                                                                             \
+                                                                              \
+static inline T *                                                             \
+name##First(dsListIter *iter, dsList *list)                                   \
+{                                                                             \
+	if (dsListIterBegin(iter, list) == NULL) {                                \
+		return NULL;                                                          \
+	}                                                                         \
+	return (T *)dsListIterData(iter);                                         \
+}                                                                             \
+                                                                              \
+static inline T *                                                             \
+name##Next(dsListIter *iter)                                                  \
+{                                                                             \
+	if (dsListIterNext(iter) == NULL) {                                       \
+		return NULL;                                                          \
+	}                                                                         \
+	return (T *)dsListIterData(iter);                                         \
+}
+
 #endif
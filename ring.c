@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+
+#include "ring.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "crate.h"
+#include "crate_internal.h"
+
+#define ringMinCapacity 4096
+
+/*
+ * Every record starts with an 8 byte header holding its type and length. A
+ * zero header hasn't been published, so the space ahead of the producers is
+ * kept zeroed. Skip records pad out a batch, or the end of the ring when a
+ * batch doesn't fit before it.
+ */
+#define ringRecordData 1
+#define ringRecordSkip 2
+
+#define ringHeader(type, length) (((uint64_t)(type) << 32) | (length))
+#define ringHeaderType(header) ((header) >> 32)
+#define ringHeaderLength(header) ((header) & UINT32_MAX)
+
+static void
+traceRing(void *object, uint64_t length, dsVisitCallback visit, void *arg)
+{
+	/*
+	 * Records hold no offsets, this keeps them from being scanned for any.
+	 */
+}
+
+/*
+ * Let the crate know rings hold no offsets, e.g. when collecting.
+ */
+static void __attribute__((constructor))
+registerRing()
+{
+	dsRegisterType(MAGIC_RING, traceRing);
+}
+
+static int
+checkRing(dsRing *ring)
+{
+	if ((ring == NULL) || (ring->magic != MAGIC_RING)) {
+		dsLog("Bad argument: %p\n", ring);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	return(0);
+}
+
+static uint8_t *
+ringData(dsRing *ring)
+{
+	return((uint8_t *)ring + sizeof(*ring) +
+		   ring->cursorCount * sizeof(ring->cursors[0]));
+}
+
+static uint64_t *
+ringRecord(dsRing *ring, uint64_t position)
+{
+	return((uint64_t *)(ringData(ring) + (position & (ring->capacity - 1))));
+}
+
+/*
+ * Zero the ring from 'position' up to 'end', at most a whole lap.
+ */
+static void
+clearRing(dsRing *ring, uint64_t position, uint64_t end)
+{
+	uint64_t offset = position & (ring->capacity - 1);
+	uint64_t length = end - position;
+	uint64_t first;
+
+	first = ring->capacity - offset;
+	if (first > length) {
+		first = length;
+	}
+	memset(ringData(ring) + offset, 0, first);
+	memset(ringData(ring), 0, length - first);
+}
+
+static uint64_t
+slowestCursor(dsRing *ring)
+{
+	uint64_t position, slowest = UINT64_MAX;
+	uint64_t i;
+
+	for (i = 0; i < ring->cursorCount; i++) {
+		position = __atomic_load_n(&ring->cursors[i].position,
+								   __ATOMIC_SEQ_CST);
+		if (position < slowest) {
+			slowest = position;
+		}
+	}
+
+	return(slowest);
+}
+
+/*
+ * Give the space every cursor has passed back to the producers. Only one
+ * consumer does it at a time, the others leave it to that one, which looks
+ * again after it's done.
+ */
+static void
+reclaimRing(dsRing *ring)
+{
+	uint64_t head, slowest;
+	uint64_t idle = 0;
+
+	for (;;) {
+		if (!__atomic_compare_exchange_n(&ring->reclaiming, &idle, 1, 0,
+										 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			return;
+		}
+
+		head = ring->head;
+		slowest = slowestCursor(ring);
+		if (slowest > head) {
+			clearRing(ring, head, slowest);
+			__atomic_store_n(&ring->head, slowest, __ATOMIC_RELEASE);
+		}
+
+		__atomic_store_n(&ring->reclaiming, 0, __ATOMIC_SEQ_CST);
+
+		if (slowestCursor(ring) <= slowest) {
+			return;
+		}
+		idle = 0;
+	}
+}
+
+dsRing *
+dsRingAlloc(uint64_t capacity, uint64_t cursors)
+{
+	dsRing *ring;
+	uint64_t size = ringMinCapacity;
+
+	if ((cursors == 0) || (capacity > (1ULL << 40))) {
+		dsLog("Bad argument: %" PRIu64 ", %" PRIu64 "\n", capacity, cursors);
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	while (size < capacity) {
+		size *= 2;
+	}
+
+	if ((ring = dsAllocAligned(sizeof(*ring) +
+							   cursors * sizeof(ring->cursors[0]) + size,
+							   dsRingLineSize)) == NULL) {
+		dsLog("Can't allocate ring object.\n");
+		return(NULL);
+	}
+
+	memset(ring, 0, sizeof(*ring) + cursors * sizeof(ring->cursors[0]) + size);
+	ring->magic = MAGIC_RING;
+	ring->capacity = size;
+	ring->cursorCount = cursors;
+
+	return(ring);
+}
+
+int
+dsRingReserve(dsRing *ring, dsRingBatch *batch, uint64_t length)
+{
+	uint64_t position, offset, skip, end;
+
+	if (checkRing(ring) < 0) {
+		return(-1);
+	}
+
+	if ((batch == NULL) || (length == 0) || (length % 8 != 0) ||
+		(length > ring->capacity / 2)) {
+		dsLog("Bad argument: %p, %" PRIu64 "\n", batch, length);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	/*
+	 * A batch is never split by the end of the ring, the space up to it is
+	 * skipped instead. At most half the capacity, a batch always fits once
+	 * the ring drains.
+	 */
+	position = __atomic_load_n(&ring->reserved, __ATOMIC_RELAXED);
+	do {
+		offset = position & (ring->capacity - 1);
+		skip = (offset + length > ring->capacity) ?
+			ring->capacity - offset : 0;
+		end = position + skip + length;
+
+		/*
+		 * Readers that caught up look at the header past the last record,
+		 * which must stay zero, so the ring is never completely full.
+		 */
+		if (end - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >
+			ring->capacity - 8) {
+			errno = EAGAIN;
+			return(-1);
+		}
+	} while (!__atomic_compare_exchange_n(&ring->reserved, &position, end, 1,
+										  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	/*
+	 * The first header of the reservation is written last, by
+	 * dsRingCommit(), which publishes the whole batch at once.
+	 */
+	batch->lead = ringRecord(ring, position);
+	batch->leadHeader = 0;
+	if (skip > 0) {
+		batch->leadHeader = ringHeader(ringRecordSkip, skip - 8);
+	}
+	batch->start = (uint8_t *)ringRecord(ring, position + skip);
+	batch->length = length;
+	batch->used = 0;
+
+	return(0);
+}
+
+static void
+addHeader(dsRingBatch *batch, uint64_t header)
+{
+	uint64_t *record = (uint64_t *)(batch->start + batch->used);
+
+	if (record == batch->lead) {
+		batch->leadHeader = header;
+	} else {
+		*record = header;
+	}
+}
+
+void *
+dsRingAdd(dsRingBatch *batch, uint64_t length)
+{
+	uint8_t *record;
+
+	if (batch == NULL) {
+		dsLog("Bad argument: %p\n", batch);
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	if ((length > UINT32_MAX) ||
+		(batch->used + dsRingRecordSize(length) > batch->length)) {
+		errno = ENOSPC;
+		return(NULL);
+	}
+
+	record = batch->start + batch->used;
+	addHeader(batch, ringHeader(ringRecordData, length));
+	batch->used += dsRingRecordSize(length);
+
+	return(record + 8);
+}
+
+int
+dsRingCommit(dsRing *ring, dsRingBatch *batch)
+{
+	if (checkRing(ring) < 0) {
+		return(-1);
+	}
+
+	if ((batch == NULL) || (batch->lead == NULL)) {
+		dsLog("Bad argument: %p\n", batch);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if (batch->used < batch->length) {
+		addHeader(batch, ringHeader(ringRecordSkip,
+									batch->length - batch->used - 8));
+	}
+
+	__atomic_store_n(batch->lead, batch->leadHeader, __ATOMIC_RELEASE);
+	batch->lead = NULL;
+
+	return(0);
+}
+
+int
+dsRingAppend(dsRing *ring, const void *data, uint64_t length)
+{
+	dsRingBatch batch;
+	void *record;
+
+	if (length > UINT32_MAX) {
+		dsLog("Bad argument: %" PRIu64 "\n", length);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if (dsRingReserve(ring, &batch, dsRingRecordSize(length)) < 0) {
+		return(-1);
+	}
+
+	record = dsRingAdd(&batch, length);
+	memcpy(record, data, length);
+
+	return(dsRingCommit(ring, &batch));
+}
+
+/*
+ * Find the next published record for 'cursor', moving it past any skip
+ * records on the way.
+ */
+static uint64_t *
+nextRecord(dsRing *ring, uint64_t cursor, uint64_t *header)
+{
+	dsRingCursor *c;
+	uint64_t *record;
+	uint64_t position;
+
+	if (checkRing(ring) < 0) {
+		return(NULL);
+	}
+
+	if (cursor >= ring->cursorCount) {
+		dsLog("Bad cursor: %" PRIu64 "\n", cursor);
+		errno = EINVAL;
+		return(NULL);
+	}
+	c = &ring->cursors[cursor];
+	position = c->position;
+
+	for (;;) {
+		record = ringRecord(ring, position);
+		if ((*header = __atomic_load_n(record, __ATOMIC_ACQUIRE)) == 0) {
+			errno = EAGAIN;
+			return(NULL);
+		}
+
+		if (ringHeaderType(*header) == ringRecordData) {
+			return(record);
+		}
+
+		if (ringHeaderType(*header) != ringRecordSkip) {
+			dsLog("Bad ring record header: %" PRIx64 "\n", *header);
+			errno = EINVAL;
+			return(NULL);
+		}
+		position += dsRingRecordSize(ringHeaderLength(*header));
+		__atomic_store_n(&c->position, position, __ATOMIC_SEQ_CST);
+	}
+}
+
+void *
+dsRingRead(dsRing *ring, uint64_t cursor, uint64_t *length)
+{
+	uint64_t *record;
+	uint64_t header;
+
+	if ((record = nextRecord(ring, cursor, &header)) == NULL) {
+		return(NULL);
+	}
+
+	if (length != NULL) {
+		*length = ringHeaderLength(header);
+	}
+
+	return(record + 1);
+}
+
+int
+dsRingConsume(dsRing *ring, uint64_t cursor)
+{
+	dsRingCursor *c;
+	uint64_t header;
+
+	if (nextRecord(ring, cursor, &header) == NULL) {
+		return(-1);
+	}
+
+	c = &ring->cursors[cursor];
+	__atomic_store_n(&c->position,
+					 c->position + dsRingRecordSize(ringHeaderLength(header)),
+					 __ATOMIC_SEQ_CST);
+
+	reclaimRing(ring);
+
+	return(0);
+}
+
+int
+dsRingRecover(dsRing *ring)
+{
+	uint64_t position, slowest, header, size;
+	uint64_t i;
+
+	if (checkRing(ring) < 0) {
+		return(-1);
+	}
+
+	/*
+	 * Keep the records from the slowest cursor for as long as they are
+	 * complete, up to what was reserved before.
+	 */
+	slowest = slowestCursor(ring);
+	position = slowest;
+	while (position < ring->reserved) {
+		header = *ringRecord(ring, position);
+		size = dsRingRecordSize(ringHeaderLength(header));
+
+		if (((ringHeaderType(header) != ringRecordData) &&
+			 (ringHeaderType(header) != ringRecordSkip)) ||
+			(position + size > ring->reserved) ||
+			((position & (ring->capacity - 1)) + size > ring->capacity)) {
+			break;
+		}
+		position += size;
+	}
+
+	for (i = 0; i < ring->cursorCount; i++) {
+		if (ring->cursors[i].position > position) {
+			ring->cursors[i].position = position;
+		}
+	}
+
+	clearRing(ring, position, slowest + ring->capacity);
+	ring->reserved = position;
+	ring->head = slowest;
+	ring->reclaiming = 0;
+
+	return(0);
+}
@@ -0,0 +1,139 @@
+#ifndef CRATE_RING_H_
+#define CRATE_RING_H_
+
+#include <inttypes.h>
+
+#include "crate.h"
+#include "crate_internal.h"
+
+/*
+ * A fixed size log of variable length records, stored in one object with the
+ * ring itself. Any number of threads append at once: a record is a
+ * reservation with one atomic update, a copy, and one store to publish it.
+ * Each of a fixed number of consumers reads through its own cursor, and the
+ * space of a record is reused once every cursor has passed it.
+ *
+ * Records and cursors live in the crate and survive a restart like any other
+ * data once dsSync() or dsClose() has written them. Changes to a ring aren't
+ * part of transactions.
+ */
+#define dsRingLineSize 64
+
+/*
+ * Bytes taken by a record of 'length' bytes, its header included.
+ */
+#define dsRingRecordSize(length) (8 + (((length) + 7) & ~(uint64_t)7))
+
+typedef struct dsRingCursor {
+	uint64_t position;
+	uint64_t pad[dsRingLineSize / 8 - 1];
+} dsRingCursor;
+
+/*
+ * Positions count bytes ever appended, the ring offset of one is the
+ * position modulo 'capacity'. Producers move 'reserved' and consumers
+ * 'head', the oldest position a cursor still needs, so each gets a cache
+ * line of its own.
+ */
+typedef struct dsRing {
+	uint64_t magic;
+	uint64_t capacity;
+	uint64_t cursorCount;
+	uint64_t reclaiming;
+	uint64_t pad0[dsRingLineSize / 8 - 4];
+	uint64_t reserved;
+	uint64_t pad1[dsRingLineSize / 8 - 1];
+	uint64_t head;
+	uint64_t pad2[dsRingLineSize / 8 - 1];
+	dsRingCursor cursors[];
+} dsRing;
+
+/*
+ * Space reserved for one or more records, which are published together by
+ * dsRingCommit().
+ */
+typedef struct dsRingBatch {
+	uint64_t *lead;
+	uint64_t leadHeader;
+	uint8_t *start;
+	uint64_t length;
+	uint64_t used;
+} dsRingBatch;
+
+/*
+ * Allocate a ring of at least 'capacity' bytes, rounded up to a power of two,
+ * read by 'cursors' consumers. All cursors start at the beginning.
+ *
+ * On success, a pointer to the new ring object is returned.
+ * On error, NULL is returned and errno is set appropriately.
+ */
+dsRing *dsRingAlloc(uint64_t capacity, uint64_t cursors);
+
+/*
+ * Reserve 'length' bytes for records, which is the sum of
+ * dsRingRecordSize() of each of them and at most half the capacity.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately, to EAGAIN if the
+ * ring is too full until the slowest consumer catches up.
+ */
+int dsRingReserve(dsRing *ring, dsRingBatch *batch, uint64_t length);
+
+/*
+ * Take a record of 'length' bytes from 'batch'. The record is filled in by
+ * the caller and only seen by consumers once the batch is committed.
+ *
+ * On success, a pointer to the record's contents is returned.
+ * On error, NULL is returned and errno is set appropriately, to ENOSPC if
+ * the batch is out of room.
+ */
+void *dsRingAdd(dsRingBatch *batch, uint64_t length);
+
+/*
+ * Publish every record added to 'batch'. Unused space is skipped by readers.
+ * Every reservation must be committed, as readers can't get past one that
+ * isn't.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsRingCommit(dsRing *ring, dsRingBatch *batch);
+
+/*
+ * Append a single record of 'length' bytes copied from 'data'.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately, like
+ * dsRingReserve().
+ */
+int dsRingAppend(dsRing *ring, const void *data, uint64_t length);
+
+/*
+ * Get the next record for consumer 'cursor' and optionally its length,
+ * without moving past it. Only one thread at a time may use a cursor.
+ *
+ * On success, a pointer to the record's contents is returned.
+ * On error, NULL is returned and errno is set appropriately, to EAGAIN if
+ * there is nothing new.
+ */
+void *dsRingRead(dsRing *ring, uint64_t cursor, uint64_t *length);
+
+/*
+ * Move consumer 'cursor' past the record returned by dsRingRead().
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsRingConsume(dsRing *ring, uint64_t cursor);
+
+/*
+ * Bring a ring back to a consistent state after the crate is opened again,
+ * dropping records whose commit didn't reach the file. Must be called before
+ * the ring is used by any thread.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsRingRecover(dsRing *ring);
+
+#endif
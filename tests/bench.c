@@ -0,0 +1,824 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+#include <list.h>
+#include <heap.h>
+#include <ring.h>
+
+/*
+ * Microbenchmarks for allocation, lists, heaps, rings and persistence.
+ *
+ * Every result is printed as one JSON object per line so runs can be diffed
+ * and compared by scripts. Random sizes come from a fixed seed, so two runs
+ * of the same build do exactly the same work.
+ */
+
+static const char *dir = ".";
+static const char *filter = NULL;
+static uint64_t maxElements = 1000000;
+static int maxThreads = 8;
+static uint64_t seed = 42;
+
+static char crateName[4096];
+static char snapshotName[4096];
+
+/*
+ * xorshift64*, reproducible across platforms unlike rand().
+ */
+static uint64_t
+nextRandom(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t
+uniform(uint64_t *state, uint64_t low, uint64_t high)
+{
+	return low + nextRandom(state) % (high - low + 1);
+}
+
+/*
+ * Uniform over the exponent, so every power of two is equally likely.
+ */
+static uint64_t
+logUniform(uint64_t *state, uint64_t low, uint64_t high)
+{
+	int lowBits = 63 - __builtin_clzll(low);
+	int highBits = 63 - __builtin_clzll(high);
+	int bits = uniform(state, lowBits, highBits);
+	uint64_t length = (1ULL << bits) + nextRandom(state) % (1ULL << bits);
+
+	return length < low ? low : (length > high ? high : length);
+}
+
+static uint64_t
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+compareSamples(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile(uint64_t *samples, uint64_t count, double p)
+{
+	uint64_t i = (uint64_t)(p * (count - 1));
+
+	return samples[i];
+}
+
+/*
+ * Print a result. With 'samples', per-operation latency percentiles are
+ * included, the samples get sorted in place.
+ */
+static void
+report(const char *bench, const char *name, uint64_t n, uint64_t ops,
+	   uint64_t nanoseconds, uint64_t *samples, uint64_t count)
+{
+	printf("{\"bench\":\"%s\",\"case\":\"%s\",\"n\":%" PRIu64
+		",\"ops\":%" PRIu64 ",\"ns\":%" PRIu64 ",\"ops_per_sec\":%.1f",
+		bench, name, n, ops, nanoseconds,
+		nanoseconds ? ops * 1e9 / nanoseconds : 0.0);
+
+	if (samples != NULL && count > 0) {
+		qsort(samples, count, sizeof(*samples), compareSamples);
+		printf(",\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64
+			",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64
+			",\"max_ns\":%" PRIu64,
+			percentile(samples, count, 0.5),
+			percentile(samples, count, 0.9),
+			percentile(samples, count, 0.99),
+			percentile(samples, count, 0.999),
+			samples[count - 1]);
+	}
+
+	printf("}\n");
+	fflush(stdout);
+}
+
+static int
+selected(const char *bench)
+{
+	return filter == NULL || strstr(bench, filter) != NULL;
+}
+
+static dsCrate *
+freshCrate()
+{
+	dsCrate *crate;
+
+	unlink(crateName);
+	if ((crate = dsOpen(crateName, 1, 1)) == NULL) {
+		fprintf(stderr, "Can't open %s\n", crateName);
+		exit(1);
+	}
+
+	return crate;
+}
+
+static void
+closeCrate(dsCrate *crate)
+{
+	dsClose(&crate);
+	unlink(crateName);
+}
+
+/*
+ * Allocation size distributions.
+ */
+typedef uint64_t (*sizeFunction)(uint64_t *state);
+
+static uint64_t
+smallSize(uint64_t *state)
+{
+	return uniform(state, 8, 256);
+}
+
+static uint64_t
+mediumSize(uint64_t *state)
+{
+	return logUniform(state, 256, 64 << 10);
+}
+
+static uint64_t
+largeSize(uint64_t *state)
+{
+	return logUniform(state, 64 << 10, 1 << 20);
+}
+
+static uint64_t
+mixedSize(uint64_t *state)
+{
+	uint64_t pick = nextRandom(state) % 100;
+
+	if (pick < 90) {
+		return smallSize(state);
+	} else if (pick < 99) {
+		return mediumSize(state);
+	}
+	return largeSize(state);
+}
+
+static void
+benchAlloc(const char *name, sizeFunction size, uint64_t n)
+{
+	dsCrate *crate = freshCrate();
+	uint64_t *samples = malloc(n * sizeof(*samples));
+	uint64_t state = seed;
+	uint64_t total = 0;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		uint64_t length = size(&state);
+		uint64_t start = now();
+
+		if (dsAlloc(length) == NULL) {
+			fprintf(stderr, "Can't allocate %" PRIu64 " bytes\n", length);
+			break;
+		}
+		samples[i] = now() - start;
+		total += samples[i];
+	}
+
+	report("alloc", name, n, i, total, samples, i);
+
+	free(samples);
+	closeCrate(crate);
+}
+
+/*
+ * Keep a fixed number of objects alive, replacing a random one per operation.
+ */
+static void
+benchChurn(const char *name, sizeFunction size, uint64_t live, uint64_t n)
+{
+	dsCrate *crate = freshCrate();
+	uint64_t *samples = malloc(n * sizeof(*samples));
+	void **objects = malloc(live * sizeof(*objects));
+	uint64_t state = seed;
+	uint64_t total = 0;
+	uint64_t i;
+
+	for (i = 0; i < live; i++) {
+		objects[i] = dsAlloc(size(&state));
+	}
+
+	for (i = 0; i < n; i++) {
+		uint64_t victim = nextRandom(&state) % live;
+		uint64_t length = size(&state);
+		uint64_t start = now();
+
+		dsFree(objects[victim]);
+		objects[victim] = dsAlloc(length);
+
+		samples[i] = now() - start;
+		total += samples[i];
+	}
+
+	report("churn", name, live, n, total, samples, n);
+
+	free(objects);
+	free(samples);
+	closeCrate(crate);
+}
+
+static void
+benchList(uint64_t n)
+{
+	dsCrate *crate = freshCrate();
+	uint64_t *samples = malloc(n * sizeof(*samples));
+	void **data = malloc(n * sizeof(*data));
+	dsList *list = dsListAlloc();
+	dsListEntry *entry;
+	dsListIter iter;
+	char name[32];
+	uint64_t total;
+	uint64_t start;
+	uint64_t sum;
+	uint64_t i;
+
+	snprintf(name, sizeof(name), "%" PRIu64, n);
+
+	for (i = 0; i < n; i++) {
+		uint64_t *value = dsAlloc(sizeof(*value));
+
+		*value = i;
+		data[i] = value;
+	}
+
+	total = 0;
+	for (i = 0; i < n; i++) {
+		start = now();
+		dsListAdd(list, data[i]);
+		samples[i] = now() - start;
+		total += samples[i];
+	}
+	report("list_add", name, n, n, total, samples, n);
+
+	/*
+	 * Iteration is too fast to time per entry.
+	 */
+	sum = 0;
+	start = now();
+	for (entry = dsListBegin(list); entry != NULL; entry = dsListNext(entry)) {
+		sum += *(uint64_t *)dsListData(entry);
+	}
+	total = now() - start;
+	if (sum != n * (n - 1) / 2) {
+		fprintf(stderr, "List sum is wrong: %" PRIu64 "\n", sum);
+	}
+	report("list_iterate", name, n, n, total, NULL, 0);
+
+	sum = 0;
+	start = now();
+	dsListForEach(&iter, list, entry) {
+		sum += *(uint64_t *)dsListIterData(&iter);
+	}
+	total = now() - start;
+	if (sum != n * (n - 1) / 2) {
+		fprintf(stderr, "List sum is wrong: %" PRIu64 "\n", sum);
+	}
+	report("list_iterate_fast", name, n, n, total, NULL, 0);
+
+	/*
+	 * Delete from the head, anything else is a linear search per delete.
+	 */
+	total = 0;
+	for (i = 0; i < n; i++) {
+		entry = dsListBegin(list);
+		start = now();
+		dsListDel(list, dsListData(entry));
+		samples[i] = now() - start;
+		total += samples[i];
+	}
+	report("list_delete", name, n, n, total, samples, n);
+
+	free(data);
+	free(samples);
+	closeCrate(crate);
+}
+
+/*
+ * Push random keys one at a time and in bulk, lower a share of them, then pop
+ * everything.
+ */
+static void
+benchHeap(uint64_t n)
+{
+	dsCrate *crate = freshCrate();
+	uint64_t *samples = malloc(n * sizeof(*samples));
+	uint64_t *handles = malloc(n * sizeof(*handles));
+	uint64_t *keys = malloc(n * sizeof(*keys));
+	void **data = malloc(n * sizeof(*data));
+	uint64_t state = seed;
+	dsHeap *heap = dsHeapAlloc();
+	char name[32];
+	uint64_t total;
+	uint64_t start;
+	uint64_t key, last;
+	uint64_t i;
+
+	snprintf(name, sizeof(name), "%" PRIu64, n);
+
+	for (i = 0; i < n; i++) {
+		uint64_t *value = dsAlloc(sizeof(*value));
+
+		*value = i;
+		data[i] = value;
+		keys[i] = nextRandom(&state);
+	}
+
+	total = 0;
+	for (i = 0; i < n; i++) {
+		start = now();
+		handles[i] = dsHeapPush(heap, keys[i], data[i]);
+		samples[i] = now() - start;
+		total += samples[i];
+	}
+	report("heap_push", name, n, n, total, samples, n);
+
+	total = 0;
+	for (i = 0; i < n; i += 4) {
+		start = now();
+		dsHeapDecreaseKey(heap, handles[i], keys[i] / 2);
+		samples[i / 4] = now() - start;
+		total += samples[i / 4];
+	}
+	report("heap_decrease_key", name, n, (n + 3) / 4, total, samples,
+		   (n + 3) / 4);
+
+	last = 0;
+	total = 0;
+	for (i = 0; i < n; i++) {
+		start = now();
+		dsHeapPop(heap, &key);
+		samples[i] = now() - start;
+		total += samples[i];
+		if (key < last) {
+			fprintf(stderr, "Heap order is wrong: %" PRIu64 "\n", key);
+		}
+		last = key;
+	}
+	report("heap_pop", name, n, n, total, samples, n);
+
+	start = now();
+	dsHeapPushBulk(heap, keys, data, n, NULL);
+	total = now() - start;
+	report("heap_push_bulk", name, n, n, total, NULL, 0);
+
+	free(data);
+	free(keys);
+	free(handles);
+	free(samples);
+	closeCrate(crate);
+}
+
+/*
+ * Fill a crate with 'megabytes' of data, then time syncing it after every
+ * page is dirtied and snapshotting it.
+ */
+static void
+benchPersist(uint64_t megabytes)
+{
+	dsCrate *crate = freshCrate();
+	uint64_t length = 1 << 20;
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	uint64_t samples[5];
+	char **chunks = malloc(megabytes * sizeof(*chunks));
+	char name[32];
+	uint64_t total;
+	uint64_t i;
+	uint64_t j;
+	int k;
+
+	snprintf(name, sizeof(name), "%" PRIu64 "MiB", megabytes);
+
+	for (i = 0; i < megabytes; i++) {
+		chunks[i] = dsAlloc(length);
+		memset(chunks[i], (int)i, length);
+	}
+	dsSync(1);
+
+	total = 0;
+	for (k = 0; k < 5; k++) {
+		uint64_t start;
+
+		for (i = 0; i < megabytes; i++) {
+			for (j = 0; j < length; j += pageSize) {
+				chunks[i][j]++;
+			}
+		}
+
+		start = now();
+		dsSync(1);
+		samples[k] = now() - start;
+		total += samples[k];
+	}
+	report("sync", name, megabytes << 20, 5, total, samples, 5);
+
+	total = 0;
+	for (k = 0; k < 3; k++) {
+		uint64_t start;
+
+		unlink(snapshotName);
+		start = now();
+		dsSnapshot(snapshotName);
+		samples[k] = now() - start;
+		total += samples[k];
+	}
+	unlink(snapshotName);
+	report("snapshot", name, megabytes << 20, 3, total, samples, 3);
+
+	free(chunks);
+	closeCrate(crate);
+}
+
+/*
+ * Small updates that each need to become durable, waiting on every sync
+ * versus handing them to the flusher thread and waiting once at the end.
+ */
+static void
+benchSyncUpdates(uint64_t n)
+{
+	dsCrate *crate = freshCrate();
+	uint64_t *samples = malloc(n * sizeof(*samples));
+	uint64_t *counter = dsAlloc(sizeof(*counter));
+	uint64_t start;
+	uint64_t total;
+	int64_t ticket = 0;
+	uint64_t i;
+
+	*counter = 0;
+	dsSync(1);
+
+	total = now();
+	for (i = 0; i < n; i++) {
+		start = now();
+		(*counter)++;
+		dsSync(1);
+		samples[i] = now() - start;
+	}
+	total = now() - total;
+	report("sync_updates", "blocking", n, n, total, samples, n);
+
+	total = now();
+	for (i = 0; i < n; i++) {
+		start = now();
+		(*counter)++;
+		ticket = dsSyncAsync(NULL, NULL);
+		samples[i] = now() - start;
+	}
+	dsSyncWait(ticket);
+	total = now() - total;
+	report("sync_updates", "async", n, n, total, samples, n);
+
+	free(samples);
+	closeCrate(crate);
+}
+
+/*
+ * Random reads through dsPtr() that mostly hit a small hot set, interrupted
+ * by full scans, over a crate several times larger than the buffer pool.
+ */
+static void
+benchPoolReads(const char *name, uint64_t poolBytes, uint64_t n)
+{
+	dsOpenOptions options = {.create = 1, .active = 1, .poolBytes = poolBytes};
+	uint64_t objects = 16384;
+	uint64_t length = 4096;
+	uint64_t hot = objects / 32;
+	uint64_t *samples = malloc(n * sizeof(*samples));
+	uint64_t *offsets = malloc(objects * sizeof(*offsets));
+	uint64_t state = seed;
+	uint64_t total;
+	uint64_t sum = 0;
+	uint64_t i;
+	uint64_t j;
+	dsCrate *crate;
+
+	unlink(crateName);
+	if ((crate = dsOpenWith(crateName, &options)) == NULL) {
+		fprintf(stderr, "Can't open %s\n", crateName);
+		exit(1);
+	}
+
+	for (i = 0; i < objects; i++) {
+		void *object = dsAlloc(length);
+
+		memset(object, (int)i, length);
+		offsets[i] = dsOffset(object);
+	}
+	dsSync(1);
+
+	total = now();
+	for (i = 0; i < n; i++) {
+		uint64_t start = now();
+		uint64_t *object;
+
+		if (i % (n / 4) == 0) {
+			for (j = 0; j < objects; j++) {
+				object = dsPtr(offsets[j], length);
+				sum += object[0];
+			}
+		}
+		object = dsPtr(offsets[nextRandom(&state) % hot], length);
+		sum += object[length / 16];
+
+		samples[i] = now() - start;
+	}
+	total = now() - total;
+	report("pool_reads", name, objects * length, n, total, samples, n);
+
+	if (sum == 0) {
+		fprintf(stderr, "Nothing read\n");
+	}
+	free(offsets);
+	free(samples);
+	closeCrate(crate);
+}
+
+typedef struct benchThread {
+	dsCrate *crate;
+	dsRing *ring;
+	uint64_t n;
+	uint64_t seed;
+	uint64_t *samples;
+} benchThread;
+
+static void *
+churnThread(void *arg)
+{
+	benchThread *thread = arg;
+	uint64_t state = thread->seed;
+	void *objects[64];
+	uint64_t i;
+
+	dsSet(thread->crate);
+
+	for (i = 0; i < 64; i++) {
+		objects[i] = dsAlloc(smallSize(&state));
+	}
+
+	for (i = 0; i < thread->n; i++) {
+		uint64_t victim = nextRandom(&state) % 64;
+		uint64_t length = smallSize(&state);
+		uint64_t start = now();
+
+		dsFree(objects[victim]);
+		objects[victim] = dsAlloc(length);
+
+		thread->samples[i] = now() - start;
+	}
+
+	return NULL;
+}
+
+/*
+ * Threads sharing one crate handle, each churning its own small objects.
+ */
+static void
+benchThreads(int threads, uint64_t n)
+{
+	dsCrate *crate = freshCrate();
+	benchThread *work = calloc(threads, sizeof(*work));
+	pthread_t *ids = calloc(threads, sizeof(*ids));
+	uint64_t *samples = malloc(threads * n * sizeof(*samples));
+	char name[32];
+	uint64_t start;
+	uint64_t total;
+	int i;
+
+	snprintf(name, sizeof(name), "%d", threads);
+
+	for (i = 0; i < threads; i++) {
+		work[i].crate = crate;
+		work[i].n = n;
+		work[i].seed = seed + i;
+		work[i].samples = samples + i * n;
+	}
+
+	start = now();
+	for (i = 0; i < threads; i++) {
+		pthread_create(ids + i, NULL, churnThread, work + i);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	total = now() - start;
+
+	report("threads", name, threads, threads * n, total, samples,
+		   threads * n);
+
+	free(samples);
+	free(ids);
+	free(work);
+	closeCrate(crate);
+}
+
+static void *
+ringThread(void *arg)
+{
+	benchThread *thread = arg;
+	uint64_t record[8] = { thread->seed };
+	uint64_t i;
+
+	dsSet(thread->crate);
+
+	for (i = 0; i < thread->n; i++) {
+		uint64_t start = now();
+
+		record[1] = i;
+		while (dsRingAppend(thread->ring, record, sizeof(record)) < 0) {
+			/*
+			 * Full, let the consumer catch up.
+			 */
+			sched_yield();
+		}
+
+		thread->samples[i] = now() - start;
+	}
+
+	return NULL;
+}
+
+/*
+ * Threads appending 64 byte records to one ring while the main thread
+ * consumes them.
+ */
+static void
+benchRing(int threads, uint64_t n)
+{
+	dsCrate *crate = freshCrate();
+	benchThread *work = calloc(threads, sizeof(*work));
+	pthread_t *ids = calloc(threads, sizeof(*ids));
+	uint64_t *samples = malloc(threads * n * sizeof(*samples));
+	dsRing *ring = dsRingAlloc(1 << 20, 1);
+	char name[32];
+	uint64_t start;
+	uint64_t total;
+	uint64_t consumed;
+	int i;
+
+	snprintf(name, sizeof(name), "%d", threads);
+
+	for (i = 0; i < threads; i++) {
+		work[i].crate = crate;
+		work[i].ring = ring;
+		work[i].n = n;
+		work[i].seed = seed + i;
+		work[i].samples = samples + i * n;
+	}
+
+	start = now();
+	for (i = 0; i < threads; i++) {
+		pthread_create(ids + i, NULL, ringThread, work + i);
+	}
+	for (consumed = 0; consumed < threads * n;) {
+		if (dsRingRead(ring, 0, NULL) == NULL) {
+			sched_yield();
+			continue;
+		}
+		dsRingConsume(ring, 0);
+		consumed++;
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	total = now() - start;
+
+	report("ring_append", name, threads, threads * n, total, samples,
+		   threads * n);
+
+	free(samples);
+	free(ids);
+	free(work);
+	closeCrate(crate);
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-d dir] [-n maxElements] [-t maxThreads] [-s seed] "
+		"[filter]\n"
+		"  -d dir          Where to create crate files (default: .).\n"
+		"  -n maxElements  Largest list or heap size to run (default: 1000000).\n"
+		"  -t maxThreads   Largest thread count to run (default: 8).\n"
+		"  -s seed         Random seed (default: 42).\n"
+		"  filter          Only run benchmarks whose name contains it.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t n;
+	int threads;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:t:s:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'n':
+			maxElements = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			maxThreads = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		filter = argv[optind];
+	}
+
+	snprintf(crateName, sizeof(crateName), "%s/bench-crate", dir);
+	snprintf(snapshotName, sizeof(snapshotName), "%s/bench-snapshot", dir);
+
+	/*
+	 * Logging would dominate every measurement.
+	 */
+	dsLogger(NULL, NULL);
+
+	if (selected("alloc")) {
+		benchAlloc("small", smallSize, 1000000);
+		benchAlloc("medium", mediumSize, 100000);
+		benchAlloc("large", largeSize, 2000);
+		benchAlloc("mixed", mixedSize, 200000);
+	}
+
+	if (selected("churn")) {
+		benchChurn("small", smallSize, 10000, 200000);
+		benchChurn("mixed", mixedSize, 10000, 200000);
+	}
+
+	if (selected("list")) {
+		for (n = 1000; n <= maxElements; n *= 10) {
+			benchList(n);
+		}
+	}
+
+	if (selected("heap")) {
+		for (n = 1000; n <= maxElements; n *= 10) {
+			benchHeap(n);
+		}
+	}
+
+	if (selected("sync") || selected("snapshot")) {
+		benchPersist(1);
+		benchPersist(16);
+		benchPersist(128);
+	}
+
+	if (selected("sync_updates")) {
+		benchSyncUpdates(1000);
+	}
+
+	if (selected("pool_reads")) {
+		benchPoolReads("mapped", 0, 200000);
+		benchPoolReads("pool", 8 << 20, 200000);
+	}
+
+	if (selected("threads")) {
+		for (threads = 1; threads <= maxThreads; threads *= 2) {
+			benchThreads(threads, 200000);
+		}
+	}
+
+	if (selected("ring")) {
+		for (threads = 1; threads <= maxThreads; threads *= 2) {
+			benchRing(threads, 200000);
+		}
+	}
+
+	return 0;
+}
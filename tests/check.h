@@ -0,0 +1,20 @@
+#ifndef CRATE_TESTS_CHECK_H_
+#define CRATE_TESTS_CHECK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Stop the test with a message naming the failed condition. Tests run
+ * under ctest, which only looks at the exit status.
+ */
+#define check(condition)                                                   \
+	do {                                                                   \
+		if (!(condition)) {                                                \
+			fprintf(stderr, "%s:%d: check failed: %s\n",                  \
+				__FILE__, __LINE__, #condition);                           \
+			exit(1);                                                       \
+		}                                                                  \
+	} while (0)
+
+#endif
@@ -0,0 +1,100 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+
+#include "check.h"
+
+/*
+ * Accessors for explicit handles: dsCratePtr() and dsCrateOffset() turn
+ * offsets of any open crate into pointers and back, whichever crate is
+ * active, for mapped crates and crates cached by a buffer pool alike, and
+ * agree with dsPtr() and dsOffset() on the active one.
+ */
+#define count 100
+
+static const char *names[] = {
+	"test-accessors-crate-a", "test-accessors-crate-b",
+	"test-accessors-crate-c"
+};
+
+static uint64_t offsets[3][count];
+
+static void
+fill(dsCrate *crate, int which)
+{
+	uint64_t *data, i;
+
+	check(dsSet(crate) == 0);
+	for (i = 0; i < count; i++) {
+		check((data = dsAlloc(sizeof(*data))) != NULL);
+		*data = which * count + i;
+		offsets[which][i] = dsOffset(data);
+	}
+}
+
+static void
+checkCrate(dsCrate *crate, int which)
+{
+	uint64_t *data, i;
+
+	for (i = 0; i < count; i++) {
+		check((data = dsCratePtr(crate, offsets[which][i], sizeof(*data))) !=
+			  NULL);
+		check(*data == which * count + i);
+		check(dsCrateOffset(crate, data) == offsets[which][i]);
+	}
+}
+
+int main()
+{
+	dsOpenOptions options = { .create = 1, .active = 0, .poolBytes = 1 << 20 };
+	dsCrate *crates[3];
+	uint64_t *data;
+	int i, j;
+
+	dsLogger(NULL, NULL);
+	for (i = 0; i < 3; i++) {
+		unlink(names[i]);
+	}
+
+	check((crates[0] = dsOpen(names[0], 1, 0)) != NULL);
+	check((crates[1] = dsOpen(names[1], 1, 0)) != NULL);
+	check((crates[2] = dsOpenWith(names[2], &options)) != NULL);
+	for (i = 0; i < 3; i++) {
+		fill(crates[i], i);
+	}
+
+	for (i = 0; i < 3; i++) {
+		check(dsSet(crates[i]) == 0);
+		for (j = 0; j < 3; j++) {
+			checkCrate(crates[j], j);
+		}
+		data = dsPtr(offsets[i][0], sizeof(*data));
+		check(data == dsCratePtr(crates[i], offsets[i][0], sizeof(*data)));
+		check(dsOffset(data) == dsCrateOffset(crates[i], data));
+	}
+
+	/*
+	 * A NULL crate is refused with or without the bounds checks.
+	 */
+	check(dsCratePtr(NULL, 0, 8) == NULL);
+	check(dsCrateOffset(NULL, &offsets) == UINT64_MAX);
+
+#ifndef NDEBUG
+	/*
+	 * Only builds with the bounds checks turn these away.
+	 */
+	check(dsCratePtr(crates[0], UINT64_MAX - 8, 8) == NULL);
+	check(dsCrateOffset(crates[0], &offsets) == UINT64_MAX);
+#endif
+
+	for (i = 0; i < 3; i++) {
+		dsClose(&crates[i]);
+		unlink(names[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+
+#include "check.h"
+
+/*
+ * Every object starts 8 byte aligned whatever its length, and aligned
+ * allocations honor their alignment, including after a resize.
+ */
+int main()
+{
+	dsCrate *crate;
+	dsCheckReport report;
+	void *objects[500];
+	uint64_t alignment;
+	int i;
+
+	dsLogger(NULL, NULL);
+	check((crate = dsOpen(NULL, 1, 1)) != NULL);
+
+	for (i = 0; i < 500; i++) {
+		check((objects[i] = dsAlloc(i % 37 + 1)) != NULL);
+		check((uintptr_t)objects[i] % 8 == 0);
+		memset(objects[i], i, i % 37 + 1);
+	}
+
+	for (alignment = 1; alignment <= 4096; alignment *= 2) {
+		void *aligned;
+
+		check((aligned = dsAllocAligned(alignment + 3, alignment)) != NULL);
+		check((uintptr_t)aligned % alignment == 0);
+		check((uintptr_t)aligned % 8 == 0);
+	}
+	check(dsAllocAligned(8, 3) == NULL);
+
+	for (i = 0; i < 500; i += 2) {
+		check(dsFree(objects[i]) == 0);
+	}
+	for (i = 1; i < 500; i += 2) {
+		check((objects[i] = dsRealloc(objects[i], i % 53 + 5)) != NULL);
+		check((uintptr_t)objects[i] % 8 == 0);
+	}
+	for (i = 0; i < 500; i += 2) {
+		check((objects[i] = dsAlloc(i % 11 + 1)) != NULL);
+		check((uintptr_t)objects[i] % 8 == 0);
+	}
+
+	check(dsCheck(&report, 1, 0) == 0);
+	check(report.misalignedObjects == 0);
+	check(report.badHeaders == 0);
+	check(report.badTrailers == 0);
+	check(report.badGroups == 0);
+
+	dsClose(&crate);
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+#include <list.h>
+
+#include "check.h"
+
+/*
+ * Anonymous crates: each one is separate from the others, grows like a
+ * crate backed by a file, and dsSnapshot() saves it to a sparse file that
+ * opens like any other crate.
+ */
+#define count 2000
+#define objectSize 4096
+
+static uint64_t
+sumList()
+{
+	dsListEntry *e;
+	uint64_t sum = 0;
+
+	for (e = dsListBegin(dsGetIndex()); e != NULL; e = dsListNext(e)) {
+		sum += *(uint64_t *)dsListData(e);
+	}
+
+	return sum;
+}
+
+static void
+fill()
+{
+	dsList *list;
+	uint64_t *data, i;
+
+	check((list = dsListAlloc()) != NULL);
+	check(dsSetIndex(list, sizeof(*list)) == 0);
+	for (i = 0; i < count; i++) {
+		check((data = dsAlloc(objectSize)) != NULL);
+		*data = i;
+		check(dsListAdd(list, data) != NULL);
+	}
+	check(sumList() == (uint64_t)count * (count - 1) / 2);
+}
+
+int main()
+{
+	const char *name = "test-anonymous-snapshot";
+	dsCheckReport report;
+	struct stat statBuffer;
+	dsCrate *a, *b;
+	uint64_t *value;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((a = dsOpen(NULL, 1, 1)) != NULL);
+	check((b = dsOpen(NULL, 1, 0)) != NULL);
+	fill();
+
+	check(dsSet(b) == 0);
+	check((value = dsAlloc(sizeof(*value))) != NULL);
+	*value = 7;
+	check(dsSetIndex(value, sizeof(*value)) == 0);
+
+	check(dsSet(a) == 0);
+	check(sumList() == (uint64_t)count * (count - 1) / 2);
+	check(dsSnapshot(name) == 0);
+	dsClose(&a);
+
+	check(dsSet(b) == 0);
+	check(*(uint64_t *)dsGetIndex() == 7);
+	dsClose(&b);
+
+	/*
+	 * The free space at the end isn't copied.
+	 */
+	check(stat(name, &statBuffer) == 0);
+	check(statBuffer.st_size > (uint64_t)count * objectSize);
+	check((uint64_t)statBuffer.st_blocks * 512 < statBuffer.st_size);
+
+	check((a = dsOpen(name, 0, 1)) != NULL);
+	check(sumList() == (uint64_t)count * (count - 1) / 2);
+	check(dsCheck(&report, 0, 0) == 0);
+	check(report.badHeaders + report.badTrailers + report.badGroups == 0);
+	dsClose(&a);
+
+	unlink(name);
+
+	return 0;
+}
@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <crate.h>
+#include <list.h>
+
+#include "check.h"
+
+/*
+ * The paths the microbenchmarks time: allocation, lists and snapshots. The
+ * contents have to survive closing the crate and opening a snapshot of it.
+ */
+#define count 1000
+
+static void
+checkList(dsList *list)
+{
+	dsListEntry *e;
+	uint64_t seen = 0;
+	uint64_t sum = 0;
+
+	for (e = dsListBegin(list); e != NULL; e = dsListNext(e)) {
+		uint64_t *data = dsListData(e);
+
+		check(data != NULL);
+		sum += *data;
+		seen++;
+	}
+
+	check(seen == count);
+	check(sum == (uint64_t)count * (count - 1) / 2);
+}
+
+int main()
+{
+	const char *name = "test-basic-crate";
+	const char *snapshotName = "test-basic-snapshot";
+	dsCrate *crate;
+	dsList *list;
+	void *freed[count];
+	uint64_t i;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+	unlink(snapshotName);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check((list = dsListAlloc()) != NULL);
+	check(dsSetIndex(list, sizeof(*list)) == 0);
+
+	for (i = 0; i < count; i++) {
+		uint64_t *data = dsAlloc(sizeof(*data));
+
+		check(data != NULL);
+		*data = i;
+		check(dsListAdd(list, data) != NULL);
+		check((freed[i] = dsAlloc(i + 1)) != NULL);
+		check((uintptr_t)freed[i] % 8 == 0);
+		memset(freed[i], 0xa5, i + 1);
+	}
+
+	/*
+	 * Freed space is reused without disturbing live objects.
+	 */
+	for (i = 0; i < count; i++) {
+		check(dsFree(freed[i]) == 0);
+	}
+	for (i = 0; i < count; i++) {
+		check(dsAlloc(64) != NULL);
+	}
+	check(dsFree(NULL) < 0);
+
+	checkList(list);
+	check(dsSnapshot(snapshotName) == 0);
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check((list = dsGetIndex()) != NULL);
+	checkList(list);
+	dsClose(&crate);
+
+	check((crate = dsOpen(snapshotName, 0, 1)) != NULL);
+	check((list = dsGetIndex()) != NULL);
+	checkList(list);
+	dsClose(&crate);
+
+	unlink(name);
+	unlink(snapshotName);
+
+	return 0;
+}
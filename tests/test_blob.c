@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+#include <blob.h>
+
+#include "check.h"
+
+/*
+ * Blob stores: identical contents are kept once and share a handle, the
+ * buckets grow without losing any blob, a blob is only freed with its last
+ * reference, everything survives reopening the crate, and the hash doesn't
+ * depend on how the data is aligned.
+ */
+#define blobs 1000
+#define largeLength 5000
+
+static uint64_t handles[blobs];
+
+/*
+ * Blob i is its number followed by i % 200 bytes derived from it.
+ */
+static uint64_t
+makeBlob(uint8_t *data, uint64_t i)
+{
+	uint64_t length = sizeof(i) + i % 200, j;
+
+	memcpy(data, &i, sizeof(i));
+	for (j = sizeof(i); j < length; j++) {
+		data[j] = (uint8_t)(i * 7 + j);
+	}
+
+	return length;
+}
+
+static void
+checkBlob(uint64_t i)
+{
+	uint8_t data[sizeof(i) + 200];
+	uint64_t length, expected;
+	void *contents;
+
+	expected = makeBlob(data, i);
+	check((contents = dsBlobGet(handles[i], &length)) != NULL);
+	check(length == expected);
+	check(memcmp(contents, data, length) == 0);
+}
+
+static void
+fill(dsBlobStore *store)
+{
+	uint8_t data[sizeof(uint64_t) + 200];
+	uint64_t i, length, empty;
+
+	for (i = 0; i < blobs; i++) {
+		length = makeBlob(data, i);
+		check((handles[i] = dsBlobPut(store, data, length)) != UINT64_MAX);
+	}
+	check(dsBlobCount(store) == blobs);
+
+	/*
+	 * The same contents again, from a different buffer, is the same blob.
+	 */
+	for (i = 0; i < blobs; i += 2) {
+		length = makeBlob(data, i);
+		check(dsBlobPut(store, data, length) == handles[i]);
+	}
+	check(dsBlobCount(store) == blobs);
+
+	check((empty = dsBlobPut(store, NULL, 0)) != UINT64_MAX);
+	check(dsBlobPut(store, "", 0) == empty);
+	check(dsBlobCount(store) == blobs + 1);
+
+	errno = 0;
+	check((dsBlobPut(store, NULL, 1) == UINT64_MAX) && (errno == EINVAL));
+	errno = 0;
+	check((dsBlobGet(UINT64_MAX, NULL) == NULL) && (errno == EINVAL));
+	errno = 0;
+	check((dsBlobRetain(dsOffset(store)) < 0) && (errno == EINVAL));
+}
+
+/*
+ * Even blobs were put twice, every third one is retained once more.
+ */
+static uint64_t
+refs(uint64_t i)
+{
+	return 1 + (i % 2 == 0) + (i % 3 == 0);
+}
+
+static void
+testRelease(dsBlobStore *store)
+{
+	uint64_t i, r, left = blobs;
+
+	for (i = 0; i < blobs; i += 3) {
+		check(dsBlobRetain(handles[i]) == 0);
+	}
+
+	/*
+	 * Drop all but one reference, nothing goes.
+	 */
+	for (i = 0; i < blobs; i++) {
+		for (r = 1; r < refs(i); r++) {
+			check(dsBlobRelease(store, handles[i]) == 0);
+		}
+		checkBlob(i);
+	}
+	check(dsBlobCount(store) == blobs + 1);
+
+	/*
+	 * An aborted release leaves the blob in place.
+	 */
+	check(dsBegin() == 0);
+	check(dsBlobRelease(store, handles[1]) == 0);
+	check(dsBlobCount(store) == blobs);
+	check(dsAbort() == 0);
+	check(dsBlobCount(store) == blobs + 1);
+	checkBlob(1);
+
+	for (i = 0; i < blobs; i += 5) {
+		check(dsBlobRelease(store, handles[i]) == 0);
+		left--;
+	}
+	check(dsBlobCount(store) == left + 1);
+
+	errno = 0;
+	check((dsBlobRelease(store, dsOffset(store)) < 0) && (errno == EINVAL));
+	errno = 0;
+	check((dsBlobRelease(NULL, handles[1]) < 0) && (errno == EINVAL));
+
+	for (i = 0; i < blobs; i++) {
+		if (i % 5 != 0) {
+			checkBlob(i);
+		}
+	}
+}
+
+/*
+ * Long enough for the vector code, at every offset within a vector.
+ */
+static void
+testHash()
+{
+	static uint8_t buffer[largeLength + 64];
+	uint64_t hash, i;
+
+	for (i = 0; i < largeLength; i++) {
+		buffer[i] = (uint8_t)(i * 31 + (i >> 8));
+	}
+	hash = dsBlobHash(buffer, largeLength);
+	check(hash != dsBlobHash(buffer, largeLength - 1));
+
+	for (i = 1; i < 64; i++) {
+		memmove(buffer + i, buffer + i - 1, largeLength);
+		check(dsBlobHash(buffer + i, largeLength) == hash);
+	}
+}
+
+int main()
+{
+	const char *name = "test-blob-crate";
+	dsCrate *crate;
+	dsBlobStore *store;
+	uint64_t i;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	testHash();
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check((store = dsBlobStoreAlloc()) != NULL);
+	check(dsSetIndex(store, sizeof(*store)) == 0);
+	fill(store);
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check((store = dsGetIndex()) != NULL);
+	check(dsBlobCount(store) == blobs + 1);
+	for (i = 0; i < blobs; i++) {
+		checkBlob(i);
+	}
+	testRelease(store);
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check((store = dsGetIndex()) != NULL);
+	for (i = 1; i < blobs; i++) {
+		if (i % 5 != 0) {
+			checkBlob(i);
+		}
+	}
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
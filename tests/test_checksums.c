@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+
+#include "check.h"
+
+/*
+ * Checksums: objects match once a sync or commit has checksummed them, a
+ * change that wasn't marked or a byte flipped in the file is caught by
+ * dsVerify() and dsScrub(), and an aborted transaction puts the checksum
+ * back with the contents.
+ */
+#define count 64
+#define objectSize 100
+
+typedef struct testIndex {
+	uint64_t offsets[count];
+} testIndex;
+
+static dsCrate *
+openCrate(const char *name, int create, int checksums)
+{
+	dsOpenOptions options = {
+		.create = create, .active = 1, .checksums = checksums
+	};
+
+	return dsOpenWith(name, &options);
+}
+
+static uint8_t *
+object(int i)
+{
+	testIndex *index = dsGetIndex();
+
+	return dsPtr(index->offsets[i], objectSize);
+}
+
+static uint64_t
+scrub(int threads)
+{
+	dsScrubReport report;
+
+	check(dsScrub(&report, threads) == 0);
+	check(report.checksums == count);
+
+	return report.badChecksums;
+}
+
+static void
+checkBad(uint8_t *address)
+{
+	errno = 0;
+	check(dsVerify(address) < 0);
+	check(errno == EBADMSG);
+}
+
+static void
+setUp()
+{
+	testIndex *index;
+	uint8_t *data;
+	int i;
+
+	check((index = dsAlloc(sizeof(*index))) != NULL);
+	check(dsSetIndex(index, sizeof(*index)) == 0);
+	for (i = 0; i < count; i++) {
+		check((data = dsAlloc(objectSize)) != NULL);
+		memset(data, i, objectSize);
+		index->offsets[i] = dsOffset(data);
+
+		/*
+		 * Never marked, so there is nothing to check yet.
+		 */
+		check(dsVerify(data) == 0);
+		check(dsMarkDirty(data) == 0);
+	}
+	check(dsSync(1) == 0);
+
+	for (i = 0; i < count; i++) {
+		check(dsVerify(object(i)) == 0);
+	}
+	check(scrub(0) == 0);
+}
+
+static void
+testChanges()
+{
+	uint8_t *data = object(3);
+
+	data[0]++;
+	checkBad(data);
+	check(scrub(0) == 1);
+
+	check(dsBegin() == 0);
+	check(dsTxAdd(data, objectSize) == 0);
+	data[1]++;
+	check(dsMarkDirty(data) == 0);
+	check(dsCommit() == 0);
+	check(dsVerify(data) == 0);
+
+	data = object(5);
+	check(dsBegin() == 0);
+	check(dsTxAdd(data, objectSize) == 0);
+	memset(data, 0xff, objectSize);
+	check(dsMarkDirty(data) == 0);
+	check(dsAbort() == 0);
+	check(data[0] == 5);
+	check(dsVerify(data) == 0);
+	check(scrub(0) == 0);
+}
+
+/*
+ * Flip a byte of object 7 behind the crate's back.
+ */
+static void
+corrupt(const char *name)
+{
+	testIndex *index = dsGetIndex();
+	uint64_t offset = index->offsets[7] + objectSize / 2;
+	dsCrate *crate = dsGet();
+	uint8_t byte;
+	int fd;
+
+	dsClose(&crate);
+
+	check((fd = open(name, O_RDWR)) >= 0);
+	check(pread(fd, &byte, 1, offset) == 1);
+	byte ^= 0x10;
+	check(pwrite(fd, &byte, 1, offset) == 1);
+	close(fd);
+}
+
+int main()
+{
+	const char *name = "test-checksums-crate";
+	dsCrate *crate;
+	uint8_t *data;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = openCrate(name, 1, 1)) != NULL);
+	setUp();
+	testChanges();
+	corrupt(name);
+
+	check((crate = openCrate(name, 0, 1)) != NULL);
+	checkBad(object(7));
+	check(dsVerify(object(6)) == 0);
+	check(scrub(4) == 1);
+	dsClose(&crate);
+
+	/*
+	 * Without the option, marking does nothing and nothing is checked.
+	 */
+	check((crate = openCrate(NULL, 1, 0)) != NULL);
+	check((data = dsAlloc(objectSize)) != NULL);
+	check(dsMarkDirty(data) == 0);
+	check(dsSync(1) == 0);
+	data[0]++;
+	check(dsVerify(data) == 0);
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+#include <list.h>
+
+#include "check.h"
+
+/*
+ * Garbage collection: whatever the index reaches through offsets in untyped
+ * data and from there through a list survives. Everything else is freed,
+ * cycles included, and collecting again finds nothing more.
+ */
+#define count 100
+#define garbage 50
+
+static uint64_t
+countLive()
+{
+	dsCrateStats stats;
+	uint64_t live = 0;
+	int i;
+
+	check(dsStats(&stats) == 0);
+	for (i = 0; i < DS_STATS_GROUPS; i++) {
+		live += stats.liveObjects[i];
+	}
+
+	return live;
+}
+
+static dsList *
+getList()
+{
+	uint64_t *holder = dsGetIndex();
+
+	return dsPtr(holder[0], sizeof(dsList));
+}
+
+static uint64_t
+sumList(dsList *list)
+{
+	dsListEntry *e;
+	uint64_t sum = 0;
+
+	for (e = dsListBegin(list); e != NULL; e = dsListNext(e)) {
+		sum += *(uint64_t *)dsListData(e);
+	}
+
+	return sum;
+}
+
+/*
+ * Unreachable objects, two of them pointing at each other.
+ */
+static void
+makeGarbage()
+{
+	uint64_t *first, *second;
+	int i;
+
+	for (i = 0; i < garbage; i++) {
+		check(dsAlloc(64) != NULL);
+	}
+
+	check((first = dsAlloc(sizeof(*first))) != NULL);
+	check((second = dsAlloc(sizeof(*second))) != NULL);
+	*first = dsOffset(second);
+	*second = dsOffset(first);
+}
+
+static void
+checkReachable(uint64_t live)
+{
+	uint64_t *holder;
+
+	check(countLive() == live);
+	check(dsListCount(getList()) == count);
+	check(sumList(getList()) == (uint64_t)count * (count - 1) / 2);
+
+	holder = dsGetIndex();
+	check(*(uint64_t *)dsPtr(holder[1], sizeof(uint64_t)) == 42);
+	check(holder[2] == 7);
+}
+
+int main()
+{
+	dsCollectReport report;
+	dsCrate *crate;
+	dsList *list;
+	uint64_t *holder, *value, live, i;
+
+	dsLogger(NULL, NULL);
+
+	check((crate = dsOpen(NULL, 1, 1)) != NULL);
+	check((list = dsListAlloc()) != NULL);
+	for (i = 0; i < count; i++) {
+		check((value = dsAlloc(sizeof(*value))) != NULL);
+		*value = i;
+		check(dsListAdd(list, value) != NULL);
+	}
+
+	/*
+	 * The index isn't of a registered type, so it is scanned for anything
+	 * that looks like an offset.
+	 */
+	check((value = dsAlloc(sizeof(*value))) != NULL);
+	*value = 42;
+	check((holder = dsAlloc(3 * sizeof(*holder))) != NULL);
+	holder[0] = dsOffset(list);
+	holder[1] = dsOffset(value);
+	holder[2] = 7;
+	check(dsSetIndex(holder, 3 * sizeof(*holder)) == 0);
+
+	live = countLive();
+	makeGarbage();
+	check(countLive() == live + garbage + 2);
+
+	check(dsCollect(&report, 0) == 0);
+	check(report.freedObjects == garbage + 2);
+	check(report.liveObjects == live);
+	checkReachable(live);
+
+	/*
+	 * Again with several marking threads, nothing is left to free.
+	 */
+	check(dsCollect(&report, 4) == 0);
+	check(report.freedObjects == 0);
+	checkReachable(live);
+
+	/*
+	 * Not while anything may hold pointers the collector can't see.
+	 */
+	check(dsBegin() == 0);
+	errno = 0;
+	check(dsCollect(&report, 0) < 0);
+	check(errno == EBUSY);
+	check(dsAbort() == 0);
+
+	check(dsEpochEnter() == 0);
+	errno = 0;
+	check(dsCollect(&report, 0) < 0);
+	check(errno == EBUSY);
+	check(dsEpochExit() == 0);
+
+	dsClose(&crate);
+
+	return 0;
+}
@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+#include <list.h>
+
+#include "check.h"
+
+/*
+ * Compaction in slices: every slice stays close to its budget however large
+ * the crate is, and the lists come out whole even when they change between
+ * slices. A slice that traced the whole crate would take milliseconds here.
+ * Slices are timed in CPU time, so being preempted doesn't count.
+ */
+#define count 50000
+#define budget 100
+#define maxAverage 1000
+#define maxSlice 10000
+
+static uint64_t nextValue = count;
+
+static uint64_t
+sumList(dsList *list)
+{
+	dsListEntry *e;
+	uint64_t sum = 0;
+
+	for (e = dsListBegin(list); e != NULL; e = dsListNext(e)) {
+		sum += *(uint64_t *)dsListData(e);
+	}
+
+	return sum;
+}
+
+static uint64_t
+elapsedMicroseconds(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+		   (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Every data object is on the list, every fourth also on the concurrent
+ * one. Freeing the gaps leaves a hole in front of each.
+ */
+static void
+fill(uint64_t *sum, uint64_t *concurrentSum)
+{
+	dsList *list, *concurrent;
+	void **gaps;
+	uint64_t i;
+
+	check((gaps = malloc(count * sizeof(*gaps))) != NULL);
+	check((list = dsListAlloc()) != NULL);
+	check(dsSetIndex(list, sizeof(*list)) == 0);
+	check((concurrent = dsListAllocConcurrent()) != NULL);
+	check(dsSetRoot("concurrent", concurrent, sizeof(*concurrent)) == 0);
+
+	for (i = 0; i < count; i++) {
+		uint64_t *data;
+
+		check((gaps[i] = dsAlloc(64)) != NULL);
+		check((data = dsAlloc(sizeof(*data))) != NULL);
+		*data = i;
+		check(dsListAdd(list, data) != NULL);
+		*sum += i;
+		if (i % 4 == 0) {
+			check(dsListAdd(concurrent, data) != NULL);
+			*concurrentSum += i;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		check(dsFree(gaps[i]) == 0);
+	}
+	free(gaps);
+
+	check(dsMarkDirty(list) == 0);
+}
+
+/*
+ * Add to both lists and take the newest entries off again, which leaves
+ * objects to move and offsets to follow behind the slices.
+ */
+static void
+change(uint64_t slice, uint64_t *sum, uint64_t *concurrentSum)
+{
+	dsList *list = dsGetIndex();
+	dsList *concurrent = dsGetRoot("concurrent", NULL);
+	uint64_t *data;
+
+	check((data = dsAlloc(sizeof(*data))) != NULL);
+	*data = nextValue++;
+	check(dsListAdd(list, data) != NULL);
+	check(dsListAdd(concurrent, data) != NULL);
+	*sum += *data;
+	*concurrentSum += *data;
+
+	if (slice % 2 == 0) {
+		data = dsListData(dsListBegin(list));
+		*sum -= *data;
+		*concurrentSum -= *data;
+		check(dsListDel(list, data) == 0);
+		check(dsListDel(concurrent, data) == 0);
+		check(dsListPurge(concurrent) == 0);
+		check(dsFree(data) == 0);
+	}
+
+	check(dsMarkDirty(list) == 0);
+}
+
+int main()
+{
+	dsOpenOptions options = {.create = 1, .active = 1, .checksums = 1};
+	dsCrate *crate;
+	struct timespec start;
+	uint64_t sum = 0, concurrentSum = 0;
+	uint64_t slices = 0, total = 0, longest = 0, took;
+	int ret;
+
+	dsLogger(NULL, NULL);
+
+	check((crate = dsOpenWith(NULL, &options)) != NULL);
+	fill(&sum, &concurrentSum);
+
+	do {
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+		ret = dsCompact(budget);
+		took = elapsedMicroseconds(&start);
+
+		total += took;
+		if (took > longest) {
+			longest = took;
+		}
+		check(++slices < 1000000);
+
+		if (ret == 1) {
+			change(slices, &sum, &concurrentSum);
+		}
+	} while (ret == 1);
+	check(ret == 0);
+
+	printf("%" PRIu64 " slices, %" PRIu64 " us on average, %" PRIu64
+		   " us at most\n", slices, total / slices, longest);
+	check(total / slices < maxAverage);
+	check(longest < maxSlice);
+
+	check(sumList(dsGetIndex()) == sum);
+	check(sumList(dsGetRoot("concurrent", NULL)) == concurrentSum);
+	check(dsVerify(dsGetIndex()) == 0);
+
+	/*
+	 * Nothing is left to move.
+	 */
+	check(dsCompact(0) == 0);
+	check(sumList(dsGetIndex()) == sum);
+
+	dsClose(&crate);
+
+	return 0;
+}
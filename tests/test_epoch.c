@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+#include <list.h>
+
+#include "check.h"
+
+#define count 2000
+
+static dsCrate *shared;
+static int stop;
+
+static uint64_t
+sumList()
+{
+	dsList *list = dsGetIndex();
+	dsListEntry *e;
+	uint64_t sum = 0;
+
+	for (e = dsListBegin(list); e != NULL; e = dsListNext(e)) {
+		sum += *(uint64_t *)dsListData(e);
+	}
+
+	return sum;
+}
+
+/*
+ * Nothing may move while a read section is open, so the list adds up the
+ * same from start to end of every section.
+ */
+static void *
+readerThread(void *arg)
+{
+	uint64_t *rounds = arg;
+
+	dsSet(shared);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		check(dsEpochEnter() == 0);
+		check(sumList() == (uint64_t)count * (count - 1) / 2);
+		check(sumList() == (uint64_t)count * (count - 1) / 2);
+		check(dsEpochExit() == 0);
+		(*rounds)++;
+	}
+
+	return NULL;
+}
+
+static void
+fill()
+{
+	dsList *list;
+	void *gaps[count];
+	uint64_t i;
+
+	check((list = dsListAlloc()) != NULL);
+	check(dsSetIndex(list, sizeof(*list)) == 0);
+	for (i = 0; i < count; i++) {
+		uint64_t *data;
+
+		check((gaps[i] = dsAlloc(256)) != NULL);
+		check((data = dsAlloc(sizeof(*data))) != NULL);
+		*data = i;
+		check(dsListAdd(list, data) != NULL);
+	}
+	for (i = 0; i < count; i++) {
+		check(dsFree(gaps[i]) == 0);
+	}
+}
+
+int main()
+{
+	dsCrate *a, *b;
+	dsCollectReport report;
+	pthread_t reader;
+	uint64_t rounds = 0;
+	int compactions = 0;
+	int ret;
+
+	dsLogger(NULL, NULL);
+
+	/*
+	 * Read sections of two crates nest in any order.
+	 */
+	check((a = dsOpen(NULL, 1, 0)) != NULL);
+	check((b = dsOpen(NULL, 1, 0)) != NULL);
+	check(dsSet(a) == 0);
+	check(dsEpochEnter() == 0);
+	check(dsSet(b) == 0);
+	check(dsEpochEnter() == 0);
+	check(dsEpochExit() == 0);
+	check(dsEpochExit() < 0 && errno == EINVAL);
+	check(dsSet(a) == 0);
+	check(dsEpochExit() == 0);
+
+	/*
+	 * With every section closed, A can still reclaim and compact.
+	 */
+	fill();
+	while ((ret = dsCompact(0)) == 1) {
+		check(++compactions < 100);
+	}
+	check(ret == 0);
+	check(sumList() == (uint64_t)count * (count - 1) / 2);
+
+	/*
+	 * An open section holds off compaction and collection.
+	 */
+	check(dsEpochEnter() == 0);
+	check(dsCompact(0) == 1);
+	check(dsCollect(&report, 1) < 0 && errno == EBUSY);
+	check(dsEpochExit() == 0);
+	check(dsCollect(&report, 1) == 0);
+
+	dsClose(&a);
+	dsClose(&b);
+
+	/*
+	 * Readers entering while a slice runs wait for it.
+	 */
+	check((shared = dsOpen(NULL, 1, 1)) != NULL);
+	fill();
+	check(pthread_create(&reader, NULL, readerThread, &rounds) == 0);
+	for (compactions = 0; compactions < 2000; compactions++) {
+		void *gap;
+
+		check((gap = dsAlloc(128)) != NULL);
+		check(dsAlloc(8) != NULL);
+		check(dsFree(gap) == 0);
+		check(dsCompact(20) >= 0);
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	check(pthread_join(reader, NULL) == 0);
+	check(rounds > 0);
+	check(sumList() == (uint64_t)count * (count - 1) / 2);
+	dsClose(&shared);
+
+	return 0;
+}
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+#include <list.h>
+
+#include "check.h"
+
+/*
+ * Export and import: every live object comes across with its offsets
+ * rewritten, whatever it holds, while undo logs and objects freed under a
+ * reader stay behind.
+ */
+#define count 100
+
+static dsCrate *source;
+static int entered;
+static int stop;
+
+static uint64_t
+countLive()
+{
+	dsCrateStats stats;
+	uint64_t live = 0;
+	int i;
+
+	check(dsStats(&stats) == 0);
+	for (i = 0; i < DS_STATS_GROUPS; i++) {
+		live += stats.liveObjects[i];
+	}
+
+	return live;
+}
+
+static uint64_t
+sumList(dsList *list)
+{
+	dsListEntry *e;
+	uint64_t sum = 0;
+
+	for (e = dsListBegin(list); e != NULL; e = dsListNext(e)) {
+		sum += *(uint64_t *)dsListData(e);
+	}
+
+	return sum;
+}
+
+/*
+ * Stay in a read section, so freed objects are only retired.
+ */
+static void *
+readerThread(void *arg)
+{
+	dsSet(source);
+	check(dsEpochEnter() == 0);
+	__atomic_store_n(&entered, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		usleep(1000);
+	}
+	check(dsEpochExit() == 0);
+
+	return NULL;
+}
+
+int main()
+{
+	dsCrate *target;
+	dsList *list;
+	uint64_t *lookalike, *value;
+	pthread_t reader;
+	uint64_t live, i;
+	FILE *stream;
+
+	dsLogger(NULL, NULL);
+
+	check((source = dsOpen(NULL, 1, 1)) != NULL);
+	check((list = dsListAlloc()) != NULL);
+	check(dsSetIndex(list, sizeof(*list)) == 0);
+	for (i = 0; i < count; i++) {
+		check((value = dsAlloc(sizeof(*value))) != NULL);
+		*value = i;
+		check(dsListAdd(list, value) != NULL);
+	}
+
+	/*
+	 * Data that happens to start like an undo log is still data.
+	 */
+	check((lookalike = dsAlloc(2 * sizeof(*lookalike))) != NULL);
+	lookalike[0] = MAGIC_LIB_UNDO;
+	lookalike[1] = 42;
+	check(dsSetRoot("lookalike", lookalike, 2 * sizeof(*lookalike)) == 0);
+	live = countLive();
+
+	/*
+	 * The transaction leaves an undo log behind for the next one.
+	 */
+	check(dsBegin() == 0);
+	check(dsTxAdd(&lookalike[1], sizeof(lookalike[1])) == 0);
+	check(dsCommit() == 0);
+
+	check(pthread_create(&reader, NULL, readerThread, NULL) == 0);
+	while (!__atomic_load_n(&entered, __ATOMIC_ACQUIRE)) {
+		usleep(1000);
+	}
+	for (i = 0; i < 2; i++) {
+		check((value = dsAlloc(sizeof(*value))) != NULL);
+		check(dsFree(value) == 0);
+	}
+
+	check((stream = tmpfile()) != NULL);
+	check(dsExport(fileno(stream)) == 0);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	check(pthread_join(reader, NULL) == 0);
+
+	check((target = dsOpen(NULL, 1, 1)) != NULL);
+	check(countLive() == 0);
+	check(lseek(fileno(stream), 0, SEEK_SET) == 0);
+	check(dsImport(fileno(stream)) == 0);
+	fclose(stream);
+
+	check(countLive() == live);
+	check(dsListCount(dsGetIndex()) == count);
+	check(sumList(dsGetIndex()) == (uint64_t)count * (count - 1) / 2);
+	check((lookalike = dsGetRoot("lookalike", NULL)) != NULL);
+	check((lookalike[0] == MAGIC_LIB_UNDO) && (lookalike[1] == 42));
+
+	dsClose(&target);
+	dsClose(&source);
+
+	return 0;
+}
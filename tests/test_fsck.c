@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+#include <list.h>
+
+#include "check.h"
+
+/*
+ * Integrity checking: crate-fsck and dsCheck() find a damaged trailer, free
+ * group link and header, repairs leave a crate that checks clean, and the
+ * objects in front of the damage are still there. The tool's path is the
+ * first argument.
+ */
+#define count 100
+
+/*
+ * Object headers as the library lays them out, the trailer holding the
+ * header's offset is the last word of the object.
+ */
+#define headerSize 16
+#define freeObjectBit 0x8000000000000000
+#define lastObjectBit 0x4000000000000000
+
+static const char *name = "test-fsck-crate";
+static uint64_t offsets[count];
+
+static uint64_t
+readWord(uint64_t offset)
+{
+	uint64_t word;
+	int fd;
+
+	check((fd = open(name, O_RDONLY)) >= 0);
+	check(pread(fd, &word, sizeof(word), offset) == sizeof(word));
+	close(fd);
+
+	return word;
+}
+
+static void
+writeWord(uint64_t offset, uint64_t word)
+{
+	int fd;
+
+	check((fd = open(name, O_RDWR)) >= 0);
+	check(pwrite(fd, &word, sizeof(word), offset) == sizeof(word));
+	close(fd);
+}
+
+static uint64_t
+objectLength(uint64_t header)
+{
+	return readWord(header) & ~(freeObjectBit | lastObjectBit);
+}
+
+static int
+runFsck(const char *fsck, const char *options)
+{
+	char command[4096];
+	int status;
+
+	snprintf(command, sizeof(command), "%s %s %s >/dev/null", fsck, options,
+			 name);
+	check((status = system(command)) != -1);
+	check(WIFEXITED(status));
+
+	return WEXITSTATUS(status);
+}
+
+static uint64_t
+sumList()
+{
+	dsListEntry *e;
+	uint64_t sum = 0;
+
+	for (e = dsListBegin(dsGetIndex()); e != NULL; e = dsListNext(e)) {
+		sum += *(uint64_t *)dsListData(e);
+	}
+
+	return sum;
+}
+
+static void
+checkClean(dsCheckReport *report)
+{
+	check(dsCheck(report, 0, 0) == 0);
+	check(report->badHeaders == 0);
+	check(report->badTrailers == 0);
+	check(report->badLastObjects == 0);
+	check(report->badGroups == 0);
+	check(report->misalignedObjects == 0);
+}
+
+static void
+makeCrate()
+{
+	dsCrate *crate;
+	dsList *list;
+	uint64_t i, *data;
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check((list = dsListAlloc()) != NULL);
+	check(dsSetIndex(list, sizeof(*list)) == 0);
+	for (i = 0; i < count; i++) {
+		check((data = dsAlloc(sizeof(*data))) != NULL);
+		*data = i;
+		check(dsListAdd(list, data) != NULL);
+		offsets[i] = dsOffset(data) - headerSize;
+	}
+	check(dsSync(1) == 0);
+	dsClose(&crate);
+}
+
+/*
+ * Repaired by the tool.
+ */
+static void
+testTrailer(const char *fsck)
+{
+	uint64_t header = offsets[10];
+
+	check(runFsck(fsck, "") == 0);
+	writeWord(header + objectLength(header) - sizeof(uint64_t), 12345);
+
+	check(runFsck(fsck, "") == 4);
+	check(runFsck(fsck, "-r -j 2") == 1);
+	check(runFsck(fsck, "") == 0);
+	check(readWord(header + objectLength(header) - sizeof(uint64_t)) ==
+		  header);
+}
+
+/*
+ * Point the free space after the last object into the group of an
+ * allocated one.
+ */
+static void
+testGroup()
+{
+	dsCheckReport report;
+	dsCrate *crate;
+	uint64_t header = offsets[count - 1];
+
+	while (!(readWord(header) & freeObjectBit)) {
+		header += objectLength(header);
+	}
+	writeWord(header + sizeof(uint64_t), offsets[0]);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check(dsCheck(&report, 0, 0) == 0);
+	check(report.badGroups > 0);
+	check(report.objects > count);
+	check(dsCheck(&report, 4, 1) == 0);
+	check(report.repairs > 0);
+	checkClean(&report);
+
+	check(sumList() == (uint64_t)count * (count - 1) / 2);
+	check(dsAlloc(64) != NULL);
+	dsClose(&crate);
+}
+
+/*
+ * Nothing after a bad header can be found again, the rest of the crate
+ * becomes free space.
+ */
+static void
+testHeader()
+{
+	dsCheckReport report;
+	dsCrate *crate;
+	uint64_t objects, *data;
+
+	writeWord(offsets[50], 1ULL << 50);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check(dsCheck(&report, 0, 0) == 0);
+	check(report.badHeaders == 1);
+	check(report.lostBytes > 0);
+	objects = report.objects;
+
+	check(dsCheck(&report, 0, 1) == 0);
+	check(report.repairs > 0);
+	checkClean(&report);
+	check(report.objects == objects + 1);
+	check(report.freeObjects == 1);
+
+	check(*(uint64_t *)dsPtr(offsets[49] + headerSize, sizeof(*data)) == 49);
+	check((data = dsAlloc(sizeof(*data))) != NULL);
+	check(dsOffset(data) - headerSize == offsets[50]);
+	dsClose(&crate);
+}
+
+int main(int argc, char **argv)
+{
+	dsLogger(NULL, NULL);
+	check(argc == 2);
+	unlink(name);
+
+	makeCrate();
+	testTrailer(argv[1]);
+	testGroup();
+	testHeader();
+
+	unlink(name);
+
+	return 0;
+}
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <crate.h>
+#include <heap.h>
+
+#include "check.h"
+
+/*
+ * Heaps: items pushed one at a time and in bulk, some with lowered keys,
+ * come out smallest first after reopening the crate, an aborted pop leaves
+ * the heap as it was, and handles of popped items are reused.
+ */
+#define count 1000
+
+static uint64_t keys[2 * count];
+static uint64_t handles[2 * count];
+static int popped[2 * count];
+
+static uint64_t
+nextKey(uint64_t *state)
+{
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+
+	return (*state >> 33) % 100000;
+}
+
+/*
+ * Each item's data holds its number.
+ */
+static void *
+makeData(uint64_t i)
+{
+	uint64_t *data;
+
+	check((data = dsAlloc(sizeof(*data))) != NULL);
+	*data = i;
+
+	return data;
+}
+
+static void
+fill(dsHeap *heap)
+{
+	void *data[count];
+	uint64_t state = 1;
+	uint64_t i;
+
+	for (i = 0; i < count; i++) {
+		keys[i] = nextKey(&state);
+		check((handles[i] = dsHeapPush(heap, keys[i], makeData(i))) !=
+			  UINT64_MAX);
+	}
+
+	for (i = count; i < 2 * count; i++) {
+		keys[i] = nextKey(&state);
+		data[i - count] = makeData(i);
+	}
+	check(dsHeapPushBulk(heap, keys + count, data, count,
+						 handles + count) == 0);
+	check(dsHeapCount(heap) == 2 * count);
+
+	for (i = 0; i < 2 * count; i += 10) {
+		keys[i] /= 2;
+		check(dsHeapDecreaseKey(heap, handles[i], keys[i]) == 0);
+	}
+
+	errno = 0;
+	check((dsHeapDecreaseKey(heap, handles[1], keys[1] + 1) < 0) &&
+		  (errno == EINVAL));
+	errno = 0;
+	check((dsHeapDecreaseKey(heap, 2 * count, 0) < 0) && (errno == EINVAL));
+}
+
+static void
+testAbort(dsHeap *heap)
+{
+	uint64_t key, *data;
+
+	check((data = dsHeapPeek(heap, &key)) != NULL);
+
+	check(dsBegin() == 0);
+	check(dsHeapPop(heap, NULL) == data);
+	check(dsHeapPop(heap, NULL) != NULL);
+	check(dsAbort() == 0);
+
+	check(dsHeapCount(heap) == 2 * count);
+	check(dsHeapPeek(heap, NULL) == data);
+}
+
+static void
+drain(dsHeap *heap)
+{
+	uint64_t i, key, last = 0, *data;
+
+	for (i = 0; i < 2 * count; i++) {
+		check((data = dsHeapPop(heap, &key)) != NULL);
+		check(key >= last);
+		check((*data < 2 * count) && !popped[*data]);
+		check(keys[*data] == key);
+		popped[*data] = 1;
+		last = key;
+	}
+	check(dsHeapCount(heap) == 0);
+
+	errno = 0;
+	check((dsHeapPeek(heap, NULL) == NULL) && (errno == ENOENT));
+	errno = 0;
+	check((dsHeapPop(heap, NULL) == NULL) && (errno == ENOENT));
+}
+
+int main()
+{
+	const char *name = "test-heap-crate";
+	dsCrate *crate;
+	dsHeap *heap;
+	uint64_t handle;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check((heap = dsHeapAlloc()) != NULL);
+	check(dsSetIndex(heap, sizeof(*heap)) == 0);
+	fill(heap);
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check((heap = dsGetIndex()) != NULL);
+	testAbort(heap);
+	drain(heap);
+
+	check((handle = dsHeapPush(heap, 1, makeData(0))) != UINT64_MAX);
+	check(handle < 2 * count);
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
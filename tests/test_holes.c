@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+
+#include "check.h"
+
+/*
+ * Hole punching: freeing an object of 1 MiB or more, on its own or after
+ * merging with its free neighbors, gives its pages back to the file system,
+ * smaller free objects keep theirs, and the objects around them are left
+ * alone.
+ */
+#define bigLength (3 << 20)
+#define smallLength (600 << 10)
+
+static const char *name = "test-holes-crate";
+
+static uint64_t
+fileBytes()
+{
+	struct stat statBuffer;
+
+	check(stat(name, &statBuffer) == 0);
+
+	return (uint64_t)statBuffer.st_blocks * 512;
+}
+
+/*
+ * Fill an object of 'length' bytes, followed by a small one that keeps it
+ * from merging with the free space after it.
+ */
+static uint8_t *
+allocate(uint64_t length, uint64_t **guard)
+{
+	uint8_t *object;
+
+	check((object = dsAlloc(length)) != NULL);
+	check((*guard = dsAlloc(sizeof(**guard))) != NULL);
+	**guard = length;
+	memset(object, 0x5a, length);
+
+	return object;
+}
+
+static void
+testBig()
+{
+	uint64_t *guard, before;
+	uint8_t *big;
+
+	big = allocate(bigLength, &guard);
+	check(dsSync(1) == 0);
+	before = fileBytes();
+
+	check(dsFree(big) == 0);
+	check(before - fileBytes() >= bigLength - (64 << 10));
+	check(*guard == bigLength);
+}
+
+static void
+testMerged()
+{
+	uint64_t *guard, before;
+	uint8_t *first, *second;
+
+	check((first = dsAlloc(smallLength)) != NULL);
+	second = allocate(smallLength, &guard);
+	memset(first, 0x5a, smallLength);
+	check(dsSync(1) == 0);
+	before = fileBytes();
+
+	check(dsFree(first) == 0);
+	check(fileBytes() == before);
+	check(dsFree(second) == 0);
+	check(before - fileBytes() >= 2 * smallLength - (64 << 10));
+	check(*guard == smallLength);
+}
+
+int main()
+{
+	dsCheckReport report;
+	dsCrate *crate;
+	uint64_t *first;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check((first = dsAlloc(sizeof(*first))) != NULL);
+	*first = 42;
+	check(dsSetIndex(first, sizeof(*first)) == 0);
+	testBig();
+	testMerged();
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check(*(uint64_t *)dsGetIndex() == 42);
+	check(dsCheck(&report, 0, 0) == 0);
+	check(report.badHeaders + report.badTrailers + report.badGroups == 0);
+	check(dsAlloc(2 * smallLength) != NULL);
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+#include <list.h>
+
+#include "check.h"
+
+/*
+ * List iterators: dsListForEach() visits the same entries as dsListBegin()
+ * and dsListNext(), in the same order, for empty, short and long lists,
+ * plain and concurrent, and across a reopen of the crate. The typed wrappers
+ * from DS_LIST_DEFINE hand out the same data.
+ */
+#define count 1000
+
+typedef struct testPoint {
+	uint64_t x;
+	uint64_t y;
+} testPoint;
+
+DS_LIST_DEFINE(points, testPoint)
+
+static void
+fill(dsList *list, uint64_t n)
+{
+	testPoint *p;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		check((p = dsAlloc(sizeof(*p))) != NULL);
+		p->x = i;
+		p->y = 2 * i;
+		check(pointsAdd(list, p) != NULL);
+	}
+}
+
+static void
+checkList(dsList *list, uint64_t n)
+{
+	dsListIter iter;
+	dsListEntry *entry, *e;
+	testPoint *p;
+	uint64_t seen = 0;
+
+	e = dsListBegin(list);
+	dsListForEach(&iter, list, entry) {
+		check(entry == e);
+		check(dsListIterData(&iter) == dsListData(e));
+		p = dsListIterData(&iter);
+		check((p->x == n - 1 - seen) && (p->y == 2 * p->x));
+		e = dsListNext(e);
+		seen++;
+	}
+	check((e == NULL) && (seen == n));
+
+	seen = 0;
+	for (p = pointsFirst(&iter, list); p != NULL; p = pointsNext(&iter)) {
+		check((p->x == n - 1 - seen) && (p->y == 2 * p->x));
+		seen++;
+	}
+	check(seen == n);
+}
+
+int main()
+{
+	const char *name = "test-iter-crate";
+	dsCrate *crate;
+	dsList *lists[4];
+	uint64_t *offsets, i;
+	dsListIter iter;
+	testPoint *p;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check((offsets = dsAlloc(4 * sizeof(*offsets))) != NULL);
+	check(dsSetIndex(offsets, 4 * sizeof(*offsets)) == 0);
+	check((lists[0] = dsListAlloc()) != NULL);
+	check((lists[1] = dsListAlloc()) != NULL);
+	check((lists[2] = dsListAlloc()) != NULL);
+	check((lists[3] = dsListAllocConcurrent()) != NULL);
+	for (i = 0; i < 4; i++) {
+		offsets[i] = dsOffset(lists[i]);
+	}
+
+	fill(lists[1], 3);
+	fill(lists[2], count);
+	fill(lists[3], count);
+	checkList(lists[0], 0);
+	checkList(lists[1], 3);
+	checkList(lists[2], count);
+	checkList(lists[3], count);
+
+	/*
+	 * Deleting through the typed wrapper.
+	 */
+	check((p = pointsFirst(&iter, lists[1])) != NULL);
+	check(pointsDel(lists[1], p) == 0);
+	checkList(lists[1], 2);
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	offsets = dsGetIndex();
+	for (i = 0; i < 4; i++) {
+		check((lists[i] = dsPtr(offsets[i], sizeof(dsList))) != NULL);
+	}
+	checkList(lists[0], 0);
+	checkList(lists[1], 2);
+	checkList(lists[2], count);
+	checkList(lists[3], count);
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
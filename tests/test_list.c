@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <crate.h>
+#include <list.h>
+
+#include "check.h"
+
+/*
+ * Concurrent lists: threads adding to one list at the same time lose no
+ * entry, a reader walking it meanwhile only sees whole entries, newest
+ * first, and threads deleting at the same time each remove exactly the
+ * entries they asked for, before and after a purge and reopening the crate.
+ */
+#define threads 4
+#define perThread 1000
+#define total (threads * perThread)
+
+static dsCrate *crate;
+static int adding;
+
+static void *
+addThread(void *arg)
+{
+	dsList *list;
+	uint64_t first = (uintptr_t)arg * perThread, i, *data;
+
+	check(dsSet(crate) == 0);
+	list = dsGetIndex();
+
+	for (i = first; i < first + perThread; i++) {
+		check((data = dsAlloc(sizeof(*data))) != NULL);
+		*data = i;
+		check(dsListAdd(list, data) != NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Each thread's entries show up in the reverse of the order it added them.
+ */
+static void *
+readThread(void *arg)
+{
+	dsListEntry *e;
+	uint64_t last[threads], *data;
+	int i, passes = 0;
+
+	check(dsSet(crate) == 0);
+
+	while (__atomic_load_n(&adding, __ATOMIC_ACQUIRE) || (passes == 0)) {
+		for (i = 0; i < threads; i++) {
+			last[i] = UINT64_MAX;
+		}
+		for (e = dsListBegin(dsGetIndex()); e != NULL; e = dsListNext(e)) {
+			check((data = dsListData(e)) != NULL);
+			check(*data < total);
+			check(*data < last[*data / perThread]);
+			last[*data / perThread] = *data;
+		}
+		passes++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Every thread deletes the odd entries it added.
+ */
+static void *
+delThread(void *arg)
+{
+	dsListEntry *e;
+	uint64_t first = (uintptr_t)arg * perThread, *data;
+	void **mine;
+	int n = 0, i;
+
+	check(dsSet(crate) == 0);
+	check((mine = malloc(perThread * sizeof(*mine))) != NULL);
+
+	for (e = dsListBegin(dsGetIndex()); e != NULL; e = dsListNext(e)) {
+		data = dsListData(e);
+		if ((*data >= first) && (*data < first + perThread) && (*data % 2)) {
+			mine[n++] = data;
+		}
+	}
+	check(n == perThread / 2);
+
+	for (i = 0; i < n; i++) {
+		check(dsListDel(dsGetIndex(), mine[i]) == 0);
+	}
+	free(mine);
+
+	return NULL;
+}
+
+static void
+run(void *(*function)(void *), int reader)
+{
+	pthread_t thread[threads + 1];
+	uintptr_t i;
+
+	__atomic_store_n(&adding, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < threads; i++) {
+		check(pthread_create(&thread[i], NULL, function, (void *)i) == 0);
+	}
+	if (reader) {
+		check(pthread_create(&thread[threads], NULL, readThread, NULL) == 0);
+	}
+	for (i = 0; i < threads; i++) {
+		check(pthread_join(thread[i], NULL) == 0);
+	}
+	__atomic_store_n(&adding, 0, __ATOMIC_RELEASE);
+	if (reader) {
+		check(pthread_join(thread[threads], NULL) == 0);
+	}
+}
+
+/*
+ * Every value in [0, total) that is a multiple of 'step' is on the list
+ * exactly once.
+ */
+static void
+checkList(uint64_t step)
+{
+	static uint8_t seen[total];
+	dsListEntry *e;
+	uint64_t n = 0, *data, i;
+
+	for (i = 0; i < total; i++) {
+		seen[i] = 0;
+	}
+	for (e = dsListBegin(dsGetIndex()); e != NULL; e = dsListNext(e)) {
+		data = dsListData(e);
+		check((*data < total) && (*data % step == 0) && !seen[*data]);
+		seen[*data] = 1;
+		n++;
+	}
+	check(n == total / step);
+	check(dsListCount(dsGetIndex()) == total / step);
+}
+
+int main()
+{
+	const char *name = "test-list-crate";
+	dsList *list;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check((list = dsListAllocConcurrent()) != NULL);
+	check(dsSetIndex(list, sizeof(*list)) == 0);
+
+	run(addThread, 1);
+	checkList(1);
+
+	run(delThread, 0);
+	checkList(2);
+	check(dsListPurge(list) == 0);
+	checkList(2);
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	checkList(2);
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
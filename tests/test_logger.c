@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+
+#include "check.h"
+
+/*
+ * Switching from asynchronous to synchronous logging while threads log
+ * loses nothing: once dsLogger() returns, every message logged before it
+ * has reached a callback.
+ */
+#define threads 4
+#define messages 500
+#define rounds 100
+
+static uint64_t received;
+static uint64_t logged;
+
+static void
+countMessage(void *userPtr, const char *format, va_list args)
+{
+	char message[64];
+
+	vsnprintf(message, sizeof(message), format, args);
+	if (strstr(message, "tick") != NULL) {
+		__atomic_add_fetch(&received, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void *
+logThread(void *arg)
+{
+	int i;
+
+	for (i = 0; i < messages; i++) {
+		dsLog("tick %d\n", i);
+		__atomic_add_fetch(&logged, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+int main()
+{
+	pthread_t thread[threads];
+	uint64_t sent = 0;
+	int round, i;
+
+	for (round = 0; round < rounds; round++) {
+		check(dsLoggerAsync(countMessage, NULL) == 0);
+		for (i = 0; i < threads; i++) {
+			check(pthread_create(&thread[i], NULL, logThread, NULL) == 0);
+		}
+
+		/*
+		 * Switch while they are still logging.
+		 */
+		while (__atomic_load_n(&logged, __ATOMIC_RELAXED) <
+			   sent + threads * messages / 2) {
+			sched_yield();
+		}
+		dsLogger(countMessage, NULL);
+		for (i = 0; i < threads; i++) {
+			check(pthread_join(thread[i], NULL) == 0);
+		}
+		sent += threads * messages;
+
+		check(__atomic_load_n(&received, __ATOMIC_RELAXED) == sent);
+	}
+
+	return 0;
+}
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <crate.h>
+
+#include "check.h"
+
+/*
+ * Buffer pools: pinned pages stay resident through scans that evict
+ * everything else, and threads faulting on many pages at once all see
+ * their own changes, before and after the crate is reopened.
+ */
+#define objectCount 256
+#define objectWords 1000
+#define poolPages 16
+#define poolSize (poolPages * (64 << 10))
+#define threads 8
+
+static dsCrate *crate;
+
+typedef struct testIndex {
+	uint64_t *objects[objectCount];
+} testIndex;
+
+static dsCrate *
+openCrate(const char *name, int create, uint64_t bytes)
+{
+	dsOpenOptions options = {
+		.create = create, .active = 1, .poolBytes = bytes
+	};
+
+	return dsOpenWith(name, &options);
+}
+
+static uint64_t
+poolLoads()
+{
+	dsCrateStats stats;
+
+	check(dsStats(&stats) == 0);
+
+	return stats.poolLoads;
+}
+
+static uint64_t
+sumObject(uint64_t *object)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < objectWords; i++) {
+		sum += object[i];
+	}
+
+	return sum;
+}
+
+static void
+scan(testIndex *index)
+{
+	int i;
+
+	for (i = 0; i < objectCount; i++) {
+		check(sumObject(index->objects[i]) == (uint64_t)i * objectWords);
+	}
+}
+
+static void
+testPin(testIndex *index)
+{
+	dsCrateStats stats;
+	uint64_t *pinned = index->objects[0];
+	uint64_t loads;
+
+	check(dsPin(pinned, objectWords * sizeof(*pinned)) == 0);
+	check(dsStats(&stats) == 0);
+	check(stats.poolPinnedBytes > 0);
+
+	scan(index);
+	scan(index);
+	check(dsStats(&stats) == 0);
+	check(stats.poolEvictions > 0);
+
+	loads = poolLoads();
+	check(sumObject(pinned) == 0);
+	check(poolLoads() == loads);
+
+	check(dsUnpin(pinned, objectWords * sizeof(*pinned)) == 0);
+	check(dsStats(&stats) == 0);
+	check(stats.poolPinnedBytes == 0);
+
+	errno = 0;
+	check(dsUnpin(pinned, objectWords * sizeof(*pinned)) < 0);
+	check(errno == EINVAL);
+}
+
+/*
+ * Add one to every word of this thread's objects, then read them all.
+ */
+static void *
+changeThread(void *arg)
+{
+	uint64_t thread = (uintptr_t)arg;
+	testIndex *index;
+	int i, j;
+
+	check(dsSet(crate) == 0);
+	check((index = dsGetIndex()) != NULL);
+
+	for (i = thread; i < objectCount; i += threads) {
+		uint64_t *object = index->objects[i];
+
+		for (j = 0; j < objectWords; j++) {
+			object[j]++;
+		}
+	}
+
+	for (i = thread; i < objectCount; i += threads) {
+		check(sumObject(index->objects[i]) ==
+			  ((uint64_t)i + 1) * objectWords);
+	}
+
+	return NULL;
+}
+
+static void
+testThreads(testIndex *index)
+{
+	pthread_t thread[threads];
+	uint64_t i;
+
+	for (i = 0; i < threads; i++) {
+		check(pthread_create(&thread[i], NULL, changeThread,
+							 (void *)(uintptr_t)i) == 0);
+	}
+	for (i = 0; i < threads; i++) {
+		check(pthread_join(thread[i], NULL) == 0);
+	}
+}
+
+int main()
+{
+	const char *name = "test-pool-crate";
+	testIndex *index;
+	int i, j;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = openCrate(name, 1, poolSize)) != NULL);
+	check((index = dsAlloc(sizeof(*index))) != NULL);
+	check(dsSetIndex(index, sizeof(*index)) == 0);
+	for (i = 0; i < objectCount; i++) {
+		check((index->objects[i] =
+				   dsAlloc(objectWords * sizeof(uint64_t))) != NULL);
+		for (j = 0; j < objectWords; j++) {
+			index->objects[i][j] = i;
+		}
+	}
+	check(dsSync(1) == 0);
+
+	testPin(index);
+	testThreads(index);
+	dsClose(&crate);
+
+	/*
+	 * Every change was written back.
+	 */
+	check((crate = openCrate(name, 0, 0)) != NULL);
+	check((index = dsGetIndex()) != NULL);
+	for (i = 0; i < objectCount; i++) {
+		check(sumObject(index->objects[i]) == ((uint64_t)i + 1) * objectWords);
+	}
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+
+#include "check.h"
+
+/*
+ * Resizing in place: growing into a freed neighbor keeps the address and the
+ * data, shrinking keeps the address and gives the end back as free space
+ * counted by dsStats(), and growing with no room after the object moves it
+ * with its data.
+ */
+#define smallLength 1000
+#define bigLength 4000
+
+static void
+fill(uint8_t *data, uint64_t length)
+{
+	uint64_t i;
+
+	for (i = 0; i < length; i++) {
+		data[i] = i % 251;
+	}
+}
+
+static void
+checkData(uint8_t *data, uint64_t length)
+{
+	uint64_t i;
+
+	for (i = 0; i < length; i++) {
+		check(data[i] == i % 251);
+	}
+}
+
+static void
+sumStats(uint64_t *freeObjects, uint64_t *freeBytes, uint64_t *splits)
+{
+	dsCrateStats stats;
+	int i;
+
+	check(dsStats(&stats) == 0);
+	*freeObjects = *freeBytes = 0;
+	for (i = 0; i < DS_STATS_GROUPS; i++) {
+		*freeObjects += stats.freeObjects[i];
+		*freeBytes += stats.freeBytes[i];
+	}
+	*splits = stats.splits;
+}
+
+int main()
+{
+	const char *name = "test-realloc-crate";
+	uint64_t freeObjects, freeBytes, splits;
+	uint64_t moreObjects, moreBytes, moreSplits;
+	dsCheckReport report;
+	dsCrate *crate;
+	uint8_t *object, *neighbor, *resized;
+	uint64_t *guard;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check((object = dsRealloc(NULL, smallLength)) != NULL);
+	check((neighbor = dsAlloc(bigLength)) != NULL);
+	check((guard = dsAlloc(sizeof(*guard))) != NULL);
+	*guard = 42;
+	fill(object, smallLength);
+
+	/*
+	 * Grow into the freed neighbor.
+	 */
+	check(dsFree(neighbor) == 0);
+	check((resized = dsRealloc(object, smallLength + bigLength)) == object);
+	checkData(object, smallLength);
+	fill(object, smallLength + bigLength);
+
+	/*
+	 * Shrink, the end becomes free space in front of the guard.
+	 */
+	sumStats(&freeObjects, &freeBytes, &splits);
+	check((resized = dsRealloc(object, smallLength)) == object);
+	checkData(object, smallLength);
+	sumStats(&moreObjects, &moreBytes, &moreSplits);
+	check(moreObjects >= freeObjects);
+	check(moreBytes - freeBytes >= bigLength);
+	check(moreSplits > splits);
+
+	/*
+	 * The end given back can be allocated again, between the object and
+	 * the guard.
+	 */
+	check((neighbor = dsAlloc(bigLength - 64)) != NULL);
+	check((neighbor > object) && (neighbor < (uint8_t *)guard));
+
+	/*
+	 * No room left after the object, so it moves.
+	 */
+	check((resized = dsRealloc(object, 2 * bigLength)) != NULL);
+	check(resized != object);
+	checkData(resized, smallLength);
+	check(*guard == 42);
+
+	check(dsCheck(&report, 0, 0) == 0);
+	check(report.badHeaders + report.badTrailers + report.badGroups == 0);
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <crate.h>
+#include <ring.h>
+
+#include "check.h"
+
+/*
+ * Rings: records of every length come out whole and in order while the ring
+ * wraps around many times, a full ring waits for its slowest cursor, unread
+ * records survive reopening the crate, batches publish together, and
+ * concurrent producers lose nothing.
+ */
+#define ringCapacity 4096
+#define records 20000
+#define producers 4
+#define producerRecords 5000
+
+static dsCrate *crate;
+
+/*
+ * A record is its sequence number followed by bytes derived from it.
+ */
+static uint64_t
+recordLength(uint64_t seq)
+{
+	return sizeof(seq) + seq % 120;
+}
+
+static void
+makeRecord(uint8_t *record, uint64_t seq)
+{
+	uint64_t i;
+
+	memcpy(record, &seq, sizeof(seq));
+	for (i = sizeof(seq); i < recordLength(seq); i++) {
+		record[i] = (uint8_t)(seq + i);
+	}
+}
+
+/*
+ * Check the next record on 'cursor' is number 'seq' and move past it.
+ */
+static void
+consume(dsRing *ring, uint64_t cursor, uint64_t seq)
+{
+	uint64_t length, i;
+	uint8_t *record;
+
+	check((record = dsRingRead(ring, cursor, &length)) != NULL);
+	check(length == recordLength(seq));
+	check(memcmp(record, &seq, sizeof(seq)) == 0);
+	for (i = sizeof(seq); i < length; i++) {
+		check(record[i] == (uint8_t)(seq + i));
+	}
+	check(dsRingConsume(ring, cursor) == 0);
+}
+
+static void
+checkEmpty(dsRing *ring, uint64_t cursor)
+{
+	errno = 0;
+	check((dsRingRead(ring, cursor, NULL) == NULL) && (errno == EAGAIN));
+}
+
+/*
+ * Cursor 0 keeps up, cursor 1 only reads when the ring is full, so it is
+ * always close to a whole ring behind.
+ */
+static uint64_t
+testWraparound(dsRing *ring)
+{
+	uint64_t seq, slow = 0;
+
+	for (seq = 0; seq < records; seq++) {
+		uint8_t record[sizeof(seq) + 120];
+
+		makeRecord(record, seq);
+		while (dsRingAppend(ring, record, recordLength(seq)) < 0) {
+			check(errno == EAGAIN);
+			check(slow < seq);
+			consume(ring, 1, slow++);
+		}
+		consume(ring, 0, seq);
+	}
+	checkEmpty(ring, 0);
+	check(ring->reserved > 10 * ringCapacity);
+
+	return slow;
+}
+
+static void
+testBatch(dsRing *ring)
+{
+	dsRingBatch batch;
+	uint64_t *value, i;
+
+	errno = 0;
+	check((dsRingReserve(ring, &batch, ringCapacity) < 0) &&
+		  (errno == EINVAL));
+	errno = 0;
+	check((dsRingReserve(ring, &batch, 12) < 0) && (errno == EINVAL));
+
+	/*
+	 * Room for four, only three are used and the rest is skipped.
+	 */
+	check(dsRingReserve(ring, &batch, 4 * dsRingRecordSize(8)) == 0);
+	for (i = 0; i < 3; i++) {
+		check((value = dsRingAdd(&batch, 8)) != NULL);
+		*value = i;
+		checkEmpty(ring, 0);
+	}
+	check(dsRingAdd(&batch, 16) == NULL);
+	check(errno == ENOSPC);
+	check(dsRingCommit(ring, &batch) == 0);
+
+	for (i = 0; i < 3; i++) {
+		check((value = dsRingRead(ring, 0, NULL)) != NULL);
+		check(*value == i);
+		check(dsRingConsume(ring, 0) == 0);
+	}
+	checkEmpty(ring, 0);
+}
+
+static void *
+produceThread(void *arg)
+{
+	dsRing *ring = dsGetRoot("ring", NULL);
+	uint64_t record[2] = {(uintptr_t)arg, 0};
+
+	for (; record[1] < producerRecords; record[1]++) {
+		while (dsRingAppend(ring, record, sizeof(record)) < 0) {
+			check(errno == EAGAIN);
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Each producer's records come in its order, none missing.
+ */
+static void *
+consumeThread(void *arg)
+{
+	dsRing *ring = dsGetRoot("ring", NULL);
+	uint64_t cursor = (uintptr_t)arg;
+	uint64_t next[producers] = {0};
+	uint64_t seen, length, *record;
+
+	for (seen = 0; seen < producers * producerRecords;) {
+		if ((record = dsRingRead(ring, cursor, &length)) == NULL) {
+			check(errno == EAGAIN);
+			sched_yield();
+			continue;
+		}
+		check(length == 2 * sizeof(*record));
+		check(record[0] < producers);
+		check(record[1] == next[record[0]]++);
+		check(dsRingConsume(ring, cursor) == 0);
+		seen++;
+	}
+
+	return NULL;
+}
+
+static void *
+runThread(void *arg)
+{
+	void *(*run)(void *) = ((void **)arg)[0];
+
+	check(dsSet(crate) == 0);
+
+	return run(((void **)arg)[1]);
+}
+
+static void
+testThreads()
+{
+	pthread_t thread[producers + 2];
+	void *args[producers + 2][2];
+	uintptr_t i;
+
+	for (i = 0; i < producers + 2; i++) {
+		args[i][0] = i < producers ? produceThread : consumeThread;
+		args[i][1] = (void *)(i < producers ? i : i - producers);
+		check(pthread_create(&thread[i], NULL, runThread, args[i]) == 0);
+	}
+	for (i = 0; i < producers + 2; i++) {
+		check(pthread_join(thread[i], NULL) == 0);
+	}
+}
+
+int main()
+{
+	const char *name = "test-ring-crate";
+	dsRing *ring;
+	uint64_t slow;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check((ring = dsRingAlloc(ringCapacity, 2)) != NULL);
+	check(ring->capacity == ringCapacity);
+	check(dsSetRoot("ring", ring, sizeof(*ring)) == 0);
+	checkEmpty(ring, 0);
+
+	slow = testWraparound(ring);
+	check(slow > 0);
+	dsClose(&crate);
+
+	/*
+	 * Cursor 1 picks up where it left off.
+	 */
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check((ring = dsGetRoot("ring", NULL)) != NULL);
+	check(dsRingRecover(ring) == 0);
+	checkEmpty(ring, 0);
+	for (; slow < records; slow++) {
+		consume(ring, 1, slow);
+	}
+	checkEmpty(ring, 1);
+
+	testBatch(ring);
+	while (dsRingRead(ring, 1, NULL) != NULL) {
+		check(dsRingConsume(ring, 1) == 0);
+	}
+	testThreads();
+	checkEmpty(ring, 0);
+	checkEmpty(ring, 1);
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <crate.h>
+
+#include "check.h"
+
+/*
+ * Named roots: the table grows and shrinks without losing any of them, they
+ * survive reopening the crate, compaction moving them rewrites where they
+ * point, and lookups from several threads find them while other roots are
+ * added and removed.
+ */
+#define rootCount 200
+#define readers 4
+#define churnCount 2000
+
+static int stopReading;
+
+static void
+rootName(char *name, int i)
+{
+	snprintf(name, DS_ROOT_NAME_MAX, "root-%d", i);
+}
+
+/*
+ * Roots that weren't removed hold their number, root 0 was replaced.
+ */
+static int
+removed(int i)
+{
+	return (i % 3) == 1;
+}
+
+static uint64_t
+expected(int i)
+{
+	return i == 0 ? 1000 : i;
+}
+
+static void
+checkRoots()
+{
+	char name[DS_ROOT_NAME_MAX];
+	uint64_t *value, length;
+	int i;
+
+	for (i = 0; i < rootCount; i++) {
+		rootName(name, i);
+		errno = 0;
+		value = dsGetRoot(name, &length);
+		if (removed(i)) {
+			check((value == NULL) && (errno == ENOENT));
+			continue;
+		}
+		check(value != NULL);
+		check(length == sizeof(*value));
+		check(*value == expected(i));
+	}
+}
+
+/*
+ * Every root follows a gap that is freed again, for compaction to close.
+ */
+static void
+setUp()
+{
+	char name[DS_ROOT_NAME_MAX];
+	void *gaps[rootCount];
+	uint64_t *value;
+	int i;
+
+	for (i = 0; i < rootCount; i++) {
+		check((gaps[i] = dsAlloc(256)) != NULL);
+		check((value = dsAlloc(sizeof(*value))) != NULL);
+		*value = i;
+		rootName(name, i);
+		check(dsSetRoot(name, value, sizeof(*value)) == 0);
+	}
+	for (i = 0; i < rootCount; i++) {
+		check(dsFree(gaps[i]) == 0);
+	}
+
+	check((value = dsAlloc(sizeof(*value))) != NULL);
+	*value = 1000;
+	check(dsSetRoot("root-0", value, sizeof(*value)) == 0);
+
+	for (i = 0; i < rootCount; i++) {
+		if (removed(i)) {
+			rootName(name, i);
+			check(dsSetRoot(name, NULL, 0) == 0);
+		}
+	}
+}
+
+static void *
+readRoots(void *arg)
+{
+	char name[DS_ROOT_NAME_MAX];
+	uint64_t *value;
+	int i;
+
+	check(dsSet(arg) == 0);
+
+	while (!__atomic_load_n(&stopReading, __ATOMIC_ACQUIRE)) {
+		for (i = 0; i < rootCount; i++) {
+			if (removed(i)) {
+				continue;
+			}
+			rootName(name, i);
+			check((value = dsGetRoot(name, NULL)) != NULL);
+			check(*value == expected(i));
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Grow the table and shift entries around under the readers.
+ */
+static void
+testConcurrent(dsCrate *crate)
+{
+	char name[DS_ROOT_NAME_MAX];
+	pthread_t threads[readers];
+	uint64_t *value;
+	int i;
+
+	check((value = dsAlloc(sizeof(*value))) != NULL);
+	for (i = 0; i < readers; i++) {
+		check(pthread_create(&threads[i], NULL, readRoots, crate) == 0);
+	}
+
+	for (i = 0; i < churnCount; i++) {
+		snprintf(name, sizeof(name), "churn-%d", i);
+		check(dsSetRoot(name, value, sizeof(*value)) == 0);
+		if (i % 2 == 1) {
+			snprintf(name, sizeof(name), "churn-%d", i - 1);
+			check(dsSetRoot(name, NULL, 0) == 0);
+		}
+	}
+
+	__atomic_store_n(&stopReading, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < readers; i++) {
+		check(pthread_join(threads[i], NULL) == 0);
+	}
+
+	for (i = 1; i < churnCount; i += 2) {
+		snprintf(name, sizeof(name), "churn-%d", i);
+		check(dsGetRoot(name, NULL) == value);
+		check(dsSetRoot(name, NULL, 0) == 0);
+	}
+	check(dsFree(value) == 0);
+}
+
+static void
+testNames()
+{
+	char name[DS_ROOT_NAME_MAX + 1];
+	uint64_t *value;
+
+	check((value = dsAlloc(sizeof(*value))) != NULL);
+
+	errno = 0;
+	check((dsSetRoot("", value, sizeof(*value)) < 0) &&
+		  (errno == ENAMETOOLONG));
+
+	memset(name, 'x', DS_ROOT_NAME_MAX);
+	name[DS_ROOT_NAME_MAX] = '\0';
+	errno = 0;
+	check((dsSetRoot(name, value, sizeof(*value)) < 0) &&
+		  (errno == ENAMETOOLONG));
+
+	name[DS_ROOT_NAME_MAX - 1] = '\0';
+	check(dsSetRoot(name, value, sizeof(*value)) == 0);
+	check(dsGetRoot(name, NULL) == value);
+	check(dsSetRoot(name, NULL, 0) == 0);
+
+	errno = 0;
+	check((dsSetRoot(name, NULL, 0) < 0) && (errno == ENOENT));
+	check(dsFree(value) == 0);
+}
+
+int main()
+{
+	const char *name = "test-roots-crate";
+	void *before[rootCount];
+	char root[DS_ROOT_NAME_MAX];
+	dsCrate *crate;
+	int i, moved = 0;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	errno = 0;
+	check((dsGetRoot("root-0", NULL) == NULL) && (errno == ENOENT));
+	setUp();
+	checkRoots();
+	testNames();
+	checkRoots();
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	checkRoots();
+	testConcurrent(crate);
+	checkRoots();
+
+	for (i = 0; i < rootCount; i++) {
+		rootName(root, i);
+		before[i] = removed(i) ? NULL : dsGetRoot(root, NULL);
+	}
+	check(dsCompact(0) == 0);
+	checkRoots();
+	for (i = 0; i < rootCount; i++) {
+		rootName(root, i);
+		if (!removed(i) && (dsGetRoot(root, NULL) != before[i])) {
+			moved++;
+		}
+	}
+	check(moved > 0);
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	checkRoots();
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+
+#include "check.h"
+
+/*
+ * Sharing a crate with a forked process: both allocate at the same time,
+ * growing the crate past its first size, without handing out the same space
+ * twice, each sees what the other wrote, and neither can compact the shared
+ * crate.
+ */
+#define count 2000
+#define objectSize 4096
+
+typedef struct testShared {
+	uint64_t childOffsets[count];
+	uint64_t childDone;
+} testShared;
+
+static void
+allocate(uint64_t *offsets, uint64_t first)
+{
+	uint64_t *data, i;
+
+	for (i = 0; i < count; i++) {
+		check((data = dsAlloc(objectSize)) != NULL);
+		data[0] = first + i;
+		data[objectSize / sizeof(*data) - 1] = first + i;
+		offsets[i] = dsOffset(data);
+	}
+}
+
+static void
+checkObjects(uint64_t *offsets, uint64_t first)
+{
+	uint64_t *data, i;
+
+	for (i = 0; i < count; i++) {
+		check((data = dsPtr(offsets[i], objectSize)) != NULL);
+		check(data[0] == first + i);
+		check(data[objectSize / sizeof(*data) - 1] == first + i);
+	}
+}
+
+static void
+child(int fd)
+{
+	dsCrate *crate;
+	testShared *shared;
+
+	check((crate = dsOpenFd(fd, 1)) != NULL);
+	close(fd);
+	shared = dsGetIndex();
+
+	allocate(shared->childOffsets, count);
+	__atomic_store_n(&shared->childDone, 1, __ATOMIC_RELEASE);
+
+	errno = 0;
+	check((dsCompact(0) < 0) && (errno != 0));
+	dsClose(&crate);
+
+	exit(0);
+}
+
+int main()
+{
+	static uint64_t parentOffsets[count];
+	dsCheckReport report;
+	dsCrate *crate;
+	testShared *shared;
+	pid_t pid;
+	int fd, status;
+
+	dsLogger(NULL, NULL);
+
+	check((crate = dsOpen(NULL, 1, 1)) != NULL);
+	check((shared = dsAlloc(sizeof(*shared))) != NULL);
+	check(dsSetIndex(shared, sizeof(*shared)) == 0);
+	check((fd = dsExportFd(crate)) >= 0);
+
+	check((pid = fork()) >= 0);
+	if (pid == 0) {
+		child(fd);
+	}
+	close(fd);
+
+	allocate(parentOffsets, 0);
+	check(waitpid(pid, &status, 0) == pid);
+	check(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+
+	shared = dsGetIndex();
+	check(__atomic_load_n(&shared->childDone, __ATOMIC_ACQUIRE) == 1);
+	checkObjects(parentOffsets, 0);
+	checkObjects(shared->childOffsets, count);
+
+	check(dsCheck(&report, 0, 0) == 0);
+	check(report.badHeaders + report.badTrailers + report.badGroups == 0);
+	check(report.objects >= 2 * count + 1);
+	dsClose(&crate);
+
+	return 0;
+}
@@ -0,0 +1,42 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+
+#include <crate.h>
+
+#include "check.h"
+
+/*
+ * A thread switching between crates keeps counting into one record per
+ * crate, so totals stay exact.
+ */
+int main()
+{
+	dsCrate *a, *b;
+	dsCrateStats stats;
+	int i;
+
+	dsLogger(NULL, NULL);
+
+	check((a = dsOpen(NULL, 1, 0)) != NULL);
+	check((b = dsOpen(NULL, 1, 0)) != NULL);
+
+	for (i = 0; i < 1000; i++) {
+		check(dsSet(a) == 0);
+		check(dsAlloc(16) != NULL);
+		check(dsSet(b) == 0);
+		check(dsAlloc(16) != NULL);
+		check(dsAlloc(16) != NULL);
+	}
+
+	check(dsSet(a) == 0);
+	check(dsStats(&stats) == 0);
+	check(stats.allocations == 1000);
+	check(dsSet(b) == 0);
+	check(dsStats(&stats) == 0);
+	check(stats.allocations == 2000);
+
+	dsClose(&a);
+	dsClose(&b);
+
+	return 0;
+}
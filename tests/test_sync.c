@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <crate.h>
+
+#include "check.h"
+
+/*
+ * Asynchronous syncs: requests from several threads get tickets that never
+ * go down, their callbacks run in the order they were requested with the
+ * sync's result, waiting on a ticket returns once its sync is done, and
+ * closing the crate runs every callback still outstanding.
+ */
+#define threads 4
+#define perThread 100
+
+typedef struct testRequest {
+	int64_t ticket;
+	int result;
+	uint64_t order;
+} testRequest;
+
+static dsCrate *crate;
+static testRequest requests[threads][perThread];
+static uint64_t callbacks;
+
+static void
+done(void *userPtr, int result)
+{
+	testRequest *request = userPtr;
+
+	request->result = result;
+	request->order = __atomic_add_fetch(&callbacks, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+syncThread(void *arg)
+{
+	testRequest *mine = requests[(uintptr_t)arg];
+	uint64_t *data;
+	int i;
+
+	check(dsSet(crate) == 0);
+	check((data = dsAlloc(sizeof(*data))) != NULL);
+
+	for (i = 0; i < perThread; i++) {
+		*data = i;
+		check((mine[i].ticket = dsSyncAsync(done, &mine[i])) > 0);
+		if (i > 0) {
+			check(mine[i].ticket >= mine[i - 1].ticket);
+		}
+		if (i % 10 == 0) {
+			check(dsSyncWait(mine[i].ticket) == 0);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * A thread's callbacks ran in the order it asked for them, and a callback
+ * with a lower ticket than another ran before it. Requests made while the
+ * same sync was pending share a ticket.
+ */
+static void
+checkOrder()
+{
+	testRequest *a, *b;
+	int i, j, k, l;
+
+	for (i = 0; i < threads; i++) {
+		for (j = 0; j < perThread; j++) {
+			a = &requests[i][j];
+			check((a->order > 0) && (a->result == 0));
+			for (k = i; k < threads; k++) {
+				for (l = (k == i) ? j + 1 : 0; l < perThread; l++) {
+					b = &requests[k][l];
+					if (k == i) {
+						check(a->order < b->order);
+					}
+					if (a->ticket != b->ticket) {
+						check((a->ticket < b->ticket) ==
+							  (a->order < b->order));
+					}
+				}
+			}
+		}
+	}
+}
+
+int main()
+{
+	const char *name = "test-sync-crate";
+	pthread_t thread[threads];
+	uintptr_t i;
+	int64_t ticket;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+
+	errno = 0;
+	check((dsSyncWait(0) < 0) && (errno == EINVAL));
+	check((ticket = dsSyncAsync(NULL, NULL)) > 0);
+	check(dsSyncWait(ticket) == 0);
+
+	for (i = 0; i < threads; i++) {
+		check(pthread_create(&thread[i], NULL, syncThread, (void *)i) == 0);
+	}
+	for (i = 0; i < threads; i++) {
+		check(pthread_join(thread[i], NULL) == 0);
+	}
+
+	dsClose(&crate);
+	check(callbacks == threads * perThread);
+	checkOrder();
+
+	unlink(name);
+
+	return 0;
+}
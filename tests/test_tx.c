@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <crate.h>
+
+#include "check.h"
+
+/*
+ * Transactions: commits survive reopening, aborts put everything back, and
+ * so does the next open after a process dies in the middle of one. With a
+ * buffer pool small enough that the transaction's own pages get evicted,
+ * those can't reach the file ahead of the records that undo them.
+ */
+#define slotCount 64
+#define slotSize (64 << 10)
+
+static uint64_t liveObjects;
+
+typedef struct testIndex {
+	uint64_t value;
+	uint64_t *slots[slotCount];
+} testIndex;
+
+static dsCrate *
+openCrate(const char *name, int create, uint64_t poolBytes)
+{
+	dsOpenOptions options = {
+		.create = create, .active = 1, .poolBytes = poolBytes
+	};
+
+	return dsOpenWith(name, &options);
+}
+
+static uint64_t
+countLive()
+{
+	dsCrateStats stats;
+	uint64_t count = 0;
+	int i;
+
+	check(dsStats(&stats) == 0);
+	for (i = 0; i < DS_STATS_GROUPS; i++) {
+		count += stats.liveObjects[i];
+	}
+
+	return count;
+}
+
+static void
+setUp(const char *name, uint64_t poolBytes)
+{
+	dsCrate *crate;
+	testIndex *index;
+	uint64_t i;
+
+	unlink(name);
+	check((crate = openCrate(name, 1, poolBytes)) != NULL);
+	check((index = dsAlloc(sizeof(*index))) != NULL);
+	memset(index, 0, sizeof(*index));
+	check(dsSetIndex(index, sizeof(*index)) == 0);
+
+	/*
+	 * One slot per pool page, so touching them all needs evictions.
+	 */
+	for (i = 0; i < slotCount; i++) {
+		check((index->slots[i] = dsAlloc(slotSize)) != NULL);
+		*index->slots[i] = i;
+	}
+
+	check(dsBegin() == 0);
+	check(dsTxAdd(&index->value, sizeof(index->value)) == 0);
+	index->value = 1;
+	check(dsCommit() == 0);
+	liveObjects = countLive();
+
+	dsClose(&crate);
+}
+
+/*
+ * Change everything in a transaction and die before committing it.
+ */
+static void
+crash(const char *name, uint64_t poolBytes)
+{
+	pid_t pid;
+	int status;
+
+	if ((pid = fork()) == 0) {
+		dsCrate *crate;
+		testIndex *index;
+		uint64_t i;
+
+		check((crate = openCrate(name, 0, poolBytes)) != NULL);
+		check((index = dsGetIndex()) != NULL);
+
+		check(dsBegin() == 0);
+		check(dsTxAdd(&index->value, sizeof(index->value)) == 0);
+		index->value = 2;
+		for (i = 0; i < slotCount; i++) {
+			check(dsTxAdd(index->slots[i], sizeof(uint64_t)) == 0);
+			*index->slots[i] = UINT64_MAX;
+		}
+		check(dsAlloc(64) != NULL);
+
+		/*
+		 * Whatever the crate wrote so far stays in the file.
+		 */
+		_exit(0);
+	}
+
+	check(pid > 0);
+	check(waitpid(pid, &status, 0) == pid);
+	check(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+}
+
+static void
+checkRolledBack(const char *name, uint64_t poolBytes)
+{
+	dsCrate *crate;
+	testIndex *index;
+	uint64_t i;
+
+	check((crate = openCrate(name, 0, poolBytes)) != NULL);
+	check((index = dsGetIndex()) != NULL);
+	check(index->value == 1);
+	for (i = 0; i < slotCount; i++) {
+		check(*index->slots[i] == i);
+	}
+
+	/*
+	 * Objects allocated by the transaction are freed again.
+	 */
+	check(countLive() == liveObjects);
+	dsClose(&crate);
+}
+
+static void
+testAbort(const char *name)
+{
+	dsCrate *crate;
+	testIndex *index;
+	uint64_t i;
+
+	check((crate = openCrate(name, 0, 0)) != NULL);
+	check((index = dsGetIndex()) != NULL);
+
+	check(dsBegin() == 0);
+	check(dsBegin() < 0);
+	for (i = 0; i < slotCount; i++) {
+		check(dsTxAdd(index->slots[i], sizeof(uint64_t)) == 0);
+		*index->slots[i] = 0;
+	}
+	check(dsAlloc(64) != NULL);
+	check(dsAbort() == 0);
+	check(countLive() == liveObjects);
+	check(dsCommit() < 0);
+
+	for (i = 0; i < slotCount; i++) {
+		check(*index->slots[i] == i);
+	}
+
+	/*
+	 * Outside of a transaction adding does nothing.
+	 */
+	check(dsTxAdd(&index->value, sizeof(index->value)) == 0);
+	dsClose(&crate);
+}
+
+int main()
+{
+	const char *name = "test-tx-crate";
+
+	dsLogger(NULL, NULL);
+
+	setUp(name, 0);
+	testAbort(name);
+	crash(name, 0);
+	checkRolledBack(name, 0);
+
+	setUp(name, 4 * slotSize);
+	crash(name, 4 * slotSize);
+	checkRolledBack(name, 0);
+
+	unlink(name);
+
+	return 0;
+}
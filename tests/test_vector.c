@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <crate.h>
+#include <vector.h>
+
+#include "check.h"
+
+/*
+ * Vectors: items keep their contents as the vector grows, through reopening
+ * and compacting the crate, an aborted transaction undoes pushes that grew
+ * the vector, and out of range or mistyped use is refused.
+ */
+#define itemCount 10000
+
+typedef struct testItem {
+	uint64_t number;
+	uint64_t square;
+	uint64_t inverse;
+} testItem;
+
+DS_VECTOR_DEFINE(testItems, testItem)
+DS_VECTOR_DEFINE(testWords, uint64_t)
+
+static testItem
+makeItem(uint64_t i)
+{
+	testItem item = {i, i * i, ~i};
+
+	return item;
+}
+
+static void
+checkItems(testItems *items, uint64_t n)
+{
+	testItem *item;
+	uint64_t i;
+
+	check(testItemsCount(items) == n);
+	for (i = 0; i < n; i++) {
+		item = testItemsAt(items, i);
+		check((item->number == i) && (item->square == i * i) &&
+			  (item->inverse == ~i));
+		check(dsVectorAt(items->vector, i) == item);
+	}
+}
+
+static void
+fill(testItems *items)
+{
+	uint64_t i, capacity = 0, grown = 0;
+
+	for (i = 0; i < itemCount; i++) {
+		check(testItemsPush(items, makeItem(i)) != NULL);
+		if (items->vector->capacity != capacity) {
+			capacity = items->vector->capacity;
+			grown++;
+		}
+	}
+	check(items->vector->capacity >= itemCount);
+	check(grown > 5);
+	checkItems(items, itemCount);
+}
+
+static void
+testErrors(testItems *items)
+{
+	testWords words;
+	dsVector *empty, *other;
+
+	errno = 0;
+	check((dsVectorAt(items->vector, itemCount) == NULL) &&
+		  (errno == ERANGE));
+	errno = 0;
+	check((dsVectorPush(NULL) == NULL) && (errno == EINVAL));
+
+	check((other = dsAlloc(sizeof(*other))) != NULL);
+	memset(other, 0, sizeof(*other));
+	errno = 0;
+	check((dsVectorPop(other) < 0) && (errno == EINVAL));
+	check(dsFree(other) == 0);
+	check(testWordsOpen(&words, items->vector) < 0);
+
+	check((empty = dsVectorAlloc(sizeof(uint64_t))) != NULL);
+	check(dsVectorCount(empty) == 0);
+	errno = 0;
+	check((dsVectorPop(empty) < 0) && (errno == ENOENT));
+	errno = 0;
+	check((dsVectorAt(empty, 0) == NULL) && (errno == ERANGE));
+	check(dsVectorClear(empty) == 0);
+	check(dsFree(empty) == 0);
+}
+
+/*
+ * Fill the vector up and push past it, then think better of it.
+ */
+static void
+testAbort(testItems *items)
+{
+	uint64_t capacity = items->vector->capacity, i;
+
+	check(dsVectorReserve(items->vector, itemCount) == 0);
+	check(items->vector->capacity == capacity);
+
+	check(dsBegin() == 0);
+	for (i = itemCount; i <= capacity; i++) {
+		check(testItemsPush(items, makeItem(i)) != NULL);
+	}
+	check(items->vector->capacity > capacity);
+	check(testItemsPop(items) == 0);
+	check(testItemsPop(items) == 0);
+	check(dsAbort() == 0);
+
+	check(items->vector->capacity == capacity);
+	checkItems(items, itemCount);
+}
+
+int main()
+{
+	const char *name = "test-vector-crate";
+	dsCrate *crate;
+	testItems items;
+	uint64_t i;
+
+	dsLogger(NULL, NULL);
+	unlink(name);
+
+	check((crate = dsOpen(name, 1, 1)) != NULL);
+	check(testItemsOpen(&items, dsVectorAlloc(sizeof(testItem))) == 0);
+	check(dsSetIndex(items.vector, sizeof(*items.vector)) == 0);
+	fill(&items);
+	testErrors(&items);
+	testAbort(&items);
+	dsClose(&crate);
+
+	/*
+	 * Growing left the old copies behind for compaction to close up.
+	 */
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check(testItemsOpen(&items, dsGetIndex()) == 0);
+	checkItems(&items, itemCount);
+	check(dsCompact(0) == 0);
+	check(testItemsOpen(&items, dsGetIndex()) == 0);
+	checkItems(&items, itemCount);
+
+	for (i = 0; i < itemCount / 2; i++) {
+		check(testItemsPop(&items) == 0);
+	}
+	checkItems(&items, itemCount / 2);
+	dsClose(&crate);
+
+	check((crate = dsOpen(name, 0, 1)) != NULL);
+	check(testItemsOpen(&items, dsGetIndex()) == 0);
+	checkItems(&items, itemCount / 2);
+
+	check(dsVectorClear(items.vector) == 0);
+	check(testItemsCount(&items) == 0);
+	check(items.vector->capacity == 0);
+	check(testItemsPush(&items, makeItem(0)) != NULL);
+	checkItems(&items, 1);
+	dsClose(&crate);
+
+	unlink(name);
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <crate.h>
+#include <crate_internal.h>
+
+/*
+ * Exit codes, borrowed from fsck(8).
+ */
+#define exitClean       0
+#define exitRepaired    1
+#define exitUncorrected 4
+#define exitError       8
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-r] [-g] [-j threads] [-v] crate\n"
+		"  -r          Repair anything found.\n"
+		"  -g          Free objects that can't be reached from the index.\n"
+		"  -j threads  Number of threads to check with (default: all CPUs).\n"
+		"  -v          Print library log messages.\n", name);
+}
+
+/*
+ * dsOpen() turns anything without a super object into a new crate, which is
+ * the last thing a checker should do to a damaged file.
+ */
+static int
+isCrate(const char *filename)
+{
+	uint64_t magic;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+
+	if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic)) {
+		fprintf(stderr, "Can't read %s: short file\n", filename);
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	if (magic != MAGIC_LIB_SUPER) {
+		fprintf(stderr, "%s: bad super object magic\n", filename);
+		return 0;
+	}
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	dsCheckReport report;
+	dsCollectReport collectReport;
+	dsCrate *crate;
+	int threads = 0;
+	int repair = 0;
+	int collect = 0;
+	int verbose = 0;
+	uint64_t errors;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "rgj:v")) != -1) {
+		switch (opt) {
+		case 'r':
+			repair = 1;
+			break;
+		case 'g':
+			collect = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return exitError;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return exitError;
+	}
+
+	if (!verbose) {
+		dsLogger(NULL, NULL);
+	}
+
+	if (!isCrate(argv[optind])) {
+		return exitError;
+	}
+
+	if ((crate = dsOpen(argv[optind], 0, 1)) == NULL) {
+		fprintf(stderr, "Can't open crate %s\n", argv[optind]);
+		return exitError;
+	}
+
+	if (dsCheck(&report, threads, repair) < 0) {
+		fprintf(stderr, "Can't check crate %s\n", argv[optind]);
+		dsClose(&crate);
+		return exitError;
+	}
+
+	errors = report.badHeaders + report.badTrailers +
+			 report.badLastObjects + report.badGroups;
+
+	/*
+	 * Tracing through damaged headers or contents could free live objects,
+	 * so only collect a crate that is clean or was just repaired.
+	 */
+	if (collect && ((report.badChecksums != 0) ||
+					((errors != 0) && !repair))) {
+		fprintf(stderr, "Not collecting %s, it has uncorrected errors\n",
+			argv[optind]);
+		collect = 0;
+	}
+
+	if (collect && (dsCollect(&collectReport, threads) < 0)) {
+		fprintf(stderr, "Can't collect crate %s: %s\n", argv[optind],
+			strerror(errno));
+		dsClose(&crate);
+		return exitError;
+	}
+
+	if ((repair || collect) && (dsSync(1) < 0)) {
+		fprintf(stderr, "Can't sync crate %s\n", argv[optind]);
+		dsClose(&crate);
+		return exitError;
+	}
+
+	dsClose(&crate);
+
+	printf("%s: %" PRIu64 " objects, %" PRIu64 " free (%" PRIu64 " bytes)\n",
+		argv[optind], report.objects, report.freeObjects, report.freeBytes);
+	printf("  bad headers:      %" PRIu64 "\n", report.badHeaders);
+	printf("  bad trailers:     %" PRIu64 "\n", report.badTrailers);
+	printf("  bad last objects: %" PRIu64 "\n", report.badLastObjects);
+	printf("  bad group links:  %" PRIu64 "\n", report.badGroups);
+	printf("  lost bytes:       %" PRIu64 "\n", report.lostBytes);
+	printf("  misaligned:       %" PRIu64 "\n", report.misalignedObjects);
+	printf("  bad checksums:    %" PRIu64 " of %" PRIu64 "\n",
+		report.badChecksums, report.checksums);
+	if (collect) {
+		printf("  collected:        %" PRIu64 " (%" PRIu64 " bytes)\n",
+			collectReport.freedObjects, collectReport.freedBytes);
+	}
+	if (repair) {
+		printf("  repairs:          %" PRIu64 "\n", report.repairs);
+	}
+
+	if ((errors == 0) && (report.badChecksums == 0)) {
+		return exitClean;
+	}
+
+	/*
+	 * Corrupt contents can't be repaired.
+	 */
+	if (report.badChecksums != 0) {
+		return exitUncorrected;
+	}
+
+	return repair ? exitRepaired : exitUncorrected;
+}
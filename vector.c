@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+
+#include "vector.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "crate.h"
+#include "crate_internal.h"
+
+#define vectorMinCapacity 8
+
+static void
+traceVector(void *object, uint64_t length, dsVisitCallback visit, void *arg)
+{
+	dsVector *vector = object;
+
+	visit(arg, &vector->dataOffset);
+}
+
+/*
+ * Let the crate follow vector offsets, e.g. when compacting.
+ */
+static void __attribute__((constructor))
+registerVector()
+{
+	dsRegisterType(MAGIC_VECTOR, traceVector);
+}
+
+static int
+checkVector(dsVector *vector)
+{
+	if ((vector == NULL) || (vector->magic != MAGIC_VECTOR)) {
+		dsLog("Bad argument: %p\n", vector);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	return(0);
+}
+
+static void *
+vectorData(dsVector *vector)
+{
+	void *data;
+
+	if ((data = dsCratePtr(dsGet(), vector->dataOffset,
+						   vector->capacity * vector->itemSize)) == NULL) {
+		dsLog("Can't map vector data.\n");
+		return(NULL);
+	}
+
+	return(data);
+}
+
+int
+dsVectorInit(dsVector *vector, uint64_t itemSize)
+{
+	if ((vector == NULL) || (itemSize == 0)) {
+		dsLog("Bad argument: %p, %" PRIu64 "\n", vector, itemSize);
+		errno = EINVAL;
+		return(-1);
+	}
+
+	dsNoteReferences(vector, sizeof(*vector));
+	vector->magic = MAGIC_VECTOR;
+	vector->count = 0;
+	vector->capacity = 0;
+	vector->itemSize = itemSize;
+	vector->dataOffset = UINT64_MAX;
+
+	return(0);
+}
+
+dsVector *
+dsVectorAlloc(uint64_t itemSize)
+{
+	dsVector *vector;
+
+	if ((vector = dsAlloc(sizeof(*vector))) == NULL) {
+		dsLog("Can't allocate vector object.\n");
+		return(NULL);
+	}
+
+	if (dsVectorInit(vector, itemSize) < 0) {
+		dsFree(vector);
+		return(NULL);
+	}
+
+	return(vector);
+}
+
+int
+dsVectorReserve(dsVector *vector, uint64_t capacity)
+{
+	void *data = NULL;
+
+	if (checkVector(vector) < 0) {
+		return(-1);
+	}
+
+	if (capacity <= vector->capacity) {
+		return(0);
+	}
+
+	if ((vector->dataOffset != UINT64_MAX) &&
+		((data = vectorData(vector)) == NULL)) {
+		return(-1);
+	}
+
+	/*
+	 * Usually the data can grow in place, otherwise dsRealloc() moves it.
+	 */
+	if ((data = dsRealloc(data, capacity * vector->itemSize)) == NULL) {
+		dsLog("Can't grow vector data.\n");
+		return(-1);
+	}
+
+	if (dsTxAdd(vector, sizeof(*vector)) < 0) {
+		dsLog("Can't log vector changes.\n");
+		return(-1);
+	}
+	vector->dataOffset = dsOffset(data);
+	vector->capacity = capacity;
+
+	return(0);
+}
+
+void *
+dsVectorPush(dsVector *vector)
+{
+	uint64_t capacity;
+	uint8_t *data;
+
+	if (checkVector(vector) < 0) {
+		return(NULL);
+	}
+
+	if (vector->count == vector->capacity) {
+		capacity = vector->capacity * 2;
+		if (capacity < vectorMinCapacity) {
+			capacity = vectorMinCapacity;
+		}
+		if (dsVectorReserve(vector, capacity) < 0) {
+			return(NULL);
+		}
+	}
+
+	if ((data = vectorData(vector)) == NULL) {
+		return(NULL);
+	}
+
+	if (dsTxAdd(vector, sizeof(*vector)) < 0) {
+		dsLog("Can't log vector changes.\n");
+		return(NULL);
+	}
+	vector->count++;
+
+	return(data + (vector->count - 1) * vector->itemSize);
+}
+
+int
+dsVectorPop(dsVector *vector)
+{
+	if (checkVector(vector) < 0) {
+		return(-1);
+	}
+
+	if (vector->count == 0) {
+		errno = ENOENT;
+		return(-1);
+	}
+
+	if (dsTxAdd(vector, sizeof(*vector)) < 0) {
+		dsLog("Can't log vector changes.\n");
+		return(-1);
+	}
+	vector->count--;
+
+	return(0);
+}
+
+void *
+dsVectorAt(dsVector *vector, uint64_t index)
+{
+	uint8_t *data;
+
+	if (checkVector(vector) < 0) {
+		return(NULL);
+	}
+
+	if (index >= vector->count) {
+		dsLog("Index %" PRIu64 " is past the end.\n", index);
+		errno = ERANGE;
+		return(NULL);
+	}
+
+	if ((data = vectorData(vector)) == NULL) {
+		return(NULL);
+	}
+
+	return(data + index * vector->itemSize);
+}
+
+uint64_t
+dsVectorCount(dsVector *vector)
+{
+	if (vector == NULL) {
+		return -1;
+	}
+
+	return vector->count;
+}
+
+int
+dsVectorClear(dsVector *vector)
+{
+	void *data;
+
+	if (checkVector(vector) < 0) {
+		return(-1);
+	}
+
+	if (vector->dataOffset == UINT64_MAX) {
+		return(0);
+	}
+
+	if ((data = vectorData(vector)) == NULL) {
+		return(-1);
+	}
+
+	if (dsTxAdd(vector, sizeof(*vector)) < 0) {
+		dsLog("Can't log vector changes.\n");
+		return(-1);
+	}
+
+	if (dsFree(data) < 0) {
+		dsLog("Can't free vector data.\n");
+		return(-1);
+	}
+
+	vector->count = 0;
+	vector->capacity = 0;
+	vector->dataOffset = UINT64_MAX;
+
+	return(0);
+}
@@ -0,0 +1,153 @@
+#ifndef CRATE_VECTOR_H_
+#define CRATE_VECTOR_H_
+
+#include <inttypes.h>
+
+#include "crate.h"
+#include "crate_internal.h"
+
+/*
+ * A growable array of fixed size items, stored in a separate object that is
+ * resized with dsRealloc().
+ */
+typedef struct dsVector {
+	uint64_t magic;
+	uint64_t count;
+	uint64_t capacity;
+	uint64_t itemSize;
+	uint64_t dataOffset;
+} dsVector;
+
+/*
+ * Allocate and initialize a new, empty vector object of 'itemSize' byte
+ * items.
+ *
+ * On success, a pointer to the new vector object is returned.
+ * On error, NULL is returned and errno is set appropriately.
+ */
+dsVector *dsVectorAlloc(uint64_t itemSize);
+
+/*
+ * Initialize an already allocated vector object.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsVectorInit(dsVector *vector, uint64_t itemSize);
+
+/*
+ * Make room for at least 'capacity' items without changing the count.
+ * Pointers to items are invalid after the vector grows.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsVectorReserve(dsVector *vector, uint64_t capacity);
+
+/*
+ * Add an item to the end, growing the vector if it is full. The new item's
+ * contents are left for the caller to fill in.
+ *
+ * On success, a pointer to the new item is returned.
+ * On error, NULL is returned and errno is set appropriately.
+ */
+void *dsVectorPush(dsVector *vector);
+
+/*
+ * Remove the last item.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsVectorPop(dsVector *vector);
+
+/*
+ * Get a pointer to item 'index'.
+ *
+ * On success, a pointer to the item is returned.
+ * On error, NULL is returned and errno is set appropriately.
+ */
+void *dsVectorAt(dsVector *vector, uint64_t index);
+
+/*
+ * Get a count of how many items are in the vector.
+ *
+ * On success, the number of items is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+uint64_t dsVectorCount(dsVector *vector);
+
+/*
+ * Free the items of a vector, leaving it empty.
+ *
+ * On success, zero is returned.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int dsVectorClear(dsVector *vector);
+
+/*
+ * Define a vector type 'name' holding items of type 'T'. A 'name' is a handle
+ * opened on a dsVector in the active crate, keeping the crate so items are
+ * found with dsCratePtr() and a size known at compile time:
+ *
+ *   DS_VECTOR_DEFINE(scores, float)
+ *
+ *   scores v;
+ *   scoresOpen(&v, dsVectorAlloc(sizeof(float)));
+ *   scoresPush(&v, 1.5);
+ *   for (i = 0; i < scoresCount(&v); i++) {
+ *       sum += *scoresAt(&v, i);
+ *   }
+ *
+ * scoresAt() doesn't check 'index' against the count, only that the item is
+ * within the crate in builds without NDEBUG. The layout in the crate
+ * is that of any dsVector, so other code can open it with a different handle.
+ */
+#define DS_VECTOR_DEFINE(name, T)                                             \
+typedef struct name {                                                         \
+	dsCrate *crate;                                                           \
+	dsVector *vector;                                                         \
+} name;                                                                       \
+                                                                              \
+static inline int                                                             \
+name##Open(name *handle, dsVector *vector)                                    \
+{                                                                             \
+	if ((vector == NULL) || (vector->itemSize != sizeof(T))) {                \
+		return -1;                                                            \
+	}                                                                         \
+	handle->crate = dsGet();                                                  \
+	handle->vector = vector;                                                  \
+	return 0;                                                                 \
+}                                                                             \
+                                                                              \
+static inline uint64_t                                                        \
+name##Count(name *handle)                                                     \
+{                                                                             \
+	return handle->vector->count;                                             \
+}                                                                             \
+                                                                              \
+static inline T *                                                             \
+name##At(name *handle, uint64_t index)                                        \
+{                                                                             \
+	return dsCratePtr(handle->crate, handle->vector->dataOffset +             \
+					  index * sizeof(T), sizeof(T));                          \
+}                                                                             \
+                                                                              \
+static inline T *                                                             \
+name##Push(name *handle, T value)                                             \
+{                                                                             \
+	T *item;                                                                  \
+                                                                              \
+	if ((item = dsVectorPush(handle->vector)) != NULL) {                      \
+		*item = value;                                                        \
+	}                                                                         \
+	return item;                                                              \
+}                                                                             \
+                                                                              \
+static inline int                                                             \
+name##Pop(name *handle)                                                       \
+{                                                                             \
+	return dsVectorPop(handle->vector);                                       \
+}
+
+#endif